@@ -24,6 +24,8 @@ static char *ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_set_shm_huge_pages(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static char *ngx_load_module(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 #if (NGX_HAVE_DLOPEN)
 static void ngx_unload_module(void *data);
@@ -137,6 +139,34 @@ static ngx_command_t  ngx_core_commands[] = {
       0,
       NULL },
 
+    { ngx_string("pool_cache"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_core_conf_t, pool_cache),
+      NULL },
+
+    { ngx_string("pool_stats"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_core_conf_t, pool_stats),
+      NULL },
+
+    { ngx_string("worker_numa"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_core_conf_t, worker_numa),
+      NULL },
+
+    { ngx_string("shm_huge_pages"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_set_shm_huge_pages,
+      0,
+      0,
+      NULL },
+
     { ngx_string("load_module"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_load_module,
@@ -992,6 +1022,11 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
 
+    ccf->pool_cache = NGX_CONF_UNSET_UINT;
+    ccf->pool_stats = NGX_CONF_UNSET;
+    ccf->shm_huge_pages = NGX_CONF_UNSET_SIZE;
+    ccf->worker_numa = NGX_CONF_UNSET;
+
     if (ngx_array_init(&ccf->env, cycle->pool, 1, sizeof(ngx_str_t))
         != NGX_OK)
     {
@@ -1014,6 +1049,22 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
 
+    ngx_conf_init_uint_value(ccf->pool_cache, 0);
+    ngx_conf_init_value(ccf->pool_stats, 0);
+    ngx_conf_init_size_value(ccf->shm_huge_pages, 0);
+    ngx_conf_init_value(ccf->worker_numa, 0);
+
+#if !(NGX_HAVE_NUMA && NGX_HAVE_SCHED_SETAFFINITY)
+
+    if (ccf->worker_numa) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"worker_numa\" is not supported "
+                      "on this platform, ignored");
+        ccf->worker_numa = 0;
+    }
+
+#endif
+
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (!ccf->cpu_affinity_auto
@@ -1444,6 +1495,54 @@ ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_set_shm_huge_pages(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_core_conf_t  *ccf = conf;
+
+    ssize_t           size;
+    ngx_str_t        *value;
+
+    if (ccf->shm_huge_pages != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ccf->shm_huge_pages = 0;
+        return NGX_CONF_OK;
+    }
+
+    size = ngx_parse_size(&value[1]);
+
+    if (size == NGX_ERROR
+        || (size_t) size <= ngx_pagesize
+        || (size & (size - 1)) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid huge page size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HAVE_MAP_HUGETLB)
+
+    ccf->shm_huge_pages = size;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "\"shm_huge_pages\" is not supported "
+                       "on this platform, ignored");
+
+    ccf->shm_huge_pages = 0;
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_load_module(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
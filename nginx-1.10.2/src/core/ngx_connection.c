@@ -1257,15 +1257,15 @@ ngx_close_idle_connections(ngx_cycle_t *cycle)
     ngx_uint_t         i;
     ngx_connection_t  *c;
 
-    c = cycle->connections;
-
     for (i = 0; i < cycle->connection_n; i++) {
 
+        c = ngx_cycle_connection(cycle, i);
+
         /* THREAD: lock */
 
-        if (c[i].fd != (ngx_socket_t) -1 && c[i].idle) {
-            c[i].close = 1;
-            c[i].read->handler(c[i].read);
+        if (c->fd != (ngx_socket_t) -1 && c->idle) {
+            c->close = 1;
+            c->read->handler(c->read);
         }
     }
 }
@@ -51,6 +51,9 @@ struct ngx_listening_s {
     ngx_listening_t    *previous;
     ngx_connection_t   *connection;
 
+    ngx_rbtree_t        rbtree;
+    ngx_rbtree_node_t   sentinel;
+
     ngx_uint_t          worker;
 
     unsigned            open:1;
@@ -72,6 +75,7 @@ struct ngx_listening_s {
 #if (NGX_HAVE_REUSEPORT)
     unsigned            reuseport:1;
     unsigned            add_reuseport:1;
+    unsigned            ordered:1;     /* group index is worker number */
 #endif
     unsigned            keepalive:2;
 
@@ -134,34 +138,22 @@ struct ngx_connection_s {
     ngx_recv_chain_pt   recv_chain;
     ngx_send_chain_pt   send_chain;
 
-    ngx_listening_t    *listening;
-
-    off_t               sent;
-
-    ngx_log_t          *log;
-
-    ngx_pool_t         *pool;
-
-    int                 type;
-
-    struct sockaddr    *sockaddr;
-    socklen_t           socklen;
-    ngx_str_t           addr_text;
-
-    ngx_str_t           proxy_protocol_addr;
+    /*
+     * the fields up to sendfile_task are used on every read and write,
+     * they are kept together in the first two cache lines
+     */
 
 #if (NGX_SSL)
     ngx_ssl_connection_t  *ssl;
 #endif
 
-    struct sockaddr    *local_sockaddr;
-    socklen_t           local_socklen;
+    off_t               sent;
 
-    ngx_buf_t          *buffer;
+    ngx_log_t          *log;
 
-    ngx_queue_t         queue;
+    ngx_pool_t         *pool;
 
-    ngx_atomic_uint_t   number;
+    ngx_buf_t          *buffer;
 
     ngx_uint_t          requests;
 
@@ -197,6 +189,25 @@ struct ngx_connection_s {
 #if (NGX_THREADS)
     ngx_thread_task_t  *sendfile_task;
 #endif
+
+    ngx_listening_t    *listening;
+
+    int                 type;
+
+    struct sockaddr    *sockaddr;
+    socklen_t           socklen;
+    ngx_str_t           addr_text;
+
+    ngx_str_t           proxy_protocol_addr;
+
+    struct sockaddr    *local_sockaddr;
+    socklen_t           local_socklen;
+
+    ngx_udp_connection_t  *udp;
+
+    ngx_queue_t         queue;
+
+    ngx_atomic_uint_t   number;
 };
 
 
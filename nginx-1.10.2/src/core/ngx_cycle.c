@@ -402,6 +402,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
     /* create shared memory */
 
+#if (NGX_HAVE_NUMA)
+    ngx_numa_init(ccf->worker_numa, log);
+#endif
+
     part = &cycle->shared_memory.part;
     shm_zone = part->elts;
 
@@ -425,6 +429,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
         shm_zone[i].shm.log = cycle->log;
 
+#if (NGX_HAVE_MAP_HUGETLB)
+        shm_zone[i].shm.huge = ccf->shm_huge_pages;
+#endif
+
         opart = &old_cycle->shared_memory.part;
         oshm_zone = opart->elts;
 
@@ -459,6 +467,9 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 #if (NGX_WIN32)
                 shm_zone[i].shm.handle = oshm_zone[n].shm.handle;
 #endif
+#if (NGX_HAVE_MAP_HUGETLB)
+                shm_zone[i].shm.huge = oshm_zone[n].shm.huge;
+#endif
 
                 if (shm_zone[i].init(&shm_zone[i], oshm_zone[n].data)
                     != NGX_OK)
@@ -478,6 +489,11 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             goto failed;
         }
 
+#if (NGX_HAVE_NUMA)
+        ngx_numa_interleave(shm_zone[i].shm.addr, shm_zone[i].shm.size,
+                            log);
+#endif
+
         if (ngx_init_zone_pool(cycle, &shm_zone[i]) != NGX_OK) {
             goto failed;
         }
@@ -610,6 +626,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
         goto failed;
     }
 
+    ngx_numa_order_reuseport(cycle);
+
     if (!ngx_test_config) {
         ngx_configure_listening_sockets(cycle);
     }
@@ -1310,7 +1328,7 @@ ngx_clean_old_cycles(ngx_event_t *ev)
         found = 0;
 
         for (n = 0; n < cycle[i]->connection_n; n++) {
-            if (cycle[i]->connections[n].fd != (ngx_socket_t) -1) {
+            if (ngx_cycle_connection(cycle[i], n)->fd != (ngx_socket_t) -1) {
                 found = 1;
 
                 ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0, "live fd:%ui", n);
@@ -66,6 +66,9 @@ struct ngx_cycle_s {
     ngx_connection_t         *connections;
     ngx_event_t              *read_events;
     ngx_event_t              *write_events;
+#if (NGX_CACHE_LINE_LAYOUT)
+    size_t                    connection_size;
+#endif
 
     ngx_cycle_t              *old_cycle;
 
@@ -108,11 +111,34 @@ typedef struct {
 
     ngx_array_t               env;
     char                    **environment;
+
+    ngx_uint_t                pool_cache;
+    ngx_flag_t                pool_stats;
+
+    size_t                    shm_huge_pages;
+    ngx_flag_t                worker_numa;
 } ngx_core_conf_t;
 
 
 #define ngx_is_init_cycle(cycle)  (cycle->conf_ctx == NULL)
 
+#if (NGX_CACHE_LINE_LAYOUT)
+
+/*
+ * each connection is followed by its read and write events,
+ * all of them start at a cache line
+ */
+
+#define ngx_cycle_connection(cycle, n)                                       \
+    ((ngx_connection_t *) ((u_char *) (cycle)->connections                    \
+                           + (n) * (cycle)->connection_size))
+
+#else
+
+#define ngx_cycle_connection(cycle, n)  (&(cycle)->connections[n])
+
+#endif
+
 
 ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle);
 ngx_int_t ngx_create_pidfile(ngx_str_t *name, ngx_log_t *log);
@@ -9,18 +9,83 @@
 #include <ngx_core.h>
 
 
+#define NGX_POOL_CACHE_SLOTS    8
+#define NGX_POOL_CACHE_LARGE    16
+#define NGX_POOL_STATS_BUCKETS  12
+#define NGX_POOL_STATS_MIN      256
+
+
+typedef struct ngx_pool_cached_s  ngx_pool_cached_t;
+
+struct ngx_pool_cached_s {
+    ngx_pool_cached_t    *next;
+};
+
+
+typedef struct {
+    size_t                size;
+    ngx_uint_t            number;
+    ngx_pool_cached_t    *free;
+
+    ngx_uint_t            pools;
+    ngx_uint_t            grown;
+    ngx_uint_t            large;
+    size_t                max_used;
+    ngx_uint_t            used[NGX_POOL_STATS_BUCKETS];
+} ngx_pool_cache_slot_t;
+
+
+typedef struct {
+    ngx_uint_t            number;
+    ngx_pool_cached_t    *free;
+} ngx_pool_cache_large_t;
+
+
+typedef struct {
+    ngx_uint_t            enabled;
+    ngx_uint_t            max;
+    ngx_uint_t            stats;
+#if (NGX_THREADS)
+    pthread_t             owner;
+#endif
+    ngx_pool_cache_slot_t   slots[NGX_POOL_CACHE_SLOTS];
+    ngx_pool_cache_large_t  large[NGX_POOL_CACHE_LARGE];
+} ngx_pool_cache_t;
+
+
 static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
 
+static ngx_inline ngx_uint_t ngx_pool_cache_usable(void);
+static ngx_pool_cache_slot_t *ngx_pool_cache_slot(size_t size);
+static void *ngx_pool_get_block(size_t size, ngx_log_t *log);
+static void ngx_pool_free_block(void *p, size_t size);
+static size_t ngx_pool_large_size(size_t size);
+static void *ngx_pool_get_large(size_t size, ngx_log_t *log);
+static void ngx_pool_free_large(ngx_pool_large_t *l);
+static void ngx_pool_account(ngx_pool_t *pool);
+static void ngx_pool_cache_free(void);
+
+
+/*
+ * The pool cache is per process: whole pool blocks of up to
+ * NGX_POOL_CACHE_SLOTS different sizes and large allocations rounded up
+ * to 1..NGX_POOL_CACHE_LARGE pages are kept on freelists instead of being
+ * returned to malloc().  It is only used by the thread which enabled it,
+ * pools may be also used from thread pool tasks.
+ */
+
+static ngx_pool_cache_t  ngx_pool_cache;
+
 
 ngx_pool_t *
 ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_pool_get_block(size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -46,6 +111,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
+    size_t               size;
     ngx_pool_t          *p, *n;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
@@ -80,14 +146,20 @@ ngx_destroy_pool(ngx_pool_t *pool)
 
 #endif
 
+    if (ngx_pool_cache.stats && ngx_pool_cache_usable()) {
+        ngx_pool_account(pool);
+    }
+
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
         }
     }
 
+    size = (size_t) (pool->d.end - (u_char *) pool);
+
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        ngx_pool_free_block(p, size);
 
         if (n == NULL) {
             break;
@@ -104,7 +176,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
         }
     }
 
@@ -183,7 +255,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_pool_get_block(psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -214,10 +286,19 @@ static void *
 ngx_palloc_large(ngx_pool_t *pool, size_t size)
 {
     void              *p;
+    size_t             lsize;
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    lsize = ngx_pool_large_size(size);
+
+    if (lsize) {
+        p = ngx_pool_get_large(lsize, pool->log);
+
+    } else {
+        p = ngx_alloc(size, pool->log);
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -227,6 +308,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = lsize;
             return p;
         }
 
@@ -242,6 +324,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     }
 
     large->alloc = p;
+    large->size = lsize;
     large->next = pool->large;
     pool->large = large;
 
@@ -267,6 +350,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -283,7 +367,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pool_free_large(l);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -401,30 +485,314 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+void
+ngx_pool_cache_init(ngx_uint_t max, ngx_uint_t stats)
+{
+    ngx_pool_cache_free();
 
-static void *
-ngx_get_cached_block(size_t size)
+    ngx_memzero(&ngx_pool_cache, sizeof(ngx_pool_cache_t));
+
+#if (NGX_DEBUG_PALLOC)
+    /* recycled memory would hide use-after-free errors */
+    max = 0;
+#endif
+
+    ngx_pool_cache.max = max;
+    ngx_pool_cache.stats = stats;
+    ngx_pool_cache.enabled = (max || stats);
+
+#if (NGX_THREADS)
+    ngx_pool_cache.owner = pthread_self();
+#endif
+}
+
+
+void
+ngx_pool_cache_done(ngx_log_t *log)
 {
-    void                     *p;
-    ngx_cached_block_slot_t  *slot;
+    if (ngx_pool_cache.stats) {
+        ngx_pool_log_stats(log);
+    }
 
-    if (ngx_cycle->cache == NULL) {
-        return NULL;
+    ngx_pool_cache_free();
+
+    ngx_pool_cache.enabled = 0;
+    ngx_pool_cache.max = 0;
+    ngx_pool_cache.stats = 0;
+}
+
+
+void
+ngx_pool_log_stats(ngx_log_t *log)
+{
+    u_char                 *p, *last;
+    size_t                  bound;
+    ngx_uint_t              i, n;
+    ngx_pool_cache_slot_t  *slot;
+    u_char                  buf[NGX_POOL_STATS_BUCKETS
+                                * (sizeof(" <=1024K:") + NGX_INT_T_LEN)];
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache.slots[i];
+
+        if (slot->pools == 0) {
+            continue;
+        }
+
+        p = buf;
+        last = buf + sizeof(buf);
+        bound = NGX_POOL_STATS_MIN;
+
+        for (n = 0; n < NGX_POOL_STATS_BUCKETS; n++, bound <<= 1) {
+
+            if (slot->used[n] == 0) {
+                continue;
+            }
+
+            if (n == NGX_POOL_STATS_BUCKETS - 1) {
+                p = ngx_snprintf(p, last - p, " >%uzK:%ui",
+                                 bound / 2 / 1024, slot->used[n]);
+
+            } else if (bound < 1024) {
+                p = ngx_snprintf(p, last - p, " <=%uz:%ui",
+                                 bound, slot->used[n]);
+
+            } else {
+                p = ngx_snprintf(p, last - p, " <=%uzK:%ui",
+                                 bound / 1024, slot->used[n]);
+            }
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "pool size:%uz pools:%ui grown:%ui large:%ui "
+                      "max used:%uz, used:%*s",
+                      slot->size, slot->pools, slot->grown, slot->large,
+                      slot->max_used, (size_t) (p - buf), buf);
     }
+}
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
 
-    slot->tries++;
+static ngx_inline ngx_uint_t
+ngx_pool_cache_usable(void)
+{
+    if (!ngx_pool_cache.enabled) {
+        return 0;
+    }
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+#if (NGX_THREADS)
+    if (!pthread_equal(pthread_self(), ngx_pool_cache.owner)) {
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+
+static ngx_pool_cache_slot_t *
+ngx_pool_cache_slot(size_t size)
+{
+    ngx_uint_t              i;
+    ngx_pool_cache_slot_t  *slot;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache.slots[i];
+
+        if (slot->size == size) {
+            return slot;
+        }
+
+        if (slot->size == 0) {
+            slot->size = size;
+            return slot;
+        }
     }
 
     return NULL;
 }
 
-#endif
+
+static void *
+ngx_pool_get_block(size_t size, ngx_log_t *log)
+{
+    ngx_pool_cached_t      *b;
+    ngx_pool_cache_slot_t  *slot;
+
+    if (ngx_pool_cache.max && ngx_pool_cache_usable()) {
+        slot = ngx_pool_cache_slot(size);
+
+        if (slot && slot->free) {
+            b = slot->free;
+            slot->free = b->next;
+            slot->number--;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                           "cached block: %p:%uz", b, size);
+
+            return b;
+        }
+    }
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+}
+
+
+static void
+ngx_pool_free_block(void *p, size_t size)
+{
+    ngx_pool_cached_t      *b;
+    ngx_pool_cache_slot_t  *slot;
+
+    if (ngx_pool_cache.max && ngx_pool_cache_usable()) {
+        slot = ngx_pool_cache_slot(size);
+
+        if (slot && slot->number < ngx_pool_cache.max) {
+            b = p;
+            b->next = slot->free;
+            slot->free = b;
+            slot->number++;
+            return;
+        }
+    }
+
+    ngx_free(p);
+}
+
+
+static size_t
+ngx_pool_large_size(size_t size)
+{
+    /*
+     * only allocations of half a page and more are rounded up,
+     * smaller ones would waste too much memory
+     */
+
+    if (ngx_pool_cache.max == 0
+        || size < ngx_pagesize / 2
+        || size > NGX_POOL_CACHE_LARGE * ngx_pagesize
+        || !ngx_pool_cache_usable())
+    {
+        return 0;
+    }
+
+    return ngx_align(size, ngx_pagesize);
+}
+
+
+static void *
+ngx_pool_get_large(size_t size, ngx_log_t *log)
+{
+    ngx_pool_cached_t       *b;
+    ngx_pool_cache_large_t  *large;
+
+    large = &ngx_pool_cache.large[size / ngx_pagesize - 1];
+
+    if (large->free) {
+        b = large->free;
+        large->free = b->next;
+        large->number--;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                       "cached large: %p:%uz", b, size);
+
+        return b;
+    }
+
+    return ngx_alloc(size, log);
+}
+
+
+static void
+ngx_pool_free_large(ngx_pool_large_t *l)
+{
+    ngx_pool_cached_t       *b;
+    ngx_pool_cache_large_t  *large;
+
+    if (l->size && ngx_pool_cache.max && ngx_pool_cache_usable()) {
+        large = &ngx_pool_cache.large[l->size / ngx_pagesize - 1];
+
+        if (large->number < ngx_pool_cache.max) {
+            b = l->alloc;
+            b->next = large->free;
+            large->free = b;
+            large->number++;
+            return;
+        }
+    }
+
+    ngx_free(l->alloc);
+}
+
+
+static void
+ngx_pool_account(ngx_pool_t *pool)
+{
+    size_t                  used, bound;
+    ngx_uint_t              n;
+    ngx_pool_t             *p;
+    ngx_pool_large_t       *l;
+    ngx_pool_cache_slot_t  *slot;
+
+    slot = ngx_pool_cache_slot((size_t) (pool->d.end - (u_char *) pool));
+    if (slot == NULL) {
+        return;
+    }
+
+    used = 0;
+
+    for (p = pool; p; p = p->d.next) {
+        used += (size_t) (p->d.last - (u_char *) p);
+    }
+
+    for (l = pool->large; l; l = l->next) {
+        slot->large++;
+    }
+
+    slot->pools++;
+
+    if (pool->d.next) {
+        slot->grown++;
+    }
+
+    if (used > slot->max_used) {
+        slot->max_used = used;
+    }
+
+    bound = NGX_POOL_STATS_MIN;
+
+    for (n = 0; n < NGX_POOL_STATS_BUCKETS - 1; n++, bound <<= 1) {
+        if (used <= bound) {
+            break;
+        }
+    }
+
+    slot->used[n]++;
+}
+
+
+static void
+ngx_pool_cache_free(void)
+{
+    ngx_uint_t          i;
+    ngx_pool_cached_t  *b, *next;
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        for (b = ngx_pool_cache.slots[i].free; b; b = next) {
+            next = b->next;
+            ngx_free(b);
+        }
+
+        ngx_pool_cache.slots[i].free = NULL;
+        ngx_pool_cache.slots[i].number = 0;
+    }
+
+    for (i = 0; i < NGX_POOL_CACHE_LARGE; i++) {
+        for (b = ngx_pool_cache.large[i].free; b; b = next) {
+            next = b->next;
+            ngx_free(b);
+        }
+
+        ngx_pool_cache.large[i].free = NULL;
+        ngx_pool_cache.large[i].number = 0;
+    }
+}
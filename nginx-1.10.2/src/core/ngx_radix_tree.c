@@ -9,7 +9,31 @@
 #include <ngx_core.h>
 
 
+typedef struct {
+    ngx_rbtree_node_t   node;
+    uint32_t            index;
+} ngx_radix_trie_value_node_t;
+
+
+typedef struct {
+    ngx_array_t         nodes;
+    ngx_array_t         values;
+    ngx_rbtree_t        rbtree;
+    ngx_rbtree_node_t   sentinel;
+    ngx_pool_t         *temp_pool;
+    ngx_uint_t          bits;
+} ngx_radix_trie_ctx_t;
+
+
 static ngx_radix_node_t *ngx_radix_alloc(ngx_radix_tree_t *tree);
+static ngx_int_t ngx_radix_trie_node(ngx_radix_trie_ctx_t *ctx,
+    ngx_radix_node_t *node, ngx_uint_t depth, uint32_t index, uint32_t *entry);
+static ngx_uint_t ngx_radix_trie_stride(ngx_radix_node_t *node,
+    ngx_uint_t max);
+static ngx_uint_t ngx_radix_trie_count(ngx_radix_node_t *node,
+    ngx_uint_t depth);
+static ngx_int_t ngx_radix_trie_value(ngx_radix_trie_ctx_t *ctx,
+    uintptr_t value, uint32_t *index);
 
 
 ngx_radix_tree_t *
@@ -194,7 +218,7 @@ ngx_radix32tree_delete(ngx_radix_tree_t *tree, uint32_t key, uint32_t mask)
         return NGX_ERROR;
     }
 
-    if (node->right || node->left) {
+    if (node->right || node->left || node->parent == NULL) {
         if (node->value != NGX_RADIX_NO_VALUE) {
             node->value = NGX_RADIX_NO_VALUE;
             return NGX_OK;
@@ -263,6 +287,277 @@ ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key)
 }
 
 
+/*
+ * The trie is compiled once at configuration time.  The value index 0
+ * is reserved for the value of the tree root, that is, the value found
+ * when no other prefix matches; it is never shared with other prefixes,
+ * so the caller may replace it afterwards.
+ */
+
+ngx_radix_trie_t *
+ngx_radix_trie_create(ngx_radix_tree_t *tree, ngx_uint_t bits,
+    ngx_pool_t *pool, ngx_pool_t *temp_pool)
+{
+    uint32_t               root;
+    uintptr_t             *value;
+    ngx_radix_trie_t      *trie;
+    ngx_radix_trie_ctx_t   ctx;
+
+    if (ngx_array_init(&ctx.nodes, temp_pool, 1024, sizeof(uint32_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&ctx.values, temp_pool, 64, sizeof(uintptr_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&ctx.rbtree, &ctx.sentinel, ngx_rbtree_insert_value);
+
+    ctx.temp_pool = temp_pool;
+    ctx.bits = bits;
+
+    value = ngx_array_push(&ctx.values);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    *value = tree->root->value;
+
+    if (ngx_radix_trie_node(&ctx, tree->root, 0, 0, &root) != NGX_OK) {
+        return NULL;
+    }
+
+    trie = ngx_palloc(pool, sizeof(ngx_radix_trie_t));
+    if (trie == NULL) {
+        return NULL;
+    }
+
+    trie->nnodes = ctx.nodes.nelts;
+    trie->nodes = ngx_pmemalign(pool, trie->nnodes * sizeof(uint32_t),
+                                NGX_CPU_CACHE_LINE);
+    if (trie->nodes == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(trie->nodes, ctx.nodes.elts, trie->nnodes * sizeof(uint32_t));
+
+    trie->nvalues = ctx.values.nelts;
+    trie->values = ngx_palloc(pool, trie->nvalues * sizeof(uintptr_t));
+    if (trie->values == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(trie->values, ctx.values.elts,
+               trie->nvalues * sizeof(uintptr_t));
+
+    trie->root = root;
+
+    return trie;
+}
+
+
+static ngx_int_t
+ngx_radix_trie_node(ngx_radix_trie_ctx_t *ctx, ngx_radix_node_t *node,
+    ngx_uint_t depth, uint32_t index, uint32_t *entry)
+{
+    uint32_t           e, v, *slot;
+    ngx_uint_t         i, b, n, max, pad, start, stride;
+    ngx_radix_node_t  *next;
+
+    /* the root node may be wider as it is always looked up */
+
+    max = (depth == 0) ? 16 : 8;
+
+    stride = ngx_radix_trie_stride(node, ngx_min(max, ctx->bits - depth));
+    n = (ngx_uint_t) 1 << stride;
+
+    /* every node starts at a cache line boundary */
+
+    start = ngx_align(ctx->nodes.nelts, NGX_CPU_CACHE_LINE / sizeof(uint32_t));
+
+    if (start + n > NGX_RADIX_TRIE_MAX_NODES) {
+        return NGX_ERROR;
+    }
+
+    pad = start - ctx->nodes.nelts;
+
+    slot = ngx_array_push_n(&ctx->nodes, pad + n);
+    if (slot == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the padding is never looked up, but is kept valid */
+
+    while (pad--) {
+        *slot++ = NGX_RADIX_TRIE_LEAF;
+    }
+
+    for (i = 0; i < n; i++) {
+
+        next = node;
+        v = index;
+
+        for (b = stride; b; b--) {
+
+            if (i & ((ngx_uint_t) 1 << (b - 1))) {
+                next = next->right;
+
+            } else {
+                next = next->left;
+            }
+
+            if (next == NULL) {
+                break;
+            }
+
+            if (next->value != NGX_RADIX_NO_VALUE) {
+                if (ngx_radix_trie_value(ctx, next->value, &v) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+        }
+
+        if (next == NULL || (next->left == NULL && next->right == NULL)) {
+            e = NGX_RADIX_TRIE_LEAF | v;
+
+        } else if (ngx_radix_trie_node(ctx, next, depth + stride, v, &e)
+                   != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /* the array may have been reallocated by the recursive call */
+
+        slot = ctx->nodes.elts;
+        slot[start + i] = e;
+    }
+
+    *entry = (uint32_t) (stride << 26 | start);
+
+    return NGX_OK;
+}
+
+
+/*
+ * A node consumes at least 4 bits, that is, 16 entries per cache line,
+ * and grows while at least half of the entries of a wider node would
+ * lead to different subtrees.
+ */
+
+static ngx_uint_t
+ngx_radix_trie_stride(ngx_radix_node_t *node, ngx_uint_t max)
+{
+    ngx_uint_t  stride;
+
+    stride = ngx_min(4, max);
+
+    while (stride < max
+           && ngx_radix_trie_count(node, stride + 1) * 2
+              >= (ngx_uint_t) 1 << (stride + 1))
+    {
+        stride++;
+    }
+
+    return stride;
+}
+
+
+static ngx_uint_t
+ngx_radix_trie_count(ngx_radix_node_t *node, ngx_uint_t depth)
+{
+    if (node == NULL) {
+        return 0;
+    }
+
+    if (depth == 0) {
+        return 1;
+    }
+
+    return ngx_radix_trie_count(node->left, depth - 1)
+           + ngx_radix_trie_count(node->right, depth - 1);
+}
+
+
+static ngx_int_t
+ngx_radix_trie_value(ngx_radix_trie_ctx_t *ctx, uintptr_t value,
+    uint32_t *index)
+{
+    uintptr_t                    *v;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_radix_trie_value_node_t  *vn;
+
+    node = ctx->rbtree.root;
+    sentinel = ctx->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (value < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (value > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        *index = ((ngx_radix_trie_value_node_t *) node)->index;
+
+        return NGX_OK;
+    }
+
+    if (ctx->values.nelts >= NGX_RADIX_TRIE_LEAF) {
+        return NGX_ERROR;
+    }
+
+    vn = ngx_palloc(ctx->temp_pool, sizeof(ngx_radix_trie_value_node_t));
+    if (vn == NULL) {
+        return NGX_ERROR;
+    }
+
+    v = ngx_array_push(&ctx->values);
+    if (v == NULL) {
+        return NGX_ERROR;
+    }
+
+    *v = value;
+
+    vn->node.key = value;
+    vn->index = (uint32_t) (ctx->values.nelts - 1);
+
+    ngx_rbtree_insert(&ctx->rbtree, &vn->node);
+
+    *index = vn->index;
+
+    return NGX_OK;
+}
+
+
+uintptr_t
+ngx_radix32trie_find(ngx_radix_trie_t *trie, uint32_t key)
+{
+    uint32_t    e;
+    ngx_uint_t  shift, stride;
+
+    e = trie->root;
+    shift = 32;
+
+    while (!(e & NGX_RADIX_TRIE_LEAF)) {
+        stride = NGX_RADIX_TRIE_STRIDE(e);
+        shift -= stride;
+
+        e = trie->nodes[NGX_RADIX_TRIE_OFFSET(e)
+                        + ((key >> shift) & (((uint32_t) 1 << stride) - 1))];
+    }
+
+    return trie->values[e & ~NGX_RADIX_TRIE_LEAF];
+}
+
+
 #if (NGX_HAVE_INET6)
 
 ngx_int_t
@@ -382,7 +677,7 @@ ngx_radix128tree_delete(ngx_radix_tree_t *tree, u_char *key, u_char *mask)
         return NGX_ERROR;
     }
 
-    if (node->right || node->left) {
+    if (node->right || node->left || node->parent == NULL) {
         if (node->value != NGX_RADIX_NO_VALUE) {
             node->value = NGX_RADIX_NO_VALUE;
             return NGX_OK;
@@ -457,6 +752,42 @@ ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key)
     return value;
 }
 
+uintptr_t
+ngx_radix128trie_find(ngx_radix_trie_t *trie, u_char *key)
+{
+    uint32_t    e, w;
+    ngx_uint_t  i, bit, stride;
+
+    e = trie->root;
+    bit = 0;
+
+    while (!(e & NGX_RADIX_TRIE_LEAF)) {
+        stride = NGX_RADIX_TRIE_STRIDE(e);
+
+        /* a stride never exceeds 16 bits, so 3 bytes always suffice */
+
+        i = bit >> 3;
+
+        w = (uint32_t) key[i] << 16;
+
+        if (i + 1 < 16) {
+            w |= (uint32_t) key[i + 1] << 8;
+
+            if (i + 2 < 16) {
+                w |= key[i + 2];
+            }
+        }
+
+        w = (w >> (24 - (bit & 7) - stride)) & (((uint32_t) 1 << stride) - 1);
+
+        e = trie->nodes[NGX_RADIX_TRIE_OFFSET(e) + w];
+
+        bit += stride;
+    }
+
+    return trie->values[e & ~NGX_RADIX_TRIE_LEAF];
+}
+
 #endif
 
 
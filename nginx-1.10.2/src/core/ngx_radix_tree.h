@@ -34,6 +34,30 @@ typedef struct {
 } ngx_radix_tree_t;
 
 
+/*
+ * A level-compressed trie compiled from a radix tree.  Every node is
+ * a power-of-two array of 32-bit entries; an entry is either a leaf with
+ * an index into the values array, or a reference to the child node with
+ * the number of key bits the child consumes.  Values are pushed down to
+ * the leaves, so a lookup does one dependent load per node instead of
+ * one per key bit.  The nodes array is position-independent and may be
+ * mapped from a file as is.
+ */
+
+#define NGX_RADIX_TRIE_LEAF         0x80000000
+#define NGX_RADIX_TRIE_STRIDE(e)    (((e) >> 26) & 0x1f)
+#define NGX_RADIX_TRIE_OFFSET(e)    ((e) & 0x03ffffff)
+#define NGX_RADIX_TRIE_MAX_NODES    0x04000000
+
+typedef struct {
+    uint32_t          *nodes;
+    ngx_uint_t         nnodes;
+    uintptr_t         *values;
+    ngx_uint_t         nvalues;
+    uint32_t           root;
+} ngx_radix_trie_t;
+
+
 ngx_radix_tree_t *ngx_radix_tree_create(ngx_pool_t *pool,
     ngx_int_t preallocate);
 
@@ -43,12 +67,17 @@ ngx_int_t ngx_radix32tree_delete(ngx_radix_tree_t *tree,
     uint32_t key, uint32_t mask);
 uintptr_t ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key);
 
+ngx_radix_trie_t *ngx_radix_trie_create(ngx_radix_tree_t *tree,
+    ngx_uint_t bits, ngx_pool_t *pool, ngx_pool_t *temp_pool);
+uintptr_t ngx_radix32trie_find(ngx_radix_trie_t *trie, uint32_t key);
+
 #if (NGX_HAVE_INET6)
 ngx_int_t ngx_radix128tree_insert(ngx_radix_tree_t *tree,
     u_char *key, u_char *mask, uintptr_t value);
 ngx_int_t ngx_radix128tree_delete(ngx_radix_tree_t *tree,
     u_char *key, u_char *mask);
 uintptr_t ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key);
+uintptr_t ngx_radix128trie_find(ngx_radix_trie_t *trie, u_char *key);
 #endif
 
 
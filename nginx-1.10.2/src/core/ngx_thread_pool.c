@@ -572,6 +572,26 @@ ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 }
 
 
+ngx_int_t
+ngx_thread_pool_start(ngx_cycle_t *cycle, ngx_thread_pool_t *tp)
+{
+    /*
+     * workers start all thread pools on initialization, while
+     * a helper process starts only the pools it uses, on first use
+     */
+
+    if (ngx_process != NGX_PROCESS_HELPER || tp->log) {
+        return NGX_OK;
+    }
+
+    if (ngx_thread_pool_done.last == NULL) {
+        ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    }
+
+    return ngx_thread_pool_init(tp, cycle->log, cycle->pool);
+}
+
+
 static ngx_int_t
 ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
 {
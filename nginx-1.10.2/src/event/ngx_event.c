@@ -503,6 +503,9 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     shm.name.len = sizeof("nginx_shared_zone") - 1;
     shm.name.data = (u_char *) "nginx_shared_zone";
     shm.log = cycle->log;
+#if (NGX_HAVE_MAP_HUGETLB)
+    shm.huge = 0;
+#endif
 
     if (ngx_shm_alloc(&shm) != NGX_OK) {
         return NGX_ERROR;
@@ -575,6 +578,9 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     ngx_core_conf_t     *ccf;
     ngx_event_conf_t    *ecf;
     ngx_event_module_t  *module;
+#if (NGX_CACHE_LINE_LAYOUT)
+    size_t               csize, esize;
+#endif
 
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
     ecf = ngx_event_get_conf(cycle->conf_ctx, ngx_event_core_module);
@@ -681,6 +687,50 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
 #endif
 
+#if (NGX_CACHE_LINE_LAYOUT)
+
+    csize = ngx_align(sizeof(ngx_connection_t), NGX_CPU_CACHE_LINE);
+    esize = ngx_align(sizeof(ngx_event_t), NGX_CPU_CACHE_LINE);
+
+    cycle->connection_size = csize + 2 * esize;
+
+    cycle->connections = ngx_memalign(NGX_CPU_CACHE_LINE,
+                                      cycle->connection_size
+                                      * cycle->connection_n,
+                                      cycle->log);
+    if (cycle->connections == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the events are placed right after their connections */
+
+    cycle->read_events = NULL;
+    cycle->write_events = NULL;
+
+    i = cycle->connection_n;
+    next = NULL;
+
+    do {
+        i--;
+
+        c = ngx_cycle_connection(cycle, i);
+        rev = (ngx_event_t *) ((u_char *) c + csize);
+        wev = (ngx_event_t *) ((u_char *) rev + esize);
+
+        rev->closed = 1;
+        rev->instance = 1;
+        wev->closed = 1;
+
+        c->data = next;
+        c->read = rev;
+        c->write = wev;
+        c->fd = (ngx_socket_t) -1;
+
+        next = c;
+    } while (i);
+
+#else
+
     cycle->connections =
         ngx_alloc(sizeof(ngx_connection_t) * cycle->connection_n, cycle->log);
     if (cycle->connections == NULL) {
@@ -726,6 +776,8 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         next = &c[i];
     } while (i);
 
+#endif
+
     cycle->free_connections = next;
     cycle->free_connection_n = cycle->connection_n;
 
@@ -822,6 +874,11 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         rev->handler = (c->type == SOCK_STREAM) ? ngx_event_accept
                                                 : ngx_event_recvmsg;
 
+        if (c->type == SOCK_DGRAM) {
+            ngx_rbtree_init(&ls[i].rbtree, &ls[i].sentinel,
+                            ngx_udp_rbtree_insert_value);
+        }
+
         if (ngx_use_accept_mutex
 #if (NGX_HAVE_REUSEPORT)
             && !ls[i].reuseport
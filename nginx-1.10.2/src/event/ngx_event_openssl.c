@@ -300,6 +300,9 @@ ngx_ssl_create(ngx_ssl_t *ssl, ngx_uint_t protocols, void *data)
     SSL_CTX_set_mode(ssl->ctx, SSL_MODE_NO_AUTO_CHAIN);
 #endif
 
+    /* records written without copying may be retried from c->ssl->buf */
+    SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     SSL_CTX_set_read_ahead(ssl->ctx, 1);
 
     SSL_CTX_set_info_callback(ssl->ctx, ngx_ssl_info_callback);
@@ -1617,6 +1620,56 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
             size = in->buf->last - in->buf->pos;
 
+            if (size >= (ssize_t) c->ssl->buffer_size
+                && limit - send >= (off_t) c->ssl->buffer_size)
+            {
+                /* a full record is written without copying */
+
+                if (buf->pos != buf->last) {
+                    flush = 1;
+                    break;
+                }
+
+                size = c->ssl->buffer_size;
+
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "SSL buf direct: %z", size);
+
+                n = ngx_ssl_write(c, in->buf->pos, size);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (n == NGX_AGAIN) {
+
+                    /* the write will be retried from the buffer */
+
+                    buf->pos = buf->start;
+                    buf->last = ngx_cpymem(buf->start, in->buf->pos, size);
+
+                    in->buf->pos += size;
+
+                    if (in->buf->pos == in->buf->last) {
+                        in = in->next;
+                    }
+
+                    buf->flush = flush;
+                    c->buffered |= NGX_SSL_BUFFERED;
+
+                    return in;
+                }
+
+                in->buf->pos += n;
+                send += n;
+
+                if (in->buf->pos == in->buf->last) {
+                    in = in->next;
+                }
+
+                continue;
+            }
+
             if (size > buf->end - buf->last) {
                 size = buf->end - buf->last;
             }
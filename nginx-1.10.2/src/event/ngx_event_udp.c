@@ -0,0 +1,817 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#if !(NGX_WIN32)
+
+#if (NGX_HAVE_RECVMMSG)
+#define NGX_UDP_RECV_BATCH  32
+#else
+#define NGX_UDP_RECV_BATCH  1
+#endif
+
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+typedef union {
+    struct cmsghdr  cmsg;
+#if (NGX_HAVE_IP_RECVDSTADDR)
+    u_char          msg_control[CMSG_SPACE(sizeof(struct in_addr))];
+#elif (NGX_HAVE_IP_PKTINFO)
+    u_char          msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+    u_char          msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+#endif
+} ngx_udp_msg_control_t;
+
+#endif
+
+
+typedef struct {
+    ssize_t                size;
+    struct iovec           iov;
+    ngx_buf_t              buf;
+    ngx_chain_t            chain;
+    u_char                 sockaddr[NGX_SOCKADDRLEN];
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    ngx_udp_msg_control_t  msg_control;
+#endif
+    u_char                 buffer[65535];
+} ngx_udp_datagram_t;
+
+
+static ngx_int_t ngx_event_udp_recv(ngx_event_t *ev, ngx_connection_t *lc);
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+static void ngx_event_udp_local_sockaddr(struct msghdr *msg,
+    struct sockaddr *sockaddr);
+#endif
+static ngx_int_t ngx_event_udp_accept(ngx_event_t *ev, ngx_listening_t *ls,
+    ngx_udp_datagram_t *d, struct msghdr *msg,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen);
+static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
+static ssize_t ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen);
+static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c);
+static void ngx_delete_udp_connection(void *data);
+static ngx_int_t ngx_udp_connection_hash(ngx_listening_t *ls,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen,
+    uint32_t *hash);
+static ngx_int_t ngx_udp_connection_cmp(struct sockaddr *sockaddr,
+    socklen_t socklen, struct sockaddr *local_sockaddr,
+    socklen_t local_socklen, ngx_connection_t *c);
+
+
+static ngx_udp_datagram_t  ngx_udp_datagrams[NGX_UDP_RECV_BATCH];
+
+#if (NGX_HAVE_RECVMMSG)
+static struct mmsghdr      ngx_udp_msgs[NGX_UDP_RECV_BATCH];
+#define ngx_udp_msghdr(i)  (&ngx_udp_msgs[i].msg_hdr)
+#else
+static struct msghdr       ngx_udp_msgs[NGX_UDP_RECV_BATCH];
+#define ngx_udp_msghdr(i)  (&ngx_udp_msgs[i])
+#endif
+
+
+void
+ngx_event_recvmsg(ngx_event_t *ev)
+{
+    ssize_t              n;
+    socklen_t            local_socklen;
+    ngx_int_t            i, count;
+    ngx_uint_t           k, nsessions;
+    ngx_chain_t        **ll;
+    struct msghdr       *msg;
+    ngx_listening_t     *ls;
+    ngx_event_conf_t    *ecf;
+    ngx_connection_t    *c, *lc;
+    struct sockaddr     *local_sockaddr;
+    ngx_udp_datagram_t  *d;
+    ngx_connection_t    *sessions[NGX_UDP_RECV_BATCH];
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    u_char               local[NGX_SOCKADDRLEN];
+#endif
+
+    if (ev->timedout) {
+        if (ngx_enable_accept_events((ngx_cycle_t *) ngx_cycle) != NGX_OK) {
+            return;
+        }
+
+        ev->timedout = 0;
+    }
+
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
+
+    if (!(ngx_event_flags & NGX_USE_KQUEUE_EVENT)) {
+        ev->available = ecf->multi_accept;
+    }
+
+    lc = ev->data;
+    ls = lc->listening;
+    ev->ready = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
+
+    do {
+        count = ngx_event_udp_recv(ev, lc);
+
+        if (count == NGX_AGAIN || count == NGX_ERROR) {
+            return;
+        }
+
+        nsessions = 0;
+
+        for (i = 0; i < count; i++) {
+            d = &ngx_udp_datagrams[i];
+            msg = ngx_udp_msghdr(i);
+            n = d->size;
+
+            if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+                ev->available -= n;
+            }
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+            if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                              "recvmsg() truncated data");
+                continue;
+            }
+#endif
+
+            local_sockaddr = ls->sockaddr;
+            local_socklen = ls->socklen;
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+            if (ls->wildcard) {
+                ngx_memcpy(local, ls->sockaddr, ls->socklen);
+                local_sockaddr = (struct sockaddr *) local;
+
+                ngx_event_udp_local_sockaddr(msg, local_sockaddr);
+            }
+
+#endif
+
+            c = ngx_lookup_udp_connection(ls, msg->msg_name, msg->msg_namelen,
+                                          local_sockaddr, local_socklen);
+
+            if (c == NULL) {
+                if (ngx_event_udp_accept(ev, ls, d, msg, local_sockaddr,
+                                         local_socklen)
+                    != NGX_OK)
+                {
+                    break;
+                }
+
+                continue;
+            }
+
+            /*
+             * the datagram belongs to an existing session, it is
+             * passed to the session read handler after the batch
+             */
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "*%uA recvmsg: fd:%d n:%z",
+                           c->number, c->fd, n);
+
+            ngx_memzero(&d->buf, sizeof(ngx_buf_t));
+
+            d->buf.start = d->buffer;
+            d->buf.pos = d->buffer;
+            d->buf.last = d->buffer + n;
+            d->buf.end = d->buf.last;
+            d->buf.memory = 1;
+
+            d->chain.buf = &d->buf;
+            d->chain.next = NULL;
+
+            for (ll = &c->udp->in; *ll; ll = &(*ll)->next) { /* void */ }
+
+            if (ll == &c->udp->in) {
+                sessions[nsessions++] = c;
+            }
+
+            *ll = &d->chain;
+        }
+
+        for (k = 0; k < nsessions; k++) {
+            c = sessions[k];
+
+            c->read->ready = 1;
+            c->read->active = 0;
+
+            c->read->handler(c->read);
+
+            /* the session may be closed by the handler */
+
+            if (c->udp) {
+                c->udp->in = NULL;
+
+                c->read->ready = 0;
+                c->read->active = 1;
+            }
+        }
+
+        if (i < count) {
+            return;
+        }
+
+        if (count < NGX_UDP_RECV_BATCH) {
+
+            /* the socket receive queue is empty */
+
+            return;
+        }
+
+    } while (ev->available);
+}
+
+
+static ngx_int_t
+ngx_event_udp_recv(ngx_event_t *ev, ngx_connection_t *lc)
+{
+    ssize_t              n;
+    ngx_int_t            i;
+    ngx_err_t            err;
+    struct msghdr       *msg;
+    ngx_listening_t     *ls;
+    ngx_udp_datagram_t  *d;
+
+    ls = lc->listening;
+
+    for (i = 0; i < NGX_UDP_RECV_BATCH; i++) {
+        d = &ngx_udp_datagrams[i];
+        msg = ngx_udp_msghdr(i);
+
+        ngx_memzero(msg, sizeof(struct msghdr));
+
+        d->iov.iov_base = (void *) d->buffer;
+        d->iov.iov_len = sizeof(d->buffer);
+
+        msg->msg_name = d->sockaddr;
+        msg->msg_namelen = sizeof(d->sockaddr);
+        msg->msg_iov = &d->iov;
+        msg->msg_iovlen = 1;
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+        if (ls->wildcard) {
+            msg->msg_control = &d->msg_control;
+            msg->msg_controllen = sizeof(ngx_udp_msg_control_t);
+        }
+
+#endif
+    }
+
+#if (NGX_HAVE_RECVMMSG)
+
+    n = recvmmsg(lc->fd, ngx_udp_msgs, NGX_UDP_RECV_BATCH, 0, NULL);
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                           "recvmmsg() not ready");
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmmsg() failed");
+
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_udp_datagrams[i].size = ngx_udp_msgs[i].msg_len;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "recvmmsg: %z of %d", n, NGX_UDP_RECV_BATCH);
+
+#else
+
+    n = recvmsg(lc->fd, &ngx_udp_msgs[0], 0);
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                           "recvmsg() not ready");
+            return NGX_AGAIN;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
+
+        return NGX_ERROR;
+    }
+
+    ngx_udp_datagrams[0].size = n;
+    n = 1;
+
+#endif
+
+    return n;
+}
+
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+static void
+ngx_event_udp_local_sockaddr(struct msghdr *msg, struct sockaddr *sockaddr)
+{
+    struct cmsghdr  *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+
+#if (NGX_HAVE_IP_RECVDSTADDR)
+
+        if (cmsg->cmsg_level == IPPROTO_IP
+            && cmsg->cmsg_type == IP_RECVDSTADDR
+            && sockaddr->sa_family == AF_INET)
+        {
+            struct in_addr      *addr;
+            struct sockaddr_in  *sin;
+
+            addr = (struct in_addr *) CMSG_DATA(cmsg);
+            sin = (struct sockaddr_in *) sockaddr;
+            sin->sin_addr = *addr;
+
+            break;
+        }
+
+#elif (NGX_HAVE_IP_PKTINFO)
+
+        if (cmsg->cmsg_level == IPPROTO_IP
+            && cmsg->cmsg_type == IP_PKTINFO
+            && sockaddr->sa_family == AF_INET)
+        {
+            struct in_pktinfo   *pkt;
+            struct sockaddr_in  *sin;
+
+            pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+            sin = (struct sockaddr_in *) sockaddr;
+            sin->sin_addr = pkt->ipi_addr;
+
+            break;
+        }
+
+#endif
+
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+
+        if (cmsg->cmsg_level == IPPROTO_IPV6
+            && cmsg->cmsg_type == IPV6_PKTINFO
+            && sockaddr->sa_family == AF_INET6)
+        {
+            struct in6_pktinfo   *pkt6;
+            struct sockaddr_in6  *sin6;
+
+            pkt6 = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+            sin6 = (struct sockaddr_in6 *) sockaddr;
+            sin6->sin6_addr = pkt6->ipi6_addr;
+
+            break;
+        }
+
+#endif
+
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_event_udp_accept(ngx_event_t *ev, ngx_listening_t *ls,
+    ngx_udp_datagram_t *d, struct msghdr *msg,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen)
+{
+    ssize_t            n;
+    ngx_log_t         *log;
+    ngx_event_t       *rev, *wev;
+    ngx_connection_t  *c, *lc;
+#if (NGX_DEBUG)
+    ngx_event_conf_t  *ecf;
+#endif
+
+    lc = ev->data;
+    n = d->size;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+#endif
+
+    ngx_accept_disabled = ngx_cycle->connection_n / 8
+                          - ngx_cycle->free_connection_n;
+
+    c = ngx_get_connection(lc->fd, ev->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->shared = 1;
+    c->type = SOCK_DGRAM;
+    c->socklen = msg->msg_namelen;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    c->pool = ngx_create_pool(ls->pool_size, ev->log);
+    if (c->pool == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    c->sockaddr = ngx_palloc(c->pool, c->socklen);
+    if (c->sockaddr == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->sockaddr, msg->msg_name, c->socklen);
+
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    *log = ls->log;
+
+    c->recv = ngx_udp_shared_recv;
+    c->send = ngx_udp_send;
+    c->send_chain = ngx_udp_send_chain;
+
+    c->log = log;
+    c->pool->log = log;
+
+    c->listening = ls;
+
+    if (local_sockaddr == ls->sockaddr) {
+        c->local_sockaddr = ls->sockaddr;
+        c->local_socklen = ls->socklen;
+
+    } else {
+        c->local_sockaddr = ngx_palloc(c->pool, local_socklen);
+        if (c->local_sockaddr == NULL) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(c->local_sockaddr, local_sockaddr, local_socklen);
+        c->local_socklen = local_socklen;
+    }
+
+    c->buffer = ngx_create_temp_buf(c->pool, n);
+    if (c->buffer == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    c->buffer->last = ngx_cpymem(c->buffer->last, d->buffer, n);
+
+    rev = c->read;
+    wev = c->write;
+
+    wev->ready = 1;
+
+    /* the shared socket is watched by the listening connection */
+    rev->active = 1;
+
+    rev->log = log;
+    wev->log = log;
+
+    /*
+     * TODO: MT: - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     *
+     * TODO: MP: - allocated in a shared memory
+     *           - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     */
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
+#endif
+
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
+        }
+
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_DEBUG)
+    {
+    ngx_str_t  addr;
+    u_char     text[NGX_SOCKADDR_STRLEN];
+
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
+
+    ngx_debug_accepted_connection(ecf, c);
+
+    if (log->log_level & NGX_LOG_DEBUG_EVENT) {
+        addr.data = text;
+        addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
+                                 NGX_SOCKADDR_STRLEN, 1);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "*%uA recvmsg: %V fd:%d n:%z",
+                       c->number, &addr, c->fd, n);
+    }
+
+    }
+#endif
+
+    if (ngx_insert_udp_connection(c) != NGX_OK) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    log->data = NULL;
+    log->handler = NULL;
+
+    ls->handler(c);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_close_accepted_udp_connection(ngx_connection_t *c)
+{
+    ngx_free_connection(c);
+
+    c->fd = (ngx_socket_t) -1;
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+}
+
+
+static ssize_t
+ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t       n;
+    ngx_buf_t    *b;
+
+    if (c->udp == NULL || c->udp->in == NULL) {
+        c->read->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    b = c->udp->in->buf;
+
+    n = ngx_min(b->last - b->pos, (ssize_t) size);
+
+    ngx_memcpy(buf, b->pos, n);
+
+    c->udp->in = c->udp->in->next;
+
+    if (c->udp->in == NULL) {
+        c->read->ready = 0;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "udp recv(): fd:%d %z of %uz", c->fd, n, size);
+
+    return n;
+}
+
+
+static ngx_connection_t *
+ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
+    socklen_t socklen, struct sockaddr *local_sockaddr,
+    socklen_t local_socklen)
+{
+    uint32_t               hash;
+    ngx_int_t              rc;
+    ngx_rbtree_node_t     *node, *sentinel;
+    ngx_udp_connection_t  *udp;
+
+    if (ngx_udp_connection_hash(ls, sockaddr, socklen, local_sockaddr,
+                                local_socklen, &hash)
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    node = ls->rbtree.root;
+    sentinel = ls->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        udp = (ngx_udp_connection_t *) node;
+
+        rc = ngx_udp_connection_cmp(sockaddr, socklen, local_sockaddr,
+                                    local_socklen, udp->connection);
+
+        if (rc == 0) {
+            return udp->connection;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_insert_udp_connection(ngx_connection_t *c)
+{
+    uint32_t               hash;
+    ngx_pool_cleanup_t    *cln;
+    ngx_udp_connection_t  *udp;
+
+    if (ngx_udp_connection_hash(c->listening, c->sockaddr, c->socklen,
+                                c->local_sockaddr, c->local_socklen, &hash)
+        != NGX_OK)
+    {
+        /* the client cannot be identified, every datagram is a session */
+        return NGX_OK;
+    }
+
+    udp = ngx_pcalloc(c->pool, sizeof(ngx_udp_connection_t));
+    if (udp == NULL) {
+        return NGX_ERROR;
+    }
+
+    udp->connection = c;
+    udp->node.key = hash;
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_delete_udp_connection;
+    cln->data = udp;
+
+    ngx_rbtree_insert(&c->listening->rbtree, &udp->node);
+
+    c->udp = udp;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_delete_udp_connection(void *data)
+{
+    ngx_udp_connection_t  *udp = data;
+
+    ngx_rbtree_delete(&udp->connection->listening->rbtree, &udp->node);
+
+    udp->connection->udp = NULL;
+}
+
+
+void
+ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_int_t              rc;
+    ngx_connection_t      *c;
+    ngx_rbtree_node_t    **p;
+    ngx_udp_connection_t  *udp, *udpt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            udp = (ngx_udp_connection_t *) node;
+            c = udp->connection;
+
+            udpt = (ngx_udp_connection_t *) temp;
+
+            rc = ngx_udp_connection_cmp(c->sockaddr, c->socklen,
+                                        c->local_sockaddr, c->local_socklen,
+                                        udpt->connection);
+
+            p = (rc < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_udp_connection_hash(ngx_listening_t *ls, struct sockaddr *sockaddr,
+    socklen_t socklen, struct sockaddr *local_sockaddr,
+    socklen_t local_socklen, uint32_t *hash)
+{
+#if (NGX_HAVE_UNIX_DOMAIN)
+
+    if (sockaddr->sa_family == AF_UNIX) {
+        struct sockaddr_un  *saun = (struct sockaddr_un *) sockaddr;
+
+        if (socklen <= (socklen_t) offsetof(struct sockaddr_un, sun_path)
+            || saun->sun_path[0] == '\0')
+        {
+            /* an unbound unix socket */
+            return NGX_DECLINED;
+        }
+    }
+
+#endif
+
+    ngx_crc32_init(*hash);
+    ngx_crc32_update(hash, (u_char *) sockaddr, socklen);
+
+    if (ls->wildcard) {
+        ngx_crc32_update(hash, (u_char *) local_sockaddr, local_socklen);
+    }
+
+    ngx_crc32_final(*hash);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_udp_connection_cmp(struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen,
+    ngx_connection_t *c)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_memn2cmp((u_char *) sockaddr, (u_char *) c->sockaddr,
+                      socklen, c->socklen);
+
+    if (rc != 0 || local_sockaddr == c->local_sockaddr) {
+        return rc;
+    }
+
+    return ngx_memn2cmp((u_char *) local_sockaddr,
+                        (u_char *) c->local_sockaddr,
+                        local_socklen, c->local_socklen);
+}
+
+#endif
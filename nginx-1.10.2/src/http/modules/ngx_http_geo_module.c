@@ -18,11 +18,11 @@ typedef struct {
 
 
 typedef struct {
-    ngx_radix_tree_t                *tree;
+    ngx_radix_trie_t                *trie;
 #if (NGX_HAVE_INET6)
-    ngx_radix_tree_t                *tree6;
+    ngx_radix_trie_t                *trie6;
 #endif
-} ngx_http_geo_trees_t;
+} ngx_http_geo_tries_t;
 
 
 typedef struct {
@@ -46,6 +46,8 @@ typedef struct {
 #if (NGX_HAVE_INET6)
     ngx_radix_tree_t                *tree6;
 #endif
+    ngx_http_geo_tries_t             tries;
+    ngx_http_variable_value_t       *include_default;
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_array_t                     *proxies;
@@ -62,13 +64,14 @@ typedef struct {
     unsigned                         outside_entries:1;
     unsigned                         allow_binary_include:1;
     unsigned                         binary_include:1;
+    unsigned                         including:1;
     unsigned                         proxy_recursive:1;
 } ngx_http_geo_conf_ctx_t;
 
 
 typedef struct {
     union {
-        ngx_http_geo_trees_t         trees;
+        ngx_http_geo_tries_t         tries;
         ngx_http_geo_high_ranges_t   high;
     } u;
 
@@ -95,6 +98,10 @@ static char *ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *value);
 static char *ngx_http_geo_cidr_add(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_cidr_t *cidr, ngx_str_t *value, ngx_str_t *net);
+static char *ngx_http_geo_cidr_trees(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx);
+static char *ngx_http_geo_cidr_tries(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx);
 static ngx_http_variable_value_t *ngx_http_geo_value(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *value);
 static char *ngx_http_geo_add_proxy(ngx_conf_t *cf,
@@ -108,6 +115,20 @@ static ngx_int_t ngx_http_geo_include_binary_base(ngx_conf_t *cf,
 static void ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx);
 static u_char *ngx_http_geo_copy_values(u_char *base, u_char *p,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_geo_include_binary_trie(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *name);
+static ngx_radix_trie_t *ngx_http_geo_map_trie(ngx_http_geo_conf_ctx_t *ctx,
+    u_char *base, size_t size, uint32_t *h, ngx_uint_t bits);
+static ngx_int_t ngx_http_geo_check_trie(ngx_http_geo_conf_ctx_t *ctx,
+    ngx_radix_trie_t *trie, ngx_uint_t bits);
+static ngx_http_variable_value_t *ngx_http_geo_map_value(
+    ngx_http_geo_conf_ctx_t *ctx, u_char *base, size_t size, size_t offset);
+static void ngx_http_geo_create_binary_trie(ngx_http_geo_conf_ctx_t *ctx);
+static u_char *ngx_http_geo_copy_trie(ngx_http_geo_conf_ctx_t *ctx,
+    u_char *base, u_char *p, ngx_radix_trie_t *trie, uint32_t *h);
+static uint32_t ngx_http_geo_value_offset(ngx_http_geo_conf_ctx_t *ctx,
+    ngx_http_variable_value_t *vv);
+static void ngx_http_geo_cleanup_mapping(void *data);
 
 
 static ngx_command_t  ngx_http_geo_commands[] = {
@@ -168,6 +189,42 @@ static ngx_http_geo_header_t  ngx_http_geo_header = {
 };
 
 
+/*
+ * The binary CIDR base is mapped read-only as is, thus it contains
+ * offsets only: values are referenced by offsets of their
+ * ngx_http_variable_value_t copies, the trie nodes are position-independent.
+ * The first value of each trie is the default value.
+ */
+
+typedef struct {
+    u_char    GEOTRI[6];
+    u_char    version;
+    u_char    ptr_size;
+    uint32_t  endianness;
+    uint32_t  crc32;
+
+    uint32_t  default_value;
+
+    uint32_t  root;
+    uint32_t  values;
+    uint32_t  nvalues;
+    uint32_t  nodes;
+    uint32_t  nnodes;
+
+    uint32_t  root6;
+    uint32_t  values6;
+    uint32_t  nvalues6;
+    uint32_t  nodes6;
+    uint32_t  nnodes6;
+} ngx_http_geo_trie_header_t;
+
+
+static ngx_http_geo_trie_header_t  ngx_http_geo_trie_header = {
+    { 'G', 'E', 'O', 'T', 'R', 'I' }, 0, sizeof(void *), 0x12345678, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+
 /* geo range is AF_INET only */
 
 static ngx_int_t
@@ -187,7 +244,7 @@ ngx_http_geo_cidr_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 
     if (ngx_http_geo_addr(r, ctx, &addr) != NGX_OK) {
         vv = (ngx_http_variable_value_t *)
-                  ngx_radix32tree_find(ctx->u.trees.tree, INADDR_NONE);
+                  ngx_radix32trie_find(ctx->u.tries.trie, INADDR_NONE);
         goto done;
     }
 
@@ -205,11 +262,11 @@ ngx_http_geo_cidr_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
             inaddr += p[15];
 
             vv = (ngx_http_variable_value_t *)
-                      ngx_radix32tree_find(ctx->u.trees.tree, inaddr);
+                      ngx_radix32trie_find(ctx->u.tries.trie, inaddr);
 
         } else {
             vv = (ngx_http_variable_value_t *)
-                      ngx_radix128tree_find(ctx->u.trees.tree6, p);
+                      ngx_radix128trie_find(ctx->u.tries.trie6, p);
         }
 
         break;
@@ -220,7 +277,7 @@ ngx_http_geo_cidr_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         inaddr = ntohl(sin->sin_addr.s_addr);
 
         vv = (ngx_http_variable_value_t *)
-                  ngx_radix32tree_find(ctx->u.trees.tree, inaddr);
+                  ngx_radix32trie_find(ctx->u.tries.trie, inaddr);
 
         break;
     }
@@ -445,9 +502,6 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_rbtree_init(&ctx.rbtree, &ctx.sentinel, ngx_str_rbtree_insert_value);
 
     ctx.pool = cf->pool;
-    ctx.data_size = sizeof(ngx_http_geo_header_t)
-                  + sizeof(ngx_http_variable_value_t)
-                  + 0x10000 * sizeof(ngx_http_geo_range_t *);
     ctx.allow_binary_include = 1;
 
     save = *cf;
@@ -507,32 +561,10 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         ngx_destroy_pool(pool);
 
     } else {
-        if (ctx.tree == NULL) {
-            ctx.tree = ngx_radix_tree_create(cf->pool, -1);
-            if (ctx.tree == NULL) {
-                return NGX_CONF_ERROR;
-            }
-        }
-
-        geo->u.trees.tree = ctx.tree;
-
-#if (NGX_HAVE_INET6)
-        if (ctx.tree6 == NULL) {
-            ctx.tree6 = ngx_radix_tree_create(cf->pool, -1);
-            if (ctx.tree6 == NULL) {
-                return NGX_CONF_ERROR;
-            }
+        if (ngx_http_geo_cidr_trees(cf, &ctx) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
         }
 
-        geo->u.trees.tree6 = ctx.tree6;
-#endif
-
-        var->get_handler = ngx_http_geo_cidr_variable;
-        var->data = (uintptr_t) geo;
-
-        ngx_destroy_pool(ctx.temp_pool);
-        ngx_destroy_pool(pool);
-
         if (ngx_radix32tree_insert(ctx.tree, 0, 0,
                                    (uintptr_t) &ngx_http_variable_null_value)
             == NGX_ERROR)
@@ -550,6 +582,18 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return NGX_CONF_ERROR;
         }
 #endif
+
+        if (ngx_http_geo_cidr_tries(cf, &ctx) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        geo->u.tries = ctx.tries;
+
+        var->get_handler = ngx_http_geo_cidr_variable;
+        var->data = (uintptr_t) geo;
+
+        ngx_destroy_pool(ctx.temp_pool);
+        ngx_destroy_pool(pool);
     }
 
     return rv;
@@ -1020,23 +1064,19 @@ ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t   *net;
     ngx_cidr_t   cidr;
 
-    if (ctx->tree == NULL) {
-        ctx->tree = ngx_radix_tree_create(ctx->pool, -1);
-        if (ctx->tree == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    if (ngx_http_geo_cidr_trees(cf, ctx) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
     }
 
-#if (NGX_HAVE_INET6)
-    if (ctx->tree6 == NULL) {
-        ctx->tree6 = ngx_radix_tree_create(ctx->pool, -1);
-        if (ctx->tree6 == NULL) {
-            return NGX_CONF_ERROR;
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+
+        if (ctx->including) {
+            ctx->include_default = ngx_http_geo_value(cf, ctx, &value[1]);
+            if (ctx->include_default == NULL) {
+                return NGX_CONF_ERROR;
+            }
         }
-    }
-#endif
 
-    if (ngx_strcmp(value[0].data, "default") == 0) {
         cidr.family = AF_INET;
         cidr.u.in.addr = 0;
         cidr.u.in.mask = 0;
@@ -1061,6 +1101,16 @@ ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         return NGX_CONF_OK;
     }
 
+    if (ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary geo base \"%s\" cannot be mixed with usual entries",
+            ctx->include_name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->entries++;
+    ctx->outside_entries = 1;
+
     if (ngx_strcmp(value[0].data, "delete") == 0) {
         net = &value[1];
         del = 1;
@@ -1206,6 +1256,82 @@ ngx_http_geo_cidr_add(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 }
 
 
+static char *
+ngx_http_geo_cidr_trees(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx)
+{
+    /*
+     * the radix trees are used while parsing only, the lookups are done
+     * in the tries compiled from them, so the trees are neither
+     * preallocated nor kept after the configuration is read
+     */
+
+    if (ctx->tree == NULL) {
+        ctx->tree = ngx_radix_tree_create(ctx->temp_pool, 0);
+        if (ctx->tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+#if (NGX_HAVE_INET6)
+    if (ctx->tree6 == NULL) {
+        ctx->tree6 = ngx_radix_tree_create(ctx->temp_pool, 0);
+        if (ctx->tree6 == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_geo_cidr_tries(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx)
+{
+    if (ctx->binary_include) {
+
+        /* the default value is the only one that may be set outside */
+
+        ctx->tries.trie->values[0] = ctx->tree->root->value;
+#if (NGX_HAVE_INET6)
+        ctx->tries.trie6->values[0] = ctx->tree6->root->value;
+#endif
+
+        return NGX_CONF_OK;
+    }
+
+    ctx->tries.trie = ngx_radix_trie_create(ctx->tree, 32, ctx->pool,
+                                            ctx->temp_pool);
+    if (ctx->tries.trie == NULL) {
+        goto failed;
+    }
+
+#if (NGX_HAVE_INET6)
+    ctx->tries.trie6 = ngx_radix_trie_create(ctx->tree6, 128, ctx->pool,
+                                             ctx->temp_pool);
+    if (ctx->tries.trie6 == NULL) {
+        goto failed;
+    }
+#endif
+
+    if (ctx->allow_binary_include
+        && !ctx->outside_entries
+        && ctx->entries > 100000
+        && ctx->includes == 1)
+    {
+        ngx_http_geo_create_binary_trie(ctx);
+    }
+
+    return NGX_CONF_OK;
+
+failed:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "could not build geo base");
+
+    return NGX_CONF_ERROR;
+}
+
+
 static ngx_http_variable_value_t *
 ngx_http_geo_value(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *value)
@@ -1317,7 +1443,9 @@ ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name)
 {
     char       *rv;
+    ngx_int_t   rc;
     ngx_str_t   file;
+    unsigned    including;
 
     file.len = name->len + 4;
     file.data = ngx_pnalloc(ctx->temp_pool, name->len + 5);
@@ -1331,17 +1459,22 @@ ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         return NGX_CONF_ERROR;
     }
 
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
+
     if (ctx->ranges) {
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
+        rc = ngx_http_geo_include_binary_base(cf, ctx, &file);
 
-        switch (ngx_http_geo_include_binary_base(cf, ctx, &file)) {
-        case NGX_OK:
-            return NGX_CONF_OK;
-        case NGX_ERROR:
-            return NGX_CONF_ERROR;
-        default:
-            break;
-        }
+    } else {
+        rc = ngx_http_geo_include_binary_trie(cf, ctx, &file);
+    }
+
+    switch (rc) {
+    case NGX_OK:
+        return NGX_CONF_OK;
+    case NGX_ERROR:
+        return NGX_CONF_ERROR;
+    default:
+        break;
     }
 
     file.len -= 4;
@@ -1355,8 +1488,12 @@ ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 
     ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
 
+    including = ctx->including;
+    ctx->including = 1;
+
     rv = ngx_conf_parse(cf, &file);
 
+    ctx->including = including;
     ctx->includes++;
     ctx->outside_entries = 0;
 
@@ -1556,7 +1693,10 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
 
     ngx_sprintf(fm.name, "%V.bin%Z", &ctx->include_name);
 
-    fm.size = ctx->data_size;
+    fm.size = sizeof(ngx_http_geo_header_t)
+              + sizeof(ngx_http_variable_value_t)
+              + 0x10000 * sizeof(ngx_http_geo_range_t *)
+              + ctx->data_size;
     fm.log = ctx->pool->log;
 
     ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
@@ -1642,3 +1782,494 @@ ngx_http_geo_copy_values(u_char *base, u_char *p, ngx_rbtree_node_t *node,
 
     return ngx_http_geo_copy_values(base, p, node->right, sentinel);
 }
+
+
+static ngx_int_t
+ngx_http_geo_include_binary_trie(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
+    ngx_str_t *name)
+{
+    u_char                      *base, ch;
+    size_t                       size, off;
+    time_t                       mtime;
+    uint32_t                     crc32;
+    ngx_int_t                    rc;
+    ngx_file_info_t              fi;
+    ngx_radix_trie_t            *trie;
+    ngx_pool_cleanup_t          *cln;
+    ngx_file_mapping_t          *fm;
+    ngx_http_geo_trie_header_t  *header;
+    ngx_http_variable_value_t   *vv;
+#if (NGX_HAVE_INET6)
+    ngx_radix_trie_t            *trie6;
+#endif
+
+    cln = ngx_pool_cleanup_add(ctx->pool, sizeof(ngx_file_mapping_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fm = cln->data;
+
+    fm->name = ngx_pnalloc(ctx->pool, name->len + 1);
+    if (fm->name == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(fm->name, name->data, name->len + 1);
+
+    fm->log = cf->log;
+
+    if (ngx_open_file_mapping(fm) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    base = fm->addr;
+    size = fm->size;
+
+    if (ctx->outside_entries) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary geo base \"%s\" cannot be mixed with usual entries",
+            name->data);
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "second binary geo base \"%s\" cannot be mixed with \"%s\"",
+            name->data, ctx->include_name.data);
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    rc = NGX_DECLINED;
+
+    if (ngx_fd_info(fm->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    mtime = ngx_file_mtime(&fi);
+
+    ch = name->data[name->len - 4];
+    name->data[name->len - 4] = '\0';
+
+    if (ngx_file_info(name->data, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_file_info_n " \"%s\" failed", name->data);
+        name->data[name->len - 4] = ch;
+        goto failed;
+    }
+
+    name->data[name->len - 4] = ch;
+
+    if (mtime < ngx_file_mtime(&fi)) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "stale binary geo base \"%s\"", name->data);
+        goto failed;
+    }
+
+    header = (ngx_http_geo_trie_header_t *) base;
+
+    if (size < sizeof(ngx_http_geo_trie_header_t)
+        || ngx_memcmp(&ngx_http_geo_trie_header, header, 12) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "incompatible binary geo base \"%s\"", name->data);
+        goto failed;
+    }
+
+    off = offsetof(ngx_http_geo_trie_header_t, default_value);
+
+    crc32 = ngx_crc32_long(base + off, size - off);
+
+    if (crc32 != header->crc32) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                        "CRC32 mismatch in binary geo base \"%s\"", name->data);
+        goto failed;
+    }
+
+    trie = ngx_http_geo_map_trie(ctx, base, size, &header->root, 32);
+    if (trie == NULL) {
+        goto invalid;
+    }
+
+#if (NGX_HAVE_INET6)
+    trie6 = ngx_http_geo_map_trie(ctx, base, size, &header->root6, 128);
+    if (trie6 == NULL) {
+        goto invalid;
+    }
+#endif
+
+    if (ngx_http_geo_cidr_trees(cf, ctx) != NGX_CONF_OK) {
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (header->default_value) {
+        vv = ngx_http_geo_map_value(ctx, base, size, header->default_value);
+        if (vv == NULL) {
+            goto invalid;
+        }
+
+        ctx->tree->root->value = (uintptr_t) vv;
+#if (NGX_HAVE_INET6)
+        ctx->tree6->root->value = (uintptr_t) vv;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "using binary geo base \"%s\"", name->data);
+
+    cln->handler = ngx_http_geo_cleanup_mapping;
+
+    ctx->include_name = *name;
+    ctx->binary_include = 1;
+    ctx->tries.trie = trie;
+#if (NGX_HAVE_INET6)
+    ctx->tries.trie6 = trie6;
+#endif
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "invalid binary geo base \"%s\"", name->data);
+
+failed:
+
+    ngx_close_file_mapping(fm);
+
+    return rc;
+}
+
+
+/*
+ * h points to the trie description in the header:
+ * root entry, values offset, number of values, nodes offset, number of nodes
+ */
+
+static ngx_radix_trie_t *
+ngx_http_geo_map_trie(ngx_http_geo_conf_ctx_t *ctx, u_char *base, size_t size,
+    uint32_t *h, ngx_uint_t bits)
+{
+    uint32_t          *offsets;
+    ngx_uint_t         i, nvalues, nnodes;
+    ngx_radix_trie_t  *trie;
+
+    nvalues = h[2];
+    nnodes = h[4];
+
+    if (nvalues == 0
+        || (h[1] & 3)
+        || h[1] > size
+        || nvalues > (size - h[1]) / sizeof(uint32_t)
+        || (h[3] & (NGX_CPU_CACHE_LINE - 1))
+        || h[3] > size
+        || nnodes > (size - h[3]) / sizeof(uint32_t))
+    {
+        return NULL;
+    }
+
+    trie = ngx_palloc(ctx->pool, sizeof(ngx_radix_trie_t));
+    if (trie == NULL) {
+        return NULL;
+    }
+
+    trie->root = h[0];
+    trie->nodes = (uint32_t *) (base + h[3]);
+    trie->nnodes = nnodes;
+    trie->nvalues = nvalues;
+
+    trie->values = ngx_palloc(ctx->pool, nvalues * sizeof(uintptr_t));
+    if (trie->values == NULL) {
+        return NULL;
+    }
+
+    /* the default value is set when the whole block is parsed */
+
+    trie->values[0] = NGX_RADIX_NO_VALUE;
+
+    offsets = (uint32_t *) (base + h[1]);
+
+    for (i = 1; i < nvalues; i++) {
+        trie->values[i] = (uintptr_t) ngx_http_geo_map_value(ctx, base, size,
+                                                             offsets[i]);
+        if (trie->values[i] == 0) {
+            return NULL;
+        }
+    }
+
+    if (ngx_http_geo_check_trie(ctx, trie, bits) != NGX_OK) {
+        return NULL;
+    }
+
+    return trie;
+}
+
+
+/*
+ * The nodes are not trusted: every reference must stay within them,
+ * and the strides along any path must not exceed the key width.
+ * The trie is created with every child node after its parent entry,
+ * so the depth of all nodes is found in one pass, and a node referenced
+ * twice, or before its parent, is rejected.
+ */
+
+static ngx_int_t
+ngx_http_geo_check_trie(ngx_http_geo_conf_ctx_t *ctx, ngx_radix_trie_t *trie,
+    ngx_uint_t bits)
+{
+    u_char      *depth;
+    uint32_t     e;
+    ngx_int_t    rc;
+    ngx_uint_t   i, j, n, d, offset;
+
+    depth = ngx_calloc(trie->nnodes + 1, ctx->pool->log);
+    if (depth == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    for (i = 0; i <= trie->nnodes; i++) {
+
+        /* the root entry is checked first, as if it precedes the nodes */
+
+        if (i == 0) {
+            e = trie->root;
+            d = 0;
+
+        } else {
+            e = trie->nodes[i - 1];
+            d = depth[i - 1];
+
+            if (d == 0) {
+                /* unreachable */
+                continue;
+            }
+        }
+
+        if (e & NGX_RADIX_TRIE_LEAF) {
+            if ((e & ~NGX_RADIX_TRIE_LEAF) >= trie->nvalues) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        n = NGX_RADIX_TRIE_STRIDE(e);
+        offset = NGX_RADIX_TRIE_OFFSET(e);
+
+        if (n == 0 || n > 16
+            || d + n > bits
+            || (i && offset < i)
+            || offset + ((ngx_uint_t) 1 << n) > trie->nnodes)
+        {
+            goto failed;
+        }
+
+        for (j = offset; j < offset + ((ngx_uint_t) 1 << n); j++) {
+            if (depth[j]) {
+                goto failed;
+            }
+
+            depth[j] = (u_char) (d + n);
+        }
+    }
+
+    rc = NGX_OK;
+
+failed:
+
+    ngx_free(depth);
+
+    return rc;
+}
+
+
+static ngx_http_variable_value_t *
+ngx_http_geo_map_value(ngx_http_geo_conf_ctx_t *ctx, u_char *base,
+    size_t size, size_t offset)
+{
+    size_t                      data;
+    ngx_http_variable_value_t  *vv, *value;
+
+    if ((offset & (sizeof(void *) - 1))
+        || offset > size - sizeof(ngx_http_variable_value_t))
+    {
+        return NULL;
+    }
+
+    value = (ngx_http_variable_value_t *) (base + offset);
+    data = (size_t) value->data;
+
+    if (data > size || value->len > size - data) {
+        return NULL;
+    }
+
+    vv = ngx_palloc(ctx->pool, sizeof(ngx_http_variable_value_t));
+    if (vv == NULL) {
+        return NULL;
+    }
+
+    *vv = *value;
+    vv->data = base + data;
+
+    return vv;
+}
+
+
+static void
+ngx_http_geo_create_binary_trie(ngx_http_geo_conf_ctx_t *ctx)
+{
+    u_char                      *p, *name;
+    size_t                       off;
+    ngx_file_mapping_t           fm;
+    ngx_http_geo_trie_header_t  *header;
+
+    /*
+     * the base is mapped by the running configuration, so it is
+     * written to a temporary file first and then renamed over the old one
+     */
+
+    name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    fm.name = ngx_pnalloc(ctx->temp_pool,
+                          ctx->include_name.len + 5 + 1 + NGX_INT64_LEN);
+    if (fm.name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(fm.name, "%V.bin.%P%Z", &ctx->include_name, ngx_pid);
+
+    fm.size = ngx_align(sizeof(ngx_http_geo_trie_header_t), sizeof(void *))
+              + ctx->data_size
+              + ctx->tries.trie->nvalues * sizeof(uint32_t)
+              + NGX_CPU_CACHE_LINE
+              + ctx->tries.trie->nnodes * sizeof(uint32_t);
+#if (NGX_HAVE_INET6)
+    fm.size += ctx->tries.trie6->nvalues * sizeof(uint32_t)
+               + NGX_CPU_CACHE_LINE
+               + ctx->tries.trie6->nnodes * sizeof(uint32_t);
+#endif
+    fm.log = ctx->pool->log;
+
+    ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
+                  "creating binary geo base \"%s\"", name);
+
+    if (ngx_create_file_mapping(&fm) != NGX_OK) {
+        goto failed;
+    }
+
+    header = fm.addr;
+    *header = ngx_http_geo_trie_header;
+
+    p = (u_char *) fm.addr + ngx_align(sizeof(ngx_http_geo_trie_header_t),
+                                       sizeof(void *));
+
+    p = ngx_http_geo_copy_values(fm.addr, p, ctx->rbtree.root,
+                                 ctx->rbtree.sentinel);
+
+    if (ctx->include_default) {
+        header->default_value = ngx_http_geo_value_offset(ctx,
+                                                      ctx->include_default);
+    }
+
+    p = ngx_http_geo_copy_trie(ctx, fm.addr, p, ctx->tries.trie,
+                               &header->root);
+#if (NGX_HAVE_INET6)
+    p = ngx_http_geo_copy_trie(ctx, fm.addr, p, ctx->tries.trie6,
+                               &header->root6);
+#endif
+
+    off = offsetof(ngx_http_geo_trie_header_t, default_value);
+
+    header->crc32 = ngx_crc32_long((u_char *) fm.addr + off, fm.size - off);
+
+    ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) != NGX_FILE_ERROR) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                  ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                  fm.name, name);
+
+failed:
+
+    if (ngx_delete_file(fm.name) == NGX_FILE_ERROR) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", fm.name);
+        }
+    }
+}
+
+
+static u_char *
+ngx_http_geo_copy_trie(ngx_http_geo_conf_ctx_t *ctx, u_char *base, u_char *p,
+    ngx_radix_trie_t *trie, uint32_t *h)
+{
+    uint32_t    *offsets;
+    ngx_uint_t   i;
+
+    offsets = (uint32_t *) p;
+
+    /* the default value is not stored with the trie */
+
+    offsets[0] = 0;
+
+    for (i = 1; i < trie->nvalues; i++) {
+        offsets[i] = ngx_http_geo_value_offset(ctx,
+                              (ngx_http_variable_value_t *) trie->values[i]);
+    }
+
+    h[0] = trie->root;
+    h[1] = (uint32_t) (p - base);
+    h[2] = (uint32_t) trie->nvalues;
+
+    p += trie->nvalues * sizeof(uint32_t);
+    p = ngx_align_ptr(p, NGX_CPU_CACHE_LINE);
+
+    h[3] = (uint32_t) (p - base);
+    h[4] = (uint32_t) trie->nnodes;
+
+    return ngx_cpymem(p, trie->nodes, trie->nnodes * sizeof(uint32_t));
+}
+
+
+static uint32_t
+ngx_http_geo_value_offset(ngx_http_geo_conf_ctx_t *ctx,
+    ngx_http_variable_value_t *vv)
+{
+    uint32_t                             hash;
+    ngx_str_t                            s;
+    ngx_http_geo_variable_value_node_t  *gvvn;
+
+    s.len = vv->len;
+    s.data = vv->data;
+    hash = ngx_crc32_long(s.data, s.len);
+
+    gvvn = (ngx_http_geo_variable_value_node_t *)
+                ngx_str_rbtree_lookup(&ctx->rbtree, &s, hash);
+
+    return (uint32_t) gvvn->offset;
+}
+
+
+static void
+ngx_http_geo_cleanup_mapping(void *data)
+{
+    ngx_file_mapping_t  *fm = data;
+
+    ngx_close_file_mapping(fm);
+}
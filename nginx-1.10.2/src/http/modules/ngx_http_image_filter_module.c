@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 #include <gd.h>
 
@@ -23,8 +24,10 @@
 #define NGX_HTTP_IMAGE_START     0
 #define NGX_HTTP_IMAGE_READ      1
 #define NGX_HTTP_IMAGE_PROCESS   2
-#define NGX_HTTP_IMAGE_PASS      3
-#define NGX_HTTP_IMAGE_DONE      4
+#define NGX_HTTP_IMAGE_WAIT      3
+#define NGX_HTTP_IMAGE_PASS      4
+#define NGX_HTTP_IMAGE_SKIP      5
+#define NGX_HTTP_IMAGE_DONE      6
 
 
 #define NGX_HTTP_IMAGE_NONE      0
@@ -36,6 +39,9 @@
 #define NGX_HTTP_IMAGE_BUFFERED  0x08
 
 
+#define NGX_HTTP_IMAGE_KEY_LEN   16
+
+
 typedef struct {
     ngx_uint_t                   filter;
     ngx_uint_t                   width;
@@ -54,9 +60,41 @@ typedef struct {
     ngx_http_complex_value_t    *shcv;
 
     size_t                       buffer_size;
+
+    ngx_shm_zone_t              *cache;
 } ngx_http_image_filter_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_http_image_cache_sh_t;
+
+
+typedef struct {
+    ngx_http_image_cache_sh_t   *sh;
+    ngx_slab_pool_t             *shpool;
+    ngx_shm_zone_t              *shm_zone;
+} ngx_http_image_cache_t;
+
+
+/*
+ * A cache node keeps a processed image, it is looked up by the MD5 hash
+ * of the source identity and of the transform parameters.
+ */
+
+typedef struct {
+    ngx_rbtree_node_t            node;
+    ngx_queue_t                  queue;
+
+    u_char                       key[NGX_HTTP_IMAGE_KEY_LEN];
+
+    size_t                       size;
+    u_char                       data[1];
+} ngx_http_image_cache_node_t;
+
+
 typedef struct {
     u_char                      *image;
     u_char                      *last;
@@ -68,10 +106,25 @@ typedef struct {
     ngx_uint_t                   max_width;
     ngx_uint_t                   max_height;
     ngx_uint_t                   angle;
+    ngx_uint_t                   jpeg_quality;
+    ngx_uint_t                   sharpen;
 
     ngx_uint_t                   phase;
     ngx_uint_t                   type;
     ngx_uint_t                   force;
+
+    ngx_uint_t                   filter;
+    ngx_flag_t                   transparency;
+    ngx_flag_t                   interlace;
+
+    /* the result of ngx_http_image_transform() */
+
+    ngx_int_t                    rc;
+    u_char                      *out;
+    int                          size;
+
+    unsigned                     cacheable:1;
+    u_char                       key[NGX_HTTP_IMAGE_KEY_LEN];
 } ngx_http_image_filter_ctx_t;
 
 
@@ -79,6 +132,8 @@ static ngx_int_t ngx_http_image_send(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx, ngx_chain_t *in);
 static ngx_uint_t ngx_http_image_test(ngx_http_request_t *r, ngx_chain_t *in);
 static ngx_int_t ngx_http_image_read(ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_int_t ngx_http_image_params(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
 static ngx_buf_t *ngx_http_image_process(ngx_http_request_t *r);
 static ngx_buf_t *ngx_http_image_json(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx);
@@ -90,13 +145,34 @@ static ngx_int_t ngx_http_image_size(ngx_http_request_t *r,
 
 static ngx_buf_t *ngx_http_image_resize(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx);
-static gdImagePtr ngx_http_image_source(ngx_http_request_t *r,
+static ngx_buf_t *ngx_http_image_result(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_image_thread_post(ngx_http_request_t *r,
     ngx_http_image_filter_ctx_t *ctx);
-static gdImagePtr ngx_http_image_new(ngx_http_request_t *r, int w, int h,
+static void ngx_http_image_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_image_thread_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_image_transform(ngx_http_image_filter_ctx_t *ctx,
+    ngx_log_t *log);
+static gdImagePtr ngx_http_image_source(ngx_http_image_filter_ctx_t *ctx,
+    ngx_log_t *log);
+static gdImagePtr ngx_http_image_new(ngx_log_t *log, int w, int h,
     int colors);
-static u_char *ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type,
-    gdImagePtr img, int *size);
+static u_char *ngx_http_image_out(ngx_http_image_filter_ctx_t *ctx,
+    gdImagePtr img, ngx_log_t *log);
 static void ngx_http_image_cleanup(void *data);
+
+static void ngx_http_image_cache_key(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
+static ngx_buf_t *ngx_http_image_cache_get(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
+static void ngx_http_image_cache_set(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx);
+static ngx_http_image_cache_node_t *ngx_http_image_cache_lookup(
+    ngx_http_image_cache_t *cache, u_char *key);
+static void ngx_http_image_cache_delete(ngx_http_image_cache_t *cache,
+    ngx_http_image_cache_node_t *node);
 static ngx_uint_t ngx_http_image_filter_get_value(ngx_http_request_t *r,
     ngx_http_complex_value_t *cv, ngx_uint_t v);
 static ngx_uint_t ngx_http_image_filter_value(ngx_str_t *value);
@@ -111,6 +187,10 @@ static char *ngx_http_image_filter_jpeg_quality(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static char *ngx_http_image_filter_sharpen(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_image_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_image_init_cache(ngx_shm_zone_t *shm_zone,
+    void *data);
 static ngx_int_t ngx_http_image_filter_init(ngx_conf_t *cf);
 
 
@@ -158,6 +238,13 @@ static ngx_command_t  ngx_http_image_filter_commands[] = {
       offsetof(ngx_http_image_filter_conf_t, buffer_size),
       NULL },
 
+    { ngx_string("image_filter_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_image_filter_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -280,22 +367,22 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     ngx_int_t                      rc;
     ngx_str_t                     *ct;
-    ngx_chain_t                    out;
+    ngx_chain_t                    out, *cl;
     ngx_http_image_filter_ctx_t   *ctx;
     ngx_http_image_filter_conf_t  *conf;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "image filter");
 
-    if (in == NULL) {
-        return ngx_http_next_body_filter(r, in);
-    }
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_image_filter_module);
 
     if (ctx == NULL) {
         return ngx_http_next_body_filter(r, in);
     }
 
+    if (in == NULL && ctx->phase != NGX_HTTP_IMAGE_WAIT) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
     switch (ctx->phase) {
 
     case NGX_HTTP_IMAGE_START:
@@ -335,6 +422,28 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             return ngx_http_image_send(r, ctx, in);
         }
 
+        if (conf->filter != NGX_HTTP_IMAGE_SIZE) {
+
+            if (ngx_http_image_params(r, ctx) != NGX_OK) {
+                return ngx_http_filter_finalize_request(r,
+                                              &ngx_http_image_filter_module,
+                                              NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+            }
+
+            out.buf = ngx_http_image_cache_get(r, ctx);
+
+            if (out.buf) {
+                out.next = NULL;
+                ctx->phase = NGX_HTTP_IMAGE_SKIP;
+
+                for (cl = in; cl; cl = cl->next) {
+                    cl->buf->pos = cl->buf->last;
+                }
+
+                return ngx_http_image_send(r, ctx, &out);
+            }
+        }
+
         ctx->phase = NGX_HTTP_IMAGE_READ;
 
         /* fall through */
@@ -357,23 +466,41 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     case NGX_HTTP_IMAGE_PROCESS:
 
+        ctx->phase = NGX_HTTP_IMAGE_PROCESS;
+
         out.buf = ngx_http_image_process(r);
 
-        if (out.buf == NULL) {
-            return ngx_http_filter_finalize_request(r,
-                                              &ngx_http_image_filter_module,
-                                              NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+        if (ctx->phase == NGX_HTTP_IMAGE_WAIT) {
+            /* the image is being processed in a thread */
+            return NGX_OK;
+        }
+
+        break;
+
+    case NGX_HTTP_IMAGE_WAIT:
+
+        if (r->aio) {
+            return NGX_OK;
         }
 
-        out.next = NULL;
-        ctx->phase = NGX_HTTP_IMAGE_PASS;
+        out.buf = ngx_http_image_result(r, ctx);
 
-        return ngx_http_image_send(r, ctx, &out);
+        break;
 
     case NGX_HTTP_IMAGE_PASS:
 
         return ngx_http_next_body_filter(r, in);
 
+    case NGX_HTTP_IMAGE_SKIP:
+
+        /* the cached image is sent, the rest of the source is discarded */
+
+        for (cl = in; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+        }
+
+        return ngx_http_next_body_filter(r, NULL);
+
     default: /* NGX_HTTP_IMAGE_DONE */
 
         rc = ngx_http_next_body_filter(r, NULL);
@@ -381,6 +508,19 @@ ngx_http_image_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         /* NGX_ERROR resets any pending data */
         return (rc == NGX_OK) ? NGX_ERROR : rc;
     }
+
+    r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
+
+    if (out.buf == NULL) {
+        return ngx_http_filter_finalize_request(r,
+                                              &ngx_http_image_filter_module,
+                                              NGX_HTTP_UNSUPPORTED_MEDIA_TYPE);
+    }
+
+    out.next = NULL;
+    ctx->phase = NGX_HTTP_IMAGE_PASS;
+
+    return ngx_http_image_send(r, ctx, &out);
 }
 
 
@@ -501,6 +641,53 @@ ngx_http_image_read(ngx_http_request_t *r, ngx_chain_t *in)
 }
 
 
+static ngx_int_t
+ngx_http_image_params(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
+{
+    ngx_http_image_filter_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    ctx->filter = conf->filter;
+    ctx->transparency = conf->transparency;
+    ctx->interlace = conf->interlace;
+
+    ctx->angle = ngx_http_image_filter_get_value(r, conf->acv, conf->angle);
+
+    if (conf->filter == NGX_HTTP_IMAGE_ROTATE) {
+
+        if (ctx->angle != 90 && ctx->angle != 180 && ctx->angle != 270) {
+            return NGX_ERROR;
+        }
+
+    } else {
+
+        ctx->max_width = ngx_http_image_filter_get_value(r, conf->wcv,
+                                                         conf->width);
+        if (ctx->max_width == 0) {
+            return NGX_ERROR;
+        }
+
+        ctx->max_height = ngx_http_image_filter_get_value(r, conf->hcv,
+                                                          conf->height);
+        if (ctx->max_height == 0) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->jpeg_quality = ngx_http_image_filter_get_value(r, conf->jqcv,
+                                                        conf->jpeg_quality);
+    ctx->sharpen = ngx_http_image_filter_get_value(r, conf->shcv,
+                                                   conf->sharpen);
+
+    if (conf->cache) {
+        ngx_http_image_cache_key(r, ctx);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_buf_t *
 ngx_http_image_process(ngx_http_request_t *r)
 {
@@ -508,8 +695,6 @@ ngx_http_image_process(ngx_http_request_t *r)
     ngx_http_image_filter_ctx_t   *ctx;
     ngx_http_image_filter_conf_t  *conf;
 
-    r->connection->buffered &= ~NGX_HTTP_IMAGE_BUFFERED;
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_image_filter_module);
 
     rc = ngx_http_image_size(r, ctx);
@@ -520,28 +705,10 @@ ngx_http_image_process(ngx_http_request_t *r)
         return ngx_http_image_json(r, rc == NGX_OK ? ctx : NULL);
     }
 
-    ctx->angle = ngx_http_image_filter_get_value(r, conf->acv, conf->angle);
-
     if (conf->filter == NGX_HTTP_IMAGE_ROTATE) {
-
-        if (ctx->angle != 90 && ctx->angle != 180 && ctx->angle != 270) {
-            return NULL;
-        }
-
         return ngx_http_image_resize(r, ctx);
     }
 
-    ctx->max_width = ngx_http_image_filter_get_value(r, conf->wcv, conf->width);
-    if (ctx->max_width == 0) {
-        return NULL;
-    }
-
-    ctx->max_height = ngx_http_image_filter_get_value(r, conf->hcv,
-                                                      conf->height);
-    if (ctx->max_height == 0) {
-        return NULL;
-    }
-
     if (rc == NGX_OK
         && ctx->width <= ctx->max_width
         && ctx->height <= ctx->max_height
@@ -749,39 +916,193 @@ ngx_http_image_size(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 static ngx_buf_t *
 ngx_http_image_resize(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 {
-    int                            sx, sy, dx, dy, ox, oy, ax, ay, size,
-                                   colors, palette, transparent, sharpen,
-                                   red, green, blue, t;
-    u_char                        *out;
-    ngx_buf_t                     *b;
-    ngx_uint_t                     resize;
-    gdImagePtr                     src, dst;
-    ngx_pool_cleanup_t            *cln;
-    ngx_http_image_filter_conf_t  *conf;
+#if (NGX_THREADS)
+    ngx_http_core_loc_conf_t  *clcf;
 
-    src = ngx_http_image_source(r, ctx);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    if (src == NULL) {
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+
+        if (ngx_http_image_thread_post(r, ctx) != NGX_OK) {
+            return NULL;
+        }
+
+        ctx->phase = NGX_HTTP_IMAGE_WAIT;
+
+        return NULL;
+    }
+#endif
+
+    ctx->rc = ngx_http_image_transform(ctx, r->connection->log);
+
+    return ngx_http_image_result(r, ctx);
+}
+
+
+static ngx_buf_t *
+ngx_http_image_result(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
+{
+    ngx_buf_t           *b;
+    ngx_pool_cleanup_t  *cln;
+
+    if (ctx->rc == NGX_DECLINED) {
+        return ngx_http_image_asis(r, ctx);
+    }
+
+    ngx_pfree(r->pool, ctx->image);
+
+    if (ctx->rc != NGX_OK) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        gdFree(ctx->out);
+        return NULL;
+    }
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        gdFree(ctx->out);
         return NULL;
     }
 
+    cln->handler = ngx_http_image_cleanup;
+    cln->data = ctx->out;
+
+    b->pos = ctx->out;
+    b->last = ctx->out + ctx->size;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    if (ctx->cacheable) {
+        ngx_http_image_cache_set(r, ctx);
+    }
+
+    ngx_http_image_length(r, b);
+    ngx_http_weak_etag(r);
+
+    return b;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_image_thread_post(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_thread_task_t         *task;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task = ngx_thread_task_alloc(r->pool, 0);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    task->ctx = ctx;
+    task->handler = ngx_http_image_thread_handler;
+    task->event.data = r;
+    task->event.handler = ngx_http_image_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_image_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_image_filter_ctx_t *ctx = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "image thread handler");
+
+    /*
+     * the request is blocked while the task runs, so the source image
+     * kept in the request pool is not freed
+     */
+
+    ctx->rc = ngx_http_image_transform(ctx, log);
+}
+
+
+static void
+ngx_http_image_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->connection->write->handler(r->connection->write);
+}
+
+#endif
+
+
+/*
+ * ngx_http_image_transform() does not use the request, so it may run
+ * in a thread; it returns NGX_DECLINED if the image is to be sent as is
+ */
+
+static ngx_int_t
+ngx_http_image_transform(ngx_http_image_filter_ctx_t *ctx, ngx_log_t *log)
+{
+    int          sx, sy, dx, dy, ox, oy, ax, ay, colors, palette,
+                 transparent, sharpen, red, green, blue, t;
+    ngx_uint_t   resize;
+    gdImagePtr   src, dst;
+
+    src = ngx_http_image_source(ctx, log);
+
+    if (src == NULL) {
+        return NGX_ERROR;
+    }
+
     sx = gdImageSX(src);
     sy = gdImageSY(src);
 
-    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
-
     if (!ctx->force
         && ctx->angle == 0
         && (ngx_uint_t) sx <= ctx->max_width
         && (ngx_uint_t) sy <= ctx->max_height)
     {
         gdImageDestroy(src);
-        return ngx_http_image_asis(r, ctx);
+        return NGX_DECLINED;
     }
 
     colors = gdImageColorsTotal(src);
 
-    if (colors && conf->transparency) {
+    if (colors && ctx->transparency) {
         transparent = gdImageGetTransparent(src);
 
         if (transparent != -1) {
@@ -807,7 +1128,7 @@ transparent:
     dx = sx;
     dy = sy;
 
-    if (conf->filter == NGX_HTTP_IMAGE_RESIZE) {
+    if (ctx->filter == NGX_HTTP_IMAGE_RESIZE) {
 
         if ((ngx_uint_t) dx > ctx->max_width) {
             dy = dy * ctx->max_width / dx;
@@ -823,7 +1144,7 @@ transparent:
 
         resize = 1;
 
-    } else if (conf->filter == NGX_HTTP_IMAGE_ROTATE) {
+    } else if (ctx->filter == NGX_HTTP_IMAGE_ROTATE) {
 
         resize = 0;
 
@@ -850,10 +1171,10 @@ transparent:
     }
 
     if (resize) {
-        dst = ngx_http_image_new(r, dx, dy, palette);
+        dst = ngx_http_image_new(log, dx, dy, palette);
         if (dst == NULL) {
             gdImageDestroy(src);
-            return NULL;
+            return NGX_ERROR;
         }
 
         if (colors == 0) {
@@ -883,10 +1204,10 @@ transparent:
 
         case 90:
         case 270:
-            dst = ngx_http_image_new(r, dy, dx, palette);
+            dst = ngx_http_image_new(log, dy, dx, palette);
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
             if (ctx->angle == 90) {
                 ox = dy / 2 + ay;
@@ -907,10 +1228,10 @@ transparent:
             break;
 
         case 180:
-            dst = ngx_http_image_new(r, dx, dy, palette);
+            dst = ngx_http_image_new(log, dx, dy, palette);
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
             gdImageCopyRotated(dst, src, dx / 2 - ax, dy / 2 - ay, 0, 0,
                                dx + ax, dy + ay, ctx->angle);
@@ -919,7 +1240,7 @@ transparent:
         }
     }
 
-    if (conf->filter == NGX_HTTP_IMAGE_CROP) {
+    if (ctx->filter == NGX_HTTP_IMAGE_CROP) {
 
         src = dst;
 
@@ -939,17 +1260,17 @@ transparent:
 
         if (ox || oy) {
 
-            dst = ngx_http_image_new(r, dx - ox, dy - oy, colors);
+            dst = ngx_http_image_new(log, dx - ox, dy - oy, colors);
 
             if (dst == NULL) {
                 gdImageDestroy(src);
-                return NULL;
+                return NGX_ERROR;
             }
 
             ox /= 2;
             oy /= 2;
 
-            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, log, 0,
                            "image crop: %d x %d @ %d x %d",
                            dx, dy, ox, oy);
 
@@ -972,54 +1293,30 @@ transparent:
         gdImageColorTransparent(dst, gdImageColorExact(dst, red, green, blue));
     }
 
-    sharpen = ngx_http_image_filter_get_value(r, conf->shcv, conf->sharpen);
+    sharpen = (int) ctx->sharpen;
     if (sharpen > 0) {
         gdImageSharpen(dst, sharpen);
     }
 
-    gdImageInterlace(dst, (int) conf->interlace);
+    gdImageInterlace(dst, (int) ctx->interlace);
 
-    out = ngx_http_image_out(r, ctx->type, dst, &size);
+    ctx->out = ngx_http_image_out(ctx, dst, log);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
                    "image: %d x %d %d", sx, sy, colors);
 
     gdImageDestroy(dst);
-    ngx_pfree(r->pool, ctx->image);
-
-    if (out == NULL) {
-        return NULL;
-    }
-
-    cln = ngx_pool_cleanup_add(r->pool, 0);
-    if (cln == NULL) {
-        gdFree(out);
-        return NULL;
-    }
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        gdFree(out);
-        return NULL;
+    if (ctx->out == NULL) {
+        return NGX_ERROR;
     }
 
-    cln->handler = ngx_http_image_cleanup;
-    cln->data = out;
-
-    b->pos = out;
-    b->last = out + size;
-    b->memory = 1;
-    b->last_buf = 1;
-
-    ngx_http_image_length(r, b);
-    ngx_http_weak_etag(r);
-
-    return b;
+    return NGX_OK;
 }
 
 
 static gdImagePtr
-ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
+ngx_http_image_source(ngx_http_image_filter_ctx_t *ctx, ngx_log_t *log)
 {
     char        *failed;
     gdImagePtr   img;
@@ -1049,7 +1346,7 @@ ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
     }
 
     if (img == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, failed);
+        ngx_log_error(NGX_LOG_ERR, log, 0, failed);
     }
 
     return img;
@@ -1057,7 +1354,7 @@ ngx_http_image_source(ngx_http_request_t *r, ngx_http_image_filter_ctx_t *ctx)
 
 
 static gdImagePtr
-ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
+ngx_http_image_new(ngx_log_t *log, int w, int h, int colors)
 {
     gdImagePtr  img;
 
@@ -1065,7 +1362,7 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
         img = gdImageCreateTrueColor(w, h);
 
         if (img == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            ngx_log_error(NGX_LOG_ERR, log, 0,
                           "gdImageCreateTrueColor() failed");
             return NULL;
         }
@@ -1074,7 +1371,7 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
         img = gdImageCreate(w, h);
 
         if (img == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            ngx_log_error(NGX_LOG_ERR, log, 0,
                           "gdImageCreate() failed");
             return NULL;
         }
@@ -1085,37 +1382,34 @@ ngx_http_image_new(ngx_http_request_t *r, int w, int h, int colors)
 
 
 static u_char *
-ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type, gdImagePtr img,
-    int *size)
+ngx_http_image_out(ngx_http_image_filter_ctx_t *ctx, gdImagePtr img,
+    ngx_log_t *log)
 {
-    char                          *failed;
-    u_char                        *out;
-    ngx_int_t                      jq;
-    ngx_http_image_filter_conf_t  *conf;
+    char       *failed;
+    u_char     *out;
+    ngx_int_t   jq;
 
     out = NULL;
 
-    switch (type) {
+    switch (ctx->type) {
 
     case NGX_HTTP_IMAGE_JPEG:
-        conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
-
-        jq = ngx_http_image_filter_get_value(r, conf->jqcv, conf->jpeg_quality);
+        jq = (ngx_int_t) ctx->jpeg_quality;
         if (jq <= 0) {
             return NULL;
         }
 
-        out = gdImageJpegPtr(img, size, jq);
+        out = gdImageJpegPtr(img, &ctx->size, jq);
         failed = "gdImageJpegPtr() failed";
         break;
 
     case NGX_HTTP_IMAGE_GIF:
-        out = gdImageGifPtr(img, size);
+        out = gdImageGifPtr(img, &ctx->size);
         failed = "gdImageGifPtr() failed";
         break;
 
     case NGX_HTTP_IMAGE_PNG:
-        out = gdImagePngPtr(img, size);
+        out = gdImagePngPtr(img, &ctx->size);
         failed = "gdImagePngPtr() failed";
         break;
 
@@ -1125,7 +1419,7 @@ ngx_http_image_out(ngx_http_request_t *r, ngx_uint_t type, gdImagePtr img,
     }
 
     if (out == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, failed);
+        ngx_log_error(NGX_LOG_ERR, log, 0, failed);
     }
 
     return out;
@@ -1176,6 +1470,237 @@ ngx_http_image_filter_value(ngx_str_t *value)
 }
 
 
+static void
+ngx_http_image_cache_key(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx)
+{
+    ngx_md5_t    md5;
+    ngx_str_t    etag;
+    ngx_uint_t   params[12];
+
+    /* the source is identified by its URI, and its validators and length */
+
+    if (r->headers_out.etag) {
+        etag = r->headers_out.etag->value;
+
+    } else if (r->headers_out.last_modified_time != -1) {
+        ngx_str_null(&etag);
+
+    } else {
+        return;
+    }
+
+    params[0] = r->headers_in.server.len;
+    params[1] = r->uri.len;
+    params[2] = r->args.len;
+    params[3] = etag.len;
+    params[4] = ctx->type;
+    params[5] = ctx->filter;
+    params[6] = ctx->max_width;
+    params[7] = ctx->max_height;
+    params[8] = ctx->angle;
+    params[9] = ctx->jpeg_quality;
+    params[10] = ctx->sharpen;
+    params[11] = (ctx->transparency << 1) | ctx->interlace;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, params, sizeof(params));
+    ngx_md5_update(&md5, &r->headers_out.last_modified_time, sizeof(time_t));
+    ngx_md5_update(&md5, &r->headers_out.content_length_n, sizeof(off_t));
+    ngx_md5_update(&md5, r->headers_in.server.data, r->headers_in.server.len);
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+    ngx_md5_update(&md5, r->args.data, r->args.len);
+    ngx_md5_update(&md5, etag.data, etag.len);
+    ngx_md5_final(ctx->key, &md5);
+
+    ctx->cacheable = 1;
+}
+
+
+static ngx_buf_t *
+ngx_http_image_cache_get(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx)
+{
+    u_char                        *p;
+    size_t                         size;
+    ngx_buf_t                     *b;
+    ngx_http_image_cache_t        *cache;
+    ngx_http_image_cache_node_t   *node;
+    ngx_http_image_filter_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    if (conf->cache == NULL || !ctx->cacheable) {
+        return NULL;
+    }
+
+    cache = conf->cache->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_image_cache_lookup(cache, ctx->key);
+
+    if (node == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "image cache miss");
+        return NULL;
+    }
+
+    size = node->size;
+
+    p = ngx_pnalloc(r->pool, size);
+    if (p == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NULL;
+    }
+
+    ngx_memcpy(p, node->data, size);
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "image cache hit, size:%uz", size);
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->pos = p;
+    b->last = p + size;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    ngx_http_image_length(r, b);
+    ngx_http_weak_etag(r);
+
+    return b;
+}
+
+
+static void
+ngx_http_image_cache_set(ngx_http_request_t *r,
+    ngx_http_image_filter_ctx_t *ctx)
+{
+    size_t                         size;
+    ngx_queue_t                   *q;
+    ngx_http_image_cache_t        *cache;
+    ngx_http_image_cache_node_t   *node;
+    ngx_http_image_filter_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_image_filter_module);
+
+    cache = conf->cache->data;
+
+    size = offsetof(ngx_http_image_cache_node_t, data) + ctx->size;
+
+    /* a single image is not allowed to evict more than a half of the zone */
+
+    if (size > cache->shm_zone->shm.size / 2) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "image cache: image is too large:%d", ctx->size);
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (ngx_http_image_cache_lookup(cache, ctx->key)) {
+        /* processed by another worker meanwhile */
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (node) {
+            break;
+        }
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+
+        ngx_http_image_cache_delete(cache,
+                     ngx_queue_data(q, ngx_http_image_cache_node_t, queue));
+    }
+
+    ngx_memcpy(&node->node.key, ctx->key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, ctx->key, NGX_HTTP_IMAGE_KEY_LEN);
+
+    node->size = ctx->size;
+    ngx_memcpy(node->data, ctx->out, ctx->size);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "image cache set, size:%d", ctx->size);
+}
+
+
+static ngx_http_image_cache_node_t *
+ngx_http_image_cache_lookup(ngx_http_image_cache_t *cache, u_char *key)
+{
+    ngx_int_t                     rc;
+    ngx_rbtree_key_t              node_key;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_image_cache_node_t  *cn;
+
+    ngx_memcpy(&node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        cn = (ngx_http_image_cache_node_t *) node;
+
+        rc = ngx_memcmp(key, cn->key, NGX_HTTP_IMAGE_KEY_LEN);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_image_cache_delete(ngx_http_image_cache_t *cache,
+    ngx_http_image_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+
 static void *
 ngx_http_image_filter_create_conf(ngx_conf_t *cf)
 {
@@ -1205,6 +1730,7 @@ ngx_http_image_filter_create_conf(ngx_conf_t *cf)
     conf->transparency = NGX_CONF_UNSET;
     conf->interlace = NGX_CONF_UNSET;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->cache = NGX_CONF_UNSET_PTR;
 
     return conf;
 }
@@ -1257,6 +1783,8 @@ ngx_http_image_filter_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
                               1 * 1024 * 1024);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
     return NGX_CONF_OK;
 }
 
@@ -1508,6 +2036,137 @@ ngx_http_image_filter_sharpen(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+static char *
+ngx_http_image_filter_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_image_filter_conf_t *imcf = conf;
+
+    u_char                  *p;
+    ssize_t                  size;
+    ngx_str_t               *value, name, s;
+    ngx_http_image_cache_t  *cache;
+
+    if (imcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        imcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    name = value[1];
+    size = 0;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p) {
+        name.len = p - name.data;
+
+        s.data = p + 1;
+        s.len = value[1].data + value[1].len - s.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    imcf->cache = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_image_filter_module);
+    if (imcf->cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (imcf->cache->data) {
+        return NGX_CONF_OK;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_image_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->shm_zone = imcf->cache;
+
+    imcf->cache->init = ngx_http_image_init_cache;
+    imcf->cache->data = cache;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_image_init_cache(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_image_cache_t  *ocache = data;
+
+    size_t                   len;
+    ngx_http_image_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_image_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in image filter cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in image filter cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_image_filter_init(ngx_conf_t *cf)
 {
@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 
 typedef struct {
@@ -28,6 +29,15 @@ typedef struct {
     ngx_http_variable_value_t  *default_value;
     ngx_conf_t                 *cf;
     ngx_uint_t                  hostnames;      /* unsigned  hostnames:1 */
+
+    ngx_hash_t                  binary_hash;
+    ngx_str_t                   include_name;
+    ngx_uint_t                  includes;
+
+    unsigned                    including:1;
+    unsigned                    outside_entries:1;
+    unsigned                    allow_binary_include:1;
+    unsigned                    binary_include:1;
 } ngx_http_map_conf_ctx_t;
 
 
@@ -44,6 +54,18 @@ static int ngx_libc_cdecl ngx_http_map_cmp_dns_wildcards(const void *one,
 static void *ngx_http_map_create_conf(ngx_conf_t *cf);
 static char *ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+static char *ngx_http_map_include(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static ngx_int_t ngx_http_map_include_binary_base(ngx_conf_t *cf,
+    ngx_http_map_conf_ctx_t *ctx, ngx_http_map_conf_t *mcf, ngx_str_t *name);
+static void ngx_http_map_create_binary_base(ngx_http_map_conf_ctx_t *ctx,
+    ngx_http_map_conf_t *mcf, ngx_hash_t *hash, ngx_pool_t *temp_pool);
+static size_t ngx_http_map_value_offsets(ngx_rbtree_t *rbtree,
+    ngx_hash_t *hash, size_t offset, uint32_t *nvalues, ngx_pool_t *pool);
+static void ngx_http_map_copy_values(u_char *p, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_map_file_md5(ngx_str_t *name, u_char *md5,
+    ngx_log_t *log);
 
 
 static ngx_command_t  ngx_http_map_commands[] = {
@@ -104,6 +126,51 @@ ngx_module_t  ngx_http_map_module = {
 };
 
 
+/*
+ * The binary map base is a relocatable copy of the exact names hash
+ * built from a single large include file.  It is keyed by the MD5
+ * of the include file contents and by the hash parameters, so it is used
+ * instead of parsing the file and searching for the hash size again
+ * until the file or the parameters change.
+ */
+
+#define NGX_HTTP_MAP_BINARY_MIN_KEYS  10000
+
+
+typedef struct {
+    u_char    MAPBIN[6];
+    u_char    version;
+    u_char    ptr_size;
+    uint32_t  endianness;
+    uint32_t  crc32;
+
+    u_char    md5[16];
+
+    uint32_t  hostnames;
+    uint32_t  max_size;
+    uint32_t  bucket_size;
+    uint32_t  cacheline_size;
+
+    uint32_t  size;
+    uint32_t  values;
+    uint32_t  nvalues;
+    uint32_t  buckets;
+    uint32_t  elts;
+} ngx_http_map_header_t;
+
+
+static ngx_http_map_header_t  ngx_http_map_header = {
+    { 'M', 'A', 'P', 'B', 'I', 'N' }, 0, sizeof(void *), 0x12345678, 0,
+    { 0 }, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    size_t                      offset;
+} ngx_http_map_value_node_t;
+
+
 static ngx_int_t
 ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     uintptr_t data)
@@ -267,6 +334,14 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ctx.cf = &save;
     ctx.hostnames = 0;
 
+    ngx_memzero(&ctx.binary_hash, sizeof(ngx_hash_t));
+    ngx_str_null(&ctx.include_name);
+    ctx.includes = 0;
+    ctx.including = 0;
+    ctx.outside_entries = 0;
+    ctx.allow_binary_include = 1;
+    ctx.binary_include = 0;
+
     save = *cf;
     cf->pool = pool;
     cf->ctx = &ctx;
@@ -293,7 +368,10 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     hash.name = "map_hash";
     hash.pool = cf->pool;
 
-    if (ctx.keys.keys.nelts) {
+    if (ctx.binary_include) {
+        map->map.hash.hash = ctx.binary_hash;
+
+    } else if (ctx.keys.keys.nelts) {
         hash.hash = &map->map.hash.hash;
         hash.temp_pool = NULL;
 
@@ -303,6 +381,21 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             ngx_destroy_pool(pool);
             return NGX_CONF_ERROR;
         }
+
+        if (ctx.allow_binary_include
+            && !ctx.outside_entries
+            && ctx.includes == 1
+            && ctx.keys.keys.nelts > NGX_HTTP_MAP_BINARY_MIN_KEYS
+            && ctx.keys.dns_wc_head.nelts == 0
+            && ctx.keys.dns_wc_tail.nelts == 0
+#if (NGX_PCRE)
+            && ctx.regexes.nelts == 0
+#endif
+           )
+        {
+            ngx_http_map_create_binary_base(&ctx, mcf, &map->map.hash.hash,
+                                            pool);
+        }
     }
 
     if (ctx.keys.dns_wc_head.nelts) {
@@ -388,6 +481,10 @@ ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
     if (cf->args->nelts == 1
         && ngx_strcmp(value[0].data, "hostnames") == 0)
     {
+        if (ctx->including) {
+            ctx->allow_binary_include = 0;
+        }
+
         ctx->hostnames = 1;
         return NGX_CONF_OK;
 
@@ -398,7 +495,28 @@ ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
     }
 
     if (ngx_strcmp(value[0].data, "include") == 0) {
-        return ngx_conf_include(cf, dummy, conf);
+        return ngx_http_map_include(cf, dummy, conf);
+    }
+
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+        if (ctx->including) {
+            ctx->allow_binary_include = 0;
+        }
+
+    } else if (ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary map base \"%s\" cannot be mixed with usual entries",
+            ctx->include_name.data);
+        return NGX_CONF_ERROR;
+
+    } else if (!ctx->including) {
+        ctx->outside_entries = 1;
+
+    } else if (value[1].data[0] == '$'
+               || (value[0].len && value[0].data[0] == '~'))
+    {
+        /* variables indices and regexes cannot be saved */
+        ctx->allow_binary_include = 0;
     }
 
     if (value[1].data[0] == '$') {
@@ -565,3 +683,594 @@ found:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_map_include(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    char                     *rv;
+    unsigned                  including;
+    ngx_str_t                *value, file;
+    ngx_http_map_conf_ctx_t  *ctx;
+
+    ctx = cf->ctx;
+    value = cf->args->elts;
+
+    file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (strpbrk((char *) file.data, "*?[") != NULL) {
+        ctx->allow_binary_include = 0;
+        return ngx_conf_include(cf, dummy, conf);
+    }
+
+    switch (ngx_http_map_include_binary_base(cf, ctx, conf, &file)) {
+    case NGX_OK:
+        return NGX_CONF_OK;
+    case NGX_ERROR:
+        return NGX_CONF_ERROR;
+    default:
+        break;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
+
+    if (ctx->including) {
+        ctx->allow_binary_include = 0;
+    }
+
+    ctx->include_name = file;
+
+    including = ctx->including;
+    ctx->including = 1;
+
+    rv = ngx_conf_parse(cf, &file);
+
+    ctx->including = including;
+    ctx->includes++;
+
+    return rv;
+}
+
+
+static ngx_int_t
+ngx_http_map_include_binary_base(ngx_conf_t *cf, ngx_http_map_conf_ctx_t *ctx,
+    ngx_http_map_conf_t *mcf, ngx_str_t *name)
+{
+    u_char                     *base, md5[16];
+    size_t                      size, off, len;
+    ssize_t                     n;
+    uint32_t                    crc32;
+    ngx_err_t                   err;
+    ngx_int_t                   rc;
+    ngx_str_t                   bin;
+    ngx_uint_t                  i;
+    ngx_file_t                  file;
+    ngx_hash_elt_t             *elt, **buckets;
+    ngx_file_info_t             fi;
+    ngx_http_map_header_t      *header;
+    ngx_http_variable_value_t  *vv;
+
+    bin.len = name->len + 4;
+    bin.data = ngx_pnalloc(cf->pool, name->len + 5);
+    if (bin.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(bin.data, "%V.bin%Z", name);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = bin;
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(bin.data, NGX_FILE_RDONLY, 0, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+        if (err != NGX_ENOENT) {
+            ngx_conf_log_error(NGX_LOG_CRIT, cf, err,
+                               ngx_open_file_n " \"%s\" failed", bin.data);
+        }
+        return NGX_DECLINED;
+    }
+
+    if (ctx->outside_entries || ctx->includes) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary map base \"%s\" cannot be mixed with usual entries",
+            bin.data);
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    rc = NGX_DECLINED;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", bin.data);
+        goto done;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size < sizeof(ngx_http_map_header_t)) {
+        goto incompatible;
+    }
+
+    base = ngx_pmemalign(ctx->keys.pool, size, ngx_cacheline_size);
+    if (base == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    n = ngx_read_file(&file, base, size, 0);
+
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_read_file_n " \"%s\" failed", bin.data);
+        goto done;
+    }
+
+    if ((size_t) n != size) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
+            ngx_read_file_n " \"%s\" returned only %z bytes instead of %z",
+            bin.data, n, size);
+        goto done;
+    }
+
+    header = (ngx_http_map_header_t *) base;
+
+    if (ngx_memcmp(&ngx_http_map_header, header, 12) != 0
+        || header->hostnames != ctx->hostnames
+        || header->max_size != mcf->hash_max_size
+        || header->bucket_size != mcf->hash_bucket_size
+        || header->cacheline_size != ngx_cacheline_size)
+    {
+        goto incompatible;
+    }
+
+    off = offsetof(ngx_http_map_header_t, md5);
+
+    crc32 = ngx_crc32_long(base + off, size - off);
+
+    if (crc32 != header->crc32) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                      "CRC32 mismatch in binary map base \"%s\"", bin.data);
+        goto done;
+    }
+
+    if (ngx_http_map_file_md5(name, md5, cf->log) != NGX_OK) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    if (ngx_memcmp(md5, header->md5, 16) != 0) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "stale binary map base \"%s\"", bin.data);
+        goto done;
+    }
+
+    if (header->values > header->buckets
+        || header->buckets > size
+        || header->size > (size - header->buckets) / sizeof(void *)
+        || header->elts > size)
+    {
+        goto incompatible;
+    }
+
+    /* relocate the values, they are followed by the buckets */
+
+    off = header->values;
+
+    for (i = 0; i < header->nvalues; i++) {
+
+        if (off > header->buckets
+            || header->buckets - off < sizeof(ngx_http_variable_value_t))
+        {
+            goto incompatible;
+        }
+
+        vv = (ngx_http_variable_value_t *) (base + off);
+        len = sizeof(ngx_http_variable_value_t) + vv->len;
+
+        if (len > header->buckets - off) {
+            goto incompatible;
+        }
+
+        len = ngx_align(len, sizeof(void *));
+
+        vv->data = base + off + sizeof(ngx_http_variable_value_t);
+
+        off += len;
+    }
+
+    /* relocate the buckets and the elements */
+
+    buckets = (ngx_hash_elt_t **) (base + header->buckets);
+
+    for (i = 0; i < header->size; i++) {
+
+        if (buckets[i] == NULL) {
+            continue;
+        }
+
+        off = (size_t) buckets[i];
+
+        if (off < header->elts || off > size - sizeof(void *)) {
+            goto incompatible;
+        }
+
+        elt = (ngx_hash_elt_t *) (base + off);
+        buckets[i] = elt;
+
+        while (elt->value) {
+
+            if ((u_char *) &elt->name[0] > base + size
+                || elt->len > (size_t) (base + size - &elt->name[0]))
+            {
+                goto incompatible;
+            }
+
+            off = (size_t) elt->value;
+
+            if (off < header->values || off >= header->buckets) {
+                goto incompatible;
+            }
+
+            elt->value = base + off;
+
+            elt = (ngx_hash_elt_t *) ngx_align_ptr(&elt->name[0] + elt->len,
+                                                   sizeof(void *));
+
+            if ((u_char *) elt > base + size - sizeof(void *)) {
+                goto incompatible;
+            }
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "using binary map base \"%s\"", bin.data);
+
+    ctx->binary_hash.buckets = buckets;
+    ctx->binary_hash.size = header->size;
+
+    ctx->include_name = bin;
+    ctx->binary_include = 1;
+    ctx->includes++;
+
+    rc = NGX_OK;
+
+    goto done;
+
+incompatible:
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "incompatible binary map base \"%s\"", bin.data);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", bin.data);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_map_create_binary_base(ngx_http_map_conf_ctx_t *ctx,
+    ngx_http_map_conf_t *mcf, ngx_hash_t *hash, ngx_pool_t *temp_pool)
+{
+    u_char                     *p, *start, *end, *name;
+    size_t                      values, size;
+    uint32_t                    nvalues;
+    ngx_uint_t                  i;
+    ngx_rbtree_t                rbtree;
+    ngx_hash_elt_t             *elt, **buckets;
+    ngx_rbtree_node_t           sentinel, *node;
+    ngx_file_mapping_t          fm;
+    ngx_http_map_header_t      *header;
+
+    /* the elements of all buckets are allocated together */
+
+    start = NULL;
+    end = NULL;
+
+    for (i = 0; i < hash->size; i++) {
+        elt = hash->buckets[i];
+
+        if (elt == NULL) {
+            continue;
+        }
+
+        if (start == NULL) {
+            start = (u_char *) elt;
+        }
+
+        while (elt->value) {
+            elt = (ngx_hash_elt_t *) ngx_align_ptr(&elt->name[0] + elt->len,
+                                                   sizeof(void *));
+        }
+
+        end = (u_char *) elt + sizeof(void *);
+    }
+
+    end = ngx_align_ptr(end, ngx_cacheline_size);
+
+    ngx_rbtree_init(&rbtree, &sentinel, ngx_rbtree_insert_value);
+
+    values = ngx_align(sizeof(ngx_http_map_header_t), sizeof(void *));
+
+    nvalues = 0;
+
+    size = ngx_http_map_value_offsets(&rbtree, hash, values, &nvalues,
+                                      temp_pool);
+    if (size == 0) {
+        return;
+    }
+
+    /*
+     * other processes, e.g. "nginx -t" or a new binary, may read the base
+     * at the same time, so it is written to a temporary file first and
+     * then renamed over the old one
+     */
+
+    name = ngx_pnalloc(temp_pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    fm.name = ngx_pnalloc(temp_pool,
+                          ctx->include_name.len + 5 + 1 + NGX_INT64_LEN);
+    if (fm.name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(fm.name, "%V.bin.%P%Z", &ctx->include_name, ngx_pid);
+
+    fm.size = ngx_align(size + hash->size * sizeof(ngx_hash_elt_t *),
+                       ngx_cacheline_size)
+              + (end - start);
+    fm.log = ctx->cf->log;
+
+    ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
+                  "creating binary map base \"%s\"", name);
+
+    if (ngx_create_file_mapping(&fm) != NGX_OK) {
+        goto failed;
+    }
+
+    header = fm.addr;
+    *header = ngx_http_map_header;
+
+    if (ngx_http_map_file_md5(&ctx->include_name, header->md5, fm.log)
+        != NGX_OK)
+    {
+        ngx_close_file_mapping(&fm);
+        goto failed;
+    }
+
+    header->hostnames = (uint32_t) ctx->hostnames;
+    header->max_size = (uint32_t) mcf->hash_max_size;
+    header->bucket_size = (uint32_t) mcf->hash_bucket_size;
+    header->cacheline_size = (uint32_t) ngx_cacheline_size;
+    header->size = (uint32_t) hash->size;
+    header->values = (uint32_t) values;
+    header->nvalues = nvalues;
+    header->buckets = (uint32_t) size;
+    header->elts = (uint32_t) ngx_align(size + hash->size
+                                               * sizeof(ngx_hash_elt_t *),
+                                        ngx_cacheline_size);
+
+    ngx_http_map_copy_values(fm.addr, rbtree.root, &sentinel);
+
+    p = (u_char *) fm.addr + header->elts;
+
+    ngx_memcpy(p, start, end - start);
+
+    buckets = (ngx_hash_elt_t **) ((u_char *) fm.addr + header->buckets);
+
+    for (i = 0; i < hash->size; i++) {
+        elt = hash->buckets[i];
+
+        if (elt == NULL) {
+            continue;
+        }
+
+        buckets[i] = (ngx_hash_elt_t *)
+                         (header->elts + ((u_char *) elt - start));
+
+        elt = (ngx_hash_elt_t *) (p + ((u_char *) elt - start));
+
+        while (elt->value) {
+            node = rbtree.root;
+
+            while (node->key != (ngx_rbtree_key_t) elt->value) {
+                node = ((ngx_rbtree_key_t) elt->value < node->key)
+                       ? node->left : node->right;
+            }
+
+            elt->value = (void *) ((ngx_http_map_value_node_t *) node)->offset;
+
+            elt = (ngx_hash_elt_t *) ngx_align_ptr(&elt->name[0] + elt->len,
+                                                   sizeof(void *));
+        }
+    }
+
+    size = offsetof(ngx_http_map_header_t, md5);
+
+    header->crc32 = ngx_crc32_long((u_char *) fm.addr + size, fm.size - size);
+
+    ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) != NGX_FILE_ERROR) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                  ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                  fm.name, name);
+
+failed:
+
+    if (ngx_delete_file(fm.name) == NGX_FILE_ERROR) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", fm.name);
+        }
+    }
+}
+
+
+/*
+ * assigns the file offsets to the distinct values of the hash,
+ * returns the end of the values or 0 on error
+ */
+
+static size_t
+ngx_http_map_value_offsets(ngx_rbtree_t *rbtree, ngx_hash_t *hash,
+    size_t offset, uint32_t *nvalues, ngx_pool_t *pool)
+{
+    ngx_uint_t                  i;
+    ngx_hash_elt_t             *elt;
+    ngx_rbtree_node_t          *node;
+    ngx_http_map_value_node_t  *vn;
+    ngx_http_variable_value_t  *vv;
+
+    for (i = 0; i < hash->size; i++) {
+
+        for (elt = hash->buckets[i];
+             elt && elt->value;
+             elt = (ngx_hash_elt_t *) ngx_align_ptr(&elt->name[0] + elt->len,
+                                                    sizeof(void *)))
+        {
+            node = rbtree->root;
+
+            while (node != rbtree->sentinel) {
+                if ((ngx_rbtree_key_t) elt->value == node->key) {
+                    break;
+                }
+
+                node = ((ngx_rbtree_key_t) elt->value < node->key)
+                       ? node->left : node->right;
+            }
+
+            if (node != rbtree->sentinel) {
+                continue;
+            }
+
+            vn = ngx_palloc(pool, sizeof(ngx_http_map_value_node_t));
+            if (vn == NULL) {
+                return 0;
+            }
+
+            vv = elt->value;
+
+            vn->node.key = (ngx_rbtree_key_t) vv;
+            vn->offset = offset;
+
+            ngx_rbtree_insert(rbtree, &vn->node);
+
+            (*nvalues)++;
+
+            offset += ngx_align(sizeof(ngx_http_variable_value_t) + vv->len,
+                                sizeof(void *));
+        }
+    }
+
+    return offset;
+}
+
+
+static void
+ngx_http_map_copy_values(u_char *p, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_http_variable_value_t  *vv, *value;
+
+    if (node == sentinel) {
+        return;
+    }
+
+    value = (ngx_http_variable_value_t *) node->key;
+    vv = (ngx_http_variable_value_t *)
+             (p + ((ngx_http_map_value_node_t *) node)->offset);
+
+    *vv = *value;
+    vv->data = NULL;
+
+    ngx_memcpy((u_char *) vv + sizeof(ngx_http_variable_value_t),
+               value->data, value->len);
+
+    ngx_http_map_copy_values(p, node->left, sentinel);
+    ngx_http_map_copy_values(p, node->right, sentinel);
+}
+
+
+static ngx_int_t
+ngx_http_map_file_md5(ngx_str_t *name, u_char *md5, ngx_log_t *log)
+{
+    u_char      *buf;
+    off_t        offset;
+    ssize_t      n;
+    ngx_int_t    rc;
+    ngx_md5_t    ctx;
+    ngx_file_t   file;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = *name;
+    file.log = log;
+
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, 0, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name->data);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    buf = ngx_alloc(NGX_MAX_ALLOC_FROM_POOL, log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    ngx_md5_init(&ctx);
+
+    offset = 0;
+
+    for ( ;; ) {
+        n = ngx_read_file(&file, buf, NGX_MAX_ALLOC_FROM_POOL, offset);
+
+        if (n == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_read_file_n " \"%s\" failed", name->data);
+            break;
+        }
+
+        if (n == 0) {
+            ngx_md5_final(md5, &ctx);
+            rc = NGX_OK;
+            break;
+        }
+
+        ngx_md5_update(&ctx, buf, n);
+
+        offset += n;
+    }
+
+    ngx_free(buf);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
+
+    return rc;
+}
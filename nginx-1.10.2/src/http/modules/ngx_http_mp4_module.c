@@ -40,12 +40,63 @@
 #define NGX_HTTP_MP4_LAST_ATOM    NGX_HTTP_MP4_CO64_DATA
 
 
+#define NGX_HTTP_MP4_HLS_PLAYLIST  1
+#define NGX_HTTP_MP4_HLS_INIT      2
+#define NGX_HTTP_MP4_HLS_SEGMENT   3
+
+
 typedef struct {
     size_t                buffer_size;
     size_t                max_buffer_size;
+    ngx_shm_zone_t       *cache;
+    ngx_flag_t            hls;
+    ngx_msec_t            hls_fragment;
 } ngx_http_mp4_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_t          rbtree;
+    ngx_rbtree_node_t     sentinel;
+    ngx_queue_t           queue;
+} ngx_http_mp4_cache_sh_t;
+
+
+typedef struct {
+    ngx_http_mp4_cache_sh_t  *sh;
+    ngx_slab_pool_t          *shpool;
+    ngx_shm_zone_t           *shm_zone;
+} ngx_http_mp4_cache_t;
+
+
+/*
+ * A cache node keeps the ftyp atom as it is sent to a client followed by
+ * the original moov atom data, the position of the mdat atom data, and
+ * the parsed trak atoms, so a cached file is processed without reading
+ * and parsing its metadata again.
+ */
+
+typedef struct {
+    ngx_rbtree_node_t     node;
+    ngx_queue_t           queue;
+
+    ngx_file_uniq_t       uniq;
+    ngx_file_dev_t        dev;
+    time_t                mtime;
+    off_t                 size;
+
+    off_t                 moov_offset;
+    off_t                 mdat_offset;
+    off_t                 mdat_size;
+    size_t                ftyp_size;
+    size_t                moov_data_size;
+    size_t                mvhd_pos;
+    size_t                mvhd_size;
+    ngx_uint_t            traks;
+
+    u_char                data[1];
+} ngx_http_mp4_cache_node_t;
+
+
 typedef struct {
     u_char                chunk[4];
     u_char                samples[4];
@@ -116,6 +167,24 @@ typedef struct {
 } ngx_http_mp4_trak_t;
 
 
+/*
+ * A parsed trak atom is cached with its buffers replaced by offsets:
+ * of the buffer in the trak, and of the atom data in the moov atom data.
+ */
+
+typedef struct {
+    size_t                buf;
+    size_t                pos;
+    size_t                last;
+} ngx_http_mp4_cache_buf_t;
+
+
+typedef struct {
+    ngx_http_mp4_trak_t       trak;
+    ngx_http_mp4_cache_buf_t  bufs[NGX_HTTP_MP4_LAST_ATOM + 1];
+} ngx_http_mp4_cache_trak_t;
+
+
 typedef struct {
     ngx_file_t            file;
 
@@ -153,9 +222,78 @@ typedef struct {
 
     u_char                moov_atom_header[8];
     u_char                mdat_atom_header[16];
+
+    ngx_open_file_info_t  of;
+
+    u_char               *moov_data;
+    u_char               *moov_base;
+    size_t                moov_data_size;
+    off_t                 moov_offset;
+    off_t                 mdat_offset;
+    off_t                 mdat_size;
+    ngx_uint_t            skipped;
+
+    ngx_file_dev_t        dev;
+    ngx_http_mp4_cache_node_t  *cached;
+
+    ngx_uint_t            hls;
+    ngx_uint_t            segment;
+
+#if (NGX_THREADS)
+    uint64_t              moov_read;
+#endif
 } ngx_http_mp4_file_t;
 
 
+typedef struct {
+    ngx_http_mp4_trak_t  *trak;
+    uint32_t              track_id;
+    uint32_t              timescale;
+    ngx_uint_t            samples;
+
+    /* the current sample */
+    ngx_uint_t            sample;
+    uint64_t              dts;
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              offset;
+    off_t                 pos;
+    ngx_uint_t            key;
+
+    uint64_t              next_dts;
+    u_char               *stts;
+    u_char               *stts_end;
+    uint32_t              stts_left;
+    uint32_t              stts_duration;
+    u_char               *ctts;
+    u_char               *ctts_end;
+    uint32_t              ctts_left;
+    uint32_t              ctts_offset;
+    ngx_uint_t            ctts_version;
+    u_char               *stss;
+    u_char               *stss_end;
+    u_char               *stsz;
+    uint32_t              uniform_size;
+    u_char               *stsc;
+    u_char               *stsc_end;
+    uint32_t              chunk_samples;
+    uint32_t              chunk_left;
+    ngx_uint_t            chunk;
+    u_char               *chunks;
+    ngx_uint_t            co64;
+} ngx_http_mp4_hls_track_t;
+
+
+typedef struct {
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              flags;
+    uint32_t              offset;
+    off_t                 pos;
+} ngx_http_mp4_hls_sample_t;
+
+
+
 typedef struct {
     char                 *name;
     ngx_int_t           (*handler)(ngx_http_mp4_file_t *mp4,
@@ -214,10 +352,54 @@ typedef struct {
 #define ngx_mp4_last_trak(mp4)                                                \
     &((ngx_http_mp4_trak_t *) mp4->trak.elts)[mp4->trak.nelts - 1]
 
+#define ngx_mp4_write_32value(p, n)                                           \
+    ngx_mp4_set_32value(p, n);                                                \
+    p += 4
+
+#define ngx_mp4_write_64value(p, n)                                           \
+    ngx_mp4_set_64value(p, n);                                                \
+    p += 8
+
+#define ngx_mp4_write_atom_header(p, size, name)                              \
+    ngx_mp4_set_32value(p, size);                                             \
+    ngx_memcpy(p + 4, name, 4);                                               \
+    p += 8
+
+#define ngx_mp4_buf_size(b)                                                   \
+    ((b) ? (size_t) ((b)->last - (b)->pos) : 0)
+
+#define ngx_http_mp4_cache_traks(node)                                        \
+    ((ngx_http_mp4_cache_trak_t *)                                            \
+         ((node)->data + ngx_align((node)->ftyp_size + (node)->moov_data_size, \
+                                   NGX_ALIGNMENT)))
+
 
 static ngx_int_t ngx_http_mp4_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_mp4_send(ngx_http_request_t *r,
+    ngx_http_mp4_file_t *mp4, ngx_int_t rc, ngx_open_file_info_t *of,
+    ngx_str_t *path);
 
 static ngx_int_t ngx_http_mp4_process(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_update(ngx_http_mp4_file_t *mp4);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_mp4_thread_handler(ngx_thread_task_t *task,
+    ngx_file_t *file);
+static void ngx_http_mp4_thread_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_mp4_cache_get(ngx_http_mp4_file_t *mp4);
+static void ngx_http_mp4_cache_set(ngx_http_mp4_file_t *mp4);
+static void ngx_http_mp4_cache_restore_atom(ngx_http_mp4_file_t *mp4,
+    u_char *p, ngx_buf_t *atom);
+static ngx_http_mp4_cache_node_t *ngx_http_mp4_cache_lookup(
+    ngx_http_mp4_cache_t *cache, ngx_file_uniq_t uniq, ngx_file_dev_t dev);
+static void ngx_http_mp4_cache_delete(ngx_http_mp4_cache_t *cache,
+    ngx_http_mp4_cache_node_t *node);
+static ngx_int_t ngx_http_mp4_read_cached(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_read_cached_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_cache_buf_t *bufs, ngx_uint_t n,
+    ngx_int_t (*handler)(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size));
+static ngx_int_t ngx_http_mp4_hls_arg(ngx_http_mp4_file_t *mp4,
+    ngx_str_t *value);
 static ngx_int_t ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size);
@@ -225,6 +407,9 @@ static ngx_int_t ngx_http_mp4_read_ftyp_atom(ngx_http_mp4_file_t *mp4,
     uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4,
     uint64_t atom_data_size);
+static void ngx_http_mp4_init_moov_atom(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_parse_moov_atom(ngx_http_mp4_file_t *mp4,
+    uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_read_mdat_atom(ngx_http_mp4_file_t *mp4,
     uint64_t atom_data_size);
 static size_t ngx_http_mp4_update_mdat_atom(ngx_http_mp4_file_t *mp4,
@@ -304,7 +489,25 @@ static ngx_int_t ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
 static void ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak, off_t adjustment);
 
+static ngx_int_t ngx_http_mp4_hls_process(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_hls_init_track(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_http_mp4_hls_track_t *t);
+static ngx_int_t ngx_http_mp4_hls_next_sample(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *t);
+static ngx_array_t *ngx_http_mp4_hls_segments(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *ref);
+static ngx_int_t ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *ref, ngx_array_t *segments);
+static ngx_int_t ngx_http_mp4_hls_init_segment(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *tracks, ngx_uint_t n);
+static ngx_int_t ngx_http_mp4_hls_media_segment(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *tracks, ngx_uint_t n,
+    ngx_http_mp4_hls_track_t *ref, ngx_array_t *segments);
+
 static char *ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_mp4_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_mp4_init_cache(ngx_shm_zone_t *shm_zone, void *data);
 static void *ngx_http_mp4_create_conf(ngx_conf_t *cf);
 static char *ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child);
 
@@ -332,6 +535,27 @@ static ngx_command_t  ngx_http_mp4_commands[] = {
       offsetof(ngx_http_mp4_conf_t, max_buffer_size),
       NULL },
 
+    { ngx_string("mp4_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_mp4_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mp4_hls"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, hls),
+      NULL },
+
+    { ngx_string("mp4_hls_fragment"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, hls_fragment),
+      NULL },
+
       ngx_null_command
 };
 
@@ -422,10 +646,9 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
     size_t                     root;
     ngx_int_t                  rc, start, end;
     ngx_uint_t                 level, length;
-    ngx_str_t                  path, value;
+    ngx_str_t                  path, value, hls;
     ngx_log_t                 *log;
-    ngx_buf_t                 *b;
-    ngx_chain_t                out;
+    ngx_http_mp4_conf_t       *conf;
     ngx_http_mp4_file_t       *mp4;
     ngx_open_file_info_t       of;
     ngx_http_core_loc_conf_t  *clcf;
@@ -529,7 +752,7 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
     length = 0;
     r->headers_out.content_length_n = of.size;
     mp4 = NULL;
-    b = NULL;
+    ngx_str_null(&hls);
 
     if (r->args.len) {
 
@@ -570,6 +793,16 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
         }
     }
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_mp4_module);
+
+    if (conf->hls
+        && r->args.len
+        && ngx_http_arg(r, (u_char *) "hls", 3, &hls) == NGX_OK)
+    {
+        start = 0;
+        length = 0;
+    }
+
     if (start >= 0) {
         r->single_range = 1;
 
@@ -585,8 +818,47 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
         mp4->start = (ngx_uint_t) start;
         mp4->length = length;
         mp4->request = r;
+        mp4->of = of;
+
+        if (hls.data && ngx_http_mp4_hls_arg(mp4, &hls) != NGX_OK) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        rc = ngx_http_mp4_process(mp4);
+
+#if (NGX_THREADS)
+        if (rc == NGX_AGAIN) {
+            r->main->count++;
+            r->write_event_handler = ngx_http_request_empty_handler;
+            return NGX_DONE;
+        }
+#endif
+
+    } else {
+        rc = NGX_OK;
+    }
+
+    return ngx_http_mp4_send(r, mp4, rc, &of, &path);
+}
 
-        switch (ngx_http_mp4_process(mp4)) {
+
+static ngx_int_t
+ngx_http_mp4_send(ngx_http_request_t *r, ngx_http_mp4_file_t *mp4,
+    ngx_int_t rc, ngx_open_file_info_t *of, ngx_str_t *path)
+{
+    ngx_log_t                 *log;
+    ngx_buf_t                 *b;
+    ngx_chain_t                out;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    log = r->connection->log;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    b = NULL;
+
+    if (mp4) {
+
+        switch (rc) {
 
         case NGX_DECLINED:
             if (mp4->buffer) {
@@ -602,32 +874,32 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
             r->headers_out.content_length_n = mp4->content_length;
             break;
 
-        default: /* NGX_ERROR */
+        default: /* NGX_ERROR, NGX_HTTP_NOT_FOUND */
             if (mp4->buffer) {
                 ngx_pfree(r->pool, mp4->buffer);
             }
 
             ngx_pfree(r->pool, mp4);
 
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return (rc == NGX_ERROR) ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc;
         }
     }
 
     log->action = "sending mp4 to client";
 
-    if (clcf->directio <= of.size) {
+    if (clcf->directio <= of->size) {
 
         /*
          * DIRECTIO is set on transfer only
          * to allow kernel to cache "moov" atom
          */
 
-        if (ngx_directio_on(of.fd) == NGX_FILE_ERROR) {
+        if (ngx_directio_on(of->fd) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
-                          ngx_directio_on_n " \"%s\" failed", path.data);
+                          ngx_directio_on_n " \"%s\" failed", path->data);
         }
 
-        of.is_directio = 1;
+        of->is_directio = 1;
 
         if (mp4) {
             mp4->file.directio = 1;
@@ -635,7 +907,7 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
     }
 
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.last_modified_time = of.mtime;
+    r->headers_out.last_modified_time = of->mtime;
 
     if (ngx_http_set_etag(r) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -668,16 +940,16 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
     }
 
     b->file_pos = 0;
-    b->file_last = of.size;
+    b->file_last = of->size;
 
     b->in_file = b->file_last ? 1 : 0;
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
 
-    b->file->fd = of.fd;
-    b->file->name = path;
+    b->file->fd = of->fd;
+    b->file->name = *path;
     b->file->log = log;
-    b->file->directio = of.is_directio;
+    b->file->directio = of->is_directio;
 
     out.buf = b;
     out.next = NULL;
@@ -689,12 +961,11 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
 {
-    off_t                  start_offset, end_offset, adjustment;
-    ngx_int_t              rc;
-    ngx_uint_t             i, j;
-    ngx_chain_t          **prev;
-    ngx_http_mp4_trak_t   *trak;
-    ngx_http_mp4_conf_t   *conf;
+    ngx_int_t                  rc;
+    ngx_http_mp4_conf_t       *conf;
+#if (NGX_THREADS)
+    ngx_http_core_loc_conf_t  *clcf;
+#endif
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
                    "mp4 start:%ui, length:%ui", mp4->start, mp4->length);
@@ -703,11 +974,42 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
 
     mp4->buffer_size = conf->buffer_size;
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
+    rc = ngx_http_mp4_cache_get(mp4);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_mp4_read_cached(mp4);
+
+    } else if (rc == NGX_DECLINED) {
+
+#if (NGX_THREADS)
+        clcf = ngx_http_get_module_loc_conf(mp4->request,
+                                            ngx_http_core_module);
+
+        if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+            mp4->file.thread_handler = ngx_http_mp4_thread_handler;
+            mp4->file.thread_ctx = mp4;
+        }
+#endif
+
+        rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
+    }
+
     if (rc != NGX_OK) {
         return rc;
     }
 
+    return ngx_http_mp4_update(mp4);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update(ngx_http_mp4_file_t *mp4)
+{
+    off_t                  start_offset, end_offset, adjustment;
+    ngx_uint_t             i, j;
+    ngx_chain_t          **prev;
+    ngx_http_mp4_trak_t   *trak;
+
     if (mp4->trak.nelts == 0) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
                       "no mp4 trak atoms were found in \"%s\"",
@@ -722,6 +1024,14 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
         return NGX_ERROR;
     }
 
+    if (mp4->moov_data) {
+        ngx_http_mp4_cache_set(mp4);
+    }
+
+    if (mp4->hls) {
+        return ngx_http_mp4_hls_process(mp4);
+    }
+
     prev = &mp4->out;
 
     if (mp4->ftyp_atom.buf) {
@@ -840,875 +1150,819 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
 }
 
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-} ngx_mp4_atom_header_t;
-
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    size64[8];
-} ngx_mp4_atom_header64_t;
+#if (NGX_THREADS)
 
+/*
+ * Only file reads are done in threads: ngx_http_mp4_read() returns
+ * NGX_AGAIN while a read is in progress, and parsing is resumed in
+ * the event handler, either at the top level atom being read, or with
+ * the moov atom data read by ngx_http_mp4_read_moov_atom().
+ */
 
 static ngx_int_t
-ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size)
+ngx_http_mp4_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
 {
-    off_t        end;
-    size_t       atom_header_size;
-    u_char      *atom_header, *atom_name;
-    uint64_t     atom_size;
-    ngx_int_t    rc;
-    ngx_uint_t   n;
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_mp4_file_t       *mp4;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    end = mp4->offset + atom_data_size;
+    mp4 = file->thread_ctx;
+    r = mp4->request;
 
-    while (mp4->offset < end) {
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
 
-        if (ngx_http_mp4_read(mp4, sizeof(uint32_t)) != NGX_OK) {
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
             return NGX_ERROR;
         }
 
-        atom_header = mp4->buffer_pos;
-        atom_size = ngx_mp4_get_32value(atom_header);
-        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
 
-        if (atom_size == 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "mp4 atom end");
-            return NGX_OK;
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
         }
+    }
 
-        if (atom_size < sizeof(ngx_mp4_atom_header_t)) {
+    task->event.data = mp4;
+    task->event.handler = ngx_http_mp4_thread_event_handler;
 
-            if (atom_size == 1) {
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-                if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header64_t))
-                    != NGX_OK)
-                {
-                    return NGX_ERROR;
-                }
+    r->main->blocked++;
+    r->aio = 1;
 
-                /* 64-bit atom size */
-                atom_header = mp4->buffer_pos;
-                atom_size = ngx_mp4_get_64value(atom_header + 8);
-                atom_header_size = sizeof(ngx_mp4_atom_header64_t);
+    return NGX_OK;
+}
 
-            } else {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "\"%s\" mp4 atom is too small:%uL",
-                              mp4->file.name.data, atom_size);
-                return NGX_ERROR;
-            }
-        }
 
-        if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header_t)) != NGX_OK) {
-            return NGX_ERROR;
-        }
+static void
+ngx_http_mp4_thread_event_handler(ngx_event_t *ev)
+{
+    uint64_t               size;
+    ngx_int_t              rc;
+    ngx_str_t              path;
+    ngx_connection_t      *c;
+    ngx_http_request_t    *r;
+    ngx_open_file_info_t   of;
+    ngx_http_mp4_file_t   *mp4;
 
-        atom_header = mp4->buffer_pos;
-        atom_name = atom_header + sizeof(uint32_t);
+    mp4 = ev->data;
+    r = mp4->request;
+    c = r->connection;
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 atom: %*s @%O:%uL",
-                       (size_t) 4, atom_name, mp4->offset, atom_size);
+    ngx_http_set_log_request(c->log, r);
 
-        if (atom_size > (uint64_t) (NGX_MAX_OFF_T_VALUE - mp4->offset)
-            || mp4->offset + (off_t) atom_size > end)
-        {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 atom too large:%uL",
-                          mp4->file.name.data, atom_size);
-            return NGX_ERROR;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http mp4 thread: \"%V?%V\"", &r->uri, &r->args);
 
-        for (n = 0; atom[n].name; n++) {
+    r->main->blocked--;
+    r->aio = 0;
 
-            if (ngx_strncmp(atom_name, atom[n].name, 4) == 0) {
+    rc = NGX_OK;
 
-                ngx_mp4_atom_next(mp4, atom_header_size);
+    if (mp4->moov_read) {
+        size = mp4->moov_read;
+        mp4->moov_read = 0;
 
-                rc = atom[n].handler(mp4, atom_size - atom_header_size);
-                if (rc != NGX_OK) {
-                    return rc;
-                }
+        rc = ngx_http_mp4_read_moov_atom(mp4, size);
+    }
 
-                goto next;
-            }
-        }
+    if (rc == NGX_OK) {
+        rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms,
+                                    mp4->end - mp4->offset);
+    }
 
-        ngx_mp4_atom_next(mp4, atom_size);
+    if (rc == NGX_AGAIN) {
+        return;
+    }
 
-    next:
-        continue;
+    if (rc == NGX_OK) {
+        rc = ngx_http_mp4_update(mp4);
     }
 
-    return NGX_OK;
+    /* mp4 may be freed by ngx_http_mp4_send() */
+
+    of = mp4->of;
+    path = mp4->file.name;
+
+    ngx_http_finalize_request(r, ngx_http_mp4_send(r, mp4, rc, &of, &path));
+
+    ngx_http_run_posted_requests(c);
 }
 
+#endif
+
 
 static ngx_int_t
-ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size)
+ngx_http_mp4_cache_get(ngx_http_mp4_file_t *mp4)
 {
-    ssize_t  n;
+    u_char                     *p;
+    size_t                      size;
+    ngx_buf_t                  *atom;
+    ngx_file_info_t             fi;
+    ngx_http_mp4_conf_t        *conf;
+    ngx_http_mp4_cache_t       *cache;
+    ngx_http_mp4_cache_node_t  *node, *cn;
 
-    if (mp4->buffer_pos + size <= mp4->buffer_end) {
-        return NGX_OK;
-    }
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    if (mp4->offset + (off_t) mp4->buffer_size > mp4->end) {
-        mp4->buffer_size = (size_t) (mp4->end - mp4->offset);
+    if (conf->cache == NULL) {
+        return NGX_DECLINED;
     }
 
-    if (mp4->buffer_size < size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 file truncated", mp4->file.name.data);
+    /* files on different devices may have the same inode number */
+
+    if (ngx_fd_info(mp4->of.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, mp4->file.log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    if (mp4->buffer == NULL) {
-        mp4->buffer = ngx_palloc(mp4->request->pool, mp4->buffer_size);
-        if (mp4->buffer == NULL) {
-            return NGX_ERROR;
-        }
+    mp4->dev = ngx_file_dev(&fi);
 
-        mp4->buffer_start = mp4->buffer;
-    }
+    cache = conf->cache->data;
 
-    n = ngx_read_file(&mp4->file, mp4->buffer_start, mp4->buffer_size,
-                      mp4->offset);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (n == NGX_ERROR) {
-        return NGX_ERROR;
+    node = ngx_http_mp4_cache_lookup(cache, mp4->of.uniq, mp4->dev);
+
+    if (node == NULL) {
+        goto miss;
     }
 
-    if ((size_t) n != mp4->buffer_size) {
-        ngx_log_error(NGX_LOG_CRIT, mp4->file.log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, mp4->buffer_size, mp4->file.name.data);
+    if (node->mtime != mp4->of.mtime || node->size != mp4->of.size) {
+        ngx_http_mp4_cache_delete(cache, node);
+        goto miss;
+    }
+
+    size = (u_char *) (ngx_http_mp4_cache_traks(node) + node->traks)
+           - (u_char *) node;
+
+    cn = ngx_palloc(mp4->request->pool, size);
+    if (cn == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
         return NGX_ERROR;
     }
 
-    mp4->buffer_pos = mp4->buffer_start;
-    mp4->buffer_end = mp4->buffer_start + mp4->buffer_size;
+    ngx_memcpy(cn, node, size);
 
-    return NGX_OK;
-}
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
 
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-static ngx_int_t
-ngx_http_mp4_read_ftyp_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char     *ftyp_atom;
-    size_t      atom_size;
-    ngx_buf_t  *atom;
+    p = cn->data;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ftyp atom");
+    if (cn->ftyp_size) {
+        atom = &mp4->ftyp_atom_buf;
+        atom->temporary = 1;
+        atom->pos = p;
+        atom->last = p + cn->ftyp_size;
 
-    if (atom_data_size > 1024
-        || ngx_mp4_atom_data(mp4) + (size_t) atom_data_size > mp4->buffer_end)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ftyp atom is too large:%uL",
-                      mp4->file.name.data, atom_data_size);
-        return NGX_ERROR;
+        mp4->ftyp_atom.buf = atom;
+        mp4->ftyp_size = cn->ftyp_size;
+        mp4->content_length = cn->ftyp_size;
     }
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    mp4->moov_data_size = cn->moov_data_size;
+    mp4->moov_offset = cn->moov_offset;
+    mp4->mdat_offset = cn->mdat_offset;
+    mp4->mdat_size = cn->mdat_size;
 
-    ftyp_atom = ngx_palloc(mp4->request->pool, atom_size);
-    if (ftyp_atom == NULL) {
-        return NGX_ERROR;
-    }
+    mp4->cached = cn;
 
-    ngx_mp4_set_32value(ftyp_atom, atom_size);
-    ngx_mp4_set_atom_name(ftyp_atom, 'f', 't', 'y', 'p');
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 cache hit, moov size:%uz", mp4->moov_data_size);
 
-    /*
-     * only moov atom content is guaranteed to be in mp4->buffer
-     * during sending response, so ftyp atom content should be copied
-     */
-    ngx_memcpy(ftyp_atom + sizeof(ngx_mp4_atom_header_t),
-               ngx_mp4_atom_data(mp4), (size_t) atom_data_size);
+    return NGX_OK;
 
-    atom = &mp4->ftyp_atom_buf;
-    atom->temporary = 1;
-    atom->pos = ftyp_atom;
-    atom->last = ftyp_atom + atom_size;
+miss:
 
-    mp4->ftyp_atom.buf = atom;
-    mp4->ftyp_size = atom_size;
-    mp4->content_length = atom_size;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 cache miss");
 
-    return NGX_OK;
+    return NGX_DECLINED;
 }
 
 
-/*
- * Small excess buffer to process atoms after moov atom, mp4->buffer_start
- * will be set to this buffer part after moov atom processing.
- */
-#define NGX_HTTP_MP4_MOOV_BUFFER_EXCESS  (4 * 1024)
-
-static ngx_int_t
-ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static void
+ngx_http_mp4_cache_set(ngx_http_mp4_file_t *mp4)
 {
-    ngx_int_t             rc;
-    ngx_uint_t            no_mdat;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_conf_t  *conf;
+    u_char                     *p, *base, *end;
+    size_t                      size;
+    ngx_buf_t                  *b;
+    ngx_uint_t                  i, k;
+    ngx_queue_t                *q;
+    ngx_http_mp4_trak_t        *trak;
+    ngx_http_mp4_conf_t        *conf;
+    ngx_http_mp4_cache_t       *cache;
+    ngx_http_mp4_cache_buf_t   *cb;
+    ngx_http_mp4_cache_trak_t  *ct;
+    ngx_http_mp4_cache_node_t  *node;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom");
+    /*
+     * the parsed trak atoms are cached only if none was skipped
+     * for the requested start time and all their atoms are found
+     * in the moov atom data, the mvhd, tkhd, and mdhd atoms depend
+     * on the start time and are parsed again from their original data
+     */
 
-    no_mdat = (mp4->mdat_atom.buf == NULL);
+    if (mp4->skipped || mp4->mvhd_atom.buf == NULL) {
+        return;
+    }
 
-    if (no_mdat && mp4->start == 0 && mp4->length == 0) {
-        /*
-         * send original file if moov atom resides before
-         * mdat atom and client requests integral file
-         */
-        return NGX_DECLINED;
+    base = mp4->moov_base;
+    end = base + mp4->moov_data_size;
+
+    if (mp4->mvhd_atom_buf.pos < base || mp4->mvhd_atom_buf.last > end) {
+        return;
+    }
+
+    trak = mp4->trak.elts;
+
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        for (k = 0; k < NGX_HTTP_MP4_LAST_ATOM + 1; k++) {
+            b = trak[i].out[k].buf;
+
+            if (b == NULL) {
+                continue;
+            }
+
+            if ((u_char *) b < (u_char *) &trak[i]
+                || (u_char *) b >= (u_char *) &trak[i + 1]
+                || b->pos < base || b->last > end)
+            {
+                return;
+            }
+        }
     }
 
     conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    if (atom_data_size > mp4->buffer_size) {
+    cache = conf->cache->data;
 
-        if (atom_data_size > conf->max_buffer_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 moov atom is too large:%uL, "
-                          "you may want to increase mp4_max_buffer_size",
-                          mp4->file.name.data, atom_data_size);
-            return NGX_ERROR;
+    size = offsetof(ngx_http_mp4_cache_node_t, data)
+           + ngx_align(mp4->ftyp_size + mp4->moov_data_size, NGX_ALIGNMENT)
+           + mp4->trak.nelts * sizeof(ngx_http_mp4_cache_trak_t);
+
+    /* a single file is not allowed to evict more than a half of the zone */
+
+    if (size > cache->shm_zone->shm.size / 2) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 cache: moov is too large:%uz", size);
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_mp4_cache_lookup(cache, mp4->of.uniq, mp4->dev);
+
+    if (node) {
+        ngx_http_mp4_cache_delete(cache, node);
+    }
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+
+        if (node) {
+            break;
         }
 
-        ngx_pfree(mp4->request->pool, mp4->buffer);
-        mp4->buffer = NULL;
-        mp4->buffer_pos = NULL;
-        mp4->buffer_end = NULL;
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
 
-        mp4->buffer_size = (size_t) atom_data_size
-                         + NGX_HTTP_MP4_MOOV_BUFFER_EXCESS * no_mdat;
+        q = ngx_queue_last(&cache->sh->queue);
+
+        ngx_http_mp4_cache_delete(cache,
+                       ngx_queue_data(q, ngx_http_mp4_cache_node_t, queue));
     }
 
-    if (ngx_http_mp4_read(mp4, (size_t) atom_data_size) != NGX_OK) {
-        return NGX_ERROR;
+    node->node.key = (ngx_rbtree_key_t) mp4->of.uniq;
+
+    node->uniq = mp4->of.uniq;
+    node->dev = mp4->dev;
+    node->mtime = mp4->of.mtime;
+    node->size = mp4->of.size;
+    node->moov_offset = mp4->moov_offset;
+    node->mdat_offset = mp4->mdat_offset;
+    node->mdat_size = mp4->mdat_size;
+    node->ftyp_size = mp4->ftyp_size;
+    node->moov_data_size = mp4->moov_data_size;
+    node->mvhd_pos = mp4->mvhd_atom_buf.pos - base;
+    node->mvhd_size = mp4->mvhd_atom_buf.last - mp4->mvhd_atom_buf.pos;
+    node->traks = mp4->trak.nelts;
+
+    p = node->data;
+
+    if (mp4->ftyp_size) {
+        p = ngx_cpymem(p, mp4->ftyp_atom_buf.pos, mp4->ftyp_size);
     }
 
-    mp4->trak.elts = &mp4->traks;
-    mp4->trak.size = sizeof(ngx_http_mp4_trak_t);
-    mp4->trak.nalloc = 2;
-    mp4->trak.pool = mp4->request->pool;
+    ngx_memcpy(p, base, mp4->moov_data_size);
 
-    atom = &mp4->moov_atom_buf;
-    atom->temporary = 1;
-    atom->pos = mp4->moov_atom_header;
-    atom->last = mp4->moov_atom_header + 8;
+    ngx_http_mp4_cache_restore_atom(mp4, p, &mp4->mvhd_atom_buf);
 
-    mp4->moov_atom.buf = &mp4->moov_atom_buf;
+    ct = ngx_http_mp4_cache_traks(node);
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_moov_atoms, atom_data_size);
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        ngx_memcpy(&ct[i].trak, &trak[i], sizeof(ngx_http_mp4_trak_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom done");
+        ngx_http_mp4_cache_restore_atom(mp4, p,
+                                     trak[i].out[NGX_HTTP_MP4_TKHD_ATOM].buf);
+        ngx_http_mp4_cache_restore_atom(mp4, p,
+                                     trak[i].out[NGX_HTTP_MP4_MDHD_ATOM].buf);
 
-    if (no_mdat) {
-        mp4->buffer_start = mp4->buffer_pos;
-        mp4->buffer_size = NGX_HTTP_MP4_MOOV_BUFFER_EXCESS;
+        for (k = 0; k < NGX_HTTP_MP4_LAST_ATOM + 1; k++) {
+            b = trak[i].out[k].buf;
+            cb = &ct[i].bufs[k];
 
-        if (mp4->buffer_start + mp4->buffer_size > mp4->buffer_end) {
-            mp4->buffer = NULL;
-            mp4->buffer_pos = NULL;
-            mp4->buffer_end = NULL;
+            if (b == NULL) {
+                cb->buf = 0;
+                continue;
+            }
+
+            cb->buf = (u_char *) b - (u_char *) &trak[i];
+            cb->pos = b->pos - base;
+            cb->last = b->last - base;
+
+            /* no pointers to the request memory are kept */
+
+            b = (ngx_buf_t *) ((u_char *) &ct[i].trak + cb->buf);
+            b->pos = NULL;
+            b->last = NULL;
+
+            ct[i].trak.out[k].buf = NULL;
         }
+    }
 
-    } else {
-        /* skip atoms after moov atom */
-        mp4->offset = mp4->end;
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 cache set, moov size:%uz, traks:%ui",
+                   mp4->moov_data_size, mp4->trak.nelts);
+}
+
+
+static void
+ngx_http_mp4_cache_restore_atom(ngx_http_mp4_file_t *mp4, u_char *p,
+    ngx_buf_t *atom)
+{
+    size_t  pos;
+
+    if (atom == NULL) {
+        return;
     }
 
-    return rc;
+    pos = atom->pos - mp4->moov_base;
+
+    ngx_memcpy(p + pos, mp4->moov_data + pos, atom->last - atom->pos);
 }
 
 
-static ngx_int_t
-ngx_http_mp4_read_mdat_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static ngx_http_mp4_cache_node_t *
+ngx_http_mp4_cache_lookup(ngx_http_mp4_cache_t *cache, ngx_file_uniq_t uniq,
+    ngx_file_dev_t dev)
 {
-    ngx_buf_t  *data;
+    ngx_rbtree_key_t            key;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_mp4_cache_node_t  *cn;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdat atom");
+    key = (ngx_rbtree_key_t) uniq;
 
-    data = &mp4->mdat_data_buf;
-    data->file = &mp4->file;
-    data->in_file = 1;
-    data->last_buf = 1;
-    data->last_in_chain = 1;
-    data->file_last = mp4->offset + atom_data_size;
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
 
-    mp4->mdat_atom.buf = &mp4->mdat_atom_buf;
-    mp4->mdat_atom.next = &mp4->mdat_data;
-    mp4->mdat_data.buf = data;
+    while (node != sentinel) {
 
-    if (mp4->trak.nelts) {
-        /* skip atoms after mdat atom */
-        mp4->offset = mp4->end;
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
 
-    } else {
-        ngx_mp4_atom_next(mp4, atom_data_size);
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* key == node->key */
+
+        cn = (ngx_http_mp4_cache_node_t *) node;
+
+        if (cn->uniq == uniq && cn->dev == dev) {
+            return cn;
+        }
+
+        node = node->right;
     }
 
-    return NGX_OK;
+    return NULL;
 }
 
 
-static size_t
-ngx_http_mp4_update_mdat_atom(ngx_http_mp4_file_t *mp4, off_t start_offset,
-    off_t end_offset)
+static void
+ngx_http_mp4_cache_delete(ngx_http_mp4_cache_t *cache,
+    ngx_http_mp4_cache_node_t *node)
 {
-    off_t       atom_data_size;
-    u_char     *atom_header;
-    uint32_t    atom_header_size;
-    uint64_t    atom_size;
-    ngx_buf_t  *atom;
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
 
-    atom_data_size = end_offset - start_offset;
-    mp4->mdat_data.buf->file_pos = start_offset;
-    mp4->mdat_data.buf->file_last = end_offset;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdat new offset @%O:%O", start_offset, atom_data_size);
+static ngx_int_t
+ngx_http_mp4_hls_arg(ngx_http_mp4_file_t *mp4, ngx_str_t *value)
+{
+    u_char     *last;
+    ngx_int_t   n;
 
-    atom_header = mp4->mdat_atom_header;
+    last = value->data + value->len;
 
-    if ((uint64_t) atom_data_size > (uint64_t) 0xffffffff) {
-        atom_size = 1;
-        atom_header_size = sizeof(ngx_mp4_atom_header64_t);
-        ngx_mp4_set_64value(atom_header + sizeof(ngx_mp4_atom_header_t),
-                            sizeof(ngx_mp4_atom_header64_t) + atom_data_size);
-    } else {
-        atom_size = sizeof(ngx_mp4_atom_header_t) + atom_data_size;
-        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+    if (value->len > 5 && ngx_strncmp(last - 5, ".m3u8", 5) == 0) {
+        mp4->hls = NGX_HTTP_MP4_HLS_PLAYLIST;
+        return NGX_OK;
     }
 
-    mp4->content_length += atom_header_size + atom_data_size;
-
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'a', 't');
+    if (value->len == 8 && ngx_strncmp(value->data, "init.mp4", 8) == 0) {
+        mp4->hls = NGX_HTTP_MP4_HLS_INIT;
+        return NGX_OK;
+    }
 
-    atom = &mp4->mdat_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_header_size;
+    if (value->len > 4 && ngx_strncmp(last - 4, ".m4s", 4) == 0) {
+        n = ngx_atoi(value->data, value->len - 4);
 
-    return atom_header_size;
-}
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
+        mp4->hls = NGX_HTTP_MP4_HLS_SEGMENT;
+        mp4->segment = n;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    timescale[4];
-    u_char    duration[4];
-    u_char    rate[4];
-    u_char    volume[2];
-    u_char    reserved[10];
-    u_char    matrix[36];
-    u_char    preview_time[4];
-    u_char    preview_duration[4];
-    u_char    poster_time[4];
-    u_char    selection_time[4];
-    u_char    selection_duration[4];
-    u_char    current_time[4];
-    u_char    next_track_id[4];
-} ngx_mp4_mvhd_atom_t;
+        return NGX_OK;
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    timescale[4];
-    u_char    duration[8];
-    u_char    rate[4];
-    u_char    volume[2];
-    u_char    reserved[10];
-    u_char    matrix[36];
-    u_char    preview_time[4];
-    u_char    preview_duration[4];
-    u_char    poster_time[4];
-    u_char    selection_time[4];
-    u_char    selection_duration[4];
-    u_char    current_time[4];
-    u_char    next_track_id[4];
-} ngx_mp4_mvhd64_atom_t;
+    return NGX_ERROR;
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_mvhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_cached(ngx_http_mp4_file_t *mp4)
 {
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint32_t                timescale;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_mp4_mvhd_atom_t    *mvhd_atom;
-    ngx_mp4_mvhd64_atom_t  *mvhd64_atom;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mvhd atom");
+    u_char                     *base;
+    ngx_int_t                   rc;
+    ngx_uint_t                  i, k;
+    ngx_buf_t                  *b;
+    ngx_http_mp4_trak_t        *trak;
+    ngx_http_mp4_cache_buf_t   *cb;
+    ngx_http_mp4_cache_trak_t  *ct;
+    ngx_http_mp4_cache_node_t  *cn;
+
+    if (mp4->moov_offset < mp4->mdat_offset
+        && mp4->start == 0 && mp4->length == 0 && !mp4->hls)
+    {
+        /* the same as in ngx_http_mp4_read_moov_atom() */
+        return NGX_DECLINED;
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    mvhd_atom = (ngx_mp4_mvhd_atom_t *) atom_header;
-    mvhd64_atom = (ngx_mp4_mvhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(atom_header, 'm', 'v', 'h', 'd');
+    cn = mp4->cached;
+    base = cn->data + cn->ftyp_size;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_mvhd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 mvhd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    /*
+     * the cached moov atom data is processed in memory, ngx_http_mp4_read()
+     * never reads the file as the whole atom is already in the buffer
+     */
 
-    if (mvhd_atom->version[0] == 0) {
-        /* version 0: 32-bit duration */
-        timescale = ngx_mp4_get_32value(mvhd_atom->timescale);
-        duration = ngx_mp4_get_32value(mvhd_atom->duration);
+    mp4->buffer = base;
+    mp4->buffer_start = mp4->buffer;
+    mp4->buffer_pos = mp4->buffer;
+    mp4->buffer_end = mp4->buffer + mp4->moov_data_size;
+    mp4->buffer_size = mp4->moov_data_size;
+    mp4->offset = mp4->moov_offset;
 
-    } else {
-        /* version 1: 64-bit duration */
+    ngx_http_mp4_init_moov_atom(mp4);
 
-        if (ngx_mp4_atom_data_size(ngx_mp4_mvhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 mvhd atom too small",
-                          mp4->file.name.data);
+    if (cn->traks > 2) {
+        mp4->trak.elts = ngx_palloc(mp4->request->pool,
+                                    cn->traks * sizeof(ngx_http_mp4_trak_t));
+        if (mp4->trak.elts == NULL) {
             return NGX_ERROR;
         }
 
-        timescale = ngx_mp4_get_32value(mvhd64_atom->timescale);
-        duration = ngx_mp4_get_64value(mvhd64_atom->duration);
+        mp4->trak.nalloc = cn->traks;
     }
 
-    mp4->timescale = timescale;
-
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mvhd timescale:%uD, duration:%uL, time:%.3fs",
-                   timescale, duration, (double) duration / timescale);
+    /* only the atoms depending on the start time are parsed again */
 
-    start_time = (uint64_t) mp4->start * timescale / 1000;
+    mp4->buffer_pos = base + cn->mvhd_pos + 8;
 
-    if (duration < start_time) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 start time exceeds file duration",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    rc = ngx_http_mp4_read_mvhd_atom(mp4, cn->mvhd_size - 8);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    duration -= start_time;
+    ct = ngx_http_mp4_cache_traks(cn);
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * timescale / 1000;
+    for (i = 0; i < cn->traks; i++) {
 
-        if (duration > length_time) {
-            duration = length_time;
+        trak = ngx_array_push(&mp4->trak);
+        if (trak == NULL) {
+            return NGX_ERROR;
         }
-    }
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mvhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / timescale);
-
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(mvhd_atom->size, atom_size);
-
-    if (mvhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(mvhd_atom->duration, duration);
-
-    } else {
-        ngx_mp4_set_64value(mvhd64_atom->duration, duration);
-    }
-
-    atom = &mp4->mvhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
-
-    mp4->mvhd_atom.buf = atom;
-
-    ngx_mp4_atom_next(mp4, atom_data_size);
-
-    return NGX_OK;
-}
-
 
-static ngx_int_t
-ngx_http_mp4_read_trak_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_end;
-    off_t                 atom_file_end;
-    ngx_int_t             rc;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+        ngx_memcpy(trak, &ct[i].trak, sizeof(ngx_http_mp4_trak_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 trak atom");
-
-    trak = ngx_array_push(&mp4->trak);
-    if (trak == NULL) {
-        return NGX_ERROR;
-    }
-
-    ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+        for (k = 0; k < NGX_HTTP_MP4_LAST_ATOM + 1; k++) {
+            cb = &ct[i].bufs[k];
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 't', 'r', 'a', 'k');
+            if (cb->buf == 0) {
+                continue;
+            }
 
-    atom = &trak->trak_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+            b = (ngx_buf_t *) ((u_char *) trak + cb->buf);
+            b->pos = base + cb->pos;
+            b->last = base + cb->last;
 
-    trak->out[NGX_HTTP_MP4_TRAK_ATOM].buf = atom;
+            trak->out[k].buf = b;
+        }
 
-    atom_end = mp4->buffer_pos + (size_t) atom_data_size;
-    atom_file_end = mp4->offset + atom_data_size;
+        rc = ngx_http_mp4_read_cached_atom(mp4, &ct[i].bufs[0],
+                                           NGX_HTTP_MP4_TKHD_ATOM,
+                                           ngx_http_mp4_read_tkhd_atom);
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_trak_atoms, atom_data_size);
+        if (rc == NGX_OK) {
+            rc = ngx_http_mp4_read_cached_atom(mp4, &ct[i].bufs[0],
+                                               NGX_HTTP_MP4_MDHD_ATOM,
+                                               ngx_http_mp4_read_mdhd_atom);
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 trak atom: %i", rc);
+        if (rc == NGX_DECLINED) {
+            /* skip this trak */
+            ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+            mp4->trak.nelts--;
+            continue;
+        }
 
-    if (rc == NGX_DECLINED) {
-        /* skip this trak */
-        ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
-        mp4->trak.nelts--;
-        mp4->buffer_pos = atom_end;
-        mp4->offset = atom_file_end;
-        return NGX_OK;
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    return rc;
-}
-
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom done");
 
-static void
-ngx_http_mp4_update_trak_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+    mp4->offset = mp4->mdat_offset;
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->trak_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
+    return ngx_http_mp4_read_mdat_atom(mp4, mp4->mdat_size);
 }
 
 
 static ngx_int_t
-ngx_http_mp4_read_cmov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_cached_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_cache_buf_t *bufs, ngx_uint_t n,
+    ngx_int_t (*handler)(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size))
 {
-    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                  "\"%s\" mp4 compressed moov atom (cmov) is not supported",
-                  mp4->file.name.data);
+    if (bufs[n].buf == 0) {
+        return NGX_OK;
+    }
 
-    return NGX_ERROR;
+    mp4->buffer_pos = mp4->buffer + bufs[n].pos + 8;
+
+    return handler(mp4, bufs[n].last - bufs[n].pos - 8);
 }
 
 
 typedef struct {
     u_char    size[4];
     u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    track_id[4];
-    u_char    reserved1[4];
-    u_char    duration[4];
-    u_char    reserved2[8];
-    u_char    layer[2];
-    u_char    group[2];
-    u_char    volume[2];
-    u_char    reserved3[2];
-    u_char    matrix[36];
-    u_char    width[4];
-    u_char    height[4];
-} ngx_mp4_tkhd_atom_t;
+} ngx_mp4_atom_header_t;
 
 typedef struct {
     u_char    size[4];
     u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    track_id[4];
-    u_char    reserved1[4];
-    u_char    duration[8];
-    u_char    reserved2[8];
-    u_char    layer[2];
-    u_char    group[2];
-    u_char    volume[2];
-    u_char    reserved3[2];
-    u_char    matrix[36];
-    u_char    width[4];
-    u_char    height[4];
-} ngx_mp4_tkhd64_atom_t;
+    u_char    size64[8];
+} ngx_mp4_atom_header64_t;
 
 
 static ngx_int_t
-ngx_http_mp4_read_tkhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size)
 {
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_http_mp4_trak_t    *trak;
-    ngx_mp4_tkhd_atom_t    *tkhd_atom;
-    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 tkhd atom");
+    off_t        end;
+    size_t       atom_header_size;
+    u_char      *atom_header, *atom_name;
+    uint64_t     atom_size;
+    ngx_int_t    rc;
+    ngx_uint_t   n;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    tkhd_atom = (ngx_mp4_tkhd_atom_t *) atom_header;
-    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(tkhd_atom, 't', 'k', 'h', 'd');
+    end = mp4->offset + atom_data_size;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_tkhd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 tkhd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    while (mp4->offset < end) {
 
-    if (tkhd_atom->version[0] == 0) {
-        /* version 0: 32-bit duration */
-        duration = ngx_mp4_get_32value(tkhd_atom->duration);
+        rc = ngx_http_mp4_read(mp4, sizeof(uint32_t));
+        if (rc != NGX_OK) {
+            return rc;
+        }
 
-    } else {
-        /* version 1: 64-bit duration */
+        atom_header = mp4->buffer_pos;
+        atom_size = ngx_mp4_get_32value(atom_header);
+        atom_header_size = sizeof(ngx_mp4_atom_header_t);
 
-        if (ngx_mp4_atom_data_size(ngx_mp4_tkhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 tkhd atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        if (atom_size == 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "mp4 atom end");
+            return NGX_OK;
         }
 
-        duration = ngx_mp4_get_64value(tkhd64_atom->duration);
-    }
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "tkhd duration:%uL, time:%.3fs",
-                   duration, (double) duration / mp4->timescale);
+        if (atom_size < sizeof(ngx_mp4_atom_header_t)) {
 
-    start_time = (uint64_t) mp4->start * mp4->timescale / 1000;
+            if (atom_size == 1) {
 
-    if (duration <= start_time) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "tkhd duration is less than start time");
-        return NGX_DECLINED;
-    }
+                rc = ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header64_t));
+                if (rc != NGX_OK) {
+                    return rc;
+                }
 
-    duration -= start_time;
+                /* 64-bit atom size */
+                atom_header = mp4->buffer_pos;
+                atom_size = ngx_mp4_get_64value(atom_header + 8);
+                atom_header_size = sizeof(ngx_mp4_atom_header64_t);
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * mp4->timescale / 1000;
+            } else {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "\"%s\" mp4 atom is too small:%uL",
+                              mp4->file.name.data, atom_size);
+                return NGX_ERROR;
+            }
+        }
 
-        if (duration > length_time) {
-            duration = length_time;
+        rc = ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header_t));
+        if (rc != NGX_OK) {
+            return rc;
         }
-    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "tkhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / mp4->timescale);
+        atom_header = mp4->buffer_pos;
+        atom_name = atom_header + sizeof(uint32_t);
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 atom: %*s @%O:%uL",
+                       (size_t) 4, atom_name, mp4->offset, atom_size);
 
-    trak = ngx_mp4_last_trak(mp4);
-    trak->tkhd_size = atom_size;
+        if (atom_size > (uint64_t) (NGX_MAX_OFF_T_VALUE - mp4->offset)
+            || mp4->offset + (off_t) atom_size > end)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 atom too large:%uL",
+                          mp4->file.name.data, atom_size);
+            return NGX_ERROR;
+        }
 
-    ngx_mp4_set_32value(tkhd_atom->size, atom_size);
+        for (n = 0; atom[n].name; n++) {
 
-    if (tkhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(tkhd_atom->duration, duration);
+            if (ngx_strncmp(atom_name, atom[n].name, 4) == 0) {
 
-    } else {
-        ngx_mp4_set_64value(tkhd64_atom->duration, duration);
-    }
+                ngx_mp4_atom_next(mp4, atom_header_size);
 
-    atom = &trak->tkhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+                rc = atom[n].handler(mp4, atom_size - atom_header_size);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
 
-    trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf = atom;
+                goto next;
+            }
+        }
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        ngx_mp4_atom_next(mp4, atom_size);
+
+    next:
+        continue;
+    }
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_mp4_read_mdia_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size)
 {
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process mdia atom");
-
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'i', 'a');
-
-    trak = ngx_mp4_last_trak(mp4);
-
-    atom = &trak->mdia_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
-
-    trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf = atom;
-
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_mdia_atoms, atom_data_size);
-}
-
+    ssize_t  n;
 
-static void
-ngx_http_mp4_update_mdia_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+    if (mp4->buffer_pos + size <= mp4->buffer_end) {
+        return NGX_OK;
+    }
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->mdia_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
-}
+    if (mp4->offset + (off_t) mp4->buffer_size > mp4->end) {
+        mp4->buffer_size = (size_t) (mp4->end - mp4->offset);
+    }
 
+    if (mp4->buffer_size < size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 file truncated", mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    timescale[4];
-    u_char    duration[4];
-    u_char    language[2];
-    u_char    quality[2];
-} ngx_mp4_mdhd_atom_t;
+    if (mp4->buffer == NULL) {
+        mp4->buffer = ngx_palloc(mp4->request->pool, mp4->buffer_size);
+        if (mp4->buffer == NULL) {
+            return NGX_ERROR;
+        }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    timescale[4];
-    u_char    duration[8];
-    u_char    language[2];
-    u_char    quality[2];
-} ngx_mp4_mdhd64_atom_t;
+        mp4->buffer_start = mp4->buffer;
+    }
 
+#if (NGX_THREADS)
 
-static ngx_int_t
-ngx_http_mp4_read_mdhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint32_t                timescale;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_http_mp4_trak_t    *trak;
-    ngx_mp4_mdhd_atom_t    *mdhd_atom;
-    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
+    if (mp4->file.thread_handler) {
+        n = ngx_thread_read(&mp4->file, mp4->buffer_start, mp4->buffer_size,
+                            mp4->offset, mp4->request->pool);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdhd atom");
+        if (n == NGX_AGAIN) {
+            /* the buffer is being read, it is called again after the read */
+            mp4->buffer_pos = NULL;
+            mp4->buffer_end = NULL;
+            return NGX_AGAIN;
+        }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom_header;
-    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(mdhd_atom, 'm', 'd', 'h', 'd');
+    } else
+#endif
+    {
+        n = ngx_read_file(&mp4->file, mp4->buffer_start, mp4->buffer_size,
+                          mp4->offset);
+    }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_mdhd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 mdhd atom too small", mp4->file.name.data);
+    if (n == NGX_ERROR) {
         return NGX_ERROR;
     }
 
-    if (mdhd_atom->version[0] == 0) {
-        /* version 0: everything is 32-bit */
-        timescale = ngx_mp4_get_32value(mdhd_atom->timescale);
-        duration = ngx_mp4_get_32value(mdhd_atom->duration);
-
-    } else {
-        /* version 1: 64-bit duration and 32-bit timescale */
-
-        if (ngx_mp4_atom_data_size(ngx_mp4_mdhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 mdhd atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
-
-        timescale = ngx_mp4_get_32value(mdhd64_atom->timescale);
-        duration = ngx_mp4_get_64value(mdhd64_atom->duration);
+    if ((size_t) n != mp4->buffer_size) {
+        ngx_log_error(NGX_LOG_CRIT, mp4->file.log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, mp4->buffer_size, mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdhd timescale:%uD, duration:%uL, time:%.3fs",
-                   timescale, duration, (double) duration / timescale);
+    mp4->buffer_pos = mp4->buffer_start;
+    mp4->buffer_end = mp4->buffer_start + mp4->buffer_size;
 
-    start_time = (uint64_t) mp4->start * timescale / 1000;
+    return NGX_OK;
+}
 
-    if (duration <= start_time) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mdhd duration is less than start time");
-        return NGX_DECLINED;
-    }
 
-    duration -= start_time;
+static ngx_int_t
+ngx_http_mp4_read_ftyp_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char     *ftyp_atom;
+    size_t      atom_size;
+    ngx_buf_t  *atom;
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * timescale / 1000;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ftyp atom");
 
-        if (duration > length_time) {
-            duration = length_time;
-        }
+    if (atom_data_size > 1024
+        || ngx_mp4_atom_data(mp4) + (size_t) atom_data_size > mp4->buffer_end)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ftyp atom is too large:%uL",
+                      mp4->file.name.data, atom_data_size);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / timescale);
-
     atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
 
-    trak = ngx_mp4_last_trak(mp4);
-    trak->mdhd_size = atom_size;
-    trak->timescale = timescale;
-
-    ngx_mp4_set_32value(mdhd_atom->size, atom_size);
+    ftyp_atom = ngx_palloc(mp4->request->pool, atom_size);
+    if (ftyp_atom == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (mdhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(mdhd_atom->duration, duration);
+    ngx_mp4_set_32value(ftyp_atom, atom_size);
+    ngx_mp4_set_atom_name(ftyp_atom, 'f', 't', 'y', 'p');
 
-    } else {
-        ngx_mp4_set_64value(mdhd64_atom->duration, duration);
-    }
+    /*
+     * only moov atom content is guaranteed to be in mp4->buffer
+     * during sending response, so ftyp atom content should be copied
+     */
+    ngx_memcpy(ftyp_atom + sizeof(ngx_mp4_atom_header_t),
+               ngx_mp4_atom_data(mp4), (size_t) atom_data_size);
 
-    atom = &trak->mdhd_atom_buf;
+    atom = &mp4->ftyp_atom_buf;
     atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    atom->pos = ftyp_atom;
+    atom->last = ftyp_atom + atom_size;
 
-    trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf = atom;
+    mp4->ftyp_atom.buf = atom;
+    mp4->ftyp_size = atom_size;
+    mp4->content_length = atom_size;
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -1716,204 +1970,227 @@ ngx_http_mp4_read_mdhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 }
 
 
+/*
+ * Small excess buffer to process atoms after moov atom, mp4->buffer_start
+ * will be set to this buffer part after moov atom processing.
+ */
+#define NGX_HTTP_MP4_MOOV_BUFFER_EXCESS  (4 * 1024)
+
 static ngx_int_t
-ngx_http_mp4_read_hdlr_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    ngx_int_t             rc;
+    ngx_uint_t            no_mdat;
+    ngx_http_mp4_conf_t  *conf;
+#if (NGX_THREADS)
+    ngx_uint_t            threads;
+#endif
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 hdlr atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom");
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'h', 'd', 'l', 'r');
+    no_mdat = (mp4->mdat_atom.buf == NULL);
 
-    trak = ngx_mp4_last_trak(mp4);
+    if (no_mdat && mp4->start == 0 && mp4->length == 0 && !mp4->hls) {
+        /*
+         * send original file if moov atom resides before
+         * mdat atom and client requests integral file
+         */
+        return NGX_DECLINED;
+    }
 
-    atom = &trak->hdlr_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    trak->hdlr_size = atom_size;
-    trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf = atom;
+    if (atom_data_size > mp4->buffer_size) {
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        if (atom_data_size > conf->max_buffer_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 moov atom is too large:%uL, "
+                          "you may want to increase mp4_max_buffer_size",
+                          mp4->file.name.data, atom_data_size);
+            return NGX_ERROR;
+        }
 
-    return NGX_OK;
-}
+        ngx_pfree(mp4->request->pool, mp4->buffer);
+        mp4->buffer = NULL;
+        mp4->buffer_pos = NULL;
+        mp4->buffer_end = NULL;
 
+        mp4->buffer_size = (size_t) atom_data_size
+                         + NGX_HTTP_MP4_MOOV_BUFFER_EXCESS * no_mdat;
+    }
 
-static ngx_int_t
-ngx_http_mp4_read_minf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    rc = ngx_http_mp4_read(mp4, (size_t) atom_data_size);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process minf atom");
+    if (rc != NGX_OK) {
+#if (NGX_THREADS)
+        if (rc == NGX_AGAIN) {
+            mp4->moov_read = atom_data_size;
+        }
+#endif
+        return rc;
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'i', 'n', 'f');
+    if (conf->cache) {
 
-    trak = ngx_mp4_last_trak(mp4);
+        /*
+         * atoms are partially rewritten during processing,
+         * so the original moov atom data is kept to be cached
+         */
 
-    atom = &trak->minf_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+        mp4->moov_data = ngx_pnalloc(mp4->request->pool,
+                                     (size_t) atom_data_size);
+        if (mp4->moov_data == NULL) {
+            return NGX_ERROR;
+        }
 
-    trak->out[NGX_HTTP_MP4_MINF_ATOM].buf = atom;
+        ngx_memcpy(mp4->moov_data, ngx_mp4_atom_data(mp4),
+                   (size_t) atom_data_size);
 
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_minf_atoms, atom_data_size);
-}
+        mp4->moov_base = ngx_mp4_atom_data(mp4);
+        mp4->moov_data_size = (size_t) atom_data_size;
+        mp4->moov_offset = mp4->offset;
+    }
 
+#if (NGX_THREADS)
+    /* the atoms inside are in the buffer, the moov atom is parsed in place */
+    threads = (mp4->file.thread_handler != NULL);
+    mp4->file.thread_handler = NULL;
+#endif
 
-static void
-ngx_http_mp4_update_minf_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+    rc = ngx_http_mp4_parse_moov_atom(mp4, atom_data_size);
 
-    trak->size += sizeof(ngx_mp4_atom_header_t)
-               + trak->vmhd_size
-               + trak->smhd_size
-               + trak->dinf_size;
-    atom = &trak->minf_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
-}
+#if (NGX_THREADS)
+    if (threads) {
+        mp4->file.thread_handler = ngx_http_mp4_thread_handler;
+    }
+#endif
 
+    if (no_mdat) {
+        mp4->buffer_start = mp4->buffer_pos;
+        mp4->buffer_size = NGX_HTTP_MP4_MOOV_BUFFER_EXCESS;
 
-static ngx_int_t
-ngx_http_mp4_read_vmhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+        if (mp4->buffer_start + mp4->buffer_size > mp4->buffer_end) {
+            mp4->buffer = NULL;
+            mp4->buffer_pos = NULL;
+            mp4->buffer_end = NULL;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 vmhd atom");
+    } else {
+        /* skip atoms after moov atom */
+        mp4->offset = mp4->end;
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'v', 'm', 'h', 'd');
+    return rc;
+}
 
-    trak = ngx_mp4_last_trak(mp4);
 
-    atom = &trak->vmhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+static ngx_int_t
+ngx_http_mp4_parse_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    ngx_int_t  rc;
 
-    trak->vmhd_size += atom_size;
-    trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf = atom;
+    ngx_http_mp4_init_moov_atom(mp4);
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_moov_atoms, atom_data_size);
 
-    return NGX_OK;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom done");
+
+    return rc;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_read_smhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static void
+ngx_http_mp4_init_moov_atom(ngx_http_mp4_file_t *mp4)
 {
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 smhd atom");
-
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 's', 'm', 'h', 'd');
+    ngx_buf_t  *atom;
 
-    trak = ngx_mp4_last_trak(mp4);
+    mp4->trak.elts = &mp4->traks;
+    mp4->trak.size = sizeof(ngx_http_mp4_trak_t);
+    mp4->trak.nalloc = 2;
+    mp4->trak.pool = mp4->request->pool;
 
-    atom = &trak->smhd_atom_buf;
+    atom = &mp4->moov_atom_buf;
     atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
-
-    trak->smhd_size += atom_size;
-    trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf = atom;
-
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    atom->pos = mp4->moov_atom_header;
+    atom->last = mp4->moov_atom_header + 8;
 
-    return NGX_OK;
+    mp4->moov_atom.buf = &mp4->moov_atom_buf;
 }
 
 
 static ngx_int_t
-ngx_http_mp4_read_dinf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_mdat_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    ngx_buf_t  *data;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 dinf atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdat atom");
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'd', 'i', 'n', 'f');
+    data = &mp4->mdat_data_buf;
+    data->file = &mp4->file;
+    data->in_file = 1;
+    data->last_buf = 1;
+    data->last_in_chain = 1;
+    data->file_last = mp4->offset + atom_data_size;
 
-    trak = ngx_mp4_last_trak(mp4);
+    mp4->mdat_atom.buf = &mp4->mdat_atom_buf;
+    mp4->mdat_atom.next = &mp4->mdat_data;
+    mp4->mdat_data.buf = data;
 
-    atom = &trak->dinf_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    mp4->mdat_offset = mp4->offset;
+    mp4->mdat_size = atom_data_size;
 
-    trak->dinf_size += atom_size;
-    trak->out[NGX_HTTP_MP4_DINF_ATOM].buf = atom;
+    if (mp4->trak.nelts) {
+        /* skip atoms after mdat atom */
+        mp4->offset = mp4->end;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    } else {
+        ngx_mp4_atom_next(mp4, atom_data_size);
+    }
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_read_stbl_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static size_t
+ngx_http_mp4_update_mdat_atom(ngx_http_mp4_file_t *mp4, off_t start_offset,
+    off_t end_offset)
 {
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process stbl atom");
+    off_t       atom_data_size;
+    u_char     *atom_header;
+    uint32_t    atom_header_size;
+    uint64_t    atom_size;
+    ngx_buf_t  *atom;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 's', 't', 'b', 'l');
+    atom_data_size = end_offset - start_offset;
+    mp4->mdat_data.buf->file_pos = start_offset;
+    mp4->mdat_data.buf->file_last = end_offset;
 
-    trak = ngx_mp4_last_trak(mp4);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdat new offset @%O:%O", start_offset, atom_data_size);
 
-    atom = &trak->stbl_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+    atom_header = mp4->mdat_atom_header;
 
-    trak->out[NGX_HTTP_MP4_STBL_ATOM].buf = atom;
+    if ((uint64_t) atom_data_size > (uint64_t) 0xffffffff) {
+        atom_size = 1;
+        atom_header_size = sizeof(ngx_mp4_atom_header64_t);
+        ngx_mp4_set_64value(atom_header + sizeof(ngx_mp4_atom_header_t),
+                            sizeof(ngx_mp4_atom_header64_t) + atom_data_size);
+    } else {
+        atom_size = sizeof(ngx_mp4_atom_header_t) + atom_data_size;
+        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+    }
 
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_stbl_atoms, atom_data_size);
-}
+    mp4->content_length += atom_header_size + atom_data_size;
 
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'a', 't');
 
-static void
-ngx_http_mp4_update_stbl_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+    atom = &mp4->mdat_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_header_size;
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->stbl_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
+    return atom_header_size;
 }
 
 
@@ -1922,55 +2199,1717 @@ typedef struct {
     u_char    name[4];
     u_char    version[1];
     u_char    flags[3];
-    u_char    entries[4];
-
-    u_char    media_size[4];
-    u_char    media_name[4];
-} ngx_mp4_stsd_atom_t;
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    timescale[4];
+    u_char    duration[4];
+    u_char    rate[4];
+    u_char    volume[2];
+    u_char    reserved[10];
+    u_char    matrix[36];
+    u_char    preview_time[4];
+    u_char    preview_duration[4];
+    u_char    poster_time[4];
+    u_char    selection_time[4];
+    u_char    selection_duration[4];
+    u_char    current_time[4];
+    u_char    next_track_id[4];
+} ngx_mp4_mvhd_atom_t;
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    timescale[4];
+    u_char    duration[8];
+    u_char    rate[4];
+    u_char    volume[2];
+    u_char    reserved[10];
+    u_char    matrix[36];
+    u_char    preview_time[4];
+    u_char    preview_duration[4];
+    u_char    poster_time[4];
+    u_char    selection_time[4];
+    u_char    selection_duration[4];
+    u_char    current_time[4];
+    u_char    next_track_id[4];
+} ngx_mp4_mvhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_mvhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint32_t                timescale;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_mp4_mvhd_atom_t    *mvhd_atom;
+    ngx_mp4_mvhd64_atom_t  *mvhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mvhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    mvhd_atom = (ngx_mp4_mvhd_atom_t *) atom_header;
+    mvhd64_atom = (ngx_mp4_mvhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(atom_header, 'm', 'v', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_mvhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 mvhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mvhd_atom->version[0] == 0) {
+        /* version 0: 32-bit duration */
+        timescale = ngx_mp4_get_32value(mvhd_atom->timescale);
+        duration = ngx_mp4_get_32value(mvhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_mvhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 mvhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        timescale = ngx_mp4_get_32value(mvhd64_atom->timescale);
+        duration = ngx_mp4_get_64value(mvhd64_atom->duration);
+    }
+
+    mp4->timescale = timescale;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mvhd timescale:%uD, duration:%uL, time:%.3fs",
+                   timescale, duration, (double) duration / timescale);
+
+    start_time = (uint64_t) mp4->start * timescale / 1000;
+
+    if (duration < start_time) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 start time exceeds file duration",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mvhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(mvhd_atom->size, atom_size);
+
+    if (mvhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(mvhd_atom->duration, duration);
+
+    } else {
+        ngx_mp4_set_64value(mvhd64_atom->duration, duration);
+    }
+
+    atom = &mp4->mvhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    mp4->mvhd_atom.buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_trak_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_end;
+    off_t                 atom_file_end;
+    ngx_int_t             rc;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 trak atom");
+
+    trak = ngx_array_push(&mp4->trak);
+    if (trak == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 't', 'r', 'a', 'k');
+
+    atom = &trak->trak_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_TRAK_ATOM].buf = atom;
+
+    atom_end = mp4->buffer_pos + (size_t) atom_data_size;
+    atom_file_end = mp4->offset + atom_data_size;
+
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_trak_atoms, atom_data_size);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 trak atom: %i", rc);
+
+    if (rc == NGX_DECLINED) {
+        /* skip this trak */
+        ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+        mp4->trak.nelts--;
+        mp4->skipped++;
+        mp4->buffer_pos = atom_end;
+        mp4->offset = atom_file_end;
+        return NGX_OK;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_mp4_update_trak_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->trak_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_cmov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 compressed moov atom (cmov) is not supported",
+                  mp4->file.name.data);
+
+    return NGX_ERROR;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    track_id[4];
+    u_char    reserved1[4];
+    u_char    duration[4];
+    u_char    reserved2[8];
+    u_char    layer[2];
+    u_char    group[2];
+    u_char    volume[2];
+    u_char    reserved3[2];
+    u_char    matrix[36];
+    u_char    width[4];
+    u_char    height[4];
+} ngx_mp4_tkhd_atom_t;
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    track_id[4];
+    u_char    reserved1[4];
+    u_char    duration[8];
+    u_char    reserved2[8];
+    u_char    layer[2];
+    u_char    group[2];
+    u_char    volume[2];
+    u_char    reserved3[2];
+    u_char    matrix[36];
+    u_char    width[4];
+    u_char    height[4];
+} ngx_mp4_tkhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_tkhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_http_mp4_trak_t    *trak;
+    ngx_mp4_tkhd_atom_t    *tkhd_atom;
+    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 tkhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    tkhd_atom = (ngx_mp4_tkhd_atom_t *) atom_header;
+    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(tkhd_atom, 't', 'k', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_tkhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 tkhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (tkhd_atom->version[0] == 0) {
+        /* version 0: 32-bit duration */
+        duration = ngx_mp4_get_32value(tkhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_tkhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 tkhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        duration = ngx_mp4_get_64value(tkhd64_atom->duration);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "tkhd duration:%uL, time:%.3fs",
+                   duration, (double) duration / mp4->timescale);
+
+    start_time = (uint64_t) mp4->start * mp4->timescale / 1000;
+
+    if (duration <= start_time) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "tkhd duration is less than start time");
+        return NGX_DECLINED;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * mp4->timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "tkhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / mp4->timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->tkhd_size = atom_size;
+
+    ngx_mp4_set_32value(tkhd_atom->size, atom_size);
+
+    if (tkhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(tkhd_atom->duration, duration);
+
+    } else {
+        ngx_mp4_set_64value(tkhd64_atom->duration, duration);
+    }
+
+    atom = &trak->tkhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_mdia_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process mdia atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'i', 'a');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->mdia_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_mdia_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_mdia_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->mdia_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    timescale[4];
+    u_char    duration[4];
+    u_char    language[2];
+    u_char    quality[2];
+} ngx_mp4_mdhd_atom_t;
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    timescale[4];
+    u_char    duration[8];
+    u_char    language[2];
+    u_char    quality[2];
+} ngx_mp4_mdhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_mdhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint32_t                timescale;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_http_mp4_trak_t    *trak;
+    ngx_mp4_mdhd_atom_t    *mdhd_atom;
+    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom_header;
+    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(mdhd_atom, 'm', 'd', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_mdhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 mdhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mdhd_atom->version[0] == 0) {
+        /* version 0: everything is 32-bit */
+        timescale = ngx_mp4_get_32value(mdhd_atom->timescale);
+        duration = ngx_mp4_get_32value(mdhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration and 32-bit timescale */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_mdhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 mdhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        timescale = ngx_mp4_get_32value(mdhd64_atom->timescale);
+        duration = ngx_mp4_get_64value(mdhd64_atom->duration);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdhd timescale:%uD, duration:%uL, time:%.3fs",
+                   timescale, duration, (double) duration / timescale);
+
+    start_time = (uint64_t) mp4->start * timescale / 1000;
+
+    if (duration <= start_time) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mdhd duration is less than start time");
+        return NGX_DECLINED;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->mdhd_size = atom_size;
+    trak->timescale = timescale;
+
+    ngx_mp4_set_32value(mdhd_atom->size, atom_size);
+
+    if (mdhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(mdhd_atom->duration, duration);
+
+    } else {
+        ngx_mp4_set_64value(mdhd64_atom->duration, duration);
+    }
+
+    atom = &trak->mdhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_hdlr_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 hdlr atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'h', 'd', 'l', 'r');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->hdlr_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->hdlr_size = atom_size;
+    trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_minf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process minf atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'i', 'n', 'f');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->minf_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_MINF_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_minf_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_minf_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t)
+               + trak->vmhd_size
+               + trak->smhd_size
+               + trak->dinf_size;
+    atom = &trak->minf_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_vmhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 vmhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'v', 'm', 'h', 'd');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->vmhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->vmhd_size += atom_size;
+    trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_smhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 smhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 's', 'm', 'h', 'd');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->smhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->smhd_size += atom_size;
+    trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_dinf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 dinf atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'd', 'i', 'n', 'f');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->dinf_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->dinf_size += atom_size;
+    trak->out[NGX_HTTP_MP4_DINF_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_stbl_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process stbl atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 's', 't', 'b', 'l');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->stbl_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_STBL_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_stbl_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_stbl_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->stbl_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+
+    u_char    media_size[4];
+    u_char    media_name[4];
+} ngx_mp4_stsd_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stsd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table;
+    size_t                atom_size;
+    ngx_buf_t            *atom;
+    ngx_mp4_stsd_atom_t  *stsd_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* sample description atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stsd_atom = (ngx_mp4_stsd_atom_t *) atom_header;
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    atom_table = atom_header + atom_size;
+    ngx_mp4_set_32value(stsd_atom->size, atom_size);
+    ngx_mp4_set_atom_name(stsd_atom, 's', 't', 's', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "stsd entries:%uD, media:%*s",
+                   ngx_mp4_get_32value(stsd_atom->entries),
+                   (size_t) 4, stsd_atom->media_name);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    atom = &trak->stsd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    trak->out[NGX_HTTP_MP4_STSD_ATOM].buf = atom;
+    trak->size += atom_size;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_stts_atom_t;
+
+typedef struct {
+    u_char    count[4];
+    u_char    duration[4];
+} ngx_mp4_stts_entry_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* time-to-sample atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stts atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stts_atom = (ngx_mp4_stts_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stts_atom, 's', 't', 't', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stts_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 time-to-sample entries:%uD", entries);
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t)
+        + entries * sizeof(ngx_mp4_stts_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_table = atom_header + sizeof(ngx_mp4_stts_atom_t);
+    atom_end = atom_table + entries * sizeof(ngx_mp4_stts_entry_t);
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->time_to_sample_entries = entries;
+
+    atom = &trak->stts_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->stts_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STTS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STTS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update_stts_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                atom_size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stts_atom_t  *stts_atom;
+
+    /*
+     * mdia.minf.stbl.stts updating requires trak->timescale
+     * from mdia.mdhd atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stts atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+
+    if (data == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 stts atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stts_data(mp4, trak, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stts_data(mp4, trak, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "time-to-sample entries:%uD", trak->time_to_sample_entries);
+
+    atom_size = sizeof(ngx_mp4_stts_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STTS_ATOM].buf;
+    stts_atom = (ngx_mp4_stts_atom_t *) atom->pos;
+    ngx_mp4_set_32value(stts_atom->size, atom_size);
+    ngx_mp4_set_32value(stts_atom->entries, trak->time_to_sample_entries);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_crop_stts_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               count, duration, rest;
+    uint64_t               start_time;
+    ngx_buf_t             *data;
+    ngx_uint_t             start_sample, entries, start_sec;
+    ngx_mp4_stts_entry_t  *entry, *end;
+
+    if (start) {
+        start_sec = mp4->start;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stts crop start_time:%ui", start_sec);
+
+    } else if (mp4->length) {
+        start_sec = mp4->length;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stts crop end_time:%ui", start_sec);
+
+    } else {
+        return NGX_OK;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+
+    start_time = (uint64_t) start_sec * trak->timescale / 1000;
+
+    entries = trak->time_to_sample_entries;
+    start_sample = 0;
+    entry = (ngx_mp4_stts_entry_t *) data->pos;
+    end = (ngx_mp4_stts_entry_t *) data->last;
+
+    while (entry < end) {
+        count = ngx_mp4_get_32value(entry->count);
+        duration = ngx_mp4_get_32value(entry->duration);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "time:%uL, count:%uD, duration:%uD",
+                       start_time, count, duration);
+
+        if (start_time < (uint64_t) count * duration) {
+            start_sample += (ngx_uint_t) (start_time / duration);
+            rest = (uint32_t) (start_time / duration);
+            goto found;
+        }
+
+        start_sample += count;
+        start_time -= count * duration;
+        entries--;
+        entry++;
+    }
+
+    if (start) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 stts samples in \"%s\"",
+                      mp4->file.name.data);
+
+        return NGX_ERROR;
+
+    } else {
+        trak->end_sample = trak->start_sample + start_sample;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_sample:%ui", trak->end_sample);
+
+        return NGX_OK;
+    }
+
+found:
+
+    if (start) {
+        ngx_mp4_set_32value(entry->count, count - rest);
+        data->pos = (u_char *) entry;
+        trak->time_to_sample_entries = entries;
+        trak->start_sample = start_sample;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "start_sample:%ui, new count:%uD",
+                       trak->start_sample, count - rest);
+
+    } else {
+        ngx_mp4_set_32value(entry->count, rest);
+        data->last = (u_char *) (entry + 1);
+        trak->time_to_sample_entries -= entries - 1;
+        trak->end_sample = trak->start_sample + start_sample;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_sample:%ui, new count:%uD",
+                       trak->end_sample, rest);
+    }
+
+    return NGX_OK;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_http_mp4_stss_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stss_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                    *atom_header, *atom_table, *atom_end;
+    uint32_t                   entries;
+    ngx_buf_t                 *atom, *data;
+    ngx_http_mp4_trak_t       *trak;
+    ngx_http_mp4_stss_atom_t  *stss_atom;
+
+    /* sync samples atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stss atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stss_atom = (ngx_http_mp4_stss_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stss_atom, 's', 't', 's', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stss_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sync sample entries:%uD", entries);
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->sync_samples_entries = entries;
+
+    atom_table = atom_header + sizeof(ngx_http_mp4_stss_atom_t);
+
+    atom = &trak->stss_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t)
+        + entries * sizeof(uint32_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_end = atom_table + entries * sizeof(uint32_t);
+
+    data = &trak->stss_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STSS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STSS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update_stss_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                     atom_size;
+    uint32_t                   sample, start_sample, *entry, *end;
+    ngx_buf_t                 *atom, *data;
+    ngx_http_mp4_stss_atom_t  *stss_atom;
+
+    /*
+     * mdia.minf.stbl.stss updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stss atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    if (data == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_mp4_crop_stss_data(mp4, trak, 1);
+    ngx_http_mp4_crop_stss_data(mp4, trak, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sync sample entries:%uD", trak->sync_samples_entries);
+
+    if (trak->sync_samples_entries) {
+        entry = (uint32_t *) data->pos;
+        end = (uint32_t *) data->last;
+
+        start_sample = trak->start_sample;
+
+        while (entry < end) {
+            sample = ngx_mp4_get_32value(entry);
+            sample -= start_sample;
+            ngx_mp4_set_32value(entry, sample);
+            entry++;
+        }
+
+    } else {
+        trak->out[NGX_HTTP_MP4_STSS_DATA].buf = NULL;
+    }
+
+    atom_size = sizeof(ngx_http_mp4_stss_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STSS_ATOM].buf;
+    stss_atom = (ngx_http_mp4_stss_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(stss_atom->size, atom_size);
+    ngx_mp4_set_32value(stss_atom->entries, trak->sync_samples_entries);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_crop_stss_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t     sample, start_sample, *entry, *end;
+    ngx_buf_t   *data;
+    ngx_uint_t   entries;
+
+    /* sync samples starts from 1 */
+
+    if (start) {
+        start_sample = trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stss crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = trak->end_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stss crop end_sample:%uD", start_sample);
+
+    } else {
+        return;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    entries = trak->sync_samples_entries;
+    entry = (uint32_t *) data->pos;
+    end = (uint32_t *) data->last;
+
+    while (entry < end) {
+        sample = ngx_mp4_get_32value(entry);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sync:%uD", sample);
+
+        if (sample >= start_sample) {
+            goto found;
+        }
+
+        entries--;
+        entry++;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample is out of mp4 stss atom");
+
+found:
+
+    if (start) {
+        data->pos = (u_char *) entry;
+        trak->sync_samples_entries = entries;
+
+    } else {
+        data->last = (u_char *) entry;
+        trak->sync_samples_entries -= entries;
+    }
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_ctts_atom_t;
+
+typedef struct {
+    u_char    count[4];
+    u_char    offset[4];
+} ngx_mp4_ctts_entry_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_ctts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_ctts_atom_t  *ctts_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* composition offsets atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ctts atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ctts_atom = (ngx_mp4_ctts_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(ctts_atom, 'c', 't', 't', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(ctts_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "composition offset entries:%uD", entries);
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->composition_offset_entries = entries;
+
+    atom_table = atom_header + sizeof(ngx_mp4_ctts_atom_t);
+
+    atom = &trak->ctts_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t)
+        + entries * sizeof(ngx_mp4_ctts_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_end = atom_table + entries * sizeof(ngx_mp4_ctts_entry_t);
+
+    data = &trak->ctts_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_update_ctts_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                atom_size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_ctts_atom_t  *ctts_atom;
+
+    /*
+     * mdia.minf.stbl.ctts updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 ctts atom update");
+
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+    if (data == NULL) {
+        return;
+    }
+
+    ngx_http_mp4_crop_ctts_data(mp4, trak, 1);
+    ngx_http_mp4_crop_ctts_data(mp4, trak, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "composition offset entries:%uD",
+                   trak->composition_offset_entries);
+
+    if (trak->composition_offset_entries == 0) {
+        trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = NULL;
+        trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = NULL;
+        return;
+    }
+
+    atom_size = sizeof(ngx_mp4_ctts_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf;
+    ctts_atom = (ngx_mp4_ctts_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(ctts_atom->size, atom_size);
+    ngx_mp4_set_32value(ctts_atom->entries, trak->composition_offset_entries);
+
+    return;
+}
+
+
+static void
+ngx_http_mp4_crop_ctts_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               count, start_sample, rest;
+    ngx_buf_t             *data;
+    ngx_uint_t             entries;
+    ngx_mp4_ctts_entry_t  *entry, *end;
+
+    /* sync samples starts from 1 */
+
+    if (start) {
+        start_sample = trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 ctts crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = trak->end_sample - trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 ctts crop end_sample:%uD", start_sample);
+
+    } else {
+        return;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+    entries = trak->composition_offset_entries;
+    entry = (ngx_mp4_ctts_entry_t *) data->pos;
+    end = (ngx_mp4_ctts_entry_t *) data->last;
+
+    while (entry < end) {
+        count = ngx_mp4_get_32value(entry->count);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sample:%uD, count:%uD, offset:%uD",
+                       start_sample, count, ngx_mp4_get_32value(entry->offset));
+
+        if (start_sample <= count) {
+            rest = start_sample - 1;
+            goto found;
+        }
+
+        start_sample -= count;
+        entries--;
+        entry++;
+    }
+
+    if (start) {
+        data->pos = (u_char *) end;
+        trak->composition_offset_entries = 0;
+    }
+
+    return;
+
+found:
+
+    if (start) {
+        ngx_mp4_set_32value(entry->count, count - rest);
+        data->pos = (u_char *) entry;
+        trak->composition_offset_entries = entries;
+
+    } else {
+        ngx_mp4_set_32value(entry->count, rest);
+        data->last = (u_char *) (entry + 1);
+        trak->composition_offset_entries -= entries - 1;
+    }
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_stsc_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stsc_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stsc_atom_t  *stsc_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* sample-to-chunk atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsc atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stsc_atom = (ngx_mp4_stsc_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stsc_atom, 's', 't', 's', 'c');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stsc_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample-to-chunk entries:%uD", entries);
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t)
+        + entries * sizeof(ngx_mp4_stsc_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_table = atom_header + sizeof(ngx_mp4_stsc_atom_t);
+    atom_end = atom_table + entries * sizeof(ngx_mp4_stsc_entry_t);
+
+    trak = ngx_mp4_last_trak(mp4);
+    trak->sample_to_chunk_entries = entries;
+
+    atom = &trak->stsc_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->stsc_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STSC_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STSC_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update_stsc_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                 atom_size;
+    uint32_t               chunk;
+    ngx_buf_t             *atom, *data;
+    ngx_mp4_stsc_atom_t   *stsc_atom;
+    ngx_mp4_stsc_entry_t  *entry, *end;
+
+    /*
+     * mdia.minf.stbl.stsc updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stsc atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+
+    if (data == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 stsc atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (trak->sample_to_chunk_entries == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "zero number of entries in stsc atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample-to-chunk entries:%uD",
+                   trak->sample_to_chunk_entries);
+
+    entry = (ngx_mp4_stsc_entry_t *) data->pos;
+    end = (ngx_mp4_stsc_entry_t *) data->last;
+
+    while (entry < end) {
+        chunk = ngx_mp4_get_32value(entry->chunk);
+        chunk -= trak->start_chunk;
+        ngx_mp4_set_32value(entry->chunk, chunk);
+        entry++;
+    }
+
+    atom_size = sizeof(ngx_mp4_stsc_atom_t)
+                + trak->sample_to_chunk_entries * sizeof(ngx_mp4_stsc_entry_t);
+
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STSC_ATOM].buf;
+    stsc_atom = (ngx_mp4_stsc_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(stsc_atom->size, atom_size);
+    ngx_mp4_set_32value(stsc_atom->entries, trak->sample_to_chunk_entries);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_crop_stsc_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               start_sample, chunk, samples, id, next_chunk, n,
+                           prev_samples;
+    ngx_buf_t             *data, *buf;
+    ngx_uint_t             entries, target_chunk, chunk_samples;
+    ngx_mp4_stsc_entry_t  *entry, *end, *first;
+
+    entries = trak->sample_to_chunk_entries - 1;
+
+    if (start) {
+        start_sample = (uint32_t) trak->start_sample;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stsc crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = (uint32_t) (trak->end_sample - trak->start_sample);
+        samples = 0;
+
+        data = trak->out[NGX_HTTP_MP4_STSC_START].buf;
+
+        if (data) {
+            entry = (ngx_mp4_stsc_entry_t *) data->pos;
+            samples = ngx_mp4_get_32value(entry->samples);
+            entries--;
+
+            if (samples > start_sample) {
+                samples = start_sample;
+                ngx_mp4_set_32value(entry->samples, samples);
+            }
+
+            start_sample -= samples;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stsc crop end_sample:%uD, ext_samples:%uD",
+                       start_sample, samples);
+
+    } else {
+        return NGX_OK;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+
+    entry = (ngx_mp4_stsc_entry_t *) data->pos;
+    end = (ngx_mp4_stsc_entry_t *) data->last;
+
+    chunk = ngx_mp4_get_32value(entry->chunk);
+    samples = ngx_mp4_get_32value(entry->samples);
+    id = ngx_mp4_get_32value(entry->id);
+    prev_samples = 0;
+    entry++;
+
+    while (entry < end) {
+
+        next_chunk = ngx_mp4_get_32value(entry->chunk);
+
+        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sample:%uD, chunk:%uD, chunks:%uD, "
+                       "samples:%uD, id:%uD",
+                       start_sample, chunk, next_chunk - chunk, samples, id);
+
+        n = (next_chunk - chunk) * samples;
+
+        if (start_sample < n) {
+            goto found;
+        }
+
+        start_sample -= n;
+
+        prev_samples = samples;
+        chunk = next_chunk;
+        samples = ngx_mp4_get_32value(entry->samples);
+        id = ngx_mp4_get_32value(entry->id);
+        entries--;
+        entry++;
+    }
+
+    next_chunk = trak->chunks + 1;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
+                   start_sample, chunk, next_chunk - chunk, samples);
+
+    n = (next_chunk - chunk) * samples;
+
+    if (start_sample > n) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "%s time is out mp4 stsc chunks in \"%s\"",
+                      start ? "start" : "end", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+found:
+
+    entries++;
+    entry--;
+
+    if (samples == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "zero number of samples in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    target_chunk = chunk - 1;
+    target_chunk += start_sample / samples;
+    chunk_samples = start_sample % samples;
+
+    if (start) {
+        data->pos = (u_char *) entry;
+
+        trak->sample_to_chunk_entries = entries;
+        trak->start_chunk = target_chunk;
+        trak->start_chunk_samples = chunk_samples;
+
+        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 1);
+
+        samples -= chunk_samples;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "start_chunk:%ui, start_chunk_samples:%ui",
+                       trak->start_chunk, trak->start_chunk_samples);
+
+    } else {
+        if (start_sample) {
+            data->last = (u_char *) (entry + 1);
+            trak->sample_to_chunk_entries -= entries - 1;
+            trak->end_chunk_samples = samples;
+
+        } else {
+            data->last = (u_char *) entry;
+            trak->sample_to_chunk_entries -= entries;
+            trak->end_chunk_samples = prev_samples;
+        }
+
+        if (chunk_samples) {
+            trak->end_chunk = target_chunk + 1;
+            trak->end_chunk_samples = chunk_samples;
+
+        } else {
+            trak->end_chunk = target_chunk;
+        }
+
+        samples = chunk_samples;
+        next_chunk = chunk + 1;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_chunk:%ui, end_chunk_samples:%ui",
+                       trak->end_chunk, trak->end_chunk_samples);
+    }
+
+    if (chunk_samples && next_chunk - target_chunk == 2) {
+
+        ngx_mp4_set_32value(entry->samples, samples);
 
+    } else if (chunk_samples && start) {
 
-static ngx_int_t
-ngx_http_mp4_read_stsd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table;
-    size_t                atom_size;
-    ngx_buf_t            *atom;
-    ngx_mp4_stsd_atom_t  *stsd_atom;
-    ngx_http_mp4_trak_t  *trak;
+        first = &trak->stsc_start_chunk_entry;
+        ngx_mp4_set_32value(first->chunk, 1);
+        ngx_mp4_set_32value(first->samples, samples);
+        ngx_mp4_set_32value(first->id, id);
 
-    /* sample description atom */
+        buf = &trak->stsc_start_chunk_buf;
+        buf->temporary = 1;
+        buf->pos = (u_char *) first;
+        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsd atom");
+        trak->out[NGX_HTTP_MP4_STSC_START].buf = buf;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsd_atom = (ngx_mp4_stsd_atom_t *) atom_header;
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    atom_table = atom_header + atom_size;
-    ngx_mp4_set_32value(stsd_atom->size, atom_size);
-    ngx_mp4_set_atom_name(stsd_atom, 's', 't', 's', 'd');
+        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 2);
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+        trak->sample_to_chunk_entries++;
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "stsd entries:%uD, media:%*s",
-                   ngx_mp4_get_32value(stsd_atom->entries),
-                   (size_t) 4, stsd_atom->media_name);
+    } else if (chunk_samples) {
 
-    trak = ngx_mp4_last_trak(mp4);
+        first = &trak->stsc_end_chunk_entry;
+        ngx_mp4_set_32value(first->chunk, trak->end_chunk - trak->start_chunk);
+        ngx_mp4_set_32value(first->samples, samples);
+        ngx_mp4_set_32value(first->id, id);
 
-    atom = &trak->stsd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+        buf = &trak->stsc_end_chunk_buf;
+        buf->temporary = 1;
+        buf->pos = (u_char *) first;
+        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
 
-    trak->out[NGX_HTTP_MP4_STSD_ATOM].buf = atom;
-    trak->size += atom_size;
+        trak->out[NGX_HTTP_MP4_STSC_END].buf = buf;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        trak->sample_to_chunk_entries++;
+    }
 
     return NGX_OK;
 }
@@ -1981,69 +3920,79 @@ typedef struct {
     u_char    name[4];
     u_char    version[1];
     u_char    flags[3];
+    u_char    uniform_size[4];
     u_char    entries[4];
-} ngx_mp4_stts_atom_t;
-
-typedef struct {
-    u_char    count[4];
-    u_char    duration[4];
-} ngx_mp4_stts_entry_t;
+} ngx_mp4_stsz_atom_t;
 
 
 static ngx_int_t
-ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_stsz_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
     u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
+    size_t                atom_size;
+    uint32_t              entries, size;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_mp4_stsz_atom_t  *stsz_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    /* time-to-sample atom */
+    /* sample sizes atom */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stts atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsz atom");
 
     atom_header = ngx_mp4_atom_header(mp4);
-    stts_atom = (ngx_mp4_stts_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stts_atom, 's', 't', 't', 's');
+    stsz_atom = (ngx_mp4_stsz_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stsz_atom, 's', 't', 's', 'z');
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t) > atom_data_size) {
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t) > atom_data_size) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 stsz atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    entries = ngx_mp4_get_32value(stts_atom->entries);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 time-to-sample entries:%uD", entries);
-
-    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t)
-        + entries * sizeof(ngx_mp4_stts_entry_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    size = ngx_mp4_get_32value(stsz_atom->uniform_size);
+    entries = ngx_mp4_get_32value(stsz_atom->entries);
 
-    atom_table = atom_header + sizeof(ngx_mp4_stts_atom_t);
-    atom_end = atom_table + entries * sizeof(ngx_mp4_stts_entry_t);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample uniform size:%uD, entries:%uD", size, entries);
 
     trak = ngx_mp4_last_trak(mp4);
-    trak->time_to_sample_entries = entries;
+    trak->sample_sizes_entries = entries;
 
-    atom = &trak->stts_atom_buf;
+    atom_table = atom_header + sizeof(ngx_mp4_stsz_atom_t);
+
+    atom = &trak->stsz_atom_buf;
     atom->temporary = 1;
     atom->pos = atom_header;
     atom->last = atom_table;
 
-    data = &trak->stts_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf = atom;
 
-    trak->out[NGX_HTTP_MP4_STTS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STTS_DATA].buf = data;
+    if (size == 0) {
+        if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t)
+            + entries * sizeof(uint32_t) > atom_data_size)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 stsz atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        atom_end = atom_table + entries * sizeof(uint32_t);
+
+        data = &trak->stsz_data_buf;
+        data->temporary = 1;
+        data->pos = atom_table;
+        data->last = atom_end;
+
+        trak->out[NGX_HTTP_MP4_STSZ_DATA].buf = data;
+
+    } else {
+        /* if size != 0 then all samples are the same size */
+        /* TODO : chunk samples */
+        atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+        ngx_mp4_set_32value(atom_header, atom_size);
+        trak->size += atom_size;
+    }
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -2052,145 +4001,76 @@ ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
 
 static ngx_int_t
-ngx_http_mp4_update_stts_atom(ngx_http_mp4_file_t *mp4,
+ngx_http_mp4_update_stsz_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak)
 {
     size_t                atom_size;
+    uint32_t             *pos, *end, entries;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_mp4_stsz_atom_t  *stsz_atom;
 
     /*
-     * mdia.minf.stbl.stts updating requires trak->timescale
-     * from mdia.mdhd atom which may reside after mdia.minf
+     * mdia.minf.stbl.stsz updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
      */
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stts atom update");
-
-    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
-
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stts atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
-
-    if (ngx_http_mp4_crop_stts_data(mp4, trak, 1) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    if (ngx_http_mp4_crop_stts_data(mp4, trak, 0) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "time-to-sample entries:%uD", trak->time_to_sample_entries);
-
-    atom_size = sizeof(ngx_mp4_stts_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
-
-    atom = trak->out[NGX_HTTP_MP4_STTS_ATOM].buf;
-    stts_atom = (ngx_mp4_stts_atom_t *) atom->pos;
-    ngx_mp4_set_32value(stts_atom->size, atom_size);
-    ngx_mp4_set_32value(stts_atom->entries, trak->time_to_sample_entries);
-
-    return NGX_OK;
-}
-
-
-static ngx_int_t
-ngx_http_mp4_crop_stts_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
-{
-    uint32_t               count, duration, rest;
-    uint64_t               start_time;
-    ngx_buf_t             *data;
-    ngx_uint_t             start_sample, entries, start_sec;
-    ngx_mp4_stts_entry_t  *entry, *end;
-
-    if (start) {
-        start_sec = mp4->start;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stts crop start_time:%ui", start_sec);
-
-    } else if (mp4->length) {
-        start_sec = mp4->length;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stts crop end_time:%ui", start_sec);
-
-    } else {
-        return NGX_OK;
-    }
-
-    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
-
-    start_time = (uint64_t) start_sec * trak->timescale / 1000;
-
-    entries = trak->time_to_sample_entries;
-    start_sample = 0;
-    entry = (ngx_mp4_stts_entry_t *) data->pos;
-    end = (ngx_mp4_stts_entry_t *) data->last;
+                   "mp4 stsz atom update");
 
-    while (entry < end) {
-        count = ngx_mp4_get_32value(entry->count);
-        duration = ngx_mp4_get_32value(entry->duration);
+    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "time:%uL, count:%uD, duration:%uD",
-                       start_time, count, duration);
+    if (data) {
+        entries = trak->sample_sizes_entries;
 
-        if (start_time < (uint64_t) count * duration) {
-            start_sample += (ngx_uint_t) (start_time / duration);
-            rest = (uint32_t) (start_time / duration);
-            goto found;
+        if (trak->start_sample > entries) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "start time is out mp4 stsz samples in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
         }
 
-        start_sample += count;
-        start_time -= count * duration;
-        entries--;
-        entry++;
-    }
-
-    if (start) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 stts samples in \"%s\"",
-                      mp4->file.name.data);
-
-        return NGX_ERROR;
-
-    } else {
-        trak->end_sample = trak->start_sample + start_sample;
+        entries -= trak->start_sample;
+        data->pos += trak->start_sample * sizeof(uint32_t);
+        end = (uint32_t *) data->pos;
+
+        for (pos = end - trak->start_chunk_samples; pos < end; pos++) {
+            trak->start_chunk_samples_size += ngx_mp4_get_32value(pos);
+        }
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_sample:%ui", trak->end_sample);
+                       "chunk samples sizes:%uL",
+                       trak->start_chunk_samples_size);
 
-        return NGX_OK;
-    }
+        if (mp4->length) {
+            if (trak->end_sample - trak->start_sample > entries) {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "end time is out mp4 stsz samples in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
 
-found:
+            entries = trak->end_sample - trak->start_sample;
+            data->last = data->pos + entries * sizeof(uint32_t);
+            end = (uint32_t *) data->last;
 
-    if (start) {
-        ngx_mp4_set_32value(entry->count, count - rest);
-        data->pos = (u_char *) entry;
-        trak->time_to_sample_entries = entries;
-        trak->start_sample = start_sample;
+            for (pos = end - trak->end_chunk_samples; pos < end; pos++) {
+                trak->end_chunk_samples_size += ngx_mp4_get_32value(pos);
+            }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "start_sample:%ui, new count:%uD",
-                       trak->start_sample, count - rest);
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "mp4 stsz end_chunk_samples_size:%uL",
+                           trak->end_chunk_samples_size);
+        }
 
-    } else {
-        ngx_mp4_set_32value(entry->count, rest);
-        data->last = (u_char *) (entry + 1);
-        trak->time_to_sample_entries -= entries - 1;
-        trak->end_sample = trak->start_sample + start_sample;
+        atom_size = sizeof(ngx_mp4_stsz_atom_t) + (data->last - data->pos);
+        trak->size += atom_size;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_sample:%ui, new count:%uD",
-                       trak->end_sample, rest);
+        atom = trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf;
+        stsz_atom = (ngx_mp4_stsz_atom_t *) atom->pos;
+
+        ngx_mp4_set_32value(stsz_atom->size, atom_size);
+        ngx_mp4_set_32value(stsz_atom->entries, entries);
     }
 
     return NGX_OK;
@@ -2203,64 +4083,62 @@ typedef struct {
     u_char    version[1];
     u_char    flags[3];
     u_char    entries[4];
-} ngx_http_mp4_stss_atom_t;
+} ngx_mp4_stco_atom_t;
 
 
 static ngx_int_t
-ngx_http_mp4_read_stss_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_stco_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
-    u_char                    *atom_header, *atom_table, *atom_end;
-    uint32_t                   entries;
-    ngx_buf_t                 *atom, *data;
-    ngx_http_mp4_trak_t       *trak;
-    ngx_http_mp4_stss_atom_t  *stss_atom;
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stco_atom_t  *stco_atom;
+    ngx_http_mp4_trak_t  *trak;
 
-    /* sync samples atom */
+    /* chunk offsets atom */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stss atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stco atom");
 
     atom_header = ngx_mp4_atom_header(mp4);
-    stss_atom = (ngx_http_mp4_stss_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stss_atom, 's', 't', 's', 's');
+    stco_atom = (ngx_mp4_stco_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stco_atom, 's', 't', 'c', 'o');
 
-    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t) > atom_data_size) {
+    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t) > atom_data_size) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    entries = ngx_mp4_get_32value(stss_atom->entries);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sync sample entries:%uD", entries);
-
-    trak = ngx_mp4_last_trak(mp4);
-    trak->sync_samples_entries = entries;
-
-    atom_table = atom_header + sizeof(ngx_http_mp4_stss_atom_t);
+    entries = ngx_mp4_get_32value(stco_atom->entries);
 
-    atom = &trak->stss_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
 
-    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t)
+    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t)
         + entries * sizeof(uint32_t) > atom_data_size)
     {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
+    atom_table = atom_header + sizeof(ngx_mp4_stco_atom_t);
     atom_end = atom_table + entries * sizeof(uint32_t);
 
-    data = &trak->stss_data_buf;
+    trak = ngx_mp4_last_trak(mp4);
+    trak->chunks = entries;
+
+    atom = &trak->stco_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->stco_data_buf;
     data->temporary = 1;
     data->pos = atom_table;
     data->last = atom_end;
 
-    trak->out[NGX_HTTP_MP4_STSS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STSS_DATA].buf = data;
+    trak->out[NGX_HTTP_MP4_STCO_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STCO_DATA].buf = data;
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -2269,123 +4147,116 @@ ngx_http_mp4_read_stss_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
 
 static ngx_int_t
-ngx_http_mp4_update_stss_atom(ngx_http_mp4_file_t *mp4,
+ngx_http_mp4_update_stco_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak)
 {
-    size_t                     atom_size;
-    uint32_t                   sample, start_sample, *entry, *end;
-    ngx_buf_t                 *atom, *data;
-    ngx_http_mp4_stss_atom_t  *stss_atom;
+    size_t                atom_size;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stco_atom_t  *stco_atom;
 
     /*
-     * mdia.minf.stbl.stss updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * mdia.minf.stbl.stco updating requires trak->start_chunk
+     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
      * atom which may reside after mdia.minf
      */
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stss atom update");
+                   "mp4 stco atom update");
 
-    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
 
     if (data == NULL) {
-        return NGX_OK;
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 stco atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    ngx_http_mp4_crop_stss_data(mp4, trak, 1);
-    ngx_http_mp4_crop_stss_data(mp4, trak, 0);
+    if (trak->start_chunk > trak->chunks) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 stco chunks in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    data->pos += trak->start_chunk * sizeof(uint32_t);
+
+    trak->start_offset = ngx_mp4_get_32value(data->pos);
+    trak->start_offset += trak->start_chunk_samples_size;
+    ngx_mp4_set_32value(data->pos, trak->start_offset);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sync sample entries:%uD", trak->sync_samples_entries);
+                   "start chunk offset:%O", trak->start_offset);
 
-    if (trak->sync_samples_entries) {
-        entry = (uint32_t *) data->pos;
-        end = (uint32_t *) data->last;
+    if (mp4->length) {
 
-        start_sample = trak->start_sample;
+        if (trak->end_chunk > trak->chunks) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "end time is out mp4 stco chunks in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
-        while (entry < end) {
-            sample = ngx_mp4_get_32value(entry);
-            sample -= start_sample;
-            ngx_mp4_set_32value(entry, sample);
-            entry++;
+        entries = trak->end_chunk - trak->start_chunk;
+        data->last = data->pos + entries * sizeof(uint32_t);
+
+        if (entries) {
+            trak->end_offset =
+                            ngx_mp4_get_32value(data->last - sizeof(uint32_t));
+            trak->end_offset += trak->end_chunk_samples_size;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "end chunk offset:%O", trak->end_offset);
         }
 
     } else {
-        trak->out[NGX_HTTP_MP4_STSS_DATA].buf = NULL;
+        entries = trak->chunks - trak->start_chunk;
+        trak->end_offset = mp4->mdat_data.buf->file_last;
     }
 
-    atom_size = sizeof(ngx_http_mp4_stss_atom_t) + (data->last - data->pos);
+    if (entries == 0) {
+        trak->start_offset = mp4->end;
+        trak->end_offset = 0;
+    }
+
+    atom_size = sizeof(ngx_mp4_stco_atom_t) + (data->last - data->pos);
     trak->size += atom_size;
 
-    atom = trak->out[NGX_HTTP_MP4_STSS_ATOM].buf;
-    stss_atom = (ngx_http_mp4_stss_atom_t *) atom->pos;
+    atom = trak->out[NGX_HTTP_MP4_STCO_ATOM].buf;
+    stco_atom = (ngx_mp4_stco_atom_t *) atom->pos;
 
-    ngx_mp4_set_32value(stss_atom->size, atom_size);
-    ngx_mp4_set_32value(stss_atom->entries, trak->sync_samples_entries);
+    ngx_mp4_set_32value(stco_atom->size, atom_size);
+    ngx_mp4_set_32value(stco_atom->entries, entries);
 
     return NGX_OK;
 }
 
 
 static void
-ngx_http_mp4_crop_stss_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+ngx_http_mp4_adjust_stco_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, int32_t adjustment)
 {
-    uint32_t     sample, start_sample, *entry, *end;
-    ngx_buf_t   *data;
-    ngx_uint_t   entries;
-
-    /* sync samples starts from 1 */
-
-    if (start) {
-        start_sample = trak->start_sample + 1;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stss crop start_sample:%uD", start_sample);
-
-    } else if (mp4->length) {
-        start_sample = trak->end_sample + 1;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stss crop end_sample:%uD", start_sample);
+    uint32_t    offset, *entry, *end;
+    ngx_buf_t  *data;
 
-    } else {
-        return;
-    }
+    /*
+     * moov.trak.mdia.minf.stbl.stco adjustment requires
+     * minimal start offset of all traks and new moov atom size
+     */
 
-    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stco atom adjustment");
 
-    entries = trak->sync_samples_entries;
+    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
     entry = (uint32_t *) data->pos;
     end = (uint32_t *) data->last;
 
     while (entry < end) {
-        sample = ngx_mp4_get_32value(entry);
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sync:%uD", sample);
-
-        if (sample >= start_sample) {
-            goto found;
-        }
-
-        entries--;
-        entry++;
-    }
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample is out of mp4 stss atom");
-
-found:
-
-    if (start) {
-        data->pos = (u_char *) entry;
-        trak->sync_samples_entries = entries;
-
-    } else {
-        data->last = (u_char *) entry;
-        trak->sync_samples_entries -= entries;
+        offset = ngx_mp4_get_32value(entry);
+        offset += adjustment;
+        ngx_mp4_set_32value(entry, offset);
+        entry++;
     }
 }
 
@@ -2396,69 +4267,62 @@ typedef struct {
     u_char    version[1];
     u_char    flags[3];
     u_char    entries[4];
-} ngx_mp4_ctts_atom_t;
-
-typedef struct {
-    u_char    count[4];
-    u_char    offset[4];
-} ngx_mp4_ctts_entry_t;
+} ngx_mp4_co64_atom_t;
 
 
 static ngx_int_t
-ngx_http_mp4_read_ctts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_co64_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
     u_char               *atom_header, *atom_table, *atom_end;
     uint32_t              entries;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_ctts_atom_t  *ctts_atom;
+    ngx_mp4_co64_atom_t  *co64_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    /* composition offsets atom */
+    /* chunk offsets atom */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ctts atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 co64 atom");
 
     atom_header = ngx_mp4_atom_header(mp4);
-    ctts_atom = (ngx_mp4_ctts_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(ctts_atom, 'c', 't', 't', 's');
+    co64_atom = (ngx_mp4_co64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(co64_atom, 'c', 'o', '6', '4');
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t) > atom_data_size) {
+    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t) > atom_data_size) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    entries = ngx_mp4_get_32value(ctts_atom->entries);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "composition offset entries:%uD", entries);
-
-    trak = ngx_mp4_last_trak(mp4);
-    trak->composition_offset_entries = entries;
-
-    atom_table = atom_header + sizeof(ngx_mp4_ctts_atom_t);
+    entries = ngx_mp4_get_32value(co64_atom->entries);
 
-    atom = &trak->ctts_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t)
-        + entries * sizeof(ngx_mp4_ctts_entry_t) > atom_data_size)
+    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t)
+        + entries * sizeof(uint64_t) > atom_data_size)
     {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom_end = atom_table + entries * sizeof(ngx_mp4_ctts_entry_t);
+    atom_table = atom_header + sizeof(ngx_mp4_co64_atom_t);
+    atom_end = atom_table + entries * sizeof(uint64_t);
 
-    data = &trak->ctts_data_buf;
+    trak = ngx_mp4_last_trak(mp4);
+    trak->chunks = entries;
+
+    atom = &trak->co64_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->co64_data_buf;
     data->temporary = 1;
     data->pos = atom_table;
     data->last = atom_end;
 
-    trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = data;
+    trak->out[NGX_HTTP_MP4_CO64_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_CO64_DATA].buf = data;
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -2466,1006 +4330,1067 @@ ngx_http_mp4_read_ctts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 }
 
 
-static void
-ngx_http_mp4_update_ctts_atom(ngx_http_mp4_file_t *mp4,
+static ngx_int_t
+ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak)
 {
     size_t                atom_size;
+    uint64_t              entries;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_ctts_atom_t  *ctts_atom;
+    ngx_mp4_co64_atom_t  *co64_atom;
 
     /*
-     * mdia.minf.stbl.ctts updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * mdia.minf.stbl.co64 updating requires trak->start_chunk
+     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
      * atom which may reside after mdia.minf
      */
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 ctts atom update");
+                   "mp4 co64 atom update");
 
-    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
 
     if (data == NULL) {
-        return;
-    }
-
-    ngx_http_mp4_crop_ctts_data(mp4, trak, 1);
-    ngx_http_mp4_crop_ctts_data(mp4, trak, 0);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "composition offset entries:%uD",
-                   trak->composition_offset_entries);
-
-    if (trak->composition_offset_entries == 0) {
-        trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = NULL;
-        trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = NULL;
-        return;
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 co64 atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    atom_size = sizeof(ngx_mp4_ctts_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
-
-    atom = trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf;
-    ctts_atom = (ngx_mp4_ctts_atom_t *) atom->pos;
-
-    ngx_mp4_set_32value(ctts_atom->size, atom_size);
-    ngx_mp4_set_32value(ctts_atom->entries, trak->composition_offset_entries);
-
-    return;
-}
-
-
-static void
-ngx_http_mp4_crop_ctts_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
-{
-    uint32_t               count, start_sample, rest;
-    ngx_buf_t             *data;
-    ngx_uint_t             entries;
-    ngx_mp4_ctts_entry_t  *entry, *end;
-
-    /* sync samples starts from 1 */
-
-    if (start) {
-        start_sample = trak->start_sample + 1;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 ctts crop start_sample:%uD", start_sample);
-
-    } else if (mp4->length) {
-        start_sample = trak->end_sample - trak->start_sample + 1;
-
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 ctts crop end_sample:%uD", start_sample);
-
-    } else {
-        return;
+    if (trak->start_chunk > trak->chunks) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 co64 chunks in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+    data->pos += trak->start_chunk * sizeof(uint64_t);
 
-    entries = trak->composition_offset_entries;
-    entry = (ngx_mp4_ctts_entry_t *) data->pos;
-    end = (ngx_mp4_ctts_entry_t *) data->last;
+    trak->start_offset = ngx_mp4_get_64value(data->pos);
+    trak->start_offset += trak->start_chunk_samples_size;
+    ngx_mp4_set_64value(data->pos, trak->start_offset);
 
-    while (entry < end) {
-        count = ngx_mp4_get_32value(entry->count);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "start chunk offset:%O", trak->start_offset);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sample:%uD, count:%uD, offset:%uD",
-                       start_sample, count, ngx_mp4_get_32value(entry->offset));
+    if (mp4->length) {
 
-        if (start_sample <= count) {
-            rest = start_sample - 1;
-            goto found;
+        if (trak->end_chunk > trak->chunks) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "end time is out mp4 co64 chunks in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
         }
 
-        start_sample -= count;
-        entries--;
-        entry++;
-    }
-
-    if (start) {
-        data->pos = (u_char *) end;
-        trak->composition_offset_entries = 0;
-    }
-
-    return;
+        entries = trak->end_chunk - trak->start_chunk;
+        data->last = data->pos + entries * sizeof(uint64_t);
 
-found:
+        if (entries) {
+            trak->end_offset =
+                            ngx_mp4_get_64value(data->last - sizeof(uint64_t));
+            trak->end_offset += trak->end_chunk_samples_size;
 
-    if (start) {
-        ngx_mp4_set_32value(entry->count, count - rest);
-        data->pos = (u_char *) entry;
-        trak->composition_offset_entries = entries;
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "end chunk offset:%O", trak->end_offset);
+        }
 
     } else {
-        ngx_mp4_set_32value(entry->count, rest);
-        data->last = (u_char *) (entry + 1);
-        trak->composition_offset_entries -= entries - 1;
-    }
-}
-
-
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_stsc_atom_t;
-
-
-static ngx_int_t
-ngx_http_mp4_read_stsc_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsc_atom_t  *stsc_atom;
-    ngx_http_mp4_trak_t  *trak;
-
-    /* sample-to-chunk atom */
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsc atom");
-
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsc_atom = (ngx_mp4_stsc_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stsc_atom, 's', 't', 's', 'c');
-
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+        entries = trak->chunks - trak->start_chunk;
+        trak->end_offset = mp4->mdat_data.buf->file_last;
     }
 
-    entries = ngx_mp4_get_32value(stsc_atom->entries);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample-to-chunk entries:%uD", entries);
-
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t)
-        + entries * sizeof(ngx_mp4_stsc_entry_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+    if (entries == 0) {
+        trak->start_offset = mp4->end;
+        trak->end_offset = 0;
     }
 
-    atom_table = atom_header + sizeof(ngx_mp4_stsc_atom_t);
-    atom_end = atom_table + entries * sizeof(ngx_mp4_stsc_entry_t);
-
-    trak = ngx_mp4_last_trak(mp4);
-    trak->sample_to_chunk_entries = entries;
-
-    atom = &trak->stsc_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
-
-    data = &trak->stsc_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    atom_size = sizeof(ngx_mp4_co64_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
 
-    trak->out[NGX_HTTP_MP4_STSC_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STSC_DATA].buf = data;
+    atom = trak->out[NGX_HTTP_MP4_CO64_ATOM].buf;
+    co64_atom = (ngx_mp4_co64_atom_t *) atom->pos;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    ngx_mp4_set_32value(co64_atom->size, atom_size);
+    ngx_mp4_set_32value(co64_atom->entries, entries);
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_update_stsc_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+static void
+ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, off_t adjustment)
 {
-    size_t                 atom_size;
-    uint32_t               chunk;
-    ngx_buf_t             *atom, *data;
-    ngx_mp4_stsc_atom_t   *stsc_atom;
-    ngx_mp4_stsc_entry_t  *entry, *end;
+    uint64_t    offset, *entry, *end;
+    ngx_buf_t  *data;
 
     /*
-     * mdia.minf.stbl.stsc updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
+     * moov.trak.mdia.minf.stbl.co64 adjustment requires
+     * minimal start offset of all traks and new moov atom size
      */
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stsc atom update");
+                   "mp4 co64 atom adjustment");
 
-    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+    entry = (uint64_t *) data->pos;
+    end = (uint64_t *) data->last;
 
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stsc atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    while (entry < end) {
+        offset = ngx_mp4_get_64value(entry);
+        offset += adjustment;
+        ngx_mp4_set_64value(entry, offset);
+        entry++;
     }
+}
 
-    if (trak->sample_to_chunk_entries == 0) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "zero number of entries in stsc atom in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
 
-    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 1) != NGX_OK) {
-        return NGX_ERROR;
-    }
+/*
+ * HLS packaging: a playlist, an initialization segment and fragmented
+ * MP4 media segments are built from the original sample tables.  Sample
+ * data are sent directly from the mdat atom of the file.
+ */
 
-    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 0) != NGX_OK) {
+static ngx_int_t
+ngx_http_mp4_hls_process(ngx_http_mp4_file_t *mp4)
+{
+    ngx_uint_t                 i, n;
+    ngx_array_t               *segments;
+    ngx_http_mp4_trak_t       *trak;
+    ngx_http_mp4_hls_track_t  *tracks, *ref;
+
+    n = mp4->trak.nelts;
+    trak = mp4->trak.elts;
+
+    tracks = ngx_pcalloc(mp4->request->pool,
+                         n * sizeof(ngx_http_mp4_hls_track_t));
+    if (tracks == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample-to-chunk entries:%uD",
-                   trak->sample_to_chunk_entries);
+    ref = NULL;
 
-    entry = (ngx_mp4_stsc_entry_t *) data->pos;
-    end = (ngx_mp4_stsc_entry_t *) data->last;
+    for (i = 0; i < n; i++) {
+        if (ngx_http_mp4_hls_init_track(mp4, &trak[i], &tracks[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    while (entry < end) {
-        chunk = ngx_mp4_get_32value(entry->chunk);
-        chunk -= trak->start_chunk;
-        ngx_mp4_set_32value(entry->chunk, chunk);
-        entry++;
+        /* segments are aligned to key frames of the first video track */
+
+        if (ref == NULL && tracks[i].stss) {
+            ref = &tracks[i];
+        }
     }
 
-    atom_size = sizeof(ngx_mp4_stsc_atom_t)
-                + trak->sample_to_chunk_entries * sizeof(ngx_mp4_stsc_entry_t);
+    if (ref == NULL) {
+        ref = &tracks[0];
+    }
 
-    trak->size += atom_size;
+    if (mp4->hls == NGX_HTTP_MP4_HLS_INIT) {
+        return ngx_http_mp4_hls_init_segment(mp4, tracks, n);
+    }
 
-    atom = trak->out[NGX_HTTP_MP4_STSC_ATOM].buf;
-    stsc_atom = (ngx_mp4_stsc_atom_t *) atom->pos;
+    segments = ngx_http_mp4_hls_segments(mp4, ref);
+    if (segments == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_mp4_set_32value(stsc_atom->size, atom_size);
-    ngx_mp4_set_32value(stsc_atom->entries, trak->sample_to_chunk_entries);
+    if (mp4->hls == NGX_HTTP_MP4_HLS_PLAYLIST) {
+        return ngx_http_mp4_hls_playlist(mp4, ref, segments);
+    }
 
-    return NGX_OK;
+    return ngx_http_mp4_hls_media_segment(mp4, tracks, n, ref, segments);
 }
 
 
 static ngx_int_t
-ngx_http_mp4_crop_stsc_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+ngx_http_mp4_hls_init_track(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_http_mp4_hls_track_t *t)
 {
-    uint32_t               start_sample, chunk, samples, id, next_chunk, n,
-                           prev_samples;
-    ngx_buf_t             *data, *buf;
-    ngx_uint_t             entries, target_chunk, chunk_samples;
-    ngx_mp4_stsc_entry_t  *entry, *end, *first;
+    ngx_buf_t              *buf;
+    ngx_mp4_tkhd_atom_t    *tkhd_atom;
+    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
 
-    entries = trak->sample_to_chunk_entries - 1;
+    if (trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf == NULL
+        || trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf == NULL
+        || trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STSD_ATOM].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STTS_DATA].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STSC_DATA].buf == NULL
+        || trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf == NULL
+        || (trak->out[NGX_HTTP_MP4_STCO_DATA].buf == NULL
+            && trak->out[NGX_HTTP_MP4_CO64_DATA].buf == NULL)
+        || trak->timescale == 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "incomplete mp4 trak atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
-    if (start) {
-        start_sample = (uint32_t) trak->start_sample;
+    t->trak = trak;
+    t->timescale = trak->timescale;
+    t->samples = trak->sample_sizes_entries;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stsc crop start_sample:%uD", start_sample);
+    tkhd_atom = (ngx_mp4_tkhd_atom_t *) trak->tkhd_atom_buf.pos;
+    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) trak->tkhd_atom_buf.pos;
 
-    } else if (mp4->length) {
-        start_sample = (uint32_t) (trak->end_sample - trak->start_sample);
-        samples = 0;
+    if (tkhd_atom->version[0] == 0) {
+        t->track_id = ngx_mp4_get_32value(tkhd_atom->track_id);
 
-        data = trak->out[NGX_HTTP_MP4_STSC_START].buf;
+    } else {
+        t->track_id = ngx_mp4_get_32value(tkhd64_atom->track_id);
+    }
 
-        if (data) {
-            entry = (ngx_mp4_stsc_entry_t *) data->pos;
-            samples = ngx_mp4_get_32value(entry->samples);
-            entries--;
+    buf = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+    t->stts = buf->pos;
+    t->stts_end = buf->last;
 
-            if (samples > start_sample) {
-                samples = start_sample;
-                ngx_mp4_set_32value(entry->samples, samples);
-            }
+    buf = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
 
-            start_sample -= samples;
-        }
+    if (buf) {
+        t->ctts = buf->pos;
+        t->ctts_end = buf->last;
+        t->ctts_version = trak->ctts_atom_buf.pos[8];
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stsc crop end_sample:%uD, ext_samples:%uD",
-                       start_sample, samples);
+    buf = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    if (buf) {
+        t->stss = buf->pos;
+        t->stss_end = buf->last;
+    }
+
+    buf = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
+
+    if (buf) {
+        t->stsz = buf->pos;
 
     } else {
-        return NGX_OK;
+        t->uniform_size = ngx_mp4_get_32value(
+            ((ngx_mp4_stsz_atom_t *) trak->stsz_atom_buf.pos)->uniform_size);
     }
 
-    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    buf = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    t->stsc = buf->pos;
+    t->stsc_end = buf->last;
 
-    entry = (ngx_mp4_stsc_entry_t *) data->pos;
-    end = (ngx_mp4_stsc_entry_t *) data->last;
+    buf = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
 
-    chunk = ngx_mp4_get_32value(entry->chunk);
-    samples = ngx_mp4_get_32value(entry->samples);
-    id = ngx_mp4_get_32value(entry->id);
-    prev_samples = 0;
-    entry++;
+    if (buf) {
+        t->chunks = buf->pos;
+        t->co64 = 1;
 
-    while (entry < end) {
+    } else {
+        t->chunks = trak->out[NGX_HTTP_MP4_STCO_DATA].buf->pos;
+    }
 
-        next_chunk = ngx_mp4_get_32value(entry->chunk);
+    return NGX_OK;
+}
 
-        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sample:%uD, chunk:%uD, chunks:%uD, "
-                       "samples:%uD, id:%uD",
-                       start_sample, chunk, next_chunk - chunk, samples, id);
 
-        n = (next_chunk - chunk) * samples;
+static ngx_int_t
+ngx_http_mp4_hls_next_sample(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *t)
+{
+    ngx_mp4_stts_entry_t  *stts;
+    ngx_mp4_ctts_entry_t  *ctts;
+    ngx_mp4_stsc_entry_t  *stsc;
 
-        if (start_sample < n) {
-            goto found;
-        }
+    if (t->sample == t->samples) {
+        return NGX_DONE;
+    }
 
-        start_sample -= n;
+    while (t->stts_left == 0) {
+        if (t->stts == t->stts_end) {
+            goto invalid;
+        }
 
-        prev_samples = samples;
-        chunk = next_chunk;
-        samples = ngx_mp4_get_32value(entry->samples);
-        id = ngx_mp4_get_32value(entry->id);
-        entries--;
-        entry++;
+        stts = (ngx_mp4_stts_entry_t *) t->stts;
+        t->stts_left = ngx_mp4_get_32value(stts->count);
+        t->stts_duration = ngx_mp4_get_32value(stts->duration);
+        t->stts += sizeof(ngx_mp4_stts_entry_t);
     }
 
-    next_chunk = trak->chunks + 1;
+    t->stts_left--;
 
-    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
-                   start_sample, chunk, next_chunk - chunk, samples);
+    t->dts = t->next_dts;
+    t->duration = t->stts_duration;
+    t->next_dts += t->duration;
 
-    n = (next_chunk - chunk) * samples;
+    t->offset = 0;
 
-    if (start_sample > n) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "%s time is out mp4 stsc chunks in \"%s\"",
-                      start ? "start" : "end", mp4->file.name.data);
-        return NGX_ERROR;
+    if (t->ctts) {
+        while (t->ctts_left == 0 && t->ctts < t->ctts_end) {
+            ctts = (ngx_mp4_ctts_entry_t *) t->ctts;
+            t->ctts_left = ngx_mp4_get_32value(ctts->count);
+            t->ctts_offset = ngx_mp4_get_32value(ctts->offset);
+            t->ctts += sizeof(ngx_mp4_ctts_entry_t);
+        }
+
+        if (t->ctts_left) {
+            t->ctts_left--;
+            t->offset = t->ctts_offset;
+        }
     }
 
-found:
+    t->key = 1;
 
-    entries++;
-    entry--;
+    if (t->stss) {
+        while (t->stss < t->stss_end
+               && ngx_mp4_get_32value(t->stss) <= t->sample)
+        {
+            t->stss += sizeof(uint32_t);
+        }
 
-    if (samples == 0) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "zero number of samples in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+        t->key = (t->stss < t->stss_end
+                  && ngx_mp4_get_32value(t->stss) == t->sample + 1);
     }
 
-    target_chunk = chunk - 1;
-    target_chunk += start_sample / samples;
-    chunk_samples = start_sample % samples;
+    if (t->chunk_left == 0) {
+        t->chunk++;
 
-    if (start) {
-        data->pos = (u_char *) entry;
+        while (t->stsc < t->stsc_end) {
+            stsc = (ngx_mp4_stsc_entry_t *) t->stsc;
 
-        trak->sample_to_chunk_entries = entries;
-        trak->start_chunk = target_chunk;
-        trak->start_chunk_samples = chunk_samples;
+            if (ngx_mp4_get_32value(stsc->chunk) > t->chunk) {
+                break;
+            }
 
-        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 1);
+            t->chunk_samples = ngx_mp4_get_32value(stsc->samples);
+            t->stsc += sizeof(ngx_mp4_stsc_entry_t);
+        }
 
-        samples -= chunk_samples;
+        if (t->chunk > t->trak->chunks || t->chunk_samples == 0) {
+            goto invalid;
+        }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "start_chunk:%ui, start_chunk_samples:%ui",
-                       trak->start_chunk, trak->start_chunk_samples);
+        t->chunk_left = t->chunk_samples;
 
-    } else {
-        if (start_sample) {
-            data->last = (u_char *) (entry + 1);
-            trak->sample_to_chunk_entries -= entries - 1;
-            trak->end_chunk_samples = samples;
+        if (t->co64) {
+            t->pos = ngx_mp4_get_64value(t->chunks
+                                         + (t->chunk - 1) * sizeof(uint64_t));
 
         } else {
-            data->last = (u_char *) entry;
-            trak->sample_to_chunk_entries -= entries;
-            trak->end_chunk_samples = prev_samples;
+            t->pos = ngx_mp4_get_32value(t->chunks
+                                         + (t->chunk - 1) * sizeof(uint32_t));
         }
 
-        if (chunk_samples) {
-            trak->end_chunk = target_chunk + 1;
-            trak->end_chunk_samples = chunk_samples;
+    } else {
+        t->pos += t->size;
+    }
 
-        } else {
-            trak->end_chunk = target_chunk;
-        }
+    t->chunk_left--;
 
-        samples = chunk_samples;
-        next_chunk = chunk + 1;
+    if (t->stsz) {
+        t->size = ngx_mp4_get_32value(t->stsz + t->sample * sizeof(uint32_t));
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_chunk:%ui, end_chunk_samples:%ui",
-                       trak->end_chunk, trak->end_chunk_samples);
+    } else {
+        t->size = t->uniform_size;
     }
 
-    if (chunk_samples && next_chunk - target_chunk == 2) {
+    t->sample++;
 
-        ngx_mp4_set_32value(entry->samples, samples);
+    return NGX_OK;
 
-    } else if (chunk_samples && start) {
+invalid:
 
-        first = &trak->stsc_start_chunk_entry;
-        ngx_mp4_set_32value(first->chunk, 1);
-        ngx_mp4_set_32value(first->samples, samples);
-        ngx_mp4_set_32value(first->id, id);
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 sample tables are inconsistent",
+                  mp4->file.name.data);
 
-        buf = &trak->stsc_start_chunk_buf;
-        buf->temporary = 1;
-        buf->pos = (u_char *) first;
-        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
+    return NGX_ERROR;
+}
 
-        trak->out[NGX_HTTP_MP4_STSC_START].buf = buf;
 
-        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 2);
+static ngx_array_t *
+ngx_http_mp4_hls_segments(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *ref)
+{
+    uint64_t                  *b, target;
+    ngx_int_t                  rc;
+    ngx_array_t               *segments;
+    ngx_http_mp4_conf_t       *conf;
+    ngx_http_mp4_hls_track_t   t;
+
+    /*
+     * the array contains start times of segments in the reference
+     * track timescale followed by the end time of the last segment
+     */
+
+    segments = ngx_array_create(mp4->request->pool, 64, sizeof(uint64_t));
+    if (segments == NULL) {
+        return NULL;
+    }
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    target = (uint64_t) conf->hls_fragment * ref->timescale / 1000;
+
+    t = *ref;
+    b = NULL;
+
+    for ( ;; ) {
+        rc = ngx_http_mp4_hls_next_sample(mp4, &t);
 
-        trak->sample_to_chunk_entries++;
+        if (rc == NGX_DONE) {
+            break;
+        }
 
-    } else if (chunk_samples) {
+        if (rc == NGX_ERROR) {
+            return NULL;
+        }
 
-        first = &trak->stsc_end_chunk_entry;
-        ngx_mp4_set_32value(first->chunk, trak->end_chunk - trak->start_chunk);
-        ngx_mp4_set_32value(first->samples, samples);
-        ngx_mp4_set_32value(first->id, id);
+        if (b && !(t.key && t.dts - *b >= target)) {
+            continue;
+        }
 
-        buf = &trak->stsc_end_chunk_buf;
-        buf->temporary = 1;
-        buf->pos = (u_char *) first;
-        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
+        b = ngx_array_push(segments);
+        if (b == NULL) {
+            return NULL;
+        }
 
-        trak->out[NGX_HTTP_MP4_STSC_END].buf = buf;
+        *b = t.dts;
+    }
 
-        trak->sample_to_chunk_entries++;
+    if (b == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 samples were found in \"%s\"",
+                      mp4->file.name.data);
+        return NULL;
     }
 
-    return NGX_OK;
-}
+    b = ngx_array_push(segments);
+    if (b == NULL) {
+        return NULL;
+    }
 
+    *b = t.next_dts;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    uniform_size[4];
-    u_char    entries[4];
-} ngx_mp4_stsz_atom_t;
+    return segments;
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_stsz_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *ref, ngx_array_t *segments)
 {
-    u_char               *atom_header, *atom_table, *atom_end;
-    size_t                atom_size;
-    uint32_t              entries, size;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsz_atom_t  *stsz_atom;
-    ngx_http_mp4_trak_t  *trak;
+    u_char              *p;
+    size_t               len, escape;
+    double               duration, max;
+    uint64_t            *b;
+    ngx_str_t            name;
+    ngx_buf_t           *buf;
+    ngx_uint_t           i, n, target;
+    ngx_chain_t         *cl;
+    ngx_http_request_t  *r;
 
-    /* sample sizes atom */
+    r = mp4->request;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsz atom");
+    /* segments are referenced relative to the file name */
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsz_atom = (ngx_mp4_stsz_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stsz_atom, 's', 't', 's', 'z');
+    name.data = r->uri.data + r->uri.len;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsz atom too small", mp4->file.name.data);
+    while (name.data > r->uri.data && name.data[-1] != '/') {
+        name.data--;
+    }
+
+    name.len = r->uri.data + r->uri.len - name.data;
+
+    escape = 2 * ngx_escape_uri(NULL, name.data, name.len,
+                                NGX_ESCAPE_URI_COMPONENT);
+
+    b = segments->elts;
+    n = segments->nelts - 1;
+
+    max = 0;
+
+    for (i = 0; i < n; i++) {
+        duration = (double) (b[i + 1] - b[i]) / ref->timescale;
+
+        if (duration > max) {
+            max = duration;
+        }
+    }
+
+    len = sizeof("#EXTM3U" CRLF) - 1
+          + sizeof("#EXT-X-VERSION:7" CRLF) - 1
+          + sizeof("#EXT-X-TARGETDURATION:" CRLF) - 1 + NGX_INT_T_LEN
+          + sizeof("#EXT-X-PLAYLIST-TYPE:VOD" CRLF) - 1
+          + sizeof("#EXT-X-MAP:URI=\"?hls=init.mp4\"" CRLF) - 1
+          + name.len + escape
+          + n * (sizeof("#EXTINF:.000," CRLF) - 1 + NGX_INT_T_LEN
+                 + sizeof("?hls=.m4s" CRLF) - 1 + NGX_INT_T_LEN
+                 + name.len + escape)
+          + sizeof("#EXT-X-ENDLIST" CRLF) - 1;
+
+    buf = ngx_create_temp_buf(r->pool, len);
+    if (buf == NULL) {
         return NGX_ERROR;
     }
 
-    size = ngx_mp4_get_32value(stsz_atom->uniform_size);
-    entries = ngx_mp4_get_32value(stsz_atom->entries);
+    p = ngx_cpymem(buf->last, "#EXTM3U" CRLF "#EXT-X-VERSION:7" CRLF,
+                   sizeof("#EXTM3U" CRLF "#EXT-X-VERSION:7" CRLF) - 1);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample uniform size:%uD, entries:%uD", size, entries);
+    /* segment durations rounded to the nearest integer */
 
-    trak = ngx_mp4_last_trak(mp4);
-    trak->sample_sizes_entries = entries;
+    target = (ngx_uint_t) (max + 0.5);
 
-    atom_table = atom_header + sizeof(ngx_mp4_stsz_atom_t);
+    p = ngx_sprintf(p, "#EXT-X-TARGETDURATION:%ui" CRLF
+                       "#EXT-X-PLAYLIST-TYPE:VOD" CRLF
+                       "#EXT-X-MAP:URI=\"",
+                    target ? target : 1);
 
-    atom = &trak->stsz_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    p = (u_char *) ngx_escape_uri(p, name.data, name.len,
+                                  NGX_ESCAPE_URI_COMPONENT);
 
-    trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf = atom;
+    p = ngx_cpymem(p, "?hls=init.mp4\"" CRLF,
+                   sizeof("?hls=init.mp4\"" CRLF) - 1);
 
-    if (size == 0) {
-        if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t)
-            + entries * sizeof(uint32_t) > atom_data_size)
-        {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 stsz atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
+    for (i = 0; i < n; i++) {
+        duration = (double) (b[i + 1] - b[i]) / ref->timescale;
 
-        atom_end = atom_table + entries * sizeof(uint32_t);
+        p = ngx_sprintf(p, "#EXTINF:%.3f," CRLF, duration);
+        p = (u_char *) ngx_escape_uri(p, name.data, name.len,
+                                      NGX_ESCAPE_URI_COMPONENT);
+        p = ngx_sprintf(p, "?hls=%ui.m4s" CRLF, i);
+    }
 
-        data = &trak->stsz_data_buf;
-        data->temporary = 1;
-        data->pos = atom_table;
-        data->last = atom_end;
+    p = ngx_cpymem(p, "#EXT-X-ENDLIST" CRLF,
+                   sizeof("#EXT-X-ENDLIST" CRLF) - 1);
 
-        trak->out[NGX_HTTP_MP4_STSZ_DATA].buf = data;
+    buf->last = p;
+    buf->last_buf = (r == r->main) ? 1 : 0;
+    buf->last_in_chain = 1;
 
-    } else {
-        /* if size != 0 then all samples are the same size */
-        /* TODO : chunk samples */
-        atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-        ngx_mp4_set_32value(atom_header, atom_size);
-        trak->size += atom_size;
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    cl->buf = buf;
+    cl->next = NULL;
+
+    mp4->out = cl;
+    mp4->content_length = buf->last - buf->pos;
+
+    ngx_str_set(&r->headers_out.content_type, "application/vnd.apple.mpegurl");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_mp4_update_stsz_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+ngx_http_mp4_hls_init_segment(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *tracks, ngx_uint_t n)
 {
-    size_t                atom_size;
-    uint32_t             *pos, *end, entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsz_atom_t  *stsz_atom;
+    u_char               *p, *trak_atom, *mdia_atom, *minf_atom, *stbl_atom;
+    size_t                size;
+    ngx_buf_t            *buf;
+    ngx_uint_t            i, j;
+    ngx_chain_t          *cl;
+    ngx_http_mp4_trak_t  *trak;
+
+    static ngx_uint_t     atoms[] = {
+        NGX_HTTP_MP4_TKHD_ATOM, NGX_HTTP_MP4_MDHD_ATOM,
+        NGX_HTTP_MP4_HDLR_ATOM, NGX_HTTP_MP4_VMHD_ATOM,
+        NGX_HTTP_MP4_SMHD_ATOM, NGX_HTTP_MP4_DINF_ATOM,
+        NGX_HTTP_MP4_STSD_ATOM
+    };
 
     /*
-     * mdia.minf.stbl.stsz updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
+     * the moov atom contains the original track headers and sample
+     * descriptions with empty sample tables, followed by the mvex atom
      */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stsz atom update");
+    size = 24 + 8 + ngx_mp4_buf_size(mp4->mvhd_atom.buf) + 8 + n * 32;
 
-    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
+    for (i = 0; i < n; i++) {
+        trak = tracks[i].trak;
 
-    if (data) {
-        entries = trak->sample_sizes_entries;
+        /* trak, mdia, minf, stbl and empty stts, stsc, stsz, stco atoms */
+        size += 4 * 8 + 16 + 16 + 20 + 16;
 
-        if (trak->start_sample > entries) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "start time is out mp4 stsz samples in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        for (j = 0; j < sizeof(atoms) / sizeof(ngx_uint_t); j++) {
+            size += ngx_mp4_buf_size(trak->out[atoms[j]].buf);
         }
+    }
 
-        entries -= trak->start_sample;
-        data->pos += trak->start_sample * sizeof(uint32_t);
-        end = (uint32_t *) data->pos;
+    buf = ngx_create_temp_buf(mp4->request->pool, size);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
 
-        for (pos = end - trak->start_chunk_samples; pos < end; pos++) {
-            trak->start_chunk_samples_size += ngx_mp4_get_32value(pos);
-        }
+    p = buf->last;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "chunk samples sizes:%uL",
-                       trak->start_chunk_samples_size);
+    ngx_mp4_write_atom_header(p, 24, "ftyp");
+    p = ngx_cpymem(p, "iso6", 4);
+    ngx_mp4_write_32value(p, 1);
+    p = ngx_cpymem(p, "iso6mp41", 8);
 
-        if (mp4->length) {
-            if (trak->end_sample - trak->start_sample > entries) {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "end time is out mp4 stsz samples in \"%s\"",
-                              mp4->file.name.data);
-                return NGX_ERROR;
-            }
+    ngx_mp4_write_atom_header(p, size - 24, "moov");
 
-            entries = trak->end_sample - trak->start_sample;
-            data->last = data->pos + entries * sizeof(uint32_t);
-            end = (uint32_t *) data->last;
+    if (mp4->mvhd_atom.buf) {
+        p = ngx_cpymem(p, mp4->mvhd_atom_buf.pos,
+                       ngx_mp4_buf_size(&mp4->mvhd_atom_buf));
+    }
 
-            for (pos = end - trak->end_chunk_samples; pos < end; pos++) {
-                trak->end_chunk_samples_size += ngx_mp4_get_32value(pos);
-            }
+    for (i = 0; i < n; i++) {
+        trak = tracks[i].trak;
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "mp4 stsz end_chunk_samples_size:%uL",
-                           trak->end_chunk_samples_size);
+        /* container atom sizes are set when their contents are written */
+
+        trak_atom = p;
+        ngx_mp4_write_atom_header(p, 0, "trak");
+        p = ngx_cpymem(p, trak->tkhd_atom_buf.pos,
+                       ngx_mp4_buf_size(&trak->tkhd_atom_buf));
+
+        mdia_atom = p;
+        ngx_mp4_write_atom_header(p, 0, "mdia");
+        p = ngx_cpymem(p, trak->mdhd_atom_buf.pos,
+                       ngx_mp4_buf_size(&trak->mdhd_atom_buf));
+        p = ngx_cpymem(p, trak->hdlr_atom_buf.pos,
+                       ngx_mp4_buf_size(&trak->hdlr_atom_buf));
+
+        minf_atom = p;
+        ngx_mp4_write_atom_header(p, 0, "minf");
+
+        for (j = NGX_HTTP_MP4_VMHD_ATOM; j <= NGX_HTTP_MP4_DINF_ATOM; j++) {
+            if (trak->out[j].buf) {
+                p = ngx_cpymem(p, trak->out[j].buf->pos,
+                               ngx_mp4_buf_size(trak->out[j].buf));
+            }
         }
 
-        atom_size = sizeof(ngx_mp4_stsz_atom_t) + (data->last - data->pos);
-        trak->size += atom_size;
+        stbl_atom = p;
+        ngx_mp4_write_atom_header(p, 0, "stbl");
+        p = ngx_cpymem(p, trak->stsd_atom_buf.pos,
+                       ngx_mp4_buf_size(&trak->stsd_atom_buf));
 
-        atom = trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf;
-        stsz_atom = (ngx_mp4_stsz_atom_t *) atom->pos;
+        ngx_mp4_write_atom_header(p, 16, "stts");
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
 
-        ngx_mp4_set_32value(stsz_atom->size, atom_size);
-        ngx_mp4_set_32value(stsz_atom->entries, entries);
+        ngx_mp4_write_atom_header(p, 16, "stsc");
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+
+        ngx_mp4_write_atom_header(p, 20, "stsz");
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+
+        ngx_mp4_write_atom_header(p, 16, "stco");
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+
+        ngx_mp4_set_32value(stbl_atom, p - stbl_atom);
+        ngx_mp4_set_32value(minf_atom, p - minf_atom);
+        ngx_mp4_set_32value(mdia_atom, p - mdia_atom);
+        ngx_mp4_set_32value(trak_atom, p - trak_atom);
     }
 
-    return NGX_OK;
-}
+    ngx_mp4_write_atom_header(p, 8 + n * 32, "mvex");
 
+    for (i = 0; i < n; i++) {
+        ngx_mp4_write_atom_header(p, 32, "trex");
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, tracks[i].track_id);
+        ngx_mp4_write_32value(p, 1);
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+        ngx_mp4_write_32value(p, 0);
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_stco_atom_t;
+    buf->last = p;
+    buf->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    buf->last_in_chain = 1;
 
+    cl = ngx_alloc_chain_link(mp4->request->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
 
-static ngx_int_t
-ngx_http_mp4_read_stco_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stco_atom_t  *stco_atom;
-    ngx_http_mp4_trak_t  *trak;
+    cl->buf = buf;
+    cl->next = NULL;
 
-    /* chunk offsets atom */
+    mp4->out = cl;
+    mp4->content_length = buf->last - buf->pos;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stco atom");
+    return NGX_OK;
+}
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stco_atom = (ngx_mp4_stco_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stco_atom, 's', 't', 'c', 'o');
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+static ngx_int_t
+ngx_http_mp4_hls_media_segment(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_hls_track_t *tracks, ngx_uint_t n,
+    ngx_http_mp4_hls_track_t *ref, ngx_array_t *segments)
+{
+    u_char                     *p;
+    off_t                       data_size;
+    size_t                      moof_size;
+    uint32_t                    data_offset;
+    uint64_t                    start, end, *b, *dts;
+    ngx_int_t                   rc;
+    ngx_buf_t                  *buf, *last;
+    ngx_uint_t                  i, j, last_segment;
+    ngx_array_t                *samples;
+    ngx_chain_t                *cl, **ll;
+    ngx_http_request_t         *r;
+    ngx_http_mp4_hls_track_t   *t;
+    ngx_http_mp4_hls_sample_t  *s;
+
+    r = mp4->request;
+
+    if (mp4->segment >= segments->nelts - 1) {
+        return NGX_HTTP_NOT_FOUND;
     }
 
-    entries = ngx_mp4_get_32value(stco_atom->entries);
+    b = segments->elts;
+    start = b[mp4->segment];
+    end = b[mp4->segment + 1];
+    last_segment = (mp4->segment == segments->nelts - 2);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
+    samples = ngx_pcalloc(r->pool, n * sizeof(ngx_array_t));
+    if (samples == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t)
-        + entries * sizeof(uint32_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
+    dts = ngx_pcalloc(r->pool, n * sizeof(uint64_t));
+    if (dts == NULL) {
         return NGX_ERROR;
     }
 
-    atom_table = atom_header + sizeof(ngx_mp4_stco_atom_t);
-    atom_end = atom_table + entries * sizeof(uint32_t);
+    moof_size = 8 + 16;
+    data_size = 0;
 
-    trak = ngx_mp4_last_trak(mp4);
-    trak->chunks = entries;
+    for (i = 0; i < n; i++) {
+        t = &tracks[i];
 
-    atom = &trak->stco_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+        if (ngx_array_init(&samples[i], r->pool, 64,
+                           sizeof(ngx_http_mp4_hls_sample_t))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
 
-    data = &trak->stco_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+        for ( ;; ) {
+            rc = ngx_http_mp4_hls_next_sample(mp4, t);
 
-    trak->out[NGX_HTTP_MP4_STCO_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STCO_DATA].buf = data;
+            if (rc == NGX_DONE) {
+                break;
+            }
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
 
-    return NGX_OK;
-}
+            /* times are compared in the reference track timescale */
 
+            if (t->dts * ref->timescale < start * t->timescale) {
+                continue;
+            }
 
-static ngx_int_t
-ngx_http_mp4_update_stco_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    size_t                atom_size;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stco_atom_t  *stco_atom;
+            if (!last_segment
+                && t->dts * ref->timescale >= end * t->timescale)
+            {
+                break;
+            }
 
-    /*
-     * mdia.minf.stbl.stco updating requires trak->start_chunk
-     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+            if (samples[i].nelts == 0) {
+                dts[i] = t->dts;
+            }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stco atom update");
+            s = ngx_array_push(&samples[i]);
+            if (s == NULL) {
+                return NGX_ERROR;
+            }
+
+            s->duration = t->duration;
+            s->size = t->size;
+            s->flags = t->key ? 0x02000000 : 0x01010000;
+            s->offset = t->offset;
+            s->pos = t->pos;
+
+            data_size += t->size;
+        }
+
+        if (samples[i].nelts) {
+            moof_size += 8 + 16 + 20 + 20 + 16 * samples[i].nelts;
+        }
+    }
 
-    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
+    if (moof_size == 8 + 16) {
+        return NGX_HTTP_NOT_FOUND;
+    }
 
-    if (data == NULL) {
+    if (moof_size + 8 + data_size > 0xffffffff) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stco atoms were found in \"%s\"",
-                      mp4->file.name.data);
+                      "mp4 segment %ui is too large in \"%s\"",
+                      mp4->segment, mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    if (trak->start_chunk > trak->chunks) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 stco chunks in \"%s\"",
-                      mp4->file.name.data);
+    buf = ngx_create_temp_buf(r->pool, moof_size + 8);
+    if (buf == NULL) {
         return NGX_ERROR;
     }
 
-    data->pos += trak->start_chunk * sizeof(uint32_t);
-
-    trak->start_offset = ngx_mp4_get_32value(data->pos);
-    trak->start_offset += trak->start_chunk_samples_size;
-    ngx_mp4_set_32value(data->pos, trak->start_offset);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "start chunk offset:%O", trak->start_offset);
+    p = buf->last;
 
-    if (mp4->length) {
+    ngx_mp4_write_atom_header(p, moof_size, "moof");
 
-        if (trak->end_chunk > trak->chunks) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "end time is out mp4 stco chunks in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
+    ngx_mp4_write_atom_header(p, 16, "mfhd");
+    ngx_mp4_write_32value(p, 0);
+    ngx_mp4_write_32value(p, mp4->segment + 1);
 
-        entries = trak->end_chunk - trak->start_chunk;
-        data->last = data->pos + entries * sizeof(uint32_t);
+    data_offset = moof_size + 8;
 
-        if (entries) {
-            trak->end_offset =
-                            ngx_mp4_get_32value(data->last - sizeof(uint32_t));
-            trak->end_offset += trak->end_chunk_samples_size;
+    for (i = 0; i < n; i++) {
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "end chunk offset:%O", trak->end_offset);
+        if (samples[i].nelts == 0) {
+            continue;
         }
 
-    } else {
-        entries = trak->chunks - trak->start_chunk;
-        trak->end_offset = mp4->mdat_data.buf->file_last;
-    }
+        ngx_mp4_write_atom_header(p, 8 + 16 + 20 + 20
+                                     + 16 * samples[i].nelts, "traf");
 
-    if (entries == 0) {
-        trak->start_offset = mp4->end;
-        trak->end_offset = 0;
-    }
+        /* default-base-is-moof */
 
-    atom_size = sizeof(ngx_mp4_stco_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+        ngx_mp4_write_atom_header(p, 16, "tfhd");
+        ngx_mp4_write_32value(p, 0x020000);
+        ngx_mp4_write_32value(p, tracks[i].track_id);
 
-    atom = trak->out[NGX_HTTP_MP4_STCO_ATOM].buf;
-    stco_atom = (ngx_mp4_stco_atom_t *) atom->pos;
+        ngx_mp4_write_atom_header(p, 20, "tfdt");
+        ngx_mp4_write_32value(p, 0x01000000);
+        ngx_mp4_write_64value(p, dts[i]);
 
-    ngx_mp4_set_32value(stco_atom->size, atom_size);
-    ngx_mp4_set_32value(stco_atom->entries, entries);
+        /*
+         * data-offset, sample-duration, sample-size, sample-flags and
+         * sample-composition-time-offset are present; signed offsets of
+         * version 1 ctts atoms are kept by version 1 trun atoms
+         */
 
-    return NGX_OK;
-}
+        ngx_mp4_write_atom_header(p, 20 + 16 * samples[i].nelts, "trun");
+        ngx_mp4_write_32value(p, (uint32_t) tracks[i].ctts_version << 24
+                                 | 0x000f01);
+        ngx_mp4_write_32value(p, samples[i].nelts);
+        ngx_mp4_write_32value(p, data_offset);
 
+        s = samples[i].elts;
 
-static void
-ngx_http_mp4_adjust_stco_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, int32_t adjustment)
-{
-    uint32_t    offset, *entry, *end;
-    ngx_buf_t  *data;
+        for (j = 0; j < samples[i].nelts; j++) {
+            ngx_mp4_write_32value(p, s[j].duration);
+            ngx_mp4_write_32value(p, s[j].size);
+            ngx_mp4_write_32value(p, s[j].flags);
+            ngx_mp4_write_32value(p, s[j].offset);
 
-    /*
-     * moov.trak.mdia.minf.stbl.stco adjustment requires
-     * minimal start offset of all traks and new moov atom size
-     */
+            data_offset += s[j].size;
+        }
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stco atom adjustment");
+    ngx_mp4_write_atom_header(p, 8 + data_size, "mdat");
 
-    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
-    entry = (uint32_t *) data->pos;
-    end = (uint32_t *) data->last;
+    buf->last = p;
 
-    while (entry < end) {
-        offset = ngx_mp4_get_32value(entry);
-        offset += adjustment;
-        ngx_mp4_set_32value(entry, offset);
-        entry++;
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
-}
 
+    cl->buf = buf;
+    mp4->out = cl;
+    ll = &cl->next;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_co64_atom_t;
+    /* adjacent samples are sent with a single file buffer */
 
+    last = buf;
 
-static ngx_int_t
-ngx_http_mp4_read_co64_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_co64_atom_t  *co64_atom;
-    ngx_http_mp4_trak_t  *trak;
+    for (i = 0; i < n; i++) {
+        s = samples[i].elts;
 
-    /* chunk offsets atom */
+        for (j = 0; j < samples[i].nelts; j++) {
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 co64 atom");
+            if (s[j].size == 0) {
+                continue;
+            }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    co64_atom = (ngx_mp4_co64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(co64_atom, 'c', 'o', '6', '4');
+            if (last->in_file && last->file_last == s[j].pos) {
+                last->file_last += s[j].size;
+                continue;
+            }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+            last = ngx_calloc_buf(r->pool);
+            if (last == NULL) {
+                return NGX_ERROR;
+            }
 
-    entries = ngx_mp4_get_32value(co64_atom->entries);
+            last->in_file = 1;
+            last->file = &mp4->file;
+            last->file_pos = s[j].pos;
+            last->file_last = s[j].pos + s[j].size;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t)
-        + entries * sizeof(uint64_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+            cl->buf = last;
+            *ll = cl;
+            ll = &cl->next;
+        }
     }
 
-    atom_table = atom_header + sizeof(ngx_mp4_co64_atom_t);
-    atom_end = atom_table + entries * sizeof(uint64_t);
+    *ll = NULL;
 
-    trak = ngx_mp4_last_trak(mp4);
-    trak->chunks = entries;
+    last->last_buf = (r == r->main) ? 1 : 0;
+    last->last_in_chain = 1;
 
-    atom = &trak->co64_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    mp4->content_length = moof_size + 8 + data_size;
 
-    data = &trak->co64_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    return NGX_OK;
+}
 
-    trak->out[NGX_HTTP_MP4_CO64_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_CO64_DATA].buf = data;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+static char *
+ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
 
-    return NGX_OK;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mp4_handler;
+
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+static char *
+ngx_http_mp4_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    size_t                atom_size;
-    uint64_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_co64_atom_t  *co64_atom;
+    ngx_http_mp4_conf_t *mcf = conf;
 
-    /*
-     * mdia.minf.stbl.co64 updating requires trak->start_chunk
-     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    u_char                *p;
+    ssize_t                size;
+    ngx_str_t             *value, name, s;
+    ngx_http_mp4_cache_t  *cache;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 co64 atom update");
+    if (mcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+    value = cf->args->elts;
 
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 co64 atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mcf->cache = NULL;
+        return NGX_CONF_OK;
     }
 
-    if (trak->start_chunk > trak->chunks) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 co64 chunks in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    name = value[1];
+    size = 0;
 
-    data->pos += trak->start_chunk * sizeof(uint64_t);
+    p = (u_char *) ngx_strchr(name.data, ':');
 
-    trak->start_offset = ngx_mp4_get_64value(data->pos);
-    trak->start_offset += trak->start_chunk_samples_size;
-    ngx_mp4_set_64value(data->pos, trak->start_offset);
+    if (p) {
+        name.len = p - name.data;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "start chunk offset:%O", trak->start_offset);
+        s.data = p + 1;
+        s.len = value[1].data + value[1].len - s.data;
 
-    if (mp4->length) {
+        size = ngx_parse_size(&s);
 
-        if (trak->end_chunk > trak->chunks) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "end time is out mp4 co64 chunks in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
         }
 
-        entries = trak->end_chunk - trak->start_chunk;
-        data->last = data->pos + entries * sizeof(uint64_t);
-
-        if (entries) {
-            trak->end_offset =
-                            ngx_mp4_get_64value(data->last - sizeof(uint64_t));
-            trak->end_offset += trak->end_chunk_samples_size;
-
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "end chunk offset:%O", trak->end_offset);
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
         }
+    }
 
-    } else {
-        entries = trak->chunks - trak->start_chunk;
-        trak->end_offset = mp4->mdat_data.buf->file_last;
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    if (entries == 0) {
-        trak->start_offset = mp4->end;
-        trak->end_offset = 0;
+    mcf->cache = ngx_shared_memory_add(cf, &name, size, &ngx_http_mp4_module);
+    if (mcf->cache == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    atom_size = sizeof(ngx_mp4_co64_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+    if (mcf->cache->data) {
+        return NGX_CONF_OK;
+    }
 
-    atom = trak->out[NGX_HTTP_MP4_CO64_ATOM].buf;
-    co64_atom = (ngx_mp4_co64_atom_t *) atom->pos;
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_mp4_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    ngx_mp4_set_32value(co64_atom->size, atom_size);
-    ngx_mp4_set_32value(co64_atom->entries, entries);
+    cache->shm_zone = mcf->cache;
 
-    return NGX_OK;
+    mcf->cache->init = ngx_http_mp4_init_cache;
+    mcf->cache->data = cache;
+
+    return NGX_CONF_OK;
 }
 
 
-static void
-ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, off_t adjustment)
+static ngx_int_t
+ngx_http_mp4_init_cache(ngx_shm_zone_t *shm_zone, void *data)
 {
-    uint64_t    offset, *entry, *end;
-    ngx_buf_t  *data;
+    ngx_http_mp4_cache_t  *ocache = data;
 
-    /*
-     * moov.trak.mdia.minf.stbl.co64 adjustment requires
-     * minimal start offset of all traks and new moov atom size
-     */
+    size_t                 len;
+    ngx_http_mp4_cache_t  *cache;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 co64 atom adjustment");
+    cache = shm_zone->data;
 
-    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
-    entry = (uint64_t *) data->pos;
-    end = (uint64_t *) data->last;
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
 
-    while (entry < end) {
-        offset = ngx_mp4_get_64value(entry);
-        offset += adjustment;
-        ngx_mp4_set_64value(entry, offset);
-        entry++;
+        return NGX_OK;
     }
-}
 
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-static char *
-ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_core_loc_conf_t  *clcf;
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_mp4_handler;
+        return NGX_OK;
+    }
 
-    return NGX_CONF_OK;
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_mp4_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in mp4 cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in mp4 cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
 }
 
 
@@ -3481,6 +5406,9 @@ ngx_http_mp4_create_conf(ngx_conf_t *cf)
 
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->cache = NGX_CONF_UNSET_PTR;
+    conf->hls = NGX_CONF_UNSET;
+    conf->hls_fragment = NGX_CONF_UNSET_MSEC;
 
     return conf;
 }
@@ -3496,5 +5424,15 @@ ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
                               10 * 1024 * 1024);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_value(conf->hls, prev->hls, 0);
+    ngx_conf_merge_msec_value(conf->hls_fragment, prev->hls_fragment, 5000);
+
+    if (conf->hls_fragment == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"mp4_hls_fragment\" must be positive");
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
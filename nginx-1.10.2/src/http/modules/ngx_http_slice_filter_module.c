@@ -12,6 +12,8 @@
 
 typedef struct {
     size_t      size;
+    ngx_uint_t  lookahead;
+    ngx_uint_t  prefetch;
 } ngx_http_slice_loc_conf_t;
 
 
@@ -34,6 +36,11 @@ typedef struct {
 static ngx_int_t ngx_http_slice_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_slice_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
+static ngx_int_t ngx_http_slice_subrequest(ngx_http_request_t *r,
+    ngx_http_slice_ctx_t *ctx, off_t start, ngx_uint_t flags);
+static ngx_uint_t ngx_http_slice_pending(ngx_http_request_t *r);
+static ngx_int_t ngx_http_slice_prefetch(ngx_http_request_t *r,
+    ngx_http_slice_ctx_t *ctx, off_t complete_length);
 static ngx_int_t ngx_http_slice_parse_content_range(ngx_http_request_t *r,
     ngx_http_slice_content_range_t *cr);
 static ngx_int_t ngx_http_slice_range_variable(ngx_http_request_t *r,
@@ -46,6 +53,15 @@ static ngx_int_t ngx_http_slice_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_slice_init(ngx_conf_t *cf);
 
 
+static ngx_conf_num_bounds_t  ngx_http_slice_lookahead_bounds = {
+    ngx_conf_check_num_bounds, 1, 32
+};
+
+static ngx_conf_num_bounds_t  ngx_http_slice_prefetch_bounds = {
+    ngx_conf_check_num_bounds, 0, 32
+};
+
+
 static ngx_command_t  ngx_http_slice_filter_commands[] = {
 
     { ngx_string("slice"),
@@ -55,6 +71,20 @@ static ngx_command_t  ngx_http_slice_filter_commands[] = {
       offsetof(ngx_http_slice_loc_conf_t, size),
       NULL },
 
+    { ngx_string("slice_lookahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_slice_loc_conf_t, lookahead),
+      &ngx_http_slice_lookahead_bounds },
+
+    { ngx_string("slice_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_slice_loc_conf_t, prefetch),
+      &ngx_http_slice_prefetch_bounds },
+
       ngx_null_command
 };
 
@@ -200,6 +230,13 @@ ngx_http_slice_header_filter(ngx_http_request_t *r)
         ctx->end = cr.complete_length;
     }
 
+    if (rc != NGX_ERROR
+        && slcf->prefetch
+        && ngx_http_slice_prefetch(r, ctx, cr.complete_length) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     return rc;
 }
 
@@ -208,8 +245,8 @@ static ngx_int_t
 ngx_http_slice_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     ngx_int_t                   rc;
+    ngx_uint_t                  n;
     ngx_chain_t                *cl;
-    ngx_http_request_t         *sr;
     ngx_http_slice_ctx_t       *ctx;
     ngx_http_slice_loc_conf_t  *slcf;
 
@@ -244,22 +281,138 @@ ngx_http_slice_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return rc;
     }
 
-    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL, 0) != NGX_OK) {
+    /*
+     * up to "slice_lookahead" slices are fetched in parallel; the postpone
+     * filter sends them in the order the subrequests were created
+     */
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
+
+    for (n = ngx_http_slice_pending(r);
+         n < slcf->lookahead && ctx->start < ctx->end;
+         n++)
+    {
+        if (ngx_http_slice_subrequest(r, ctx, ctx->start, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->start += slcf->size;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_slice_subrequest(ngx_http_request_t *r, ngx_http_slice_ctx_t *ctx,
+    off_t start, ngx_uint_t flags)
+{
+    u_char                     *p;
+    ngx_http_request_t         *sr;
+    ngx_http_slice_ctx_t       *sctx;
+    ngx_http_slice_loc_conf_t  *slcf;
+
+    sctx = ngx_pcalloc(r->pool, sizeof(ngx_http_slice_ctx_t));
+    if (sctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_pnalloc(r->pool, sizeof("bytes=-") - 1 + 2 * NGX_OFF_T_LEN);
+    if (p == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_http_set_ctx(sr, ctx, ngx_http_slice_filter_module);
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL, flags)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(sr, sctx, ngx_http_slice_filter_module);
+
+    if (flags & NGX_HTTP_SUBREQUEST_BACKGROUND) {
+        sr->header_only = 1;
+    }
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
 
-    ctx->range.len = ngx_sprintf(ctx->range.data, "bytes=%O-%O", ctx->start,
-                                 ctx->start + (off_t) slcf->size - 1)
-                     - ctx->range.data;
+    sctx->start = start;
+    sctx->etag = ctx->etag;
+
+    sctx->range.data = p;
+    sctx->range.len = ngx_sprintf(p, "bytes=%O-%O", start,
+                                  start + (off_t) slcf->size - 1)
+                      - p;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http slice subrequest: \"%V\"", &ctx->range);
+                   "http slice subrequest: \"%V\"", &sctx->range);
 
-    return rc;
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_slice_pending(ngx_http_request_t *r)
+{
+    ngx_uint_t                     n;
+    ngx_http_postponed_request_t  *pr;
+
+    /* the active subrequest is no longer in the postponed list */
+
+    n = (r->connection->data != r) ? 1 : 0;
+
+    for (pr = r->postponed; pr; pr = pr->next) {
+        if (pr->request) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_slice_prefetch(ngx_http_request_t *r, ngx_http_slice_ctx_t *ctx,
+    off_t complete_length)
+{
+#if (NGX_HTTP_CACHE)
+
+    off_t                       start;
+    ngx_uint_t                  i;
+    ngx_http_slice_loc_conf_t  *slcf;
+
+    if (r->header_only
+        || r->upstream == NULL
+        || (r->upstream->cache_status != NGX_HTTP_CACHE_MISS
+            && r->upstream->cache_status != NGX_HTTP_CACHE_EXPIRED))
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * on a cache miss the slices following the requested range are
+     * fetched into the cache by background subrequests
+     */
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_slice_filter_module);
+
+    start = slcf->size * ((ctx->end + slcf->size - 1) / slcf->size);
+
+    for (i = 0; i < slcf->prefetch && start < complete_length; i++) {
+
+        if (ngx_http_slice_subrequest(r, ctx, start,
+                                      NGX_HTTP_SUBREQUEST_BACKGROUND)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        start += slcf->size;
+    }
+
+#endif
+
+    return NGX_OK;
 }
 
 
@@ -480,6 +633,8 @@ ngx_http_slice_create_loc_conf(ngx_conf_t *cf)
     }
 
     slcf->size = NGX_CONF_UNSET_SIZE;
+    slcf->lookahead = NGX_CONF_UNSET_UINT;
+    slcf->prefetch = NGX_CONF_UNSET_UINT;
 
     return slcf;
 }
@@ -492,6 +647,8 @@ ngx_http_slice_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_slice_loc_conf_t *conf = child;
 
     ngx_conf_merge_size_value(conf->size, prev->size, 0);
+    ngx_conf_merge_uint_value(conf->lookahead, prev->lookahead, 1);
+    ngx_conf_merge_uint_value(conf->prefetch, prev->prefetch, 0);
 
     return NGX_CONF_OK;
 }
@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_md5.h>
 
 #define NGX_HTTP_SSI_ERROR          1
 
@@ -16,6 +17,24 @@
 #define NGX_HTTP_SSI_ADD_PREFIX     1
 #define NGX_HTTP_SSI_ADD_ZERO       2
 
+#define NGX_HTTP_SSI_OP_TEXT        0
+#define NGX_HTTP_SSI_OP_COMMAND     1
+#define NGX_HTTP_SSI_OP_ERROR       2
+
+#define NGX_HTTP_SSI_TEMPLATE_MAX_SIZE  (1024 * 1024)
+#define NGX_HTTP_SSI_TEMPLATE_KEY_LEN   16
+
+
+typedef struct {
+    ngx_rbtree_t         rbtree;
+    ngx_rbtree_node_t    sentinel;
+    ngx_queue_t          expire_queue;
+
+    ngx_uint_t           current;
+    ngx_uint_t           max;
+    time_t               inactive;
+} ngx_http_ssi_cache_t;
+
 
 typedef struct {
     ngx_flag_t    enable;
@@ -29,6 +48,8 @@ typedef struct {
     size_t        value_len;
 
     ngx_array_t  *types_keys;
+
+    ngx_http_ssi_cache_t  *cache;
 } ngx_http_ssi_loc_conf_t;
 
 
@@ -46,6 +67,44 @@ typedef struct {
 } ngx_http_ssi_block_t;
 
 
+typedef struct {
+    ngx_uint_t        type;
+
+    /* NGX_HTTP_SSI_OP_TEXT */
+    size_t            start;
+    size_t            len;
+
+    /* NGX_HTTP_SSI_OP_COMMAND */
+    ngx_uint_t        key;
+    ngx_str_t         command;
+    ngx_uint_t        nparams;
+    ngx_table_elt_t  *params;
+} ngx_http_ssi_op_t;
+
+
+typedef struct {
+    ngx_str_node_t         sn;
+    ngx_queue_t            queue;
+    ngx_pool_t            *pool;
+    ngx_http_ssi_cache_t  *cache;
+
+    time_t                 mtime;
+    off_t                  size;
+    ngx_str_t              etag;
+    size_t                 value_len;
+
+    time_t                 accessed;
+    ngx_uint_t             count;
+
+    off_t                  parsed;
+    u_char                *text;
+    size_t                 text_len;
+    ngx_array_t            ops;
+
+    unsigned               close:1;
+} ngx_http_ssi_template_t;
+
+
 typedef enum {
     ssi_start_state = 0,
     ssi_tag_state,
@@ -74,6 +133,25 @@ static ngx_int_t ngx_http_ssi_output(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx);
 static void ngx_http_ssi_buffered(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx);
+static ngx_int_t ngx_http_ssi_command(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static void ngx_http_ssi_block_add(ngx_http_request_t *r, ngx_chain_t *cl);
+static ngx_int_t ngx_http_ssi_replay(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static ngx_buf_t *ngx_http_ssi_replay_buf(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static ngx_int_t ngx_http_ssi_template_lookup(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx, ngx_http_ssi_loc_conf_t *slcf);
+static void ngx_http_ssi_template_key(ngx_http_request_t *r, u_char *key);
+static ngx_int_t ngx_http_ssi_compile_text(ngx_http_ssi_ctx_t *ctx,
+    u_char *data, size_t len);
+static ngx_int_t ngx_http_ssi_compile_op(ngx_http_ssi_ctx_t *ctx,
+    ngx_uint_t type);
+static void ngx_http_ssi_compile_done(ngx_http_request_t *r,
+    ngx_http_ssi_ctx_t *ctx);
+static void ngx_http_ssi_template_delete(ngx_http_ssi_template_t *tpl);
+static void ngx_http_ssi_template_cleanup(void *data);
+static void ngx_http_ssi_cache_cleanup(void *data);
 static ngx_int_t ngx_http_ssi_parse(ngx_http_request_t *r,
     ngx_http_ssi_ctx_t *ctx);
 static ngx_str_t *ngx_http_ssi_get_variable(ngx_http_request_t *r,
@@ -112,6 +190,8 @@ static ngx_int_t ngx_http_ssi_date_gmt_local_variable(ngx_http_request_t *r,
 static ngx_int_t ngx_http_ssi_preconfiguration(ngx_conf_t *cf);
 static void *ngx_http_ssi_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_ssi_init_main_conf(ngx_conf_t *cf, void *conf);
+static char *ngx_http_ssi_template_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static void *ngx_http_ssi_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_ssi_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -170,6 +250,13 @@ static ngx_command_t  ngx_http_ssi_filter_commands[] = {
       offsetof(ngx_http_ssi_loc_conf_t, last_modified),
       NULL },
 
+    { ngx_string("ssi_template_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_ssi_template_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -364,7 +451,13 @@ ngx_http_ssi_header_filter(ngx_http_request_t *r)
     ngx_str_set(&ctx->errmsg,
                 "[an error occurred while processing the directive]");
 
-    r->filter_need_in_memory = 1;
+    if (slcf->cache && ngx_http_ssi_template_lookup(r, ctx, slcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->template == NULL) {
+        r->filter_need_in_memory = 1;
+    }
 
     if (r == r->main) {
         ngx_http_clear_content_length(r);
@@ -386,19 +479,12 @@ ngx_http_ssi_header_filter(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    size_t                     len;
     ngx_int_t                  rc;
     ngx_buf_t                 *b;
-    ngx_uint_t                 i, index;
-    ngx_chain_t               *cl, **ll;
-    ngx_table_elt_t           *param;
-    ngx_http_ssi_ctx_t        *ctx, *mctx;
-    ngx_http_ssi_block_t      *bl;
-    ngx_http_ssi_param_t      *prm;
-    ngx_http_ssi_command_t    *cmd;
+    ngx_chain_t               *cl;
+    ngx_http_ssi_ctx_t        *ctx;
     ngx_http_ssi_loc_conf_t   *slcf;
-    ngx_http_ssi_main_conf_t  *smcf;
-    ngx_str_t                 *params[NGX_HTTP_SSI_MAX_PARAMS + 1];
+    ngx_http_ssi_template_t   *tpl;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_ssi_filter_module);
 
@@ -406,7 +492,8 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         || (in == NULL
             && ctx->buf == NULL
             && ctx->in == NULL
-            && ctx->busy == NULL))
+            && ctx->busy == NULL
+            && (ctx->template == NULL || ctx->replayed)))
     {
         return ngx_http_next_body_filter(r, in);
     }
@@ -448,6 +535,10 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         }
     }
 
+    if (ctx->template) {
+        return ngx_http_ssi_replay(r, ctx);
+    }
+
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_ssi_filter_module);
 
     while (ctx->in || ctx->buf) {
@@ -456,6 +547,11 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ctx->buf = ctx->in->buf;
             ctx->in = ctx->in->next;
             ctx->pos = ctx->buf->pos;
+
+            if (ctx->compile) {
+                tpl = ctx->compile;
+                tpl->parsed += ctx->buf->last - ctx->buf->pos;
+            }
         }
 
         if (ctx->state == ssi_start_state) {
@@ -482,6 +578,17 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             if (ctx->copy_start != ctx->copy_end) {
 
+                if (ctx->compile
+                    && (ngx_http_ssi_compile_text(ctx, ngx_http_ssi_string,
+                                                  ctx->saved)
+                        != NGX_OK
+                        || ngx_http_ssi_compile_text(ctx, ctx->copy_start,
+                                          ctx->copy_end - ctx->copy_start)
+                           != NGX_OK))
+                {
+                    return NGX_ERROR;
+                }
+
                 if (ctx->output) {
 
                     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -591,17 +698,7 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
                         b = NULL;
 
-                        mctx = ngx_http_get_module_ctx(r->main,
-                                                   ngx_http_ssi_filter_module);
-                        bl = mctx->blocks->elts;
-                        for (ll = &bl[mctx->blocks->nelts - 1].bufs;
-                             *ll;
-                             ll = &(*ll)->next)
-                        {
-                            /* void */
-                        }
-
-                        *ll = cl;
+                        ngx_http_ssi_block_add(r, cl);
                     }
 
                     ctx->saved = 0;
@@ -626,361 +723,1018 @@ ngx_http_ssi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
             if (rc == NGX_OK) {
 
-                smcf = ngx_http_get_module_main_conf(r,
-                                                   ngx_http_ssi_filter_module);
+                if (ctx->compile
+                    && ngx_http_ssi_compile_op(ctx, NGX_HTTP_SSI_OP_COMMAND)
+                       != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                rc = ngx_http_ssi_command(r, ctx);
+
+                if (rc == NGX_OK) {
+                    continue;
+                }
+
+                if (rc == NGX_DONE || rc == NGX_AGAIN || rc == NGX_ERROR) {
+                    ngx_http_ssi_buffered(r, ctx);
+                    return rc;
+                }
+
+            } else if (ctx->compile
+                       && ngx_http_ssi_compile_op(ctx, NGX_HTTP_SSI_OP_ERROR)
+                          != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            /* rc == NGX_HTTP_SSI_ERROR */
+
+            if (slcf->silent_errors) {
+                continue;
+            }
+
+            if (ctx->free) {
+                cl = ctx->free;
+                ctx->free = ctx->free->next;
+                b = cl->buf;
+                ngx_memzero(b, sizeof(ngx_buf_t));
+
+            } else {
+                b = ngx_calloc_buf(r->pool);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl = ngx_alloc_chain_link(r->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = b;
+            }
+
+            b->memory = 1;
+            b->pos = ctx->errmsg.data;
+            b->last = ctx->errmsg.data + ctx->errmsg.len;
+
+            cl->next = NULL;
+            *ctx->last_out = cl;
+            ctx->last_out = &cl->next;
+
+            continue;
+        }
+
+        if (ctx->buf->last_buf || ngx_buf_in_memory(ctx->buf)) {
+            if (b == NULL) {
+                if (ctx->free) {
+                    cl = ctx->free;
+                    ctx->free = ctx->free->next;
+                    b = cl->buf;
+                    ngx_memzero(b, sizeof(ngx_buf_t));
 
-                cmd = ngx_hash_find(&smcf->hash, ctx->key, ctx->command.data,
-                                    ctx->command.len);
+                } else {
+                    b = ngx_calloc_buf(r->pool);
+                    if (b == NULL) {
+                        return NGX_ERROR;
+                    }
 
-                if (cmd == NULL) {
-                    if (ctx->output) {
-                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                      "invalid SSI command: \"%V\"",
-                                      &ctx->command);
-                        goto ssi_error;
+                    cl = ngx_alloc_chain_link(r->pool);
+                    if (cl == NULL) {
+                        return NGX_ERROR;
                     }
 
-                    continue;
+                    cl->buf = b;
+                }
+
+                b->sync = 1;
+
+                cl->next = NULL;
+                *ctx->last_out = cl;
+                ctx->last_out = &cl->next;
+            }
+
+            b->last_buf = ctx->buf->last_buf;
+            b->shadow = ctx->buf;
+
+            if (slcf->ignore_recycled_buffers == 0)  {
+                b->recycled = ctx->buf->recycled;
+            }
+        }
+
+        if (ctx->compile && (ctx->buf->last_buf || ctx->buf->last_in_chain)) {
+            ngx_http_ssi_compile_done(r, ctx);
+        }
+
+        ctx->buf = NULL;
+
+        ctx->saved = ctx->looked;
+    }
+
+    if (ctx->out == NULL && ctx->busy == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_http_ssi_output(r, ctx);
+}
+
+
+static ngx_int_t
+ngx_http_ssi_command(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    size_t                     len;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 i, index;
+    ngx_chain_t               *cl;
+    ngx_table_elt_t           *param;
+    ngx_http_ssi_param_t      *prm;
+    ngx_http_ssi_command_t    *cmd;
+    ngx_http_ssi_main_conf_t  *smcf;
+    ngx_str_t                 *params[NGX_HTTP_SSI_MAX_PARAMS + 1];
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_ssi_filter_module);
+
+    cmd = ngx_hash_find(&smcf->hash, ctx->key, ctx->command.data,
+                        ctx->command.len);
+
+    if (cmd == NULL) {
+        if (ctx->output) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "invalid SSI command: \"%V\"", &ctx->command);
+            return NGX_HTTP_SSI_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (!ctx->output && !cmd->block) {
+
+        if (ctx->block) {
+
+            /* reconstruct the SSI command text */
+
+            len = 5 + ctx->command.len + 4;
+
+            param = ctx->params.elts;
+            for (i = 0; i < ctx->params.nelts; i++) {
+                len += 1 + param[i].key.len + 2 + param[i].value.len + 1;
+            }
+
+            b = ngx_create_temp_buf(r->pool, len);
+
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = b;
+            cl->next = NULL;
+
+            *b->last++ = '<';
+            *b->last++ = '!';
+            *b->last++ = '-';
+            *b->last++ = '-';
+            *b->last++ = '#';
+
+            b->last = ngx_cpymem(b->last, ctx->command.data, ctx->command.len);
+
+            for (i = 0; i < ctx->params.nelts; i++) {
+                *b->last++ = ' ';
+                b->last = ngx_cpymem(b->last, param[i].key.data,
+                                     param[i].key.len);
+                *b->last++ = '=';
+                *b->last++ = '"';
+                b->last = ngx_cpymem(b->last, param[i].value.data,
+                                     param[i].value.len);
+                *b->last++ = '"';
+            }
+
+            *b->last++ = ' ';
+            *b->last++ = '-';
+            *b->last++ = '-';
+            *b->last++ = '>';
+
+            ngx_http_ssi_block_add(r, cl);
+
+            return NGX_OK;
+        }
+
+        if (cmd->conditional == 0) {
+            return NGX_OK;
+        }
+    }
+
+    if (cmd->conditional
+        && (ctx->conditional == 0 || ctx->conditional > cmd->conditional))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "invalid context of SSI command: \"%V\"",
+                      &ctx->command);
+        return NGX_HTTP_SSI_ERROR;
+    }
+
+    if (ctx->params.nelts > NGX_HTTP_SSI_MAX_PARAMS) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "too many SSI command parameters: \"%V\"",
+                      &ctx->command);
+        return NGX_HTTP_SSI_ERROR;
+    }
+
+    ngx_memzero(params, (NGX_HTTP_SSI_MAX_PARAMS + 1) * sizeof(ngx_str_t *));
+
+    param = ctx->params.elts;
+
+    for (i = 0; i < ctx->params.nelts; i++) {
+
+        for (prm = cmd->params; prm->name.len; prm++) {
+
+            if (param[i].key.len != prm->name.len
+                || ngx_strncmp(param[i].key.data, prm->name.data,
+                               prm->name.len) != 0)
+            {
+                continue;
+            }
+
+            if (!prm->multiple) {
+                if (params[prm->index]) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "duplicate \"%V\" parameter "
+                                  "in \"%V\" SSI command",
+                                  &param[i].key, &ctx->command);
+
+                    return NGX_HTTP_SSI_ERROR;
                 }
 
-                if (!ctx->output && !cmd->block) {
+                params[prm->index] = &param[i].value;
 
-                    if (ctx->block) {
+                break;
+            }
 
-                        /* reconstruct the SSI command text */
+            for (index = prm->index; params[index]; index++) {
+                /* void */
+            }
 
-                        len = 5 + ctx->command.len + 4;
+            params[index] = &param[i].value;
 
-                        param = ctx->params.elts;
-                        for (i = 0; i < ctx->params.nelts; i++) {
-                            len += 1 + param[i].key.len + 2
-                                + param[i].value.len + 1;
-                        }
+            break;
+        }
 
-                        b = ngx_create_temp_buf(r->pool, len);
+        if (prm->name.len == 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "invalid parameter name: \"%V\" "
+                          "in \"%V\" SSI command",
+                          &param[i].key, &ctx->command);
 
-                        if (b == NULL) {
-                            return NGX_ERROR;
-                        }
+            return NGX_HTTP_SSI_ERROR;
+        }
+    }
 
-                        cl = ngx_alloc_chain_link(r->pool);
-                        if (cl == NULL) {
-                            return NGX_ERROR;
-                        }
+    for (prm = cmd->params; prm->name.len; prm++) {
+        if (prm->mandatory && params[prm->index] == 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "mandatory \"%V\" parameter is absent "
+                          "in \"%V\" SSI command",
+                          &prm->name, &ctx->command);
+
+            return NGX_HTTP_SSI_ERROR;
+        }
+    }
+
+    if (cmd->flush && ctx->out) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "ssi flush");
+
+        if (ngx_http_ssi_output(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return cmd->handler(r, ctx, params);
+}
+
+
+static void
+ngx_http_ssi_block_add(ngx_http_request_t *r, ngx_chain_t *cl)
+{
+    ngx_chain_t           **ll;
+    ngx_http_ssi_ctx_t     *mctx;
+    ngx_http_ssi_block_t   *bl;
+
+    mctx = ngx_http_get_module_ctx(r->main, ngx_http_ssi_filter_module);
+
+    bl = mctx->blocks->elts;
+    for (ll = &bl[mctx->blocks->nelts - 1].bufs; *ll; ll = &(*ll)->next) {
+        /* void */
+    }
+
+    *ll = cl;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_output(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+#if 1
+    b = NULL;
+    for (cl = ctx->out; cl; cl = cl->next) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "ssi out: %p %p", cl->buf, cl->buf->pos);
+        if (cl->buf == b) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "the same buf was used in ssi");
+            ngx_debug_point();
+            return NGX_ERROR;
+        }
+        b = cl->buf;
+    }
+#endif
+
+    rc = ngx_http_next_body_filter(r, ctx->out);
+
+    if (ctx->busy == NULL) {
+        ctx->busy = ctx->out;
+
+    } else {
+        for (cl = ctx->busy; cl->next; cl = cl->next) { /* void */ }
+        cl->next = ctx->out;
+    }
+
+    ctx->out = NULL;
+    ctx->last_out = &ctx->out;
+
+    while (ctx->busy) {
+
+        cl = ctx->busy;
+        b = cl->buf;
+
+        if (ngx_buf_size(b) != 0) {
+            break;
+        }
+
+        if (b->shadow) {
+            b->shadow->pos = b->shadow->last;
+        }
+
+        ctx->busy = cl->next;
+
+        if (ngx_buf_in_memory(b) || b->in_file) {
+            /* add data bufs only to the free buf chain */
+
+            cl->next = ctx->free;
+            ctx->free = cl;
+        }
+    }
+
+    ngx_http_ssi_buffered(r, ctx);
+
+    return rc;
+}
+
+
+static void
+ngx_http_ssi_buffered(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    if (ctx->in || ctx->buf || (ctx->template && !ctx->replayed)) {
+        r->buffered |= NGX_HTTP_SSI_BUFFERED;
+
+    } else {
+        r->buffered &= ~NGX_HTTP_SSI_BUFFERED;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_ssi_replay(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_int_t                 rc;
+    ngx_buf_t                *b;
+    ngx_uint_t                i;
+    ngx_chain_t              *cl;
+    ngx_table_elt_t          *param;
+    ngx_http_ssi_op_t        *op;
+    ngx_http_ssi_loc_conf_t  *slcf;
+    ngx_http_ssi_template_t  *tpl;
+
+    tpl = ctx->template;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http ssi replay: %ui of %ui", ctx->op, tpl->ops.nelts);
+
+    /* the template replaces the response body, which is skipped */
+
+    for (cl = ctx->in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (b->last_buf || b->last_in_chain) {
+            ctx->last_in = 1;
+            ctx->last_buf = b->last_buf;
+        }
+
+        b->pos = b->last;
+        b->file_pos = b->file_last;
+    }
+
+    ctx->in = NULL;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_ssi_filter_module);
+
+    while (ctx->op < tpl->ops.nelts) {
+
+        op = (ngx_http_ssi_op_t *) tpl->ops.elts + ctx->op++;
+
+        switch (op->type) {
+
+        case NGX_HTTP_SSI_OP_TEXT:
+
+            if (ctx->output) {
+                b = ngx_http_ssi_replay_buf(r, ctx);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->memory = 1;
+                b->pos = tpl->text + op->start;
+                b->last = b->pos + op->len;
+
+            } else if (ctx->block) {
+                b = ngx_create_temp_buf(r->pool, op->len);
+                if (b == NULL) {
+                    return NGX_ERROR;
+                }
+
+                b->last = ngx_cpymem(b->pos, tpl->text + op->start, op->len);
+
+                cl = ngx_alloc_chain_link(r->pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = b;
+                cl->next = NULL;
+
+                ngx_http_ssi_block_add(r, cl);
+            }
+
+            continue;
+
+        case NGX_HTTP_SSI_OP_COMMAND:
+
+            /*
+             * command handlers may modify parameter values in place,
+             * so they are given copies of the template values
+             */
+
+            ctx->key = op->key;
+            ctx->command = op->command;
+            ctx->params.nelts = 0;
+
+            for (i = 0; i < op->nparams; i++) {
+                param = ngx_array_push(&ctx->params);
+                if (param == NULL) {
+                    return NGX_ERROR;
+                }
+
+                param->key = op->params[i].key;
+                param->value.len = op->params[i].value.len;
+
+                param->value.data = ngx_pstrdup(r->pool,
+                                                &op->params[i].value);
+                if (param->value.data == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            rc = ngx_http_ssi_command(r, ctx);
+
+            if (rc == NGX_OK) {
+                continue;
+            }
+
+            if (rc == NGX_DONE || rc == NGX_AGAIN || rc == NGX_ERROR) {
+                ngx_http_ssi_buffered(r, ctx);
+                return rc;
+            }
+
+            break;
+
+        default: /* NGX_HTTP_SSI_OP_ERROR */
+            break;
+        }
+
+        /* rc == NGX_HTTP_SSI_ERROR */
+
+        if (slcf->silent_errors) {
+            continue;
+        }
+
+        b = ngx_http_ssi_replay_buf(r, ctx);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->memory = 1;
+        b->pos = ctx->errmsg.data;
+        b->last = ctx->errmsg.data + ctx->errmsg.len;
+    }
+
+    if (ctx->last_in) {
+        b = ngx_http_ssi_replay_buf(r, ctx);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->sync = 1;
+        b->last_buf = ctx->last_buf;
+
+        ctx->replayed = 1;
+    }
+
+    if (ctx->out == NULL && ctx->busy == NULL) {
+        ngx_http_ssi_buffered(r, ctx);
+        return NGX_OK;
+    }
+
+    return ngx_http_ssi_output(r, ctx);
+}
+
+
+static ngx_buf_t *
+ngx_http_ssi_replay_buf(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (ctx->free) {
+        cl = ctx->free;
+        ctx->free = ctx->free->next;
+        b = cl->buf;
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+    } else {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+    }
+
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_ssi_template_lookup(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx,
+    ngx_http_ssi_loc_conf_t *slcf)
+{
+    u_char                     md5key[NGX_HTTP_SSI_TEMPLATE_KEY_LEN];
+    time_t                     now;
+    uint32_t                   hash;
+    ngx_str_t                  key, etag;
+    ngx_uint_t                 i;
+    ngx_pool_t                *pool;
+    ngx_queue_t               *q;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_ssi_cache_t      *cache;
+    ngx_http_ssi_template_t   *tpl;
+
+    /*
+     * a template is valid as long as the document has the same
+     * modification time, length and entity tag, if any, so only
+     * such responses are cached
+     */
+
+    if (r->headers_out.status != NGX_HTTP_OK
+        || r->headers_out.last_modified_time == -1
+        || r->headers_out.content_length_n <= 0
+        || r->headers_out.content_length_n > NGX_HTTP_SSI_TEMPLATE_MAX_SIZE)
+    {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_ssi_template_cleanup;
+    cln->data = ctx;
+
+    cache = slcf->cache;
+    now = ngx_time();
+
+    /* remove up to two templates which were not used for a long time */
+
+    for (i = 0; i < 2; i++) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+        tpl = ngx_queue_data(q, ngx_http_ssi_template_t, queue);
+
+        if (now - tpl->accessed <= cache->inactive) {
+            break;
+        }
+
+        ngx_http_ssi_template_delete(tpl);
+    }
+
+    /*
+     * a document is identified by its cache key if it was cached,
+     * or else by the host, the location, the URI and the arguments,
+     * as documents of different virtual hosts and locations
+     * may have the same URI
+     */
+
+    key.len = 2 * NGX_HTTP_SSI_TEMPLATE_KEY_LEN;
+    key.data = ngx_pnalloc(r->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        ngx_memcpy(md5key, r->cache->key, NGX_HTTP_SSI_TEMPLATE_KEY_LEN);
+
+    } else {
+        ngx_http_ssi_template_key(r, md5key);
+    }
+
+#else
+
+    ngx_http_ssi_template_key(r, md5key);
+
+#endif
+
+    ngx_hex_dump(key.data, md5key, NGX_HTTP_SSI_TEMPLATE_KEY_LEN);
+
+    if (r->headers_out.etag) {
+        etag = r->headers_out.etag->value;
+
+    } else {
+        ngx_str_null(&etag);
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    tpl = (ngx_http_ssi_template_t *)
+              ngx_str_rbtree_lookup(&cache->rbtree, &key, hash);
+
+    if (tpl) {
+        if (tpl->mtime == r->headers_out.last_modified_time
+            && tpl->size == r->headers_out.content_length_n
+            && tpl->etag.len == etag.len
+            && (etag.len == 0
+                || ngx_strncmp(tpl->etag.data, etag.data, etag.len) == 0)
+            && tpl->value_len == ctx->value_len)
+        {
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http ssi template hit: \"%V\" \"%V?%V\"",
+                           &key, &r->uri, &r->args);
+
+            ngx_queue_remove(&tpl->queue);
+            ngx_queue_insert_head(&cache->expire_queue, &tpl->queue);
+
+            tpl->accessed = now;
+            tpl->count++;
+
+            ctx->template = tpl;
+
+            return NGX_OK;
+        }
+
+        ngx_http_ssi_template_delete(tpl);
+    }
+
+    /* the template is compiled while the document is parsed */
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    tpl = ngx_pcalloc(pool, sizeof(ngx_http_ssi_template_t));
+    if (tpl == NULL) {
+        goto failed;
+    }
+
+    tpl->pool = pool;
+    tpl->cache = cache;
+
+    tpl->sn.node.key = hash;
+    tpl->sn.str.len = key.len;
+    tpl->sn.str.data = ngx_pstrdup(pool, &key);
+    if (tpl->sn.str.data == NULL) {
+        goto failed;
+    }
+
+    tpl->mtime = r->headers_out.last_modified_time;
+    tpl->size = r->headers_out.content_length_n;
+
+    if (etag.len) {
+        tpl->etag.len = etag.len;
+        tpl->etag.data = ngx_pstrdup(pool, &etag);
+        if (tpl->etag.data == NULL) {
+            goto failed;
+        }
+    }
+    tpl->value_len = ctx->value_len;
+
+    /* literal text never exceeds the document */
+
+    tpl->text = ngx_pnalloc(pool, (size_t) tpl->size);
+    if (tpl->text == NULL) {
+        goto failed;
+    }
+
+    if (ngx_array_init(&tpl->ops, pool, 16, sizeof(ngx_http_ssi_op_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
 
-                        cl->buf = b;
-                        cl->next = NULL;
+    ctx->compile = tpl;
 
-                        *b->last++ = '<';
-                        *b->last++ = '!';
-                        *b->last++ = '-';
-                        *b->last++ = '-';
-                        *b->last++ = '#';
-
-                        b->last = ngx_cpymem(b->last, ctx->command.data,
-                                             ctx->command.len);
-
-                        for (i = 0; i < ctx->params.nelts; i++) {
-                            *b->last++ = ' ';
-                            b->last = ngx_cpymem(b->last, param[i].key.data,
-                                                 param[i].key.len);
-                            *b->last++ = '=';
-                            *b->last++ = '"';
-                            b->last = ngx_cpymem(b->last, param[i].value.data,
-                                                 param[i].value.len);
-                            *b->last++ = '"';
-                        }
+    return NGX_OK;
 
-                        *b->last++ = ' ';
-                        *b->last++ = '-';
-                        *b->last++ = '-';
-                        *b->last++ = '>';
-
-                        mctx = ngx_http_get_module_ctx(r->main,
-                                                   ngx_http_ssi_filter_module);
-                        bl = mctx->blocks->elts;
-                        for (ll = &bl[mctx->blocks->nelts - 1].bufs;
-                             *ll;
-                             ll = &(*ll)->next)
-                        {
-                            /* void */
-                        }
+failed:
 
-                        *ll = cl;
+    ngx_destroy_pool(pool);
 
-                        b = NULL;
+    return NGX_ERROR;
+}
 
-                        continue;
-                    }
 
-                    if (cmd->conditional == 0) {
-                        continue;
-                    }
-                }
+static void
+ngx_http_ssi_template_key(ngx_http_request_t *r, u_char *key)
+{
+    ngx_str_t                  host;
+    ngx_md5_t                  md5;
+    ngx_uint_t                 params[4];
+    ngx_http_core_srv_conf_t  *cscf;
+    ngx_http_core_loc_conf_t  *clcf;
 
-                if (cmd->conditional
-                    && (ctx->conditional == 0
-                        || ctx->conditional > cmd->conditional))
-                {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                  "invalid context of SSI command: \"%V\"",
-                                  &ctx->command);
-                    goto ssi_error;
-                }
+    if (r->headers_in.server.len) {
+        host = r->headers_in.server;
 
-                if (ctx->params.nelts > NGX_HTTP_SSI_MAX_PARAMS) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                  "too many SSI command parameters: \"%V\"",
-                                  &ctx->command);
-                    goto ssi_error;
-                }
+    } else {
+        cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+        host = cscf->server_name;
+    }
 
-                ngx_memzero(params,
-                           (NGX_HTTP_SSI_MAX_PARAMS + 1) * sizeof(ngx_str_t *));
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-                param = ctx->params.elts;
+    params[0] = host.len;
+    params[1] = clcf->name.len;
+    params[2] = r->uri.len;
+    params[3] = r->args.len;
 
-                for (i = 0; i < ctx->params.nelts; i++) {
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, params, sizeof(params));
+    ngx_md5_update(&md5, host.data, host.len);
+    ngx_md5_update(&md5, clcf->name.data, clcf->name.len);
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+    ngx_md5_update(&md5, r->args.data, r->args.len);
+    ngx_md5_final(key, &md5);
+}
 
-                    for (prm = cmd->params; prm->name.len; prm++) {
 
-                        if (param[i].key.len != prm->name.len
-                            || ngx_strncmp(param[i].key.data, prm->name.data,
-                                           prm->name.len) != 0)
-                        {
-                            continue;
-                        }
+static ngx_int_t
+ngx_http_ssi_compile_text(ngx_http_ssi_ctx_t *ctx, u_char *data, size_t len)
+{
+    ngx_http_ssi_op_t        *op;
+    ngx_http_ssi_template_t  *tpl;
 
-                        if (!prm->multiple) {
-                            if (params[prm->index]) {
-                                ngx_log_error(NGX_LOG_ERR,
-                                              r->connection->log, 0,
-                                              "duplicate \"%V\" parameter "
-                                              "in \"%V\" SSI command",
-                                              &param[i].key, &ctx->command);
+    tpl = ctx->compile;
 
-                                goto ssi_error;
-                            }
+    if (len == 0) {
+        return NGX_OK;
+    }
 
-                            params[prm->index] = &param[i].value;
+    if (tpl->text_len + len > (size_t) tpl->size) {
 
-                            break;
-                        }
+        /* the document is longer than expected, it is not cached */
 
-                        for (index = prm->index; params[index]; index++) {
-                            /* void */
-                        }
+        ngx_destroy_pool(tpl->pool);
+        ctx->compile = NULL;
 
-                        params[index] = &param[i].value;
+        return NGX_OK;
+    }
 
-                        break;
-                    }
+    op = NULL;
 
-                    if (prm->name.len == 0) {
-                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                      "invalid parameter name: \"%V\" "
-                                      "in \"%V\" SSI command",
-                                      &param[i].key, &ctx->command);
+    if (tpl->ops.nelts) {
+        op = (ngx_http_ssi_op_t *) tpl->ops.elts + tpl->ops.nelts - 1;
 
-                        goto ssi_error;
-                    }
-                }
+        if (op->type != NGX_HTTP_SSI_OP_TEXT) {
+            op = NULL;
+        }
+    }
 
-                for (prm = cmd->params; prm->name.len; prm++) {
-                    if (prm->mandatory && params[prm->index] == 0) {
-                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                                      "mandatory \"%V\" parameter is absent "
-                                      "in \"%V\" SSI command",
-                                      &prm->name, &ctx->command);
+    if (op == NULL) {
+        op = ngx_array_push(&tpl->ops);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
 
-                        goto ssi_error;
-                    }
-                }
+        ngx_memzero(op, sizeof(ngx_http_ssi_op_t));
 
-                if (cmd->flush && ctx->out) {
+        op->type = NGX_HTTP_SSI_OP_TEXT;
+        op->start = tpl->text_len;
+    }
 
-                    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                                   "ssi flush");
+    ngx_memcpy(tpl->text + tpl->text_len, data, len);
 
-                    if (ngx_http_ssi_output(r, ctx) == NGX_ERROR) {
-                        return NGX_ERROR;
-                    }
-                }
+    tpl->text_len += len;
+    op->len += len;
 
-                rc = cmd->handler(r, ctx, params);
+    return NGX_OK;
+}
 
-                if (rc == NGX_OK) {
-                    continue;
-                }
 
-                if (rc == NGX_DONE || rc == NGX_AGAIN || rc == NGX_ERROR) {
-                    ngx_http_ssi_buffered(r, ctx);
-                    return rc;
-                }
-            }
+static ngx_int_t
+ngx_http_ssi_compile_op(ngx_http_ssi_ctx_t *ctx, ngx_uint_t type)
+{
+    ngx_uint_t                i;
+    ngx_table_elt_t          *param;
+    ngx_http_ssi_op_t        *op;
+    ngx_http_ssi_template_t  *tpl;
 
+    tpl = ctx->compile;
 
-            /* rc == NGX_HTTP_SSI_ERROR */
+    op = ngx_array_push(&tpl->ops);
+    if (op == NULL) {
+        return NGX_ERROR;
+    }
 
-    ssi_error:
+    ngx_memzero(op, sizeof(ngx_http_ssi_op_t));
 
-            if (slcf->silent_errors) {
-                continue;
-            }
+    op->type = type;
 
-            if (ctx->free) {
-                cl = ctx->free;
-                ctx->free = ctx->free->next;
-                b = cl->buf;
-                ngx_memzero(b, sizeof(ngx_buf_t));
+    if (type == NGX_HTTP_SSI_OP_ERROR) {
+        return NGX_OK;
+    }
 
-            } else {
-                b = ngx_calloc_buf(r->pool);
-                if (b == NULL) {
-                    return NGX_ERROR;
-                }
+    op->key = ctx->key;
 
-                cl = ngx_alloc_chain_link(r->pool);
-                if (cl == NULL) {
-                    return NGX_ERROR;
-                }
+    op->command.len = ctx->command.len;
+    op->command.data = ngx_pstrdup(tpl->pool, &ctx->command);
+    if (op->command.data == NULL) {
+        return NGX_ERROR;
+    }
 
-                cl->buf = b;
-            }
+    if (ctx->params.nelts == 0) {
+        return NGX_OK;
+    }
 
-            b->memory = 1;
-            b->pos = ctx->errmsg.data;
-            b->last = ctx->errmsg.data + ctx->errmsg.len;
+    op->params = ngx_palloc(tpl->pool,
+                            ctx->params.nelts * sizeof(ngx_table_elt_t));
+    if (op->params == NULL) {
+        return NGX_ERROR;
+    }
 
-            cl->next = NULL;
-            *ctx->last_out = cl;
-            ctx->last_out = &cl->next;
+    param = ctx->params.elts;
 
-            continue;
+    for (i = 0; i < ctx->params.nelts; i++) {
+        op->params[i] = param[i];
+
+        op->params[i].key.data = ngx_pstrdup(tpl->pool, &param[i].key);
+        if (op->params[i].key.data == NULL) {
+            return NGX_ERROR;
         }
 
-        if (ctx->buf->last_buf || ngx_buf_in_memory(ctx->buf)) {
-            if (b == NULL) {
-                if (ctx->free) {
-                    cl = ctx->free;
-                    ctx->free = ctx->free->next;
-                    b = cl->buf;
-                    ngx_memzero(b, sizeof(ngx_buf_t));
+        op->params[i].value.data = ngx_pstrdup(tpl->pool, &param[i].value);
+        if (op->params[i].value.data == NULL) {
+            return NGX_ERROR;
+        }
+    }
 
-                } else {
-                    b = ngx_calloc_buf(r->pool);
-                    if (b == NULL) {
-                        return NGX_ERROR;
-                    }
+    op->nparams = ctx->params.nelts;
 
-                    cl = ngx_alloc_chain_link(r->pool);
-                    if (cl == NULL) {
-                        return NGX_ERROR;
-                    }
+    return NGX_OK;
+}
 
-                    cl->buf = b;
-                }
 
-                b->sync = 1;
+static void
+ngx_http_ssi_compile_done(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+{
+    ngx_queue_t              *q;
+    ngx_str_node_t           *sn;
+    ngx_http_ssi_cache_t     *cache;
+    ngx_http_ssi_template_t  *tpl;
 
-                cl->next = NULL;
-                *ctx->last_out = cl;
-                ctx->last_out = &cl->next;
-            }
+    tpl = ctx->compile;
+    ctx->compile = NULL;
 
-            b->last_buf = ctx->buf->last_buf;
-            b->shadow = ctx->buf;
+    if (tpl->parsed != tpl->size) {
+        ngx_destroy_pool(tpl->pool);
+        return;
+    }
 
-            if (slcf->ignore_recycled_buffers == 0)  {
-                b->recycled = ctx->buf->recycled;
-            }
-        }
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http ssi template: \"%V\" %ui ops, %uz text",
+                   &tpl->sn.str, tpl->ops.nelts, tpl->text_len);
 
-        ctx->buf = NULL;
+    cache = tpl->cache;
 
-        ctx->saved = ctx->looked;
+    sn = ngx_str_rbtree_lookup(&cache->rbtree, &tpl->sn.str,
+                               tpl->sn.node.key);
+    if (sn) {
+        ngx_http_ssi_template_delete((ngx_http_ssi_template_t *) sn);
     }
 
-    if (ctx->out == NULL && ctx->busy == NULL) {
-        return NGX_OK;
+    if (cache->current >= cache->max) {
+        q = ngx_queue_last(&cache->expire_queue);
+        ngx_http_ssi_template_delete(
+                           ngx_queue_data(q, ngx_http_ssi_template_t, queue));
     }
 
-    return ngx_http_ssi_output(r, ctx);
+    ngx_rbtree_insert(&cache->rbtree, &tpl->sn.node);
+    ngx_queue_insert_head(&cache->expire_queue, &tpl->queue);
+
+    cache->current++;
+
+    tpl->accessed = ngx_time();
 }
 
 
-static ngx_int_t
-ngx_http_ssi_output(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+static void
+ngx_http_ssi_template_delete(ngx_http_ssi_template_t *tpl)
 {
-    ngx_int_t     rc;
-    ngx_buf_t    *b;
-    ngx_chain_t  *cl;
+    ngx_http_ssi_cache_t  *cache;
 
-#if 1
-    b = NULL;
-    for (cl = ctx->out; cl; cl = cl->next) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "ssi out: %p %p", cl->buf, cl->buf->pos);
-        if (cl->buf == b) {
-            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                          "the same buf was used in ssi");
-            ngx_debug_point();
-            return NGX_ERROR;
-        }
-        b = cl->buf;
-    }
-#endif
+    cache = tpl->cache;
 
-    rc = ngx_http_next_body_filter(r, ctx->out);
+    ngx_rbtree_delete(&cache->rbtree, &tpl->sn.node);
+    ngx_queue_remove(&tpl->queue);
 
-    if (ctx->busy == NULL) {
-        ctx->busy = ctx->out;
+    cache->current--;
 
-    } else {
-        for (cl = ctx->busy; cl->next; cl = cl->next) { /* void */ }
-        cl->next = ctx->out;
-    }
+    /* a template still being replayed is freed by its last request */
 
-    ctx->out = NULL;
-    ctx->last_out = &ctx->out;
+    if (tpl->count) {
+        tpl->close = 1;
+        return;
+    }
 
-    while (ctx->busy) {
+    ngx_destroy_pool(tpl->pool);
+}
 
-        cl = ctx->busy;
-        b = cl->buf;
 
-        if (ngx_buf_size(b) != 0) {
-            break;
-        }
+static void
+ngx_http_ssi_template_cleanup(void *data)
+{
+    ngx_http_ssi_ctx_t *ctx = data;
 
-        if (b->shadow) {
-            b->shadow->pos = b->shadow->last;
-        }
+    ngx_http_ssi_template_t  *tpl;
 
-        ctx->busy = cl->next;
+    if (ctx->compile) {
+        tpl = ctx->compile;
+        ngx_destroy_pool(tpl->pool);
+    }
 
-        if (ngx_buf_in_memory(b) || b->in_file) {
-            /* add data bufs only to the free buf chain */
+    if (ctx->template) {
+        tpl = ctx->template;
 
-            cl->next = ctx->free;
-            ctx->free = cl;
+        if (--tpl->count == 0 && tpl->close) {
+            ngx_destroy_pool(tpl->pool);
         }
     }
-
-    ngx_http_ssi_buffered(r, ctx);
-
-    return rc;
 }
 
 
 static void
-ngx_http_ssi_buffered(ngx_http_request_t *r, ngx_http_ssi_ctx_t *ctx)
+ngx_http_ssi_cache_cleanup(void *data)
 {
-    if (ctx->in || ctx->buf) {
-        r->buffered |= NGX_HTTP_SSI_BUFFERED;
+    ngx_http_ssi_cache_t  *cache = data;
 
-    } else {
-        r->buffered &= ~NGX_HTTP_SSI_BUFFERED;
+    ngx_queue_t  *q;
+
+    while (!ngx_queue_empty(&cache->expire_queue)) {
+        q = ngx_queue_last(&cache->expire_queue);
+        ngx_http_ssi_template_delete(
+                           ngx_queue_data(q, ngx_http_ssi_template_t, queue));
     }
 }
 
@@ -2861,6 +3615,105 @@ ngx_http_ssi_init_main_conf(ngx_conf_t *cf, void *conf)
 }
 
 
+static char *
+ngx_http_ssi_template_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ssi_loc_conf_t *slcf = conf;
+
+    time_t                 inactive;
+    ngx_str_t             *value, s;
+    ngx_int_t              max;
+    ngx_uint_t             i;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_ssi_cache_t  *cache;
+
+    if (slcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 60;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR) {
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+
+            slcf->cache = NULL;
+
+            continue;
+        }
+
+    failed:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"ssi_template_cache\" parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (slcf->cache == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                     "\"ssi_template_cache\" must have the \"max\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_palloc(cf->pool, sizeof(ngx_http_ssi_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    cache->current = 0;
+    cache->max = max;
+    cache->inactive = inactive;
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_http_ssi_cache_cleanup;
+    cln->data = cache;
+
+    slcf->cache = cache;
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_ssi_create_loc_conf(ngx_conf_t *cf)
 {
@@ -2886,6 +3739,8 @@ ngx_http_ssi_create_loc_conf(ngx_conf_t *cf)
     slcf->min_file_chunk = NGX_CONF_UNSET_SIZE;
     slcf->value_len = NGX_CONF_UNSET_SIZE;
 
+    slcf->cache = NGX_CONF_UNSET_PTR;
+
     return slcf;
 }
 
@@ -2905,6 +3760,8 @@ ngx_http_ssi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->min_file_chunk, prev->min_file_chunk, 1024);
     ngx_conf_merge_size_value(conf->value_len, prev->value_len, 255);
 
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
     if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
                              &prev->types_keys, &prev->types,
                              ngx_http_html_default_types)
@@ -76,11 +76,18 @@ typedef struct {
     unsigned                  block:1;
     unsigned                  output:1;
     unsigned                  output_chosen:1;
+    unsigned                  last_in:1;
+    unsigned                  last_buf:1;
+    unsigned                  replayed:1;
 
     ngx_http_request_t       *wait;
     void                     *value_buf;
     ngx_str_t                 timefmt;
     ngx_str_t                 errmsg;
+
+    void                     *template;
+    void                     *compile;
+    ngx_uint_t                op;
 } ngx_http_ssi_ctx_t;
 
 
@@ -22,12 +22,29 @@ typedef struct {
 } ngx_http_sub_match_t;
 
 
+#define NGX_HTTP_SUB_NO_MATCH      0xffff
+#define NGX_HTTP_SUB_MAX_STATES    0xffff
+
+
+/*
+ * The search patterns are compiled into an Aho-Corasick automaton
+ * with the failure links resolved, so each input byte costs a single
+ * table lookup regardless of the number of patterns.  Bytes which do not
+ * occur in any pattern share the class 0, and the letters of both cases
+ * share a class, so a row of the transition table has only as many
+ * entries as there are distinct pattern bytes.
+ */
+
 typedef struct {
-    ngx_uint_t                 min_match_len;
     ngx_uint_t                 max_match_len;
 
-    u_char                     index[257];
-    u_char                     shift[256];
+    ngx_uint_t                 nclasses;
+    u_char                     class[256];
+
+    uint16_t                  *next;    /* [state * nclasses + class] */
+    uint16_t                  *depth;   /* length of the prefix matched */
+    uint16_t                  *output;  /* pattern ending in the state */
+    uint16_t                  *dict;    /* next state with an output */
 } ngx_http_sub_tables_t;
 
 
@@ -72,29 +89,27 @@ typedef struct {
     ngx_int_t                  offset;
     ngx_uint_t                 index;
 
+    ngx_uint_t                 state;
+    ngx_int_t                  match_start;
+    ngx_uint_t                 match_len;
+
     ngx_http_sub_tables_t     *tables;
     ngx_array_t               *matches;
 } ngx_http_sub_ctx_t;
 
 
-static ngx_uint_t ngx_http_sub_cmp_index;
-
-
 static ngx_int_t ngx_http_sub_output(ngx_http_request_t *r,
     ngx_http_sub_ctx_t *ctx);
 static ngx_int_t ngx_http_sub_parse(ngx_http_request_t *r,
-    ngx_http_sub_ctx_t *ctx, ngx_uint_t flush);
-static ngx_int_t ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start,
-    ngx_str_t *m);
+    ngx_http_sub_ctx_t *ctx, ngx_uint_t last);
 
 static char * ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static void *ngx_http_sub_create_conf(ngx_conf_t *cf);
 static char *ngx_http_sub_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
-static void ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
-    ngx_http_sub_match_t *match, ngx_uint_t n);
-static ngx_int_t ngx_http_sub_cmp_matches(const void *one, const void *two);
+static ngx_int_t ngx_http_sub_init_tables(ngx_pool_t *pool,
+    ngx_http_sub_tables_t *tables, ngx_http_sub_match_t *match, ngx_uint_t n);
 static ngx_int_t ngx_http_sub_filter_init(ngx_conf_t *cf);
 
 
@@ -171,6 +186,7 @@ static ngx_int_t
 ngx_http_sub_header_filter(ngx_http_request_t *r)
 {
     ngx_str_t                *m;
+    ngx_int_t                 rc;
     ngx_uint_t                i, j, n;
     ngx_http_sub_ctx_t       *ctx;
     ngx_http_sub_pair_t      *pairs;
@@ -244,23 +260,31 @@ ngx_http_sub_header_filter(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
-        ngx_http_sub_init_tables(ctx->tables, ctx->matches->elts,
-                                 ctx->matches->nelts);
+        rc = ngx_http_sub_init_tables(r->pool, ctx->tables,
+                                      ctx->matches->elts, ctx->matches->nelts);
+
+        if (rc == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "total length of search patterns is too large");
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
     ngx_http_set_ctx(r, ctx, ngx_http_sub_filter_module);
 
-    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->saved.data == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->looked.data == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->offset = ctx->tables->min_match_len - 1;
     ctx->last_out = &ctx->out;
 
     r->filter_need_in_memory = 1;
@@ -287,7 +311,7 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_int_t                  rc;
     ngx_buf_t                 *b;
     ngx_str_t                 *sub;
-    ngx_uint_t                 flush, last;
+    ngx_uint_t                 last;
     ngx_chain_t               *cl;
     ngx_http_sub_ctx_t        *ctx;
     ngx_http_sub_match_t      *match;
@@ -329,9 +353,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http sub filter \"%V\"", &r->uri);
 
-    flush = 0;
-    last = 0;
-
     while (ctx->in || ctx->buf) {
 
         if (ctx->buf == NULL) {
@@ -340,17 +361,18 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ctx->pos = ctx->buf->pos;
         }
 
-        if (ctx->buf->flush || ctx->buf->recycled) {
-            flush = 1;
-        }
-
-        if (ctx->in == NULL) {
-            last = flush;
-        }
+        last = ctx->buf->last_buf || ctx->buf->last_in_chain;
 
         b = NULL;
 
-        while (ctx->pos < ctx->buf->last) {
+        /*
+         * at the end of the response a pending match is applied and
+         * the bytes after it are rescanned even if the buffer is empty
+         */
+
+        while (ctx->pos < ctx->buf->last
+               || (last && (ctx->offset < 0 || ctx->match_len)))
+        {
 
             rc = ngx_http_sub_parse(r, ctx, last);
 
@@ -474,9 +496,7 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             continue;
         }
 
-        if (ctx->looked.len
-            && (ctx->buf->last_buf || ctx->buf->last_in_chain))
-        {
+        if (ctx->looked.len && last) {
             cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
             if (cl == NULL) {
                 return NGX_ERROR;
@@ -605,112 +625,115 @@ ngx_http_sub_output(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 
 static ngx_int_t
 ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx,
-    ngx_uint_t flush)
+    ngx_uint_t last)
 {
     u_char                   *p, c;
-    ngx_str_t                *m;
     ngx_int_t                 offset, start, next, end, len, rc;
-    ngx_uint_t                shift, i, j;
-    ngx_http_sub_match_t     *match;
+    ngx_uint_t                state, s, i;
     ngx_http_sub_tables_t    *tables;
     ngx_http_sub_loc_conf_t  *slcf;
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
     tables = ctx->tables;
-    match = ctx->matches->elts;
 
     offset = ctx->offset;
     end = ctx->buf->last - ctx->pos;
 
     if (ctx->once) {
         /* sets start and next to end */
-        offset = end + (ngx_int_t) tables->min_match_len - 1;
+        offset = end;
+        state = 0;
+        ctx->match_len = 0;
         goto again;
     }
 
+    state = ctx->state;
+
     while (offset < end) {
 
         c = offset < 0 ? ctx->looked.data[ctx->looked.len + offset]
                        : ctx->pos[offset];
 
-        c = ngx_tolower(c);
-
-        shift = tables->shift[c];
-        if (shift > 0) {
-            offset += shift;
-            continue;
-        }
-
-        /* a potential match */
+        state = tables->next[state * tables->nclasses + tables->class[c]];
+        offset++;
 
-        start = offset - (ngx_int_t) tables->min_match_len + 1;
+        /* the longest pattern ending here which is still to be applied */
 
-        i = ngx_max(tables->index[c], ctx->index);
-        j = tables->index[c + 1];
+        s = (tables->output[state] != NGX_HTTP_SUB_NO_MATCH)
+            ? state : tables->dict[state];
 
-        while (i != j) {
+        while (s) {
+            i = tables->output[s];
 
-            if (slcf->once && ctx->sub && ctx->sub[i].data) {
-                goto next;
+            if (!(slcf->once && ctx->sub && ctx->sub[i].data)) {
+                break;
             }
 
-            m = &match[i].match;
-
-            rc = ngx_http_sub_match(ctx, start, m);
+            s = tables->dict[s];
+        }
 
-            if (rc == NGX_DECLINED) {
-                goto next;
-            }
+        if (s) {
+            len = tables->depth[s];
+            start = offset - len;
 
-            ctx->index = i;
+            /* the leftmost match wins, and the longest one among them */
 
-            if (rc == NGX_AGAIN) {
-                goto again;
+            if (ctx->match_len == 0
+                || start < ctx->match_start
+                || (start == ctx->match_start
+                    && (ngx_uint_t) len > ctx->match_len))
+            {
+                ctx->match_start = start;
+                ctx->match_len = len;
+                ctx->index = tables->output[s];
             }
+        }
 
-            ctx->offset = offset + (ngx_int_t) m->len;
-            next = start + (ngx_int_t) m->len;
-            end = ngx_max(next, 0);
-            rc = NGX_OK;
-
-            goto done;
-
-        next:
+        /*
+         * the match is final as soon as no partial match in progress
+         * starts at or before it
+         */
 
-            i++;
+        if (ctx->match_len
+            && offset - (ngx_int_t) tables->depth[state] > ctx->match_start)
+        {
+            goto found;
         }
-
-        offset++;
-        ctx->index = 0;
     }
 
-    if (flush) {
-        for ( ;; ) {
-            start = offset - (ngx_int_t) tables->min_match_len + 1;
+    if (last && ctx->match_len) {
+        goto found;
+    }
 
-            if (start >= end) {
-                break;
-            }
+again:
 
-            for (i = 0; i < ctx->matches->nelts; i++) {
-                m = &match[i].match;
+    ctx->state = state;
+    ctx->offset = offset;
 
-                if (ngx_http_sub_match(ctx, start, m) == NGX_AGAIN) {
-                    goto again;
-                }
-            }
+    start = offset - (ngx_int_t) tables->depth[state];
 
-            offset++;
-        }
+    if (ctx->match_len && ctx->match_start < start) {
+        start = ctx->match_start;
     }
 
-again:
-
-    ctx->offset = offset;
-    start = offset - (ngx_int_t) tables->min_match_len + 1;
     next = start;
     rc = NGX_AGAIN;
 
+    goto done;
+
+found:
+
+    /* the bytes after the match are scanned again from the initial state */
+
+    start = ctx->match_start;
+    next = start + (ngx_int_t) ctx->match_len;
+    end = ngx_max(next, 0);
+
+    ctx->state = 0;
+    ctx->offset = next;
+    ctx->match_len = 0;
+    rc = NGX_OK;
+
 done:
 
     /* send [ - looked.len, start ] to client */
@@ -735,56 +758,12 @@ done:
 
     ctx->pos += end;
     ctx->offset -= end;
+    ctx->match_start -= end;
 
     return rc;
 }
 
 
-static ngx_int_t
-ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start, ngx_str_t *m)
-{
-    u_char  *p, *last, *pat, *pat_end;
-
-    pat = m->data;
-    pat_end = m->data + m->len;
-
-    if (start >= 0) {
-        p = ctx->pos + start;
-
-    } else {
-        last = ctx->looked.data + ctx->looked.len;
-        p = last + start;
-
-        while (p < last && pat < pat_end) {
-            if (ngx_tolower(*p) != *pat) {
-                return NGX_DECLINED;
-            }
-
-            p++;
-            pat++;
-        }
-
-        p = ctx->pos;
-    }
-
-    while (p < ctx->buf->last && pat < pat_end) {
-        if (ngx_tolower(*p) != *pat) {
-            return NGX_DECLINED;
-        }
-
-        p++;
-        pat++;
-    }
-
-    if (pat != pat_end) {
-        /* partial match */
-        return NGX_AGAIN;
-    }
-
-    return NGX_OK;
-}
-
-
 static char *
 ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -885,6 +864,7 @@ ngx_http_sub_create_conf(ngx_conf_t *cf)
 static char *
 ngx_http_sub_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 {
+    ngx_int_t                 rc;
     ngx_uint_t                i, n;
     ngx_http_sub_pair_t      *pairs;
     ngx_http_sub_match_t     *matches;
@@ -936,72 +916,158 @@ ngx_http_sub_merge_conf(ngx_conf_t *cf, void *parent, void *child)
             return NGX_CONF_ERROR;
         }
 
-        ngx_http_sub_init_tables(conf->tables, conf->matches->elts,
-                                 conf->matches->nelts);
+        rc = ngx_http_sub_init_tables(cf->pool, conf->tables,
+                                      conf->matches->elts,
+                                      conf->matches->nelts);
+
+        if (rc == NGX_DECLINED) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "total length of search patterns "
+                               "exceeds %d", NGX_HTTP_SUB_MAX_STATES - 1);
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     return NGX_CONF_OK;
 }
 
 
-static void
-ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
+static ngx_int_t
+ngx_http_sub_init_tables(ngx_pool_t *pool, ngx_http_sub_tables_t *tables,
     ngx_http_sub_match_t *match, ngx_uint_t n)
 {
-    u_char      c;
-    ngx_uint_t  i, j, min, max, ch;
+    u_char      *p, c;
+    uint16_t    *fail, *queue, *row;
+    ngx_uint_t   i, j, k, max, nstates, state, head, tail, t, f;
 
-    min = match[0].match.len;
-    max = match[0].match.len;
+    max = 0;
+    nstates = 1;
 
-    for (i = 1; i < n; i++) {
-        min = ngx_min(min, match[i].match.len);
+    ngx_memzero(tables->class, 256);
+
+    for (i = 0; i < n; i++) {
         max = ngx_max(max, match[i].match.len);
+        nstates += match[i].match.len;
+
+        p = match[i].match.data;
+
+        for (j = 0; j < match[i].match.len; j++) {
+            tables->class[p[j]] = 1;
+        }
+    }
+
+    if (nstates > NGX_HTTP_SUB_MAX_STATES) {
+        return NGX_DECLINED;
     }
 
-    tables->min_match_len = min;
     tables->max_match_len = max;
 
-    ngx_http_sub_cmp_index = tables->min_match_len - 1;
-    ngx_sort(match, n, sizeof(ngx_http_sub_match_t), ngx_http_sub_cmp_matches);
+    /* the patterns are lowercased, the uppercase letters share the class */
+
+    k = 1;
+
+    for (i = 0; i < 256; i++) {
+        if (tables->class[i]) {
+            tables->class[i] = (u_char) k++;
+        }
+    }
 
-    min = ngx_min(min, 255);
-    ngx_memset(tables->shift, min, 256);
+    for (c = 'A'; c <= 'Z'; c++) {
+        tables->class[c] = tables->class[ngx_tolower(c)];
+    }
 
-    ch = 0;
+    tables->nclasses = k;
+
+    tables->next = ngx_pcalloc(pool, nstates * k * sizeof(uint16_t));
+    if (tables->next == NULL) {
+        return NGX_ERROR;
+    }
+
+    tables->depth = ngx_pcalloc(pool, 3 * nstates * sizeof(uint16_t));
+    if (tables->depth == NULL) {
+        return NGX_ERROR;
+    }
+
+    tables->output = tables->depth + nstates;
+    tables->dict = tables->output + nstates;
+
+    fail = ngx_palloc(pool, 2 * nstates * sizeof(uint16_t));
+    if (fail == NULL) {
+        return NGX_ERROR;
+    }
+
+    queue = fail + nstates;
+
+    for (i = 0; i < nstates; i++) {
+        tables->output[i] = NGX_HTTP_SUB_NO_MATCH;
+    }
+
+    /* the trie, a zero transition means there is no edge yet */
+
+    t = 1;
 
     for (i = 0; i < n; i++) {
+        state = 0;
+        p = match[i].match.data;
+
+        for (j = 0; j < match[i].match.len; j++) {
+            row = &tables->next[state * k];
+
+            if (row[tables->class[p[j]]] == 0) {
+                row[tables->class[p[j]]] = (uint16_t) t;
+                tables->depth[t] = (uint16_t) (j + 1);
+                t++;
+            }
 
-        for (j = 0; j < min; j++) {
-            c = match[i].match.data[tables->min_match_len - 1 - j];
-            tables->shift[c] = ngx_min(tables->shift[c], (u_char) j);
+            state = row[tables->class[p[j]]];
         }
 
-        c = match[i].match.data[tables->min_match_len - 1];
-        while (ch <= c) {
-            tables->index[ch++] = (u_char) i;
+        if (tables->output[state] == NGX_HTTP_SUB_NO_MATCH) {
+            tables->output[state] = (uint16_t) i;
         }
     }
 
-    while (ch < 257) {
-        tables->index[ch++] = (u_char) n;
-    }
-}
+    /*
+     * resolve the failure links breadth first, so the row of a failure
+     * state is always complete when it is used, while the row of the state
+     * being processed still holds the edges of the trie only
+     */
 
+    head = 0;
+    tail = 0;
 
-static ngx_int_t
-ngx_http_sub_cmp_matches(const void *one, const void *two)
-{
-    ngx_int_t              c1, c2;
-    ngx_http_sub_match_t  *first, *second;
+    queue[tail++] = 0;
+    fail[0] = 0;
+
+    while (head < tail) {
+        state = queue[head++];
+        row = &tables->next[state * k];
+        f = fail[state];
+
+        for (i = 0; i < k; i++) {
+            t = row[i];
 
-    first = (ngx_http_sub_match_t *) one;
-    second = (ngx_http_sub_match_t *) two;
+            if (t) {
+                fail[t] = state ? tables->next[f * k + i] : 0;
 
-    c1 = first->match.data[ngx_http_sub_cmp_index];
-    c2 = second->match.data[ngx_http_sub_cmp_index];
+                tables->dict[t] =
+                          (tables->output[fail[t]] != NGX_HTTP_SUB_NO_MATCH)
+                          ? fail[t] : tables->dict[fail[t]];
 
-    return c1 - c2;
+                queue[tail++] = (uint16_t) t;
+                continue;
+            }
+
+            row[i] = state ? tables->next[f * k + i] : 0;
+        }
+    }
+
+    ngx_pfree(pool, fail);
+
+    return NGX_OK;
 }
 
 
@@ -22,9 +22,25 @@ typedef struct {
 } ngx_http_upstream_chash_points_t;
 
 
+/*
+ * Maglev lookup table: each entry is the number of a peer in the list,
+ * peers take turns to claim entries in their own permutation of the table
+ */
+
+typedef struct {
+    ngx_uint_t                          size;
+    uint32_t                           *entry;
+
+    /* the peers the list below was filled from */
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t       **peer;
+} ngx_http_upstream_maglev_t;
+
+
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_maglev_t         *maglev;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -58,6 +74,14 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_uint_t ngx_http_upstream_maglev_prime(ngx_uint_t n);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -601,6 +625,266 @@ found:
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    uint32_t                           *entry, *offset, *skip;
+    ngx_int_t                           w;
+    ngx_uint_t                          i, n, filled;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+    n = peers->number;
+
+    maglev = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_maglev_t));
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * about 100 entries per weight unit keep the imbalance within 1%;
+     * the size is only changed in steps, as keys are spread over the
+     * whole table and resizing it moves almost all of them
+     */
+
+    for (size = 65536; size < 100 * peers->total_weight; size *= 10) {
+        /* void */
+    }
+
+    size = ngx_http_upstream_maglev_prime(size);
+
+    maglev->size = size;
+    maglev->peers = peers;
+
+    maglev->entry = ngx_palloc(cf->pool, size * sizeof(uint32_t));
+    if (maglev->entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->peer = ngx_palloc(cf->pool,
+                              n * sizeof(ngx_http_upstream_rr_peer_t *));
+    if (maglev->peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = ngx_alloc(2 * n * sizeof(uint32_t), cf->log);
+    if (offset == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = offset + n;
+
+    /*
+     * the permutation of a peer depends on its address only,
+     * so adding or removing a peer moves few other keys
+     */
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        maglev->peer[i] = peer;
+
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len) % size;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (size - 1) + 1;
+    }
+
+    entry = maglev->entry;
+
+    for (i = 0; i < size; i++) {
+        entry[i] = (uint32_t) -1;
+    }
+
+    filled = 0;
+
+    for ( ;; ) {
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            for (w = 0; w < peer->weight; w++) {
+
+                while (entry[offset[i]] != (uint32_t) -1) {
+                    offset[i] = (offset[i] + skip[i]) % size;
+                }
+
+                entry[offset[i]] = i;
+                offset[i] = (offset[i] + skip[i]) % size;
+
+                if (++filled == size) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(offset);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "maglev table: %uz entries, %ui peers, weight %ui",
+                   size, n, peers->total_weight);
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_maglev_prime(ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    if (n < 3) {
+        return 3;
+    }
+
+    for (n |= 1; /* void */; n += 2) {
+        for (i = 3; i * i <= n; i += 2) {
+            if (n % i == 0) {
+                break;
+            }
+        }
+
+        if (i * i > n) {
+            return n;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_srv_conf_t   *hcf;
+    ngx_http_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hp = r->upstream->peer.data;
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len) % hcf->maglev->size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t *hp = data;
+
+    time_t                         now;
+    uintptr_t                      m;
+    ngx_uint_t                     i, n, p;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_maglev_t    *maglev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev peer, try: %ui", pc->tries);
+
+    ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    maglev = hp->conf->maglev;
+    peers = hp->rrp.peers;
+
+    if (maglev->peers != peers) {
+
+        /* the peers were copied to a shared memory zone */
+
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+            maglev->peer[i] = peer;
+        }
+
+        maglev->peers = peers;
+    }
+
+    now = ngx_time();
+
+    pc->connection = NULL;
+
+    for ( ;; ) {
+
+        p = maglev->entry[hp->hash % maglev->size];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get maglev peer, entry:%uD, peer:%ui", hp->hash, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        /* the next entry belongs to another peer with the same chance */
+
+        hp->hash++;
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -612,6 +896,7 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
 
     return conf;
 }
@@ -657,6 +942,9 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_http_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
@@ -27,7 +27,7 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      42
 #define NGX_HTTP_CACHE_VARY_LEN      42
 
-#define NGX_HTTP_CACHE_VERSION       3
+#define NGX_HTTP_CACHE_VERSION       4
 
 
 typedef struct {
@@ -36,6 +36,9 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_ram_s  ngx_http_file_cache_ram_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -58,9 +61,19 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+
+    ngx_http_file_cache_ram_t       *ram;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_ram_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -70,6 +83,8 @@ struct ngx_http_cache_s {
 
     ngx_file_uniq_t                  uniq;
     time_t                           valid_sec;
+    time_t                           updating_sec;
+    time_t                           error_sec;
     time_t                           last_modified;
     time_t                           date;
 
@@ -111,12 +126,19 @@ struct ngx_http_cache_s {
     unsigned                         temp_file:1;
     unsigned                         reading:1;
     unsigned                         secondary:1;
+    unsigned                         ram:1;
+    unsigned                         background:1;
+
+    unsigned                         stale_updating:1;
+    unsigned                         stale_error:1;
 };
 
 
 typedef struct {
     ngx_uint_t                       version;
     time_t                           valid_sec;
+    time_t                           updating_sec;
+    time_t                           error_sec;
     time_t                           last_modified;
     time_t                           date;
     uint32_t                         crc32;
@@ -140,6 +162,12 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    ngx_uint_t                       evicted;
+    off_t                            evicted_size;
+    ngx_msec_t                       lock_time;
+    ngx_msec_t                       lock_max;
+    ngx_queue_t                      ram_queue;
+    size_t                           ram_size;
 } ngx_http_file_cache_sh_t;
 
 
@@ -151,6 +179,7 @@ struct ngx_http_file_cache_s {
     ngx_path_t                      *temp_path;
 
     off_t                            max_size;
+    off_t                            min_free;
     size_t                           bsize;
 
     time_t                           inactive;
@@ -163,6 +192,26 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
 
+    size_t                           ram_max_size;
+    size_t                           ram_max_object;
+    ngx_uint_t                       ram_min_uses;
+
+    ngx_uint_t                       manager_files;
+    ngx_msec_t                       manager_sleep;
+    ngx_msec_t                       manager_threshold;
+
+    ngx_msec_t                       lock_start;
+
+    ngx_msec_t                       stat_time;
+    ngx_uint_t                       stat_evicted;
+    off_t                            stat_size;
+    ngx_msec_t                       stat_lock_time;
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t               *thread_pool;
+    ngx_uint_t                       pending;
+#endif
+
     ngx_shm_zone_t                  *shm_zone;
 };
 
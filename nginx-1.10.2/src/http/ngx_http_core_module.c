@@ -2427,6 +2427,9 @@ ngx_http_subrequest(ngx_http_request_t *r,
     ngx_http_request_t            *sr;
     ngx_http_core_srv_conf_t      *cscf;
     ngx_http_postponed_request_t  *pr, *p;
+#if (NGX_PCRE)
+    ngx_http_core_main_conf_t     *cmcf;
+#endif
 
     if (r->subrequests == 0) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -2500,6 +2503,7 @@ ngx_http_subrequest(ngx_http_request_t *r,
 
     sr->subrequest_in_memory = (flags & NGX_HTTP_SUBREQUEST_IN_MEMORY) != 0;
     sr->waited = (flags & NGX_HTTP_SUBREQUEST_WAITED) != 0;
+    sr->background = (flags & NGX_HTTP_SUBREQUEST_BACKGROUND) != 0;
 
     sr->unparsed_uri = r->unparsed_uri;
     sr->method_name = ngx_http_core_get_method;
@@ -2513,29 +2517,71 @@ ngx_http_subrequest(ngx_http_request_t *r,
     sr->read_event_handler = ngx_http_request_empty_handler;
     sr->write_event_handler = ngx_http_handler;
 
-    if (c->data == r && r->postponed == NULL) {
-        c->data = sr;
+    if (flags & NGX_HTTP_SUBREQUEST_CLONE) {
+
+        /*
+         * a clone continues with the method, location and content
+         * handler of the request, server rewrites are not run again
+         */
+
+        sr->method = r->method;
+        sr->method_name = r->method_name;
+        sr->loc_conf = r->loc_conf;
+        sr->valid_location = r->valid_location;
+        sr->valid_unparsed_uri = r->valid_unparsed_uri;
+        sr->content_handler = r->content_handler;
+        sr->phase_handler = r->phase_handler;
+        sr->write_event_handler = ngx_http_core_run_phases;
+
+#if (NGX_PCRE)
+        if (r->captures) {
+            cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+            sr->captures = ngx_palloc(r->pool, cmcf->ncaptures * sizeof(int));
+            if (sr->captures == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(sr->captures, r->captures, r->ncaptures * sizeof(int));
+
+            sr->ncaptures = r->ncaptures;
+            sr->captures_data = r->captures_data;
+        }
+#endif
+
+        ngx_http_update_location_config(sr);
     }
 
     sr->variables = r->variables;
 
     sr->log_handler = r->log_handler;
 
-    pr = ngx_palloc(r->pool, sizeof(ngx_http_postponed_request_t));
-    if (pr == NULL) {
-        return NGX_ERROR;
-    }
+    /*
+     * a background subrequest produces no output and is not waited for,
+     * so it never becomes active and is not added to postponed requests
+     */
+
+    if (!sr->background) {
+        if (c->data == r && r->postponed == NULL) {
+            c->data = sr;
+        }
 
-    pr->request = sr;
-    pr->out = NULL;
-    pr->next = NULL;
+        pr = ngx_palloc(r->pool, sizeof(ngx_http_postponed_request_t));
+        if (pr == NULL) {
+            return NGX_ERROR;
+        }
 
-    if (r->postponed) {
-        for (p = r->postponed; p->next; p = p->next) { /* void */ }
-        p->next = pr;
+        pr->request = sr;
+        pr->out = NULL;
+        pr->next = NULL;
 
-    } else {
-        r->postponed = pr;
+        if (r->postponed) {
+            for (p = r->postponed; p->next; p = p->next) { /* void */ }
+            p->next = pr;
+
+        } else {
+            r->postponed = pr;
+        }
     }
 
     sr->internal = 1;
@@ -18,6 +18,12 @@ static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_ram_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_store(ngx_http_request_t *r,
+    ngx_http_cache_t *c, size_t n);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -49,6 +55,18 @@ static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
+static void ngx_http_file_cache_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_unlink_thread(
+    ngx_http_file_cache_t *cache, u_char *name, size_t len);
+static void ngx_http_file_cache_unlink_thread_handler(void *data,
+    ngx_log_t *log);
+static void ngx_http_file_cache_unlink_event_handler(ngx_event_t *ev);
+#endif
+static void ngx_http_file_cache_manager_lock(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_manager_unlock(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_manager_stat(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -116,6 +134,7 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
+        cache->min_free /= cache->bsize;
 
         if (!cache->sh->cold || cache->sh->loading) {
             cache->path->loader = NULL;
@@ -150,10 +169,18 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     cache->sh->size = 0;
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->evicted = 0;
+    cache->sh->evicted_size = 0;
+    cache->sh->lock_time = 0;
+    cache->sh->lock_max = 0;
+
+    ngx_queue_init(&cache->sh->ram_queue);
+    cache->sh->ram_size = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
+    cache->min_free /= cache->bsize;
 
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
@@ -263,6 +290,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -342,6 +370,10 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->node->ram && ngx_http_file_cache_ram_read(r, c) == NGX_OK) {
+        return ngx_http_file_cache_read(r, c);
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -381,7 +413,23 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    size = c->body_start;
+
+    /*
+     * a file which may be stored in memory is read as a whole here,
+     * using aio if enabled, so it is never read again to be stored
+     */
+
+    if (cache->ram_max_size
+        && c->length > (off_t) size
+        && c->length <= (off_t) cache->ram_max_object
+        && c->node->ram == NULL
+        && c->node->uses >= cache->ram_min_uses)
+    {
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -530,13 +578,19 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_str_t                     *key;
     ngx_int_t                      rc;
     ngx_uint_t                     i;
+    ngx_http_cache_t              *pc;
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->ram) {
+        n = c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -601,6 +655,8 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     c->buf->last += n;
 
     c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
     c->last_modified = h->last_modified;
     c->date = h->date;
     c->valid_msec = h->valid_msec;
@@ -631,11 +687,35 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     now = ngx_time();
 
+    if (!c->ram
+        && cache->ram_max_size
+        && c->length <= (off_t) cache->ram_max_object
+        && c->valid_sec >= now)
+    {
+        ngx_http_file_cache_ram_store(r, c, n);
+    }
+
     if (c->valid_sec < now) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
+
+        pc = r->background ? r->parent->cache : NULL;
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (c->node->updating) {
+        if (pc && pc->node == c->node && pc->updating) {
+
+            /*
+             * a background update takes the update over from the request
+             * which is sending the stale response
+             */
+
+            pc->updating = 0;
+            c->updating = 1;
+            c->lock_time = pc->lock_time;
+            rc = NGX_HTTP_CACHE_STALE;
+
+        } else if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
 
         } else {
@@ -658,9 +738,160 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_ram_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t      *cache;
+    ngx_http_file_cache_ram_t  *ram;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ram = c->node->ram;
+
+    if (ram == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the body is copied under the lock, so a stored body may be freed
+     * at any time regardless of requests which have used it
+     */
+
+    c->buf = ngx_create_temp_buf(r->pool, ram->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_memcpy(c->buf->pos, ram->data, ram->len);
+
+    c->length = ram->len;
+    c->uniq = c->node->uniq;
+    c->fs_size = c->node->fs_size;
+
+    ngx_queue_remove(&ram->queue);
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %O", c->length);
+
+    c->ram = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_ram_store(ngx_http_request_t *r, ngx_http_cache_t *c,
+    size_t n)
+{
+    size_t                       len, size;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_ram_t   *ram;
+    ngx_http_file_cache_node_t  *fcn;
+
+    cache = c->file_cache;
+    fcn = c->node;
+
+    len = (size_t) c->length;
+
+    /* only a file already read as a whole is stored */
+
+    if (n < len) {
+        return;
+    }
+
+    /*
+     * bodies are allocated in whole pages, so ram_size limits exactly
+     * the memory they may take from the keys zone
+     */
+
+    size = ngx_align(offsetof(ngx_http_file_cache_ram_t, data) + len,
+                     ngx_pagesize);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* the file may have been replaced while it was read */
+
+    if (fcn->ram
+        || fcn->uses < cache->ram_min_uses
+        || !fcn->exists
+        || (fcn->uniq && fcn->uniq != c->uniq))
+    {
+        goto done;
+    }
+
+    for ( ;; ) {
+
+        if (cache->sh->ram_size + size <= cache->ram_max_size) {
+
+            ram = ngx_slab_alloc_locked(cache->shpool, size);
+            if (ram) {
+                break;
+            }
+        }
+
+        if (ngx_queue_empty(&cache->sh->ram_queue)) {
+            goto done;
+        }
+
+        q = ngx_queue_last(&cache->sh->ram_queue);
+        ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+
+        ngx_http_file_cache_ram_free(cache, ram->node);
+    }
+
+    ram->node = fcn;
+    ram->len = len;
+    ngx_memcpy(ram->data, c->buf->pos, len);
+
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
+    cache->sh->ram_size += size;
+
+    fcn->ram = ram;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram store: %uz", len);
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_ram_t  *ram;
+
+    ram = fcn->ram;
+
+    if (ram == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&ram->queue);
+
+    cache->sh->ram_size -= ngx_align(offsetof(ngx_http_file_cache_ram_t, data)
+                                     + ram->len, ngx_pagesize);
+
+    ngx_slab_free_locked(cache->shpool, ram);
+
+    fcn->ram = NULL;
+}
+
+
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    size_t                     size;
 #if (NGX_HAVE_FILE_AIO || NGX_THREADS)
     ssize_t                    n;
     ngx_http_core_loc_conf_t  *clcf;
@@ -668,10 +899,12 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 #endif
 
+    size = c->buf->end - c->buf->pos;
+
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -698,7 +931,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -708,7 +941,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, size, 0);
 }
 
 
@@ -898,6 +1131,8 @@ renew:
 
     rc = NGX_DECLINED;
 
+    ngx_http_file_cache_ram_free(cache, fcn);
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -1225,7 +1460,13 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     c->secondary = 1;
     c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+
+    if (c->ram) {
+        c->ram = 0;
+
+    } else {
+        c->body_start = c->buf->end - c->buf->start;
+    }
 
     ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
 
@@ -1252,6 +1493,8 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 
     h->version = NGX_HTTP_CACHE_VERSION;
     h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
     h->last_modified = c->last_modified;
     h->date = c->date;
     h->crc32 = c->crc32;
@@ -1402,6 +1645,8 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_ram_free(cache, c->node);
+
     c->node->count--;
     c->node->uniq = uniq;
     c->node->body_start = c->body_start;
@@ -1427,12 +1672,20 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     ngx_file_t                     file;
     ngx_file_info_t                fi;
     ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t   h;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache update header");
 
     c = r->cache;
+    cache = c->file_cache;
+
+    /* the header in memory is going to be outdated */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_file_cache_ram_free(cache, c->node);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
     ngx_memzero(&file, sizeof(ngx_file_t));
 
@@ -1512,6 +1765,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
 
     h.version = NGX_HTTP_CACHE_VERSION;
     h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
     h.last_modified = c->last_modified;
     h.date = c->date;
     h.crc32 = c->crc32;
@@ -1573,9 +1828,11 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!c->ram) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     rc = ngx_http_send_header(r);
@@ -1584,17 +1841,25 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (c->ram) {
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
     b->last_buf = (r == r->main) ? 1: 0;
     b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
-
     out.buf = b;
     out.next = NULL;
 
@@ -1715,7 +1980,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     wait = 10;
     tries = 20;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_file_cache_manager_lock(cache);
 
     for (q = ngx_queue_last(&cache->sh->queue);
          q != ngx_queue_sentinel(&cache->sh->queue);
@@ -1743,7 +2008,7 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
         break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_http_file_cache_manager_unlock(cache);
 
     ngx_free(name);
 
@@ -1758,6 +2023,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
     size_t                       len;
     time_t                       now, wait;
     ngx_path_t                  *path;
+    ngx_msec_t                   elapsed;
     ngx_queue_t                 *q;
     ngx_http_file_cache_node_t  *fcn;
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
@@ -1777,7 +2043,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     now = ngx_time();
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_http_file_cache_manager_lock(cache);
 
     for ( ;; ) {
 
@@ -1809,7 +2075,7 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
         if (fcn->count == 0) {
             ngx_http_file_cache_delete(cache, q, name);
-            continue;
+            goto next;
         }
 
         if (fcn->deleting) {
@@ -1835,9 +2101,37 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
         ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                       "ignore long locked inactive cache entry %*s, count:%d",
                       (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+    next:
+
+        /*
+         * the lock is released after each entry, and the pass is limited
+         * by the same number of files and time as a single batch of
+         * forced expiration
+         */
+
+        ngx_http_file_cache_manager_unlock(cache);
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            goto done;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            goto done;
+        }
+
+        ngx_http_file_cache_manager_lock(cache);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_http_file_cache_manager_unlock(cache);
+
+done:
 
     ngx_free(name);
 
@@ -1857,8 +2151,13 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
     fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
     if (fcn->exists) {
+        ngx_http_file_cache_ram_free(cache, fcn);
+
         cache->sh->size -= fcn->fs_size;
 
+        cache->sh->evicted++;
+        cache->sh->evicted_size += fcn->fs_size;
+
         path = cache->path;
         p = name + path->name.len + 1 + path->len;
         p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
@@ -1867,49 +2166,217 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
         p = ngx_hex_dump(p, fcn->key, len);
         *p = '\0';
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_http_file_cache_unlink(cache, fcn, name);
+    }
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+static void
+ngx_http_file_cache_unlink(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name)
+{
+    size_t       len;
+    ngx_path_t  *path;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    fcn->count++;
+    fcn->deleting = 1;
+    ngx_http_file_cache_manager_unlock(cache);
+
+    ngx_create_hashed_filename(path, name, len);
+
+#if (NGX_THREADS)
+
+    if (cache->thread_pool
+        && ngx_http_file_cache_unlink_thread(cache, name, len) == NGX_OK)
+    {
+        ngx_http_file_cache_manager_lock(cache);
         fcn->count--;
         fcn->deleting = 0;
+        return;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire: \"%s\"", name);
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
     }
+
+    ngx_http_file_cache_manager_lock(cache);
+    fcn->count--;
+    fcn->deleting = 0;
 }
 
 
-static time_t
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_file_cache_unlink_thread(ngx_http_file_cache_t *cache, u_char *name,
+    size_t len)
+{
+    u_char             *p;
+    ngx_err_t           err;
+    ngx_thread_task_t  *task;
+
+    if (cache->pending >= cache->manager_files) {
+        return NGX_DECLINED;
+    }
+
+    task = ngx_alloc(sizeof(ngx_thread_task_t) + len + sizeof(".del"),
+                     ngx_cycle->log);
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(task, sizeof(ngx_thread_task_t));
+
+    p = (u_char *) (task + 1);
+    ngx_memcpy(ngx_cpymem(p, name, len), ".del", sizeof(".del"));
+
+    /*
+     * the file is moved aside while the node is still in the tree,
+     * so the thread cannot remove a file cached again for the same key;
+     * leftovers of a crashed manager are removed by the cache loader
+     */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire thread: \"%s\"", p);
+
+    if (ngx_rename_file(name, p) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                          name, p);
+        }
+
+        ngx_free(task);
+
+        return (err == NGX_ENOENT) ? NGX_OK : NGX_ERROR;
+    }
+
+    task->ctx = p;
+    task->handler = ngx_http_file_cache_unlink_thread_handler;
+    task->event.data = cache;
+    task->event.handler = ngx_http_file_cache_unlink_event_handler;
+    task->event.log = ngx_cycle->log;
+
+    if (ngx_thread_task_post(cache->thread_pool, task) != NGX_OK) {
+        ngx_http_file_cache_unlink_thread_handler(p, ngx_cycle->log);
+        ngx_free(task);
+        return NGX_OK;
+    }
+
+    cache->pending++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_unlink_thread_handler(void *data, ngx_log_t *log)
+{
+    u_char  *name = data;
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+}
+
+
+static void
+ngx_http_file_cache_unlink_event_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t      *task;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ev->data;
+    task = (ngx_thread_task_t *) ((u_char *) ev
+                                  - offsetof(ngx_thread_task_t, event));
+
+    cache->pending--;
+
+    ngx_free(task);
+}
+
+#endif
+
+
+static void
+ngx_http_file_cache_manager_lock(ngx_http_file_cache_t *cache)
+{
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_time_update();
+    cache->lock_start = ngx_current_msec;
+}
+
+
+static void
+ngx_http_file_cache_manager_unlock(ngx_http_file_cache_t *cache)
+{
+    ngx_msec_t  held;
+
+    ngx_time_update();
+    held = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->lock_start));
+
+    cache->sh->lock_time += held;
+
+    if (held > cache->sh->lock_max) {
+        cache->sh->lock_max = held;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_msec_t
 ngx_http_file_cache_manager(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
     off_t       size;
-    time_t      next, wait;
-    ngx_uint_t  count, watermark;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark, full;
 
-    next = ngx_http_file_cache_expire(cache);
+#if (NGX_THREADS)
+
+    if (cache->thread_pool
+        && ngx_thread_pool_start((ngx_cycle_t *) ngx_cycle,
+                                 cache->thread_pool)
+           != NGX_OK)
+    {
+        cache->thread_pool = NULL;
+    }
+
+#endif
 
     cache->last = ngx_current_msec;
     cache->files = 0;
 
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
     for ( ;; ) {
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -1923,20 +2390,96 @@ ngx_http_file_cache_manager(void *data)
                        "http file cache size: %O c:%ui w:%i",
                        size, count, (ngx_int_t) watermark);
 
-        if (size < cache->max_size && count < watermark) {
-            return next;
+        if (size < cache->max_size - cache->min_free && count < watermark) {
+            break;
         }
 
+        /*
+         * above max_size or the node watermark batches follow each other
+         * without a pause, between max_size - min_free and max_size
+         * they are spread by manager_sleep
+         */
+
+        full = (size >= cache->max_size || count >= watermark);
+
         wait = ngx_http_file_cache_forced_expire(cache);
 
         if (wait > 0) {
-            return wait;
+            next = (ngx_msec_t) wait * 1000;
+            break;
         }
 
         if (ngx_quit || ngx_terminate) {
-            return next;
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = full ? 0 : cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache manager time: %M", elapsed);
+
+        if (elapsed >= cache->manager_threshold) {
+            next = full ? 0 : cache->manager_sleep;
+            break;
         }
     }
+
+done:
+
+    ngx_http_file_cache_manager_stat(cache);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_manager_stat(ngx_http_file_cache_t *cache)
+{
+    off_t       size;
+    ngx_msec_t  elapsed, lock_time, lock_max;
+    ngx_uint_t  evicted;
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->stat_time));
+
+    if (cache->stat_time && elapsed < 60000) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    evicted = cache->sh->evicted;
+    size = cache->sh->evicted_size;
+    lock_time = cache->sh->lock_time;
+    lock_max = cache->sh->lock_max;
+
+    cache->sh->lock_max = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (cache->stat_time && evicted != cache->stat_evicted) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "http file cache: %V evicted %ui files %.3fM "
+                      "in %M ms, %.1f files/s, lock held %M ms, max %M ms",
+                      &cache->path->name, evicted - cache->stat_evicted,
+                      ((double) (size - cache->stat_size) * cache->bsize)
+                      / (1024 * 1024),
+                      elapsed,
+                      (double) (evicted - cache->stat_evicted) * 1000
+                      / elapsed,
+                      lock_time - cache->stat_lock_time, lock_max);
+    }
+
+    cache->stat_time = ngx_current_msec;
+    cache->stat_evicted = evicted;
+    cache->stat_size = size;
+    cache->stat_lock_time = lock_time;
 }
 
 
@@ -2204,14 +2747,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size;
+    off_t                   max_size, min_free;
     u_char                 *last, *p;
     time_t                  inactive;
     size_t                  len;
-    ssize_t                 size;
+    ssize_t                 size, ram_size, ram_max_object;
     ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
-    ngx_msec_t              loader_sleep, loader_threshold;
+    ngx_int_t               loader_files, manager_files, ram_min_uses;
+    ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
+                            manager_threshold;
     ngx_uint_t              i, n, use_temp_path;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
@@ -2233,9 +2777,18 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     loader_sleep = 50;
     loader_threshold = 200;
 
+    manager_files = 100;
+    manager_sleep = 50;
+    manager_threshold = 200;
+
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
+    min_free = 0;
+
+    ram_size = 0;
+    ram_max_object = 16384;
+    ram_min_uses = 2;
 
     value = cf->args->elts;
 
@@ -2362,6 +2915,63 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "min_free=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            min_free = ngx_parse_offset(&s);
+            if (min_free < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid min_free value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ram_size = ngx_parse_size(&s);
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max_object=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            ram_max_object = ngx_parse_size(&s);
+            if (ram_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_max_object value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_min_uses=", 13) == 0) {
+
+            ram_min_uses = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (ram_min_uses == NGX_ERROR || ram_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ram_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -2404,6 +3014,75 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "manager_files=", 14) == 0) {
+
+            manager_files = ngx_atoi(value[i].data + 14, value[i].len - 14);
+            if (manager_files == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_files value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_sleep=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            manager_sleep = ngx_parse_time(&s, 0);
+            if (manager_sleep == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_sleep value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_threshold=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            manager_threshold = ngx_parse_time(&s, 0);
+            if (manager_threshold == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_threshold value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_threads", 15) == 0
+            && (value[i].len == 15 || value[i].data[15] == '='))
+        {
+#if (NGX_THREADS)
+            if (value[i].len > 16) {
+                s.len = value[i].len - 16;
+                s.data = value[i].data + 16;
+
+                cache->thread_pool = ngx_thread_pool_add(cf, &s);
+
+            } else {
+                cache->thread_pool = ngx_thread_pool_add(cf, NULL);
+            }
+
+            if (cache->thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"manager_threads\" "
+                               "is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2416,6 +3095,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (min_free && min_free >= max_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min_free\" must be less than \"max_size\"");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2424,6 +3109,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
+    cache->manager_files = manager_files;
+    cache->manager_sleep = manager_sleep;
+    cache->manager_threshold = manager_threshold;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2460,7 +3148,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    /* bodies of the RAM tier are allocated from the keys zone */
+
+    cache->shm_zone = ngx_shared_memory_add(cf, &name, size + ram_size,
+                                            cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -2477,6 +3168,11 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cache->inactive = inactive;
     cache->max_size = max_size;
+    cache->min_free = min_free;
+
+    cache->ram_max_size = ram_size;
+    cache->ram_max_object = ram_max_object;
+    cache->ram_min_uses = ram_min_uses;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
 
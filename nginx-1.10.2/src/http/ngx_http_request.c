@@ -2287,6 +2287,35 @@ ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
         rc = r->post_subrequest->handler(r, r->post_subrequest->data, rc);
     }
 
+    if (r->background) {
+
+        /*
+         * the result of a background subrequest is never sent,
+         * and its errors do not affect the main request
+         */
+
+        if (!r->logged) {
+
+            clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+            if (clcf->log_subrequest) {
+                ngx_http_log_request(r);
+            }
+
+            r->logged = 1;
+
+        } else {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "subrequest: \"%V?%V\" logged again",
+                          &r->uri, &r->args);
+        }
+
+        r->done = 1;
+
+        ngx_http_finalize_connection(r);
+        return;
+    }
+
     if (rc == NGX_ERROR
         || rc == NGX_HTTP_REQUEST_TIME_OUT
         || rc == NGX_HTTP_CLIENT_CLOSED_REQUEST
@@ -2532,6 +2561,12 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
         return;
     }
 
+    /* the last reference may be released by a background subrequest */
+
+    r = r->main;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
     if (r->reading_body) {
         r->keepalive = 0;
         r->lingering_close = 1;
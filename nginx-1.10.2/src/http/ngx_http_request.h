@@ -62,6 +62,8 @@
 /* unused                                  1 */
 #define NGX_HTTP_SUBREQUEST_IN_MEMORY      2
 #define NGX_HTTP_SUBREQUEST_WAITED         4
+#define NGX_HTTP_SUBREQUEST_BACKGROUND     16
+#define NGX_HTTP_SUBREQUEST_CLONE          32
 #define NGX_HTTP_LOG_UNSAFE                8
 
 
@@ -483,6 +485,7 @@ struct ngx_http_request_s {
 
     unsigned                          subrequest_in_memory:1;
     unsigned                          waited:1;
+    unsigned                          background:1;
 
 #if (NGX_HTTP_CACHE)
     unsigned                          cached:1;
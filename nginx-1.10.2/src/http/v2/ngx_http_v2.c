@@ -40,6 +40,7 @@
 
 /* settings fields */
 #define NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING    0x1
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING          0x2
 #define NGX_HTTP_V2_MAX_STREAMS_SETTING          0x3
 #define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING     0x4
 #define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING       0x5
@@ -50,10 +51,20 @@
 
 #define NGX_HTTP_V2_ROOT                         (void *) -1
 
+#define NGX_HTTP_V2_SEND_BATCH                   64
+
+
+typedef struct {
+    ngx_str_t                                name;
+    ngx_uint_t                               offset;
+} ngx_http_v2_push_header_t;
+
 
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
+static void ngx_http_v2_data_queue_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
 static u_char *ngx_http_v2_state_proxy_protocol(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end);
@@ -159,7 +170,10 @@ static ngx_int_t ngx_http_v2_construct_request_line(ngx_http_request_t *r);
 static ngx_int_t ngx_http_v2_cookie(ngx_http_request_t *r,
     ngx_http_v2_header_t *header);
 static ngx_int_t ngx_http_v2_construct_cookie_header(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_push_header(ngx_http_request_t *r,
+    ngx_http_v2_header_t *header);
 static void ngx_http_v2_run_request(ngx_http_request_t *r);
+static void ngx_http_v2_run_request_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_v2_process_request_body(ngx_http_request_t *r,
     u_char *pos, size_t size, ngx_uint_t last);
 static ngx_int_t ngx_http_v2_filter_request_body(ngx_http_request_t *r);
@@ -182,6 +196,32 @@ static void ngx_http_v2_node_children_update(ngx_http_v2_node_t *node);
 static void ngx_http_v2_pool_cleanup(void *data);
 
 
+/*
+ * the request headers of the main request,
+ * which are copied into pushed requests
+ */
+
+static ngx_http_v2_push_header_t  ngx_http_v2_push_headers[] = {
+    { ngx_string("host"),
+      offsetof(ngx_http_headers_in_t, host) },
+
+#if (NGX_HTTP_GZIP)
+    { ngx_string("accept-encoding"),
+      offsetof(ngx_http_headers_in_t, accept_encoding) },
+#endif
+
+#if (NGX_HTTP_HEADERS)
+    { ngx_string("accept-language"),
+      offsetof(ngx_http_headers_in_t, accept_language) },
+#endif
+
+    { ngx_string("user-agent"),
+      offsetof(ngx_http_headers_in_t, user_agent) },
+
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_http_v2_handler_pt ngx_http_v2_frame_states[] = {
     ngx_http_v2_state_data,
     ngx_http_v2_state_headers,
@@ -245,6 +285,8 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
+    h2c->concurrent_pushes = h2scf->concurrent_pushes;
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -283,6 +325,9 @@ ngx_http_v2_init(ngx_event_t *rev)
     h2c->state.handler = hc->proxy_protocol ? ngx_http_v2_state_proxy_protocol
                                             : ngx_http_v2_state_preface;
 
+    ngx_rbtree_init(&h2c->data_queue, &h2c->data_sentinel,
+                    ngx_http_v2_data_queue_insert_value);
+
     ngx_queue_init(&h2c->waiting);
     ngx_queue_init(&h2c->posted);
     ngx_queue_init(&h2c->dependencies);
@@ -369,7 +414,9 @@ ngx_http_v2_read_handler(ngx_event_t *rev)
         return;
     }
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -410,7 +457,7 @@ ngx_http_v2_write_handler(ngx_event_t *wev)
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 write handler");
 
-    if (h2c->last_out == NULL && !c->buffered) {
+    if (!ngx_http_v2_output_queued(h2c) && !c->buffered) {
 
         if (wev->timer_set) {
             ngx_del_timer(wev);
@@ -463,9 +510,11 @@ ngx_int_t
 ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
 {
     int                        tcp_nodelay;
+    ngx_uint_t                 n;
     ngx_chain_t               *cl;
     ngx_event_t               *wev;
     ngx_connection_t          *c;
+    ngx_rbtree_node_t         *node, *sentinel;
     ngx_http_v2_out_frame_t   *out, *frame, *fn;
     ngx_http_core_loc_conf_t  *clcf;
 
@@ -481,28 +530,88 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
-    cl = NULL;
-    out = NULL;
+    sentinel = h2c->data_queue.sentinel;
+
+    do {
 
-    for (frame = h2c->last_out; frame; frame = fn) {
-        frame->last->next = cl;
-        cl = frame->first;
+        /*
+         * a batch of DATA frames is taken from the scheduler
+         * and is sent after the control and blocked frames
+         */
 
-        fn = frame->next;
-        frame->next = out;
-        out = frame;
+        for (n = 0; n < NGX_HTTP_V2_SEND_BATCH; n++) {
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http2 frame out: %p sid:%ui bl:%d len:%uz",
-                       out, out->stream ? out->stream->node->id : 0,
-                       out->blocked, out->length);
-    }
+            if (h2c->data_queue.root == sentinel) {
+                break;
+            }
 
-    cl = c->send_chain(c, cl, 0);
+            node = ngx_rbtree_min(h2c->data_queue.root, sentinel);
+            ngx_rbtree_delete(&h2c->data_queue, node);
 
-    if (cl == NGX_CHAIN_ERROR) {
-        goto error;
-    }
+            if ((ngx_rbtree_key_int_t) (node->key - h2c->vtime) > 0) {
+                h2c->vtime = node->key;
+            }
+
+            frame = ngx_http_v2_node_frame(node);
+
+            frame->next = h2c->last_out;
+            h2c->last_out = frame;
+        }
+
+        cl = NULL;
+        out = NULL;
+
+        for (frame = h2c->last_out; frame; frame = fn) {
+            frame->last->next = cl;
+            cl = frame->first;
+
+            fn = frame->next;
+            frame->next = out;
+            out = frame;
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 frame out: %p sid:%ui bl:%d len:%uz",
+                           out, out->stream ? out->stream->node->id : 0,
+                           out->blocked, out->length);
+        }
+
+        cl = c->send_chain(c, cl, 0);
+
+        if (cl == NGX_CHAIN_ERROR) {
+            goto error;
+        }
+
+        for ( /* void */ ; out; out = fn) {
+            fn = out->next;
+
+            if (out->handler(h2c, out) != NGX_OK) {
+                out->blocked = 1;
+                break;
+            }
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 frame sent: %p sid:%ui bl:%d len:%uz",
+                           out, out->stream ? out->stream->node->id : 0,
+                           out->blocked, out->length);
+        }
+
+        frame = NULL;
+
+        for ( /* void */ ; out; out = fn) {
+            fn = out->next;
+
+            if (out->stream && !out->blocked) {
+                ngx_rbtree_insert(&h2c->data_queue, &out->node);
+                continue;
+            }
+
+            out->next = frame;
+            frame = out;
+        }
+
+        h2c->last_out = frame;
+
+    } while (frame == NULL && h2c->data_queue.root != sentinel && wev->ready);
 
     clcf = ngx_http_get_module_loc_conf(h2c->http_connection->conf_ctx,
                                         ngx_http_core_module);
@@ -549,30 +658,6 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         c->tcp_nodelay = NGX_TCP_NODELAY_SET;
     }
 
-    for ( /* void */ ; out; out = fn) {
-        fn = out->next;
-
-        if (out->handler(h2c, out) != NGX_OK) {
-            out->blocked = 1;
-            break;
-        }
-
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                       "http2 frame sent: %p sid:%ui bl:%d len:%uz",
-                       out, out->stream ? out->stream->node->id : 0,
-                       out->blocked, out->length);
-    }
-
-    frame = NULL;
-
-    for ( /* void */ ; out; out = fn) {
-        fn = out->next;
-        out->next = frame;
-        frame = out;
-    }
-
-    h2c->last_out = frame;
-
     if (!wev->ready) {
         ngx_add_timer(wev, clcf->send_timeout);
         return NGX_AGAIN;
@@ -596,6 +681,49 @@ error:
 }
 
 
+static void
+ngx_http_v2_data_queue_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t        **p;
+    ngx_http_v2_out_frame_t   *f, *t;
+
+    f = ngx_http_v2_node_frame(node);
+
+    for ( ;; ) {
+
+        t = ngx_http_v2_node_frame(temp);
+
+        /*
+         * Frames are ordered by the dependency tree rank first,
+         * and then by their virtual finish time, with care of
+         * the wraparound like in the timers tree.  Frames with
+         * equal keys keep their order of arrival.
+         */
+
+        if (f->rank != t->rank) {
+            p = (f->rank < t->rank) ? &temp->left : &temp->right;
+
+        } else {
+            p = ((ngx_rbtree_key_int_t) (node->key - temp->key) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -603,7 +731,7 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     ngx_connection_t        *c;
     ngx_http_v2_srv_conf_t  *h2scf;
 
-    if (h2c->last_out || h2c->processing) {
+    if (ngx_http_v2_output_queued(h2c) || h2c->processing) {
         return;
     }
 
@@ -1096,9 +1224,10 @@ ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
 
     h2c->state.header_limit = h2scf->max_header_size;
 
-    if (h2c->processing >= h2scf->concurrent_streams) {
+    if (h2c->processing - h2c->pushing >= h2scf->concurrent_streams) {
         ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
-                      "concurrent streams exceeded %ui", h2c->processing);
+                      "concurrent streams exceeded %ui",
+                      h2c->processing - h2c->pushing);
 
         status = NGX_HTTP_V2_REFUSED_STREAM;
         goto rst_stream;
@@ -1959,7 +2088,11 @@ static u_char *
 ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
     u_char *end)
 {
-    ngx_uint_t  id, value;
+    ngx_uint_t               id, value;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
 
     while (h2c->state.length) {
         if (end - pos < NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
@@ -2010,6 +2143,24 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
             h2c->frame_size = value;
             break;
 
+        case NGX_HTTP_V2_ENABLE_PUSH_SETTING:
+
+            if (value > 1) {
+                ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                              "client sent SETTINGS frame with incorrect "
+                              "ENABLE_PUSH value %ui", value);
+
+                return ngx_http_v2_connection_error(h2c,
+                                                    NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            h2c->push_disabled = !value;
+            break;
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+            h2c->concurrent_pushes = ngx_min(value, h2scf->concurrent_pushes);
+            break;
+
         default:
             break;
         }
@@ -2771,6 +2922,11 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     r->http_version = NGX_HTTP_VERSION_20;
     r->valid_location = 1;
 
+#if (NGX_HTTP_SSL)
+    /* file data is read directly into DATA frames by the filter */
+    r->main_filter_need_in_memory = 0;
+#endif
+
     fc->data = r;
     h2c->connection->requests++;
 
@@ -2809,12 +2965,175 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     stream->send_window = h2c->init_window;
     stream->recv_window = h2scf->preread_size;
 
+    stream->vtime = h2c->vtime;
+
     h2c->processing++;
 
     return stream;
 }
 
 
+ngx_http_v2_stream_t *
+ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent, ngx_str_t *path)
+{
+    ngx_int_t                   rc;
+    ngx_pool_t                 *pool;
+    ngx_uint_t                  index;
+    ngx_table_elt_t           **h;
+    ngx_connection_t           *fc;
+    ngx_http_request_t         *r;
+    ngx_http_v2_node_t         *node;
+    ngx_http_v2_header_t        header;
+    ngx_http_v2_stream_t       *stream;
+    ngx_http_v2_srv_conf_t     *h2scf;
+    ngx_http_v2_connection_t   *h2c;
+    ngx_http_v2_push_header_t  *ph;
+
+    h2c = parent->connection;
+
+    pool = ngx_create_pool(1024, h2c->connection->log);
+    if (pool == NULL) {
+        goto rst_stream;
+    }
+
+    node = ngx_http_v2_get_node_by_id(h2c, h2c->last_push, 1);
+
+    if (node == NULL) {
+        ngx_destroy_pool(pool);
+        goto rst_stream;
+    }
+
+    stream = ngx_http_v2_create_stream(h2c);
+
+    if (stream == NULL) {
+
+        if (node->parent == NULL) {
+            h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                                 ngx_http_v2_module);
+
+            index = ngx_http_v2_index(h2scf, h2c->last_push);
+            h2c->streams_index[index] = node->index;
+        }
+
+        ngx_destroy_pool(pool);
+        goto rst_stream;
+    }
+
+    if (node->parent) {
+        ngx_queue_remove(&node->reuse);
+        h2c->closed_nodes--;
+    }
+
+    h2c->pushing++;
+
+    stream->pool = pool;
+    stream->in_closed = 1;
+    stream->node = node;
+
+    node->stream = stream;
+    node->weight = 16;
+
+    ngx_http_v2_set_dependency(h2c, node, parent->node->id, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 push stream sid:%ui depends on %ui",
+                   h2c->last_push, parent->node->id);
+
+    r = stream->request;
+    fc = r->connection;
+
+    r->method_name = ngx_http_core_get_method;
+    r->method = NGX_HTTP_GET;
+
+    r->schema_start = (u_char *) "https";
+
+#if (NGX_HTTP_SSL)
+    if (fc->ssl) {
+        r->schema_end = r->schema_start + 5;
+
+    } else
+#endif
+    {
+        r->schema_end = r->schema_start + 4;
+    }
+
+    header.value.len = path->len;
+    header.value.data = ngx_pstrdup(pool, path);
+
+    if (header.value.data == NULL) {
+        goto close;
+    }
+
+    rc = ngx_http_v2_parse_path(r, &header);
+
+    if (rc != NGX_OK) {
+        goto error;
+    }
+
+    for (ph = ngx_http_v2_push_headers; ph->name.len; ph++) {
+        h = (ngx_table_elt_t **) ((char *) &parent->request->headers_in
+                                  + ph->offset);
+
+        if (*h == NULL) {
+            continue;
+        }
+
+        header.name = ph->name;
+        header.value.len = (*h)->value.len;
+
+        header.value.data = ngx_pnalloc(pool, header.value.len + 1);
+        if (header.value.data == NULL) {
+            goto close;
+        }
+
+        ngx_memcpy(header.value.data, (*h)->value.data, header.value.len);
+        header.value.data[header.value.len] = '\0';
+
+        rc = ngx_http_v2_push_header(r, &header);
+
+        if (rc != NGX_OK) {
+            goto error;
+        }
+    }
+
+    fc->write->handler = ngx_http_v2_run_request_handler;
+    ngx_post_event(fc->write, &ngx_posted_events);
+
+    return stream;
+
+error:
+
+    if (rc == NGX_ABORT) {
+        /* header handler has already finalized request */
+        ngx_http_run_posted_requests(fc);
+        return NULL;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+        ngx_http_run_posted_requests(fc);
+        return NULL;
+    }
+
+close:
+
+    ngx_http_v2_close_stream(stream, NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    return NULL;
+
+rst_stream:
+
+    if (ngx_http_v2_send_rst_stream(h2c, h2c->last_push,
+                                    NGX_HTTP_V2_INTERNAL_ERROR)
+        != NGX_OK)
+    {
+        h2c->connection->error = 1;
+    }
+
+    return NULL;
+}
+
+
 static ngx_http_v2_node_t *
 ngx_http_v2_get_node_by_id(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
     ngx_uint_t alloc)
@@ -3423,6 +3742,45 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_v2_push_header(ngx_http_request_t *r, ngx_http_v2_header_t *header)
+{
+    ngx_table_elt_t            *h;
+    ngx_http_header_t          *hh;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->key = header->name;
+    h->hash = ngx_hash_key(h->key.data, h->key.len);
+
+    h->value = header->value;
+
+    h->lowcase_key = h->key.data;
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    hh = ngx_hash_find(&cmcf->headers_in_hash, h->hash,
+                       h->lowcase_key, h->key.len);
+
+    if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+        /*
+         * request has been finalized already
+         * in the header handler
+         */
+        return NGX_ABORT;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 push header: \"%V: %V\"", &h->key, &h->value);
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_http_v2_run_request(ngx_http_request_t *r)
 {
@@ -3458,6 +3816,24 @@ ngx_http_v2_run_request(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_v2_run_request_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *fc;
+    ngx_http_request_t  *r;
+
+    fc = ev->data;
+    r = fc->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 run request handler");
+
+    ngx_http_v2_run_request(r);
+
+    ngx_http_run_posted_requests(fc);
+}
+
+
 ngx_int_t
 ngx_http_v2_read_request_body(ngx_http_request_t *r,
     ngx_http_client_body_handler_pt post_handler)
@@ -4058,6 +4434,10 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
     fc->data = h2c->free_fake_connections;
     h2c->free_fake_connections = fc;
 
+    if (node->id % 2 == 0) {
+        h2c->pushing--;
+    }
+
     h2c->processing--;
 
     if (h2c->processing || h2c->blocked) {
@@ -4115,7 +4495,9 @@ ngx_http_v2_handle_connection_handler(ngx_event_t *rev)
     c = rev->data;
     h2c = c->data;
 
-    if (h2c->last_out && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR) {
+    if (ngx_http_v2_output_queued(h2c)
+        && ngx_http_v2_send_output_queue(h2c) == NGX_ERROR)
+    {
         ngx_http_v2_finalize_connection(h2c, 0);
         return;
     }
@@ -4213,6 +4595,9 @@ ngx_http_v2_finalize_connection(ngx_http_v2_connection_t *h2c,
 
     h2c->last_out = NULL;
 
+    ngx_rbtree_init(&h2c->data_queue, &h2c->data_sentinel,
+                    ngx_http_v2_data_queue_insert_value);
+
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
 
@@ -49,6 +49,8 @@
 #define NGX_HTTP_V2_MAX_WINDOW           ((1U << 31) - 1)
 #define NGX_HTTP_V2_DEFAULT_WINDOW       65535
 
+#define NGX_HTTP_V2_MAX_WEIGHT           256
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -115,6 +117,8 @@ struct ngx_http_v2_connection_s {
     ngx_http_connection_t           *http_connection;
 
     ngx_uint_t                       processing;
+    ngx_uint_t                       pushing;
+    ngx_uint_t                       concurrent_pushes;
 
     size_t                           send_window;
     size_t                           recv_window;
@@ -137,15 +141,23 @@ struct ngx_http_v2_connection_s {
 
     ngx_http_v2_out_frame_t         *last_out;
 
+    ngx_rbtree_t                     data_queue;
+    ngx_rbtree_node_t                data_sentinel;
+    ngx_rbtree_key_t                 vtime;
+
     ngx_queue_t                      posted;
     ngx_queue_t                      dependencies;
     ngx_queue_t                      closed;
 
     ngx_uint_t                       last_sid;
+    ngx_uint_t                       last_push;
+
+    ngx_array_t                     *pushed;
 
     unsigned                         closed_nodes:8;
     unsigned                         settings_ack:1;
     unsigned                         blocked:1;
+    unsigned                         push_disabled:1;
 };
 
 
@@ -170,6 +182,9 @@ struct ngx_http_v2_stream_s {
 
     ngx_uint_t                       queued;
 
+    ngx_uint_t                       rank;
+    ngx_rbtree_key_t                 vtime;
+
     /*
      * A change to SETTINGS_INITIAL_WINDOW_SIZE could cause the
      * send_window to become negative, hence it's signed.
@@ -182,6 +197,9 @@ struct ngx_http_v2_stream_s {
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_chain_t                     *free_frame_headers;
     ngx_chain_t                     *free_bufs;
+#if (NGX_HTTP_SSL)
+    ngx_chain_t                     *free_frame_bufs;
+#endif
 
     ngx_queue_t                      queue;
 
@@ -212,34 +230,61 @@ struct ngx_http_v2_out_frame_s {
     ngx_http_v2_stream_t            *stream;
     size_t                           length;
 
+    ngx_rbtree_node_t                node;
+    ngx_uint_t                       rank;
+
     unsigned                         blocked:1;
     unsigned                         fin:1;
 };
 
 
+#define ngx_http_v2_output_queued(h2c)                                        \
+    ((h2c)->last_out || (h2c)->data_queue.root != (h2c)->data_queue.sentinel)
+
+#define ngx_http_v2_node_frame(n)                                             \
+    (ngx_http_v2_out_frame_t *)                                               \
+        ((u_char *) (n) - offsetof(ngx_http_v2_out_frame_t, node))
+
+
+/*
+ * DATA frames are scheduled by a weighted fair queue: each frame gets
+ * a virtual finish time, which advances by the frame length divided
+ * by the relative weight of the stream in the dependency tree, and
+ * frames of streams with lower rank always precede their dependents.
+ */
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
+    ngx_uint_t             weight;
+    ngx_http_v2_stream_t  *stream;
+
+    stream = frame->stream;
+
+    /* frames of a stream must not be reordered by a priority change */
 
-    for (out = &h2c->last_out; *out; out = &(*out)->next) {
+    if (stream->queued == 0 || stream->node->rank > stream->rank) {
+        stream->rank = stream->node->rank;
+    }
+
+    if ((ngx_rbtree_key_int_t) (stream->vtime - h2c->vtime) < 0) {
+        stream->vtime = h2c->vtime;
+    }
 
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
+    weight = (ngx_uint_t) (stream->node->rel_weight * NGX_HTTP_V2_MAX_WEIGHT);
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
-            break;
-        }
+    if (weight == 0) {
+        weight = 1;
     }
 
-    frame->next = *out;
-    *out = frame;
+    stream->vtime += (frame->length + NGX_HTTP_V2_FRAME_HEADER_SIZE)
+                     * NGX_HTTP_V2_MAX_WEIGHT / weight;
+
+    frame->rank = stream->rank;
+    frame->node.key = stream->vtime;
+
+    ngx_rbtree_insert(&h2c->data_queue, &frame->node);
 }
 
 
@@ -247,17 +292,8 @@ static ngx_inline void
 ngx_http_v2_queue_blocked_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
-    ngx_http_v2_out_frame_t  **out;
-
-    for (out = &h2c->last_out; *out; out = &(*out)->next)
-    {
-        if ((*out)->blocked || (*out)->stream == NULL) {
-            break;
-        }
-    }
-
-    frame->next = *out;
-    *out = frame;
+    frame->next = h2c->last_out;
+    h2c->last_out = frame;
 }
 
 
@@ -270,6 +306,9 @@ ngx_int_t ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r);
 
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
+ngx_http_v2_stream_t *ngx_http_v2_push_stream(ngx_http_v2_stream_t *parent,
+    ngx_str_t *path);
+
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
 
@@ -33,6 +33,14 @@
 #define NGX_HTTP_V2_ENCODE_RAW            0
 #define NGX_HTTP_V2_ENCODE_HUFF           0x80
 
+#define NGX_HTTP_V2_AUTHORITY_INDEX       1
+
+#define NGX_HTTP_V2_METHOD_GET_INDEX      2
+#define NGX_HTTP_V2_PATH_INDEX            4
+
+#define NGX_HTTP_V2_SCHEME_HTTP_INDEX     6
+#define NGX_HTTP_V2_SCHEME_HTTPS_INDEX    7
+
 #define NGX_HTTP_V2_STATUS_INDEX          8
 #define NGX_HTTP_V2_STATUS_200_INDEX      8
 #define NGX_HTTP_V2_STATUS_204_INDEX      9
@@ -42,27 +50,77 @@
 #define NGX_HTTP_V2_STATUS_404_INDEX      13
 #define NGX_HTTP_V2_STATUS_500_INDEX      14
 
+#define NGX_HTTP_V2_ACCEPT_ENCODING_INDEX 16
+#define NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX 17
 #define NGX_HTTP_V2_CONTENT_LENGTH_INDEX  28
 #define NGX_HTTP_V2_CONTENT_TYPE_INDEX    31
 #define NGX_HTTP_V2_DATE_INDEX            33
 #define NGX_HTTP_V2_LAST_MODIFIED_INDEX   44
 #define NGX_HTTP_V2_LOCATION_INDEX        46
 #define NGX_HTTP_V2_SERVER_INDEX          54
+#define NGX_HTTP_V2_USER_AGENT_INDEX      58
 #define NGX_HTTP_V2_VARY_INDEX            59
 
+#define NGX_HTTP_V2_STREAM_ID_SIZE        4
+
+#define NGX_HTTP_V2_MAX_PUSH_SID          0x7ffffffe
+
+/* resources pushed over a connection which are remembered to avoid repeats */
+#define NGX_HTTP_V2_MAX_PUSHED            128
+
+#define NGX_HTTP_V2_FILE_READ_SIZE        65536
+
+
+typedef struct {
+    ngx_uint_t                        index;
+    ngx_uint_t                        offset;
+} ngx_http_v2_push_header_t;
+
+
+static ngx_http_v2_push_header_t  ngx_http_v2_push_headers[] = {
+    { NGX_HTTP_V2_AUTHORITY_INDEX,
+      offsetof(ngx_http_headers_in_t, host) },
+
+#if (NGX_HTTP_GZIP)
+    { NGX_HTTP_V2_ACCEPT_ENCODING_INDEX,
+      offsetof(ngx_http_headers_in_t, accept_encoding) },
+#endif
+
+#if (NGX_HTTP_HEADERS)
+    { NGX_HTTP_V2_ACCEPT_LANGUAGE_INDEX,
+      offsetof(ngx_http_headers_in_t, accept_language) },
+#endif
+
+    { NGX_HTTP_V2_USER_AGENT_INDEX,
+      offsetof(ngx_http_headers_in_t, user_agent) }
+};
+
+#define NGX_HTTP_V2_PUSH_HEADERS                                              \
+    (sizeof(ngx_http_v2_push_headers) / sizeof(ngx_http_v2_push_header_t))
+
 
 static u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
 static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
     ngx_uint_t value);
+static ngx_int_t ngx_http_v2_push_resources(ngx_http_request_t *r);
+static ngx_int_t ngx_http_v2_push_resource(ngx_http_request_t *r,
+    ngx_str_t *path, ngx_str_t *binary);
+
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end);
+static ngx_http_v2_out_frame_t *ngx_http_v2_create_push_frame(
+    ngx_http_request_t *r, u_char *pos, u_char *end);
 
 static ngx_chain_t *ngx_http_v2_send_chain(ngx_connection_t *fc,
     ngx_chain_t *in, off_t limit);
 
 static ngx_chain_t *ngx_http_v2_filter_get_shadow(
     ngx_http_v2_stream_t *stream, ngx_buf_t *buf, off_t offset, off_t size);
+#if (NGX_HTTP_SSL)
+static ngx_http_v2_out_frame_t *ngx_http_v2_filter_read_data_frame(
+    ngx_http_v2_stream_t *stream, ngx_buf_t *in, size_t len, size_t size);
+#endif
 static ngx_http_v2_out_frame_t *ngx_http_v2_filter_get_data_frame(
     ngx_http_v2_stream_t *stream, size_t len, ngx_chain_t *first,
     ngx_chain_t *last);
@@ -77,6 +135,8 @@ static ngx_inline ngx_int_t ngx_http_v2_filter_send(
 
 static ngx_int_t ngx_http_v2_headers_frame_handler(
     ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
+static ngx_int_t ngx_http_v2_push_frame_handler(
+    ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
 static ngx_int_t ngx_http_v2_data_frame_handler(
     ngx_http_v2_connection_t *h2c, ngx_http_v2_out_frame_t *frame);
 static ngx_inline void ngx_http_v2_handle_frame(
@@ -84,6 +144,8 @@ static ngx_inline void ngx_http_v2_handle_frame(
 static ngx_inline void ngx_http_v2_handle_stream(
     ngx_http_v2_connection_t *h2c, ngx_http_v2_stream_t *stream);
 
+static ngx_rbtree_node_t *ngx_http_v2_data_queue_next(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
 static void ngx_http_v2_filter_cleanup(void *data);
 
 static ngx_int_t ngx_http_v2_filter_init(ngx_conf_t *cf);
@@ -135,6 +197,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_connection_t          *fc;
     ngx_http_cleanup_t        *cln;
     ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     struct sockaddr_in        *sin;
@@ -175,6 +238,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+#if (NGX_HTTP_SSL)
+    if (fc->ssl) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->aio != NGX_HTTP_AIO_OFF) {
+            /* files are read by the copy filter */
+            r->main_filter_need_in_memory = 1;
+        }
+    }
+#endif
+
     if (r->method == NGX_HTTP_HEAD) {
         r->header_only = 1;
     }
@@ -596,12 +670,24 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                                       header[i].value.len, tmp);
     }
 
+    h2c = r->stream->connection;
+
+    if (r->headers_out.status == NGX_HTTP_OK
+        && !r->header_only
+        && !h2c->push_disabled
+        && r->stream->node->id % 2 == 1)
+    {
+        if (ngx_http_v2_push_resources(r) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
     frame = ngx_http_v2_create_headers_frame(r, start, pos);
     if (frame == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_http_v2_queue_blocked_frame(r->stream->connection, frame);
+    ngx_http_v2_queue_blocked_frame(h2c, frame);
 
     cln = ngx_http_cleanup_add(r, 0);
     if (cln == NULL) {
@@ -611,7 +697,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = r->stream;
 
-    r->stream->queued = 1;
+    r->stream->queued++;
 
     fc->send_chain = ngx_http_v2_send_chain;
     fc->need_last_buf = 1;
@@ -620,6 +706,444 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_v2_push_resources(ngx_http_request_t *r)
+{
+    u_char                    *start, *end, *last;
+    ngx_int_t                  rc, push;
+    ngx_str_t                  path;
+    ngx_uint_t                 i;
+    ngx_list_part_t           *part;
+    ngx_table_elt_t           *header;
+    ngx_http_v2_loc_conf_t    *h2lcf;
+    ngx_http_complex_value_t  *pushes;
+    ngx_str_t                  binary[NGX_HTTP_V2_PUSH_HEADERS];
+
+    h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
+
+    if (h2lcf->pushes == NULL && !h2lcf->push_preload) {
+        return NGX_OK;
+    }
+
+    ngx_memzero(binary, NGX_HTTP_V2_PUSH_HEADERS * sizeof(ngx_str_t));
+
+    if (h2lcf->pushes) {
+        pushes = h2lcf->pushes->elts;
+
+        for (i = 0; i < h2lcf->pushes->nelts; i++) {
+
+            if (ngx_http_complex_value(r, &pushes[i], &path) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (path.len == 0) {
+                continue;
+            }
+
+            if (path.len == 3 && ngx_strncmp(path.data, "off", 3) == 0) {
+                continue;
+            }
+
+            rc = ngx_http_v2_push_resource(r, &path, binary);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_ABORT) {
+                return NGX_OK;
+            }
+
+            /* NGX_OK, NGX_DECLINED */
+        }
+    }
+
+    if (!h2lcf->push_preload) {
+        return NGX_OK;
+    }
+
+    part = &r->headers_out.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0
+            || header[i].key.len != sizeof("Link") - 1
+            || ngx_strncasecmp(header[i].key.data, (u_char *) "Link",
+                               sizeof("Link") - 1)
+               != 0)
+        {
+            continue;
+        }
+
+        /*
+         * Link: </style.css>; rel=preload; as=style, </app.js>; rel=preload
+         *
+         * the links with the "nopush" parameter are known to be cached
+         * by the client or pushed by other means, and are not pushed
+         */
+
+        start = header[i].value.data;
+        end = start + header[i].value.len;
+
+    next_link:
+
+        while (start < end && *start == ' ') { start++; }
+
+        if (start == end || *start++ != '<') {
+            continue;
+        }
+
+        while (start < end && *start == ' ') { start++; }
+
+        for (last = start; last < end && *last != '>'; last++) {
+            /* void */
+        }
+
+        if (last == start || last == end) {
+            continue;
+        }
+
+        path.len = last - start;
+        path.data = start;
+
+        start = last + 1;
+
+        while (start < end && *start == ' ') { start++; }
+
+        if (start == end) {
+            continue;
+        }
+
+        if (*start == ',') {
+            start++;
+            goto next_link;
+        }
+
+        if (*start++ != ';') {
+            continue;
+        }
+
+        last = ngx_strlchr(start, end, ',');
+
+        if (last == NULL) {
+            last = end;
+        }
+
+        push = 0;
+
+        for ( ;; ) {
+
+            while (start < last && *start == ' ') { start++; }
+
+            if (last - start >= 6
+                && ngx_strncasecmp(start, (u_char *) "nopush", 6) == 0)
+            {
+                start += 6;
+
+                if (start == last || *start == ' ' || *start == ';') {
+                    push = 0;
+                    break;
+                }
+
+                goto next_param;
+            }
+
+            if (last - start >= 11
+                && ngx_strncasecmp(start, (u_char *) "rel=preload", 11) == 0)
+            {
+                start += 11;
+
+                if (start == last || *start == ' ' || *start == ';') {
+                    push = 1;
+                }
+
+                goto next_param;
+            }
+
+            if (last - start >= 4
+                && ngx_strncasecmp(start, (u_char *) "rel=", 4) == 0)
+            {
+                start += 4;
+
+                while (start < last && *start == ' ') { start++; }
+
+                if (start == last || *start++ != '"') {
+                    goto next_param;
+                }
+
+                for ( ;; ) {
+
+                    while (start < last && *start == ' ') { start++; }
+
+                    if (last - start >= 7
+                        && ngx_strncasecmp(start, (u_char *) "preload", 7) == 0)
+                    {
+                        start += 7;
+
+                        if (start < last && (*start == ' ' || *start == '"')) {
+                            push = 1;
+                            break;
+                        }
+                    }
+
+                    while (start < last && *start != ' ' && *start != '"') {
+                        start++;
+                    }
+
+                    if (start == last || *start == '"') {
+                        break;
+                    }
+
+                    start++;
+                }
+            }
+
+        next_param:
+
+            start = ngx_strlchr(start, last, ';');
+
+            if (start == NULL) {
+                break;
+            }
+
+            start++;
+        }
+
+        if (push) {
+            while (path.len && path.data[path.len - 1] == ' ') {
+                path.len--;
+            }
+        }
+
+        if (push && path.len
+            && !(path.len > 1 && path.data[0] == '/' && path.data[1] == '/'))
+        {
+            rc = ngx_http_v2_push_resource(r, &path, binary);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_ABORT) {
+                return NGX_OK;
+            }
+
+            /* NGX_OK, NGX_DECLINED */
+        }
+
+        if (last < end) {
+            start = last + 1;
+            goto next_link;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_push_resource(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_str_t *binary)
+{
+    u_char                     *start, *pos, *tmp;
+    size_t                      len;
+    uint32_t                    hash, *pushed;
+    ngx_str_t                  *value;
+    ngx_uint_t                  i;
+    ngx_table_elt_t           **h, *host;
+    ngx_connection_t           *fc;
+    ngx_http_v2_stream_t       *stream;
+    ngx_http_v2_out_frame_t    *frame;
+    ngx_http_v2_connection_t   *h2c;
+    ngx_http_v2_push_header_t  *ph;
+
+    fc = r->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 push resource \"%V\"", path);
+
+    stream = r->stream;
+    h2c = stream->connection;
+
+    if (path->data[0] != '/') {
+        ngx_log_error(NGX_LOG_WARN, fc->log, 0,
+                      "non-absolute path \"%V\" not pushed", path);
+        return NGX_DECLINED;
+    }
+
+    if (h2c->last_push == NGX_HTTP_V2_MAX_PUSH_SID) {
+        return NGX_ABORT;
+    }
+
+    if (h2c->pushing >= h2c->concurrent_pushes) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 concurrent pushes exceeded %ui", h2c->pushing);
+        return NGX_ABORT;
+    }
+
+    if (path->len > NGX_HTTP_V2_MAX_FIELD) {
+        return NGX_DECLINED;
+    }
+
+    host = r->headers_in.host;
+
+    if (host == NULL) {
+        return NGX_ABORT;
+    }
+
+    /* a resource is pushed over a connection once */
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, host->value.data, host->value.len);
+    ngx_crc32_update(&hash, path->data, path->len);
+    ngx_crc32_final(hash);
+
+    if (h2c->pushed == NULL) {
+        h2c->pushed = ngx_array_create(h2c->connection->pool, 8,
+                                       sizeof(uint32_t));
+        if (h2c->pushed == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    pushed = h2c->pushed->elts;
+
+    for (i = 0; i < h2c->pushed->nelts; i++) {
+        if (pushed[i] == hash) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                           "http2 resource \"%V\" was already pushed", path);
+            return NGX_DECLINED;
+        }
+    }
+
+    if (h2c->pushed->nelts < NGX_HTTP_V2_MAX_PUSHED) {
+        pushed = ngx_array_push(h2c->pushed);
+        if (pushed == NULL) {
+            return NGX_ERROR;
+        }
+
+        *pushed = hash;
+    }
+
+    ph = ngx_http_v2_push_headers;
+
+    if (binary[0].len) {
+        tmp = ngx_palloc(r->pool, path->len);
+        if (tmp == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        len = path->len;
+
+        for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
+            h = (ngx_table_elt_t **) ((char *) &r->headers_in + ph[i].offset);
+
+            if (*h) {
+                len = ngx_max(len, (*h)->value.len);
+            }
+        }
+
+        tmp = ngx_palloc(r->pool, len);
+        if (tmp == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
+            h = (ngx_table_elt_t **) ((char *) &r->headers_in + ph[i].offset);
+
+            if (*h == NULL || (*h)->value.len > NGX_HTTP_V2_MAX_FIELD) {
+                continue;
+            }
+
+            value = &(*h)->value;
+
+            len = 1 + NGX_HTTP_V2_INT_OCTETS + value->len;
+
+            pos = ngx_pnalloc(r->pool, len);
+            if (pos == NULL) {
+                return NGX_ERROR;
+            }
+
+            binary[i].data = pos;
+
+            *pos++ = ngx_http_v2_inc_indexed(ph[i].index);
+            pos = ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+
+            binary[i].len = pos - binary[i].data;
+        }
+    }
+
+    len = 1 + 1 + NGX_HTTP_V2_INT_OCTETS + path->len + 1;
+
+    for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
+        len += binary[i].len;
+    }
+
+    pos = ngx_pnalloc(r->pool, len);
+    if (pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    start = pos;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 push header: \":method: GET\"");
+
+    *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_GET_INDEX);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 push header: \":path: %V\"", path);
+
+    *pos++ = NGX_HTTP_V2_PATH_INDEX;
+    pos = ngx_http_v2_write_value(pos, path->data, path->len, tmp);
+
+#if (NGX_HTTP_SSL)
+    if (fc->ssl) {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTPS_INDEX);
+
+    } else
+#endif
+    {
+        *pos++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+    }
+
+    for (i = 0; i < NGX_HTTP_V2_PUSH_HEADERS; i++) {
+        pos = ngx_cpymem(pos, binary[i].data, binary[i].len);
+    }
+
+    h2c->last_push += 2;
+
+    frame = ngx_http_v2_create_push_frame(r, start, pos);
+    if (frame == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_v2_queue_blocked_frame(h2c, frame);
+
+    stream->queued++;
+
+    stream = ngx_http_v2_push_stream(stream, path);
+
+    if (stream) {
+        stream->request->request_length = pos - start;
+    }
+
+    return NGX_OK;
+}
+
+
 static u_char *
 ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len, u_char *tmp,
     ngx_uint_t lower)
@@ -669,35 +1193,139 @@ ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 
 
 static ngx_http_v2_out_frame_t *
-ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
-    u_char *end)
+ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
+    u_char *end)
+{
+    u_char                    type, flags;
+    size_t                    rest, frame_size;
+    ngx_buf_t                *b;
+    ngx_chain_t              *cl, **ll;
+    ngx_http_v2_stream_t     *stream;
+    ngx_http_v2_out_frame_t  *frame;
+
+    stream = r->stream;
+    rest = end - pos;
+
+    frame = ngx_palloc(r->pool, sizeof(ngx_http_v2_out_frame_t));
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    frame->handler = ngx_http_v2_headers_frame_handler;
+    frame->stream = stream;
+    frame->length = rest;
+    frame->blocked = 1;
+    frame->fin = r->header_only;
+
+    ll = &frame->first;
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    flags = r->header_only ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
+    frame_size = stream->connection->frame_size;
+
+    for ( ;; ) {
+        if (rest <= frame_size) {
+            frame_size = rest;
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        b = ngx_create_temp_buf(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->last = ngx_http_v2_write_len_and_type(b->last, frame_size, type);
+        *b->last++ = flags;
+        b->last = ngx_http_v2_write_sid(b->last, stream->node->id);
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_v2_module;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+
+        *ll = cl;
+        ll = &cl->next;
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NULL;
+        }
+
+        b->pos = pos;
+
+        pos += frame_size;
+
+        b->last = pos;
+        b->start = b->pos;
+        b->end = b->last;
+        b->temporary = 1;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = b;
+
+        *ll = cl;
+        ll = &cl->next;
+
+        rest -= frame_size;
+
+        if (rest) {
+            type = NGX_HTTP_V2_CONTINUATION_FRAME;
+            flags = NGX_HTTP_V2_NO_FLAG;
+            continue;
+        }
+
+        b->last_buf = r->header_only;
+        cl->next = NULL;
+        frame->last = cl;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http2:%ui create HEADERS frame %p: len:%uz",
+                       stream->node->id, frame, frame->length);
+
+        return frame;
+    }
+}
+
+
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_create_push_frame(ngx_http_request_t *r, u_char *pos, u_char *end)
 {
-    u_char                    type, flags;
-    size_t                    rest, frame_size;
-    ngx_buf_t                *b;
-    ngx_chain_t              *cl, **ll;
-    ngx_http_v2_stream_t     *stream;
-    ngx_http_v2_out_frame_t  *frame;
+    u_char                     type, flags;
+    size_t                     rest, frame_size, len;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl, **ll;
+    ngx_http_v2_stream_t      *stream;
+    ngx_http_v2_out_frame_t   *frame;
+    ngx_http_v2_connection_t  *h2c;
 
     stream = r->stream;
-    rest = end - pos;
+    h2c = stream->connection;
+    rest = NGX_HTTP_V2_STREAM_ID_SIZE + (end - pos);
 
     frame = ngx_palloc(r->pool, sizeof(ngx_http_v2_out_frame_t));
     if (frame == NULL) {
         return NULL;
     }
 
-    frame->handler = ngx_http_v2_headers_frame_handler;
+    frame->handler = ngx_http_v2_push_frame_handler;
     frame->stream = stream;
     frame->length = rest;
     frame->blocked = 1;
-    frame->fin = r->header_only;
+    frame->fin = 0;
 
     ll = &frame->first;
 
-    type = NGX_HTTP_V2_HEADERS_FRAME;
-    flags = r->header_only ? NGX_HTTP_V2_END_STREAM_FLAG : NGX_HTTP_V2_NO_FLAG;
-    frame_size = stream->connection->frame_size;
+    type = NGX_HTTP_V2_PUSH_PROMISE_FRAME;
+    flags = NGX_HTTP_V2_NO_FLAG;
+    frame_size = h2c->frame_size;
 
     for ( ;; ) {
         if (rest <= frame_size) {
@@ -705,7 +1333,8 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
             flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
         }
 
-        b = ngx_create_temp_buf(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+        b = ngx_create_temp_buf(r->pool, NGX_HTTP_V2_FRAME_HEADER_SIZE
+                                         + NGX_HTTP_V2_STREAM_ID_SIZE);
         if (b == NULL) {
             return NULL;
         }
@@ -716,6 +1345,14 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
 
         b->tag = (ngx_buf_tag_t) &ngx_http_v2_module;
 
+        if (type == NGX_HTTP_V2_PUSH_PROMISE_FRAME) {
+            b->last = ngx_http_v2_write_sid(b->last, h2c->last_push);
+            len = frame_size - NGX_HTTP_V2_STREAM_ID_SIZE;
+
+        } else {
+            len = frame_size;
+        }
+
         cl = ngx_alloc_chain_link(r->pool);
         if (cl == NULL) {
             return NULL;
@@ -733,7 +1370,7 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
 
         b->pos = pos;
 
-        pos += frame_size;
+        pos += len;
 
         b->last = pos;
         b->start = b->pos;
@@ -758,13 +1395,14 @@ ngx_http_v2_create_headers_frame(ngx_http_request_t *r, u_char *pos,
             continue;
         }
 
-        b->last_buf = r->header_only;
         cl->next = NULL;
         frame->last = cl;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http2:%ui create HEADERS frame %p: len:%uz",
-                       stream->node->id, frame, frame->length);
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http2:%ui create PUSH_PROMISE frame %p: "
+                       "sid:%ui len:%uz",
+                       stream->node->id, frame, h2c->last_push,
+                       frame->length);
 
         return frame;
     }
@@ -775,7 +1413,11 @@ static ngx_chain_t *
 ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 {
     off_t                      size, offset;
-    size_t                     rest, frame_size;
+    size_t                     rest, frame_size, chunk_size;
+#if (NGX_HTTP_SSL)
+    off_t                      max;
+    size_t                     record, record_size, nread;
+#endif
     ngx_chain_t               *cl, *out, **ln;
     ngx_http_request_t        *r;
     ngx_http_v2_stream_t      *stream;
@@ -790,6 +1432,14 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
     size = 0;
 #endif
 
+#if (NGX_HTTP_SSL)
+    max = limit;
+
+again:
+
+    nread = 0;
+#endif
+
     while (in) {
         size = ngx_buf_size(in->buf);
 
@@ -851,18 +1501,95 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
 
     h2lcf = ngx_http_get_module_loc_conf(r, ngx_http_v2_module);
 
-    frame_size = (h2lcf->chunk_size < h2c->frame_size)
+    chunk_size = (h2lcf->chunk_size < h2c->frame_size)
                  ? h2lcf->chunk_size : h2c->frame_size;
 
+#if (NGX_HTTP_SSL)
+
+    /*
+     * Over SSL, file data is read into buffers which hold the frame
+     * header and the data, and are sized to fill an SSL record.
+     */
+
+    record = 0;
+    record_size = 0;
+
+    if (h2c->connection->ssl) {
+        record_size = ngx_max(h2c->connection->ssl->buffer_size,
+                              2 * NGX_HTTP_V2_FRAME_HEADER_SIZE);
+
+        record = record_size - NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        if (record > h2c->frame_size) {
+            record = h2c->frame_size;
+        }
+    }
+
+#endif
+
 #if (NGX_SUPPRESS_WARN)
     cl = NULL;
 #endif
 
     for ( ;; ) {
+        frame_size = chunk_size;
+
         if ((off_t) frame_size > limit) {
             frame_size = (size_t) limit;
         }
 
+#if (NGX_HTTP_SSL)
+
+        if (record && size && !ngx_buf_in_memory(in->buf)) {
+
+            rest = (size > (off_t) record) ? record : (size_t) size;
+
+            if ((off_t) rest > limit) {
+                rest = (size_t) limit;
+            }
+
+            frame = ngx_http_v2_filter_read_data_frame(stream, in->buf, rest,
+                                                       record_size);
+            if (frame == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            ngx_http_v2_queue_frame(h2c, frame);
+
+            h2c->send_window -= rest;
+
+            stream->send_window -= rest;
+            stream->queued++;
+
+            size -= rest;
+
+            if (size == 0) {
+                in = in->next;
+
+                if (in == NULL) {
+                    break;
+                }
+
+                size = ngx_buf_size(in->buf);
+            }
+
+            limit -= rest;
+
+            if (limit == 0) {
+                break;
+            }
+
+            nread += rest;
+
+            if (max == 0 && nread >= NGX_HTTP_V2_FILE_READ_SIZE) {
+                break;
+            }
+
+            continue;
+        }
+
+#endif
+
         ln = &out;
         rest = frame_size;
 
@@ -899,6 +1626,14 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
             }
 
             size = ngx_buf_size(in->buf);
+
+#if (NGX_HTTP_SSL)
+            if (record && size && !ngx_buf_in_memory(in->buf)) {
+                frame_size -= rest;
+                rest = 0;
+                break;
+            }
+#endif
         }
 
         if (rest) {
@@ -953,6 +1688,25 @@ ngx_http_v2_send_chain(ngx_connection_t *fc, ngx_chain_t *in, off_t limit)
         return NGX_CHAIN_ERROR;
     }
 
+#if (NGX_HTTP_SSL)
+
+    /*
+     * file data is read in portions, the next one is read
+     * as soon as the previous one has been sent completely;
+     * a limited call is not repeated, as the limit is used up
+     */
+
+    if (max == 0
+        && in
+        && nread >= NGX_HTTP_V2_FILE_READ_SIZE
+        && stream->queued == 0)
+    {
+        limit = 0;
+        goto again;
+    }
+
+#endif
+
     if (in && ngx_http_v2_flow_control(h2c, stream) == NGX_DECLINED) {
         fc->write->active = 1;
         fc->write->ready = 0;
@@ -995,6 +1749,102 @@ ngx_http_v2_filter_get_shadow(ngx_http_v2_stream_t *stream, ngx_buf_t *buf,
 }
 
 
+#if (NGX_HTTP_SSL)
+
+static ngx_http_v2_out_frame_t *
+ngx_http_v2_filter_read_data_frame(ngx_http_v2_stream_t *stream,
+    ngx_buf_t *in, size_t len, size_t size)
+{
+    u_char                    flags;
+    ssize_t                   n;
+    ngx_buf_t                *buf;
+    ngx_chain_t              *cl;
+    ngx_http_request_t       *r;
+    ngx_http_v2_out_frame_t  *frame;
+
+    r = stream->request;
+
+    frame = stream->free_frames;
+
+    if (frame) {
+        stream->free_frames = frame->next;
+
+    } else {
+        frame = ngx_palloc(r->pool, sizeof(ngx_http_v2_out_frame_t));
+        if (frame == NULL) {
+            return NULL;
+        }
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &stream->free_frame_bufs);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    buf = cl->buf;
+
+    if (!buf->start) {
+        buf->start = ngx_palloc(r->pool, size);
+        if (buf->start == NULL) {
+            return NULL;
+        }
+
+        buf->end = buf->start + size;
+
+        buf->tag = (ngx_buf_tag_t) &ngx_http_v2_filter_read_data_frame;
+        buf->memory = 1;
+    }
+
+    n = ngx_read_file(in->file, buf->start + NGX_HTTP_V2_FRAME_HEADER_SIZE,
+                      len, in->file_pos);
+
+    if (n == NGX_ERROR) {
+        return NULL;
+    }
+
+    if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %uz from \"%s\"",
+                      n, len, in->file->name.data);
+        return NULL;
+    }
+
+    in->file_pos += len;
+
+    buf->last_buf = (in->last_buf && in->file_pos == in->file_last);
+    buf->flush = 1;
+
+    flags = buf->last_buf ? NGX_HTTP_V2_END_STREAM_FLAG : 0;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2:%ui read DATA frame %p: len:%uz flags:%ui",
+                   stream->node->id, frame, len, (ngx_uint_t) flags);
+
+    buf->pos = buf->start;
+
+    buf->last = ngx_http_v2_write_len_and_type(buf->pos, len,
+                                               NGX_HTTP_V2_DATA_FRAME);
+    *buf->last++ = flags;
+
+    buf->last = ngx_http_v2_write_sid(buf->last, stream->node->id);
+    buf->last += len;
+
+    cl->next = NULL;
+
+    frame->first = cl;
+    frame->last = cl;
+    frame->handler = ngx_http_v2_data_frame_handler;
+    frame->stream = stream;
+    frame->length = len;
+    frame->blocked = 0;
+    frame->fin = buf->last_buf;
+
+    return frame;
+}
+
+#endif
+
+
 static ngx_http_v2_out_frame_t *
 ngx_http_v2_filter_get_data_frame(ngx_http_v2_stream_t *stream,
     size_t len, ngx_chain_t *first, ngx_chain_t *last)
@@ -1198,6 +2048,57 @@ ngx_http_v2_headers_frame_handler(ngx_http_v2_connection_t *h2c,
 }
 
 
+static ngx_int_t
+ngx_http_v2_push_frame_handler(ngx_http_v2_connection_t *h2c,
+    ngx_http_v2_out_frame_t *frame)
+{
+    ngx_chain_t           *cl, *ln;
+    ngx_http_v2_stream_t  *stream;
+
+    stream = frame->stream;
+    cl = frame->first;
+
+    for ( ;; ) {
+        if (cl->buf->pos != cl->buf->last) {
+            frame->first = cl;
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2:%ui PUSH_PROMISE frame %p was sent partially",
+                           stream->node->id, frame);
+
+            return NGX_AGAIN;
+        }
+
+        ln = cl->next;
+
+        if (cl->buf->tag == (ngx_buf_tag_t) &ngx_http_v2_module) {
+            cl->next = stream->free_frame_headers;
+            stream->free_frame_headers = cl;
+
+        } else {
+            cl->next = stream->free_bufs;
+            stream->free_bufs = cl;
+        }
+
+        if (cl == frame->last) {
+            break;
+        }
+
+        cl = ln;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2:%ui PUSH_PROMISE frame %p was sent",
+                   stream->node->id, frame);
+
+    ngx_http_v2_handle_frame(stream, frame);
+
+    ngx_http_v2_handle_stream(h2c, stream);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_v2_data_frame_handler(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
@@ -1210,6 +2111,26 @@ ngx_http_v2_data_frame_handler(ngx_http_v2_connection_t *h2c,
 
     cl = frame->first;
 
+#if (NGX_HTTP_SSL)
+
+    if (cl->buf->tag == (ngx_buf_tag_t) &ngx_http_v2_filter_read_data_frame) {
+
+        if (cl->buf->pos != cl->buf->last) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2:%ui DATA frame %p was sent partially",
+                           stream->node->id, frame);
+
+            return NGX_AGAIN;
+        }
+
+        cl->next = stream->free_frame_bufs;
+        stream->free_frame_bufs = cl;
+
+        goto done;
+    }
+
+#endif
+
     if (cl->buf->tag == (ngx_buf_tag_t) &ngx_http_v2_module) {
 
         if (cl->buf->pos != cl->buf->last) {
@@ -1317,6 +2238,7 @@ static ngx_inline void
 ngx_http_v2_handle_stream(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_stream_t *stream)
 {
+    ngx_event_t       *wev;
     ngx_connection_t  *fc;
 
     if (stream->handled || stream->blocked) {
@@ -1325,7 +2247,18 @@ ngx_http_v2_handle_stream(ngx_http_v2_connection_t *h2c,
 
     fc = stream->request->connection;
 
-    if (!fc->error && (stream->exhausted || fc->write->delayed)) {
+    if (!fc->error && stream->exhausted) {
+        return;
+    }
+
+    wev = fc->write;
+
+    /* a delayed stream is resumed by its timer once the frames are sent */
+
+    wev->active = 0;
+    wev->ready = 1;
+
+    if (!fc->error && wev->delayed) {
         return;
     }
 
@@ -1334,13 +2267,43 @@ ngx_http_v2_handle_stream(ngx_http_v2_connection_t *h2c,
 }
 
 
+static ngx_rbtree_node_t *
+ngx_http_v2_data_queue_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *root, *sentinel, *parent;
+
+    sentinel = tree->sentinel;
+
+    if (node->right != sentinel) {
+        return ngx_rbtree_min(node->right, sentinel);
+    }
+
+    root = tree->root;
+
+    for ( ;; ) {
+        parent = node->parent;
+
+        if (node == root) {
+            return NULL;
+        }
+
+        if (node == parent->left) {
+            return parent;
+        }
+
+        node = parent;
+    }
+}
+
+
 static void
 ngx_http_v2_filter_cleanup(void *data)
 {
     ngx_http_v2_stream_t *stream = data;
 
     size_t                     window;
-    ngx_http_v2_out_frame_t   *frame, **fn;
+    ngx_rbtree_node_t         *node, *next, *sentinel;
+    ngx_http_v2_out_frame_t   *frame;
     ngx_http_v2_connection_t  *h2c;
 
     if (stream->handled) {
@@ -1354,28 +2317,27 @@ ngx_http_v2_filter_cleanup(void *data)
 
     window = 0;
     h2c = stream->connection;
-    fn = &h2c->last_out;
+    sentinel = h2c->data_queue.sentinel;
 
-    for ( ;; ) {
-        frame = *fn;
+    node = (h2c->data_queue.root != sentinel)
+           ? ngx_rbtree_min(h2c->data_queue.root, sentinel) : NULL;
 
-        if (frame == NULL) {
-            break;
-        }
+    while (node) {
+        next = ngx_http_v2_data_queue_next(&h2c->data_queue, node);
+
+        frame = ngx_http_v2_node_frame(node);
 
-        if (frame->stream == stream && !frame->blocked) {
-            *fn = frame->next;
+        if (frame->stream == stream) {
+            ngx_rbtree_delete(&h2c->data_queue, node);
 
             window += frame->length;
 
             if (--stream->queued == 0) {
                 break;
             }
-
-            continue;
         }
 
-        fn = &frame->next;
+        node = next;
     }
 
     if (h2c->send_window == 0 && window && !ngx_queue_empty(&h2c->waiting)) {
@@ -178,9 +178,29 @@ typedef enum {
 } ngx_smtp_state_e;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                fd[2];
+    size_t                  size;
+} ngx_mail_proxy_pipe_t;
+
+#endif
+
+
 typedef struct {
     ngx_peer_connection_t   upstream;
     ngx_buf_t              *buffer;
+
+    off_t                   received;
+    off_t                   sent;
+    ngx_msec_t              start_time;
+
+#if (NGX_HAVE_SPLICE)
+    /* client to upstream and upstream to client */
+    ngx_mail_proxy_pipe_t  *pipe;
+    unsigned                splice:1;
+#endif
 } ngx_mail_proxy_ctx_t;
 
 
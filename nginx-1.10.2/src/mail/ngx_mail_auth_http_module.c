@@ -9,9 +9,13 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 #include <ngx_event_connect.h>
+#include <ngx_md5.h>
 #include <ngx_mail.h>
 
 
+#define NGX_MAIL_AUTH_HTTP_KEY_LEN  16
+
+
 typedef struct {
     ngx_addr_t                     *peer;
 
@@ -24,11 +28,56 @@ typedef struct {
 
     ngx_array_t                    *headers;
 
+    ngx_shm_zone_t                 *cache_zone;
+
+    ngx_uint_t                      keepalive;
+    ngx_queue_t                     keepalive_cache;
+    ngx_queue_t                     keepalive_free;
+
     u_char                         *file;
     ngx_uint_t                      line;
 } ngx_mail_auth_http_conf_t;
 
 
+typedef struct {
+    ngx_mail_auth_http_conf_t      *conf;
+    ngx_queue_t                     queue;
+    ngx_connection_t               *connection;
+} ngx_mail_auth_http_keepalive_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t               node;
+    ngx_queue_t                     queue;
+
+    u_char                          key[NGX_MAIL_AUTH_HTTP_KEY_LEN
+                                        - sizeof(ngx_rbtree_key_t)];
+
+    time_t                          expire;
+
+    u_short                         socklen;
+    u_short                         name_len;
+    u_short                         login_len;
+    u_short                         passwd_len;
+
+    /* sockaddr, peer name, login and password of the backend */
+    u_char                          data[1];
+} ngx_mail_auth_http_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                    rbtree;
+    ngx_rbtree_node_t               sentinel;
+    ngx_queue_t                     queue;
+} ngx_mail_auth_http_cache_sh_t;
+
+
+typedef struct {
+    ngx_mail_auth_http_cache_sh_t  *sh;
+    ngx_slab_pool_t                *shpool;
+} ngx_mail_auth_http_cache_t;
+
+
 typedef struct ngx_mail_auth_http_ctx_s  ngx_mail_auth_http_ctx_t;
 
 typedef void (*ngx_mail_auth_http_handler_pt)(ngx_mail_session_t *s,
@@ -55,11 +104,26 @@ struct ngx_mail_auth_http_ctx_s {
     ngx_str_t                       errcode;
 
     time_t                          sleep;
+    time_t                          cache_ttl;
+    ngx_int_t                       content_length_n;
+
+    u_char                          key[NGX_MAIL_AUTH_HTTP_KEY_LEN];
+
+    unsigned                        cacheable:1;
+    unsigned                        keepalive:1;
+    unsigned                        reconnect:1;
 
     ngx_pool_t                     *pool;
 };
 
 
+static void ngx_mail_auth_http_connect(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx);
+static void ngx_mail_auth_http_retry(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx);
+static void ngx_mail_auth_http_free_peer(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx);
+static void ngx_mail_auth_http_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_mail_auth_http_write_handler(ngx_event_t *wev);
 static void ngx_mail_auth_http_read_handler(ngx_event_t *rev);
 static void ngx_mail_auth_http_ignore_status_line(ngx_mail_session_t *s,
@@ -76,12 +140,31 @@ static ngx_buf_t *ngx_mail_auth_http_create_request(ngx_mail_session_t *s,
 static ngx_int_t ngx_mail_auth_http_escape(ngx_pool_t *pool, ngx_str_t *text,
     ngx_str_t *escaped);
 
+static ngx_int_t ngx_mail_auth_http_cache_key(ngx_mail_session_t *s,
+    ngx_mail_auth_http_conf_t *ahcf, u_char *key);
+static ngx_mail_auth_http_cache_node_t *ngx_mail_auth_http_cache_find(
+    ngx_mail_auth_http_cache_t *cache, u_char *key);
+static ngx_int_t ngx_mail_auth_http_cache_lookup(ngx_mail_session_t *s,
+    ngx_mail_auth_http_conf_t *ahcf, u_char *key, ngx_addr_t **peer);
+static void ngx_mail_auth_http_cache_store(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx, ngx_addr_t *peer);
+static void ngx_mail_auth_http_cache_expire(ngx_mail_auth_http_cache_t *cache,
+    ngx_uint_t n);
+static void ngx_mail_auth_http_cache_delete(ngx_mail_auth_http_cache_t *cache,
+    ngx_mail_auth_http_cache_node_t *cn);
+static void ngx_mail_auth_http_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_mail_auth_http_init_cache_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
 static void *ngx_mail_auth_http_create_conf(ngx_conf_t *cf);
 static char *ngx_mail_auth_http_merge_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_mail_auth_http(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_mail_auth_http_header(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_mail_auth_http_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_command_t  ngx_mail_auth_http_commands[] = {
@@ -114,6 +197,20 @@ static ngx_command_t  ngx_mail_auth_http_commands[] = {
       offsetof(ngx_mail_auth_http_conf_t, pass_client_cert),
       NULL },
 
+    { ngx_string("auth_http_cache"),
+      NGX_MAIL_MAIN_CONF|NGX_MAIL_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_mail_auth_http_cache,
+      NGX_MAIL_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("auth_http_keepalive"),
+      NGX_MAIL_MAIN_CONF|NGX_MAIL_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_MAIL_SRV_CONF_OFFSET,
+      offsetof(ngx_mail_auth_http_conf_t, keepalive),
+      NULL },
+
       ngx_null_command
 };
 
@@ -160,13 +257,38 @@ static ngx_str_t   ngx_mail_smtp_errcode = ngx_string("535 5.7.0");
 void
 ngx_mail_auth_http_init(ngx_mail_session_t *s)
 {
+    u_char                      key[NGX_MAIL_AUTH_HTTP_KEY_LEN];
     ngx_int_t                   rc;
+    ngx_uint_t                  cacheable;
     ngx_pool_t                 *pool;
+    ngx_addr_t                 *peer;
     ngx_mail_auth_http_ctx_t   *ctx;
     ngx_mail_auth_http_conf_t  *ahcf;
 
     s->connection->log->action = "in http auth state";
 
+    ahcf = ngx_mail_get_module_srv_conf(s, ngx_mail_auth_http_module);
+
+    cacheable = 0;
+
+    if (ahcf->cache_zone
+        && ngx_mail_auth_http_cache_key(s, ahcf, key) == NGX_OK)
+    {
+        rc = ngx_mail_auth_http_cache_lookup(s, ahcf, key, &peer);
+
+        if (rc == NGX_OK) {
+            ngx_mail_proxy_init(s, peer);
+            return;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_mail_session_internal_server_error(s);
+            return;
+        }
+
+        cacheable = 1;
+    }
+
     pool = ngx_create_pool(2048, s->connection->log);
     if (pool == NULL) {
         ngx_mail_session_internal_server_error(s);
@@ -181,8 +303,12 @@ ngx_mail_auth_http_init(ngx_mail_session_t *s)
     }
 
     ctx->pool = pool;
+    ctx->content_length_n = -1;
 
-    ahcf = ngx_mail_get_module_srv_conf(s, ngx_mail_auth_http_module);
+    if (cacheable) {
+        ctx->cacheable = 1;
+        ngx_memcpy(ctx->key, key, NGX_MAIL_AUTH_HTTP_KEY_LEN);
+    }
 
     ctx->request = ngx_mail_auth_http_create_request(s, pool, ahcf);
     if (ctx->request == NULL) {
@@ -200,16 +326,58 @@ ngx_mail_auth_http_init(ngx_mail_session_t *s)
     ctx->peer.log = s->connection->log;
     ctx->peer.log_error = NGX_ERROR_ERR;
 
-    rc = ngx_event_connect_peer(&ctx->peer);
+    ngx_mail_auth_http_connect(s, ctx);
+}
 
-    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
-        if (ctx->peer.connection) {
-            ngx_close_connection(ctx->peer.connection);
-        }
 
-        ngx_destroy_pool(ctx->pool);
-        ngx_mail_session_internal_server_error(s);
-        return;
+static void
+ngx_mail_auth_http_connect(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx)
+{
+    ngx_int_t                        rc;
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+    ngx_mail_auth_http_conf_t       *ahcf;
+    ngx_mail_auth_http_keepalive_t  *item;
+
+    ahcf = ngx_mail_get_module_srv_conf(s, ngx_mail_auth_http_module);
+
+    if (ahcf->keepalive
+        && !ctx->reconnect
+        && !ngx_queue_empty(&ahcf->keepalive_cache))
+    {
+        q = ngx_queue_head(&ahcf->keepalive_cache);
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&ahcf->keepalive_free, q);
+
+        item = ngx_queue_data(q, ngx_mail_auth_http_keepalive_t, queue);
+        c = item->connection;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                       "mail auth http keepalive connection %p", c);
+
+        c->idle = 0;
+        c->log = s->connection->log;
+        c->read->log = s->connection->log;
+        c->write->log = s->connection->log;
+
+        ctx->peer.connection = c;
+        ctx->peer.cached = 1;
+
+        rc = NGX_OK;
+
+    } else {
+        rc = ngx_event_connect_peer(&ctx->peer);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            if (ctx->peer.connection) {
+                ngx_close_connection(ctx->peer.connection);
+            }
+
+            ngx_destroy_pool(ctx->pool);
+            ngx_mail_session_internal_server_error(s);
+            return;
+        }
     }
 
     ctx->peer.connection->data = s;
@@ -231,6 +399,160 @@ ngx_mail_auth_http_init(ngx_mail_session_t *s)
 }
 
 
+static void
+ngx_mail_auth_http_retry(ngx_mail_session_t *s, ngx_mail_auth_http_ctx_t *ctx)
+{
+    ngx_close_connection(ctx->peer.connection);
+
+    /*
+     * the auth server may close an idle keepalive connection at any time,
+     * so the request is repeated once over a new connection if nothing
+     * was received yet
+     */
+
+    if (!ctx->peer.cached
+        || (ctx->response && ctx->response->last != ctx->response->start))
+    {
+        ngx_destroy_pool(ctx->pool);
+        ngx_mail_session_internal_server_error(s);
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                   "mail auth http keepalive connection failed");
+
+    ctx->peer.connection = NULL;
+    ctx->peer.cached = 0;
+    ctx->reconnect = 1;
+
+    ctx->request->pos = ctx->request->start;
+
+    ngx_mail_auth_http_connect(s, ctx);
+}
+
+
+static void
+ngx_mail_auth_http_free_peer(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx)
+{
+    ngx_queue_t                     *q;
+    ngx_connection_t                *c;
+    ngx_mail_auth_http_conf_t       *ahcf;
+    ngx_mail_auth_http_keepalive_t  *item;
+
+    c = ctx->peer.connection;
+
+    ahcf = ngx_mail_get_module_srv_conf(s, ngx_mail_auth_http_module);
+
+    /* the whole response, including the body, must be read already */
+
+    if (ahcf->keepalive == 0
+        || !ctx->keepalive
+        || ctx->content_length_n
+           != (ngx_int_t) (ctx->response->last - ctx->response->pos)
+        || c->read->eof
+        || c->read->error
+        || ngx_terminate
+        || ngx_exiting)
+    {
+        ngx_close_connection(c);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                   "mail auth http saving connection %p", c);
+
+    if (ngx_queue_empty(&ahcf->keepalive_free)) {
+
+        q = ngx_queue_last(&ahcf->keepalive_cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_mail_auth_http_keepalive_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&ahcf->keepalive_free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_mail_auth_http_keepalive_t, queue);
+    }
+
+    ngx_queue_insert_head(&ahcf->keepalive_cache, q);
+
+    item->connection = c;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_mail_auth_http_dummy_handler;
+    c->read->handler = ngx_mail_auth_http_keepalive_close_handler;
+
+    c->data = item;
+    c->pool = NULL;
+    c->idle = 1;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    if (c->read->ready) {
+        ngx_mail_auth_http_keepalive_close_handler(c->read);
+    }
+}
+
+
+static void
+ngx_mail_auth_http_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_mail_auth_http_conf_t       *ahcf;
+    ngx_mail_auth_http_keepalive_t  *item;
+
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_MAIL, ev->log, 0,
+                   "mail auth http keepalive close handler");
+
+    c = ev->data;
+
+    if (c->close) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+    ahcf = item->conf;
+
+    ngx_close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&ahcf->keepalive_free, &item->queue);
+}
+
+
 static void
 ngx_mail_auth_http_write_handler(ngx_event_t *wev)
 {
@@ -262,9 +584,7 @@ ngx_mail_auth_http_write_handler(ngx_event_t *wev)
     n = ngx_send(c, ctx->request->pos, size);
 
     if (n == NGX_ERROR) {
-        ngx_close_connection(c);
-        ngx_destroy_pool(ctx->pool);
-        ngx_mail_session_internal_server_error(s);
+        ngx_mail_auth_http_retry(s, ctx);
         return;
     }
 
@@ -345,9 +665,7 @@ ngx_mail_auth_http_read_handler(ngx_event_t *rev)
         return;
     }
 
-    ngx_close_connection(c);
-    ngx_destroy_pool(ctx->pool);
-    ngx_mail_session_internal_server_error(s);
+    ngx_mail_auth_http_retry(s, ctx);
 }
 
 
@@ -680,6 +998,56 @@ ngx_mail_auth_http_process_headers(ngx_mail_session_t *s,
                 continue;
             }
 
+            if (len == sizeof("Auth-Cache-TTL") - 1
+                && ngx_strncasecmp(ctx->header_name_start,
+                                   (u_char *) "Auth-Cache-TTL",
+                                   sizeof("Auth-Cache-TTL") - 1)
+                   == 0)
+            {
+                n = ngx_atoi(ctx->header_start,
+                             ctx->header_end - ctx->header_start);
+
+                if (n != NGX_ERROR) {
+                    ctx->cache_ttl = n;
+                }
+
+                continue;
+            }
+
+            if (len == sizeof("Connection") - 1
+                && ngx_strncasecmp(ctx->header_name_start,
+                                   (u_char *) "Connection",
+                                   sizeof("Connection") - 1)
+                   == 0)
+            {
+                len = ctx->header_end - ctx->header_start;
+
+                if (len == sizeof("keep-alive") - 1
+                    && ngx_strncasecmp(ctx->header_start,
+                                       (u_char *) "keep-alive",
+                                       sizeof("keep-alive") - 1)
+                       == 0)
+                {
+                    ctx->keepalive = 1;
+                }
+
+                continue;
+            }
+
+            if (len == sizeof("Content-Length") - 1
+                && ngx_strncasecmp(ctx->header_name_start,
+                                   (u_char *) "Content-Length",
+                                   sizeof("Content-Length") - 1)
+                   == 0)
+            {
+                n = ngx_atoi(ctx->header_start,
+                             ctx->header_end - ctx->header_start);
+
+                ctx->content_length_n = n;
+
+                continue;
+            }
+
             /* ignore other headers */
 
             continue;
@@ -689,7 +1057,7 @@ ngx_mail_auth_http_process_headers(ngx_mail_session_t *s,
             ngx_log_debug0(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
                            "mail auth http header done");
 
-            ngx_close_connection(ctx->peer.connection);
+            ngx_mail_auth_http_free_peer(s, ctx);
 
             if (ctx->err.len) {
 
@@ -847,6 +1215,10 @@ ngx_mail_auth_http_process_headers(ngx_mail_session_t *s,
 
             ngx_memcpy(peer->name.data + len, ctx->port.data, ctx->port.len);
 
+            if (ctx->cacheable && ctx->cache_ttl > 0) {
+                ngx_mail_auth_http_cache_store(s, ctx, peer);
+            }
+
             ngx_destroy_pool(ctx->pool);
             ngx_mail_proxy_init(s, peer);
 
@@ -1227,6 +1599,7 @@ ngx_mail_auth_http_create_request(ngx_mail_session_t *s, ngx_pool_t *pool,
 
     len = sizeof("GET ") - 1 + ahcf->uri.len + sizeof(" HTTP/1.0" CRLF) - 1
           + sizeof("Host: ") - 1 + ahcf->host_header.len + sizeof(CRLF) - 1
+          + sizeof("Connection: keep-alive" CRLF) - 1
           + sizeof("Auth-Method: ") - 1
                 + ngx_mail_auth_http_method[s->auth_method].len
                 + sizeof(CRLF) - 1
@@ -1271,6 +1644,11 @@ ngx_mail_auth_http_create_request(ngx_mail_session_t *s, ngx_pool_t *pool,
                          ahcf->host_header.len);
     *b->last++ = CR; *b->last++ = LF;
 
+    if (ahcf->keepalive) {
+        b->last = ngx_cpymem(b->last, "Connection: keep-alive" CRLF,
+                             sizeof("Connection: keep-alive" CRLF) - 1);
+    }
+
     b->last = ngx_cpymem(b->last, "Auth-Method: ",
                          sizeof("Auth-Method: ") - 1);
     b->last = ngx_cpymem(b->last,
@@ -1431,6 +1809,387 @@ ngx_mail_auth_http_escape(ngx_pool_t *pool, ngx_str_t *text, ngx_str_t *escaped)
 }
 
 
+static ngx_int_t
+ngx_mail_auth_http_cache_key(ngx_mail_session_t *s,
+    ngx_mail_auth_http_conf_t *ahcf, u_char *key)
+{
+    ngx_md5_t                  md5;
+    ngx_mail_core_srv_conf_t  *cscf;
+#if (NGX_MAIL_SSL)
+    ngx_mail_ssl_conf_t       *sslcf;
+#endif
+
+    /* salted and SMTP "none" methods never repeat the same request */
+
+    if (s->auth_method != NGX_MAIL_AUTH_PLAIN
+        && s->auth_method != NGX_MAIL_AUTH_LOGIN
+        && s->auth_method != NGX_MAIL_AUTH_LOGIN_USERNAME)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_MAIL_SSL)
+
+    /* the auth server may check client certificates */
+
+    sslcf = ngx_mail_get_module_srv_conf(s, ngx_mail_ssl_module);
+
+    if (s->connection->ssl && sslcf->verify) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    cscf = ngx_mail_get_module_srv_conf(s, ngx_mail_core_module);
+
+    ngx_md5_init(&md5);
+
+    ngx_md5_update(&md5, ahcf->peer->name.data, ahcf->peer->name.len);
+    ngx_md5_update(&md5, ahcf->uri.data, ahcf->uri.len);
+    ngx_md5_update(&md5, cscf->protocol->name.data, cscf->protocol->name.len);
+
+    ngx_md5_update(&md5, &s->login.len, sizeof(size_t));
+    ngx_md5_update(&md5, s->login.data, s->login.len);
+    ngx_md5_update(&md5, &s->passwd.len, sizeof(size_t));
+    ngx_md5_update(&md5, s->passwd.data, s->passwd.len);
+
+    ngx_md5_final(key, &md5);
+
+    return NGX_OK;
+}
+
+
+static ngx_mail_auth_http_cache_node_t *
+ngx_mail_auth_http_cache_find(ngx_mail_auth_http_cache_t *cache, u_char *key)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_key_t                  node_key;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_mail_auth_http_cache_node_t  *cn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        cn = (ngx_mail_auth_http_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], cn->key,
+                        NGX_MAIL_AUTH_HTTP_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_mail_auth_http_cache_lookup(ngx_mail_session_t *s,
+    ngx_mail_auth_http_conf_t *ahcf, u_char *key, ngx_addr_t **peer)
+{
+    u_char                           *p;
+    ngx_addr_t                       *addr;
+    ngx_mail_auth_http_cache_t       *cache;
+    ngx_mail_auth_http_cache_node_t  *cn;
+
+    cache = ahcf->cache_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_mail_auth_http_cache_find(cache, key);
+
+    if (cn == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (cn->expire <= ngx_time()) {
+        ngx_mail_auth_http_cache_delete(cache, cn);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    addr = ngx_palloc(s->connection->pool,
+                      sizeof(ngx_addr_t) + cn->socklen + cn->name_len
+                      + cn->login_len + cn->passwd_len);
+    if (addr == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    p = (u_char *) addr + sizeof(ngx_addr_t);
+
+    addr->sockaddr = (struct sockaddr *) p;
+    addr->socklen = cn->socklen;
+    p = ngx_cpymem(p, cn->data, cn->socklen);
+
+    addr->name.len = cn->name_len;
+    addr->name.data = p;
+    p = ngx_cpymem(p, cn->data + cn->socklen, cn->name_len);
+
+    s->login.len = cn->login_len;
+    s->login.data = p;
+    p = ngx_cpymem(p, cn->data + cn->socklen + cn->name_len, cn->login_len);
+
+    s->passwd.len = cn->passwd_len;
+    s->passwd.data = p;
+    ngx_memcpy(p, cn->data + cn->socklen + cn->name_len + cn->login_len,
+               cn->passwd_len);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                   "mail auth http cache hit: %V", &addr->name);
+
+    *peer = addr;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_mail_auth_http_cache_store(ngx_mail_session_t *s,
+    ngx_mail_auth_http_ctx_t *ctx, ngx_addr_t *peer)
+{
+    u_char                           *p;
+    size_t                            size;
+    ngx_mail_auth_http_conf_t        *ahcf;
+    ngx_mail_auth_http_cache_t       *cache;
+    ngx_mail_auth_http_cache_node_t  *cn;
+
+    if (peer->socklen > 0xffff
+        || peer->name.len > 0xffff
+        || s->login.len > 0xffff
+        || s->passwd.len > 0xffff)
+    {
+        return;
+    }
+
+    ahcf = ngx_mail_get_module_srv_conf(s, ngx_mail_auth_http_module);
+
+    cache = ahcf->cache_zone->data;
+
+    size = offsetof(ngx_mail_auth_http_cache_node_t, data)
+           + peer->socklen + peer->name.len + s->login.len + s->passwd.len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_mail_auth_http_cache_find(cache, ctx->key);
+
+    if (cn) {
+        ngx_mail_auth_http_cache_delete(cache, cn);
+    }
+
+    ngx_mail_auth_http_cache_expire(cache, 1);
+
+    cn = ngx_slab_alloc_locked(cache->shpool, size);
+
+    if (cn == NULL) {
+        ngx_mail_auth_http_cache_expire(cache, 0);
+
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+        if (cn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+    }
+
+    ngx_memcpy((u_char *) &cn->node.key, ctx->key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(cn->key, &ctx->key[sizeof(ngx_rbtree_key_t)],
+               NGX_MAIL_AUTH_HTTP_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    cn->expire = ngx_time() + ctx->cache_ttl;
+
+    cn->socklen = (u_short) peer->socklen;
+    cn->name_len = (u_short) peer->name.len;
+    cn->login_len = (u_short) s->login.len;
+    cn->passwd_len = (u_short) s->passwd.len;
+
+    p = ngx_cpymem(cn->data, peer->sockaddr, peer->socklen);
+    p = ngx_cpymem(p, peer->name.data, peer->name.len);
+    p = ngx_cpymem(p, s->login.data, s->login.len);
+    ngx_memcpy(p, s->passwd.data, s->passwd.len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                   "mail auth http cache store: %T", ctx->cache_ttl);
+}
+
+
+static void
+ngx_mail_auth_http_cache_expire(ngx_mail_auth_http_cache_t *cache,
+    ngx_uint_t n)
+{
+    time_t                            now;
+    ngx_queue_t                      *q;
+    ngx_mail_auth_http_cache_node_t  *cn;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes least recently used entry by force
+     *        and one or two expired entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+
+        cn = ngx_queue_data(q, ngx_mail_auth_http_cache_node_t, queue);
+
+        if (n++ != 0 && cn->expire > now) {
+            return;
+        }
+
+        ngx_mail_auth_http_cache_delete(cache, cn);
+    }
+}
+
+
+static void
+ngx_mail_auth_http_cache_delete(ngx_mail_auth_http_cache_t *cache,
+    ngx_mail_auth_http_cache_node_t *cn)
+{
+    ngx_queue_remove(&cn->queue);
+
+    ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+
+static void
+ngx_mail_auth_http_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_mail_auth_http_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_mail_auth_http_cache_node_t *) node;
+            cnt = (ngx_mail_auth_http_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_MAIL_AUTH_HTTP_KEY_LEN
+                            - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_mail_auth_http_init_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_mail_auth_http_cache_t  *ocache = data;
+
+    size_t                       len;
+    ngx_mail_auth_http_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_mail_auth_http_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_mail_auth_http_cache_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    len = sizeof(" in auth_http_cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in auth_http_cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_mail_auth_http_create_conf(ngx_conf_t *cf)
 {
@@ -1443,6 +2202,8 @@ ngx_mail_auth_http_create_conf(ngx_conf_t *cf)
 
     ahcf->timeout = NGX_CONF_UNSET_MSEC;
     ahcf->pass_client_cert = NGX_CONF_UNSET;
+    ahcf->cache_zone = NGX_CONF_UNSET_PTR;
+    ahcf->keepalive = NGX_CONF_UNSET_UINT;
 
     ahcf->file = cf->conf_file->file.name.data;
     ahcf->line = cf->conf_file->line;
@@ -1457,10 +2218,11 @@ ngx_mail_auth_http_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_mail_auth_http_conf_t *prev = parent;
     ngx_mail_auth_http_conf_t *conf = child;
 
-    u_char           *p;
-    size_t            len;
-    ngx_uint_t        i;
-    ngx_table_elt_t  *header;
+    u_char                          *p;
+    size_t                           len;
+    ngx_uint_t                       i;
+    ngx_table_elt_t                 *header;
+    ngx_mail_auth_http_keepalive_t  *cached;
 
     if (conf->peer == NULL) {
         conf->peer = prev->peer;
@@ -1480,6 +2242,26 @@ ngx_mail_auth_http_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->pass_client_cert, prev->pass_client_cert, 0);
 
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+
+    if (conf->keepalive) {
+        cached = ngx_pcalloc(cf->pool, sizeof(ngx_mail_auth_http_keepalive_t)
+                                       * conf->keepalive);
+        if (cached == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_queue_init(&conf->keepalive_cache);
+        ngx_queue_init(&conf->keepalive_free);
+
+        for (i = 0; i < conf->keepalive; i++) {
+            ngx_queue_insert_head(&conf->keepalive_free, &cached[i].queue);
+            cached[i].conf = conf;
+        }
+    }
+
     if (conf->headers == NULL) {
         conf->headers = prev->headers;
         conf->header = prev->header;
@@ -1588,3 +2370,85 @@ ngx_mail_auth_http_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_mail_auth_http_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_mail_auth_http_conf_t *ahcf = conf;
+
+    u_char                      *p;
+    ssize_t                      size;
+    ngx_str_t                   *value, name, s;
+    ngx_mail_auth_http_cache_t  *cache;
+
+    if (ahcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ahcf->cache_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 5;
+
+    p = (u_char *) ngx_strchr(name.data, ':');
+
+    if (p) {
+        name.len = p - name.data;
+
+        s.data = p + 1;
+        s.len = value[1].data + value[1].len - s.data;
+
+        size = ngx_parse_size(&s);
+
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid zone size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is too small", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+        name.len = value[1].len - 5;
+        size = 0;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ahcf->cache_zone = ngx_shared_memory_add(cf, &name, size,
+                                             &ngx_mail_auth_http_module);
+    if (ahcf->cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ahcf->cache_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_mail_auth_http_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ahcf->cache_zone->init = ngx_mail_auth_http_init_cache_zone;
+        ahcf->cache_zone->data = cache;
+    }
+
+    return NGX_CONF_OK;
+}
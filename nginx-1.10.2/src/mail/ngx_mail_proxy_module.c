@@ -12,10 +12,15 @@
 #include <ngx_mail.h>
 
 
+/* the default pipe capacity on Linux */
+#define NGX_MAIL_PROXY_SPLICE_SIZE  65536
+
+
 typedef struct {
     ngx_flag_t  enable;
     ngx_flag_t  pass_error_message;
     ngx_flag_t  xclient;
+    ngx_flag_t  splice;
     size_t      buffer_size;
     ngx_msec_t  timeout;
 } ngx_mail_proxy_conf_t;
@@ -29,6 +34,13 @@ static void ngx_mail_proxy_dummy_handler(ngx_event_t *ev);
 static ngx_int_t ngx_mail_proxy_read_response(ngx_mail_session_t *s,
     ngx_uint_t state);
 static void ngx_mail_proxy_handler(ngx_event_t *ev);
+#if (NGX_HAVE_SPLICE)
+static void ngx_mail_proxy_splice_init(ngx_mail_session_t *s);
+static ngx_int_t ngx_mail_proxy_splice(ngx_mail_session_t *s,
+    ngx_connection_t *src, ngx_connection_t *dst, ngx_mail_proxy_pipe_t *p,
+    ngx_uint_t do_write);
+static void ngx_mail_proxy_splice_cleanup(void *data);
+#endif
 static void ngx_mail_proxy_upstream_error(ngx_mail_session_t *s);
 static void ngx_mail_proxy_internal_server_error(ngx_mail_session_t *s);
 static void ngx_mail_proxy_close_session(ngx_mail_session_t *s);
@@ -74,6 +86,13 @@ static ngx_command_t  ngx_mail_proxy_commands[] = {
       offsetof(ngx_mail_proxy_conf_t, xclient),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_MAIL_MAIN_CONF|NGX_MAIL_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_MAIL_SRV_CONF_OFFSET,
+      offsetof(ngx_mail_proxy_conf_t, splice),
+      NULL },
+
       ngx_null_command
 };
 
@@ -128,6 +147,8 @@ ngx_mail_proxy_init(ngx_mail_session_t *s, ngx_addr_t *peer)
 
     s->proxy = p;
 
+    p->start_time = ngx_current_msec;
+
     p->upstream.sockaddr = peer->sockaddr;
     p->upstream.socklen = peer->socklen;
     p->upstream.name = &peer->name;
@@ -159,6 +180,20 @@ ngx_mail_proxy_init(ngx_mail_session_t *s, ngx_addr_t *peer)
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    /* data can be spliced between plain sockets only */
+
+    p->splice = pcf->splice;
+
+#if (NGX_MAIL_SSL)
+    if (s->connection->ssl) {
+        p->splice = 0;
+    }
+#endif
+
+#endif
+
     s->out.len = 0;
 
     switch (s->protocol) {
@@ -871,13 +906,16 @@ static void
 ngx_mail_proxy_handler(ngx_event_t *ev)
 {
     char                   *action, *recv_action, *send_action;
-    size_t                  size;
+    size_t                  size, to_client, to_upstream;
     ssize_t                 n;
     ngx_buf_t              *b;
     ngx_uint_t              do_write;
     ngx_connection_t       *c, *src, *dst;
     ngx_mail_session_t     *s;
     ngx_mail_proxy_conf_t  *pcf;
+#if (NGX_HAVE_SPLICE)
+    ngx_mail_proxy_pipe_t  *p;
+#endif
 
     c = ev->data;
     s = c->data;
@@ -938,6 +976,23 @@ ngx_mail_proxy_handler(ngx_event_t *ev)
                    "mail proxy handler: %ui, #%d > #%d",
                    do_write, src->fd, dst->fd);
 
+#if (NGX_HAVE_SPLICE)
+
+    if (s->proxy->pipe) {
+        p = (src == s->connection) ? &s->proxy->pipe[0] : &s->proxy->pipe[1];
+
+        c->log->action = recv_action;
+
+        if (ngx_mail_proxy_splice(s, src, dst, p, do_write) != NGX_OK) {
+            ngx_mail_proxy_close_session(s);
+            return;
+        }
+
+        goto relayed;
+    }
+
+#endif
+
     for ( ;; ) {
 
         if (do_write) {
@@ -957,6 +1012,10 @@ ngx_mail_proxy_handler(ngx_event_t *ev)
                 if (n > 0) {
                     b->pos += n;
 
+                    if (dst == s->connection) {
+                        s->proxy->sent += n;
+                    }
+
                     if (b->pos == b->last) {
                         b->pos = b->start;
                         b->last = b->start;
@@ -980,6 +1039,10 @@ ngx_mail_proxy_handler(ngx_event_t *ev)
                 do_write = 1;
                 b->last += n;
 
+                if (src == s->connection) {
+                    s->proxy->received += n;
+                }
+
                 continue;
             }
 
@@ -991,11 +1054,24 @@ ngx_mail_proxy_handler(ngx_event_t *ev)
         break;
     }
 
+#if (NGX_HAVE_SPLICE)
+relayed:
+#endif
+
     c->log->action = "proxying";
 
-    if ((s->connection->read->eof && s->buffer->pos == s->buffer->last)
-        || (s->proxy->upstream.connection->read->eof
-            && s->proxy->buffer->pos == s->proxy->buffer->last)
+    to_upstream = s->buffer->last - s->buffer->pos;
+    to_client = s->proxy->buffer->last - s->proxy->buffer->pos;
+
+#if (NGX_HAVE_SPLICE)
+    if (s->proxy->pipe) {
+        to_upstream += s->proxy->pipe[0].size;
+        to_client += s->proxy->pipe[1].size;
+    }
+#endif
+
+    if ((s->connection->read->eof && to_upstream == 0)
+        || (s->proxy->upstream.connection->read->eof && to_client == 0)
         || (s->connection->read->eof
             && s->proxy->upstream.connection->read->eof))
     {
@@ -1032,9 +1108,186 @@ ngx_mail_proxy_handler(ngx_event_t *ev)
         pcf = ngx_mail_get_module_srv_conf(s, ngx_mail_proxy_module);
         ngx_add_timer(c->read, pcf->timeout);
     }
+
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * the relay switches to splice() once the responses of the protocol
+     * handshake left in the buffers are sent
+     */
+
+    if (s->proxy->splice && to_client == 0 && to_upstream == 0) {
+        ngx_mail_proxy_splice_init(s);
+    }
+
+#endif
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static void
+ngx_mail_proxy_splice_init(ngx_mail_session_t *s)
+{
+    ngx_uint_t              i;
+    ngx_pool_cleanup_t     *cln;
+    ngx_mail_proxy_pipe_t  *p;
+
+    s->proxy->splice = 0;
+
+    p = ngx_palloc(s->connection->pool, 2 * sizeof(ngx_mail_proxy_pipe_t));
+    if (p == NULL) {
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+    if (cln == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        p[i].fd[0] = NGX_INVALID_FILE;
+        p[i].fd[1] = NGX_INVALID_FILE;
+        p[i].size = 0;
+    }
+
+    cln->handler = ngx_mail_proxy_splice_cleanup;
+    cln->data = p;
+
+    for (i = 0; i < 2; i++) {
+        if (pipe(p[i].fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, s->connection->log, ngx_errno,
+                          "pipe() failed");
+            return;
+        }
+
+        if (ngx_nonblocking(p[i].fd[0]) == -1
+            || ngx_nonblocking(p[i].fd[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, s->connection->log, ngx_errno,
+                          ngx_nonblocking_n " failed");
+            return;
+        }
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                   "mail proxy splice pipes: %d:%d %d:%d",
+                   p[0].fd[0], p[0].fd[1], p[1].fd[0], p[1].fd[1]);
+
+    s->proxy->pipe = p;
+}
+
+
+static ngx_int_t
+ngx_mail_proxy_splice(ngx_mail_session_t *s, ngx_connection_t *src,
+    ngx_connection_t *dst, ngx_mail_proxy_pipe_t *p, ngx_uint_t do_write)
+{
+    ssize_t    n;
+    ngx_err_t  err;
+
+    for ( ;; ) {
+
+        if (do_write && p->size && dst->write->ready) {
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                           "splice to #%d: %z", dst->fd, n);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                p->size -= n;
+
+                if (p->size) {
+                    dst->write->ready = 0;
+                }
+
+                if (dst == s->connection) {
+                    s->proxy->sent += n;
+                }
+            }
+        }
+
+        /*
+         * the pipe is filled only when empty, so EAGAIN
+         * can be reported by the socket only
+         */
+
+        if (p->size == 0 && src->read->ready) {
+
+            n = splice(src->fd, NULL, p->fd[1], NULL,
+                       NGX_MAIL_PROXY_SPLICE_SIZE,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
+                           "splice from #%d: %z", src->fd, n);
+
+            if (n > 0) {
+                do_write = 1;
+                p->size = n;
+
+                if (src == s->connection) {
+                    s->proxy->received += n;
+                }
+
+                continue;
+            }
+
+            src->read->ready = 0;
+
+            if (n == 0) {
+                src->read->eof = 1;
+                break;
+            }
+
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN) {
+                src->read->eof = 1;
+                src->read->error = 1;
+                ngx_connection_error(src, err, "splice() failed");
+            }
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_mail_proxy_splice_cleanup(void *data)
+{
+    ngx_mail_proxy_pipe_t  *p = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < 2; i++) {
+        if (p[i].fd[0] != NGX_INVALID_FILE) {
+            (void) close(p[i].fd[0]);
+        }
+
+        if (p[i].fd[1] != NGX_INVALID_FILE) {
+            (void) close(p[i].fd[1]);
+        }
+    }
+}
+
+#endif
+
+
 static void
 ngx_mail_proxy_upstream_error(ngx_mail_session_t *s)
 {
@@ -1074,6 +1327,23 @@ ngx_mail_proxy_internal_server_error(ngx_mail_session_t *s)
 static void
 ngx_mail_proxy_close_session(ngx_mail_session_t *s)
 {
+    char  *action;
+
+    action = s->connection->log->action;
+    s->connection->log->action = NULL;
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "proxied %O bytes from client and %O bytes to client "
+                  "in %M ms%s",
+                  s->proxy->received, s->proxy->sent,
+                  (ngx_msec_t) (ngx_current_msec - s->proxy->start_time),
+#if (NGX_HAVE_SPLICE)
+                  s->proxy->pipe ? " with splice" :
+#endif
+                  "");
+
+    s->connection->log->action = action;
+
     if (s->proxy->upstream.connection) {
         ngx_log_debug1(NGX_LOG_DEBUG_MAIL, s->connection->log, 0,
                        "close mail proxy connection: %d",
@@ -1099,6 +1369,7 @@ ngx_mail_proxy_create_conf(ngx_conf_t *cf)
     pcf->enable = NGX_CONF_UNSET;
     pcf->pass_error_message = NGX_CONF_UNSET;
     pcf->xclient = NGX_CONF_UNSET;
+    pcf->splice = NGX_CONF_UNSET;
     pcf->buffer_size = NGX_CONF_UNSET_SIZE;
     pcf->timeout = NGX_CONF_UNSET_MSEC;
 
@@ -1115,9 +1386,21 @@ ngx_mail_proxy_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
     ngx_conf_merge_value(conf->pass_error_message, prev->pass_error_message, 0);
     ngx_conf_merge_value(conf->xclient, prev->xclient, 1);
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
     ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
                               (size_t) ngx_pagesize);
     ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 24 * 60 * 60000);
 
+#if !(NGX_HAVE_SPLICE)
+
+    if (conf->splice) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_splice\" is not supported "
+                           "on this platform, ignored");
+        conf->splice = 0;
+    }
+
+#endif
+
     return NGX_CONF_OK;
 }
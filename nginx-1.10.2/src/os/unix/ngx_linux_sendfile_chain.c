@@ -12,6 +12,8 @@
 
 static ssize_t ngx_linux_sendfile(ngx_connection_t *c, ngx_buf_t *file,
     size_t size);
+static ngx_chain_t *ngx_linux_sendfile_batch(ngx_connection_t *c,
+    ngx_iovec_t *vec, ngx_chain_t *in, off_t limit);
 
 #if (NGX_THREADS)
 #include <ngx_thread_pool.h>
@@ -43,6 +45,18 @@ static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
 #define NGX_SENDFILE_MAXSIZE  2147483647L
 
 
+/*
+ * A multipart range response interleaves small headers with file parts,
+ * so it costs a writev() and a sendfile() per range.  If several file parts
+ * lie within NGX_SENDFILE_BATCH_SIZE bytes of the same file, they are read
+ * with a single pread() and sent along with the headers by a single writev().
+ */
+
+#define NGX_SENDFILE_BATCH_SIZE  65536
+
+static u_char  ngx_linux_sendfile_batch_buf[NGX_SENDFILE_BATCH_SIZE];
+
+
 ngx_chain_t *
 ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
@@ -95,6 +109,16 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return NGX_CHAIN_ERROR;
         }
 
+        /* read the small file parts between the headers into the iovec */
+
+        if (header.count != 0 && cl && cl->buf->in_file) {
+            cl = ngx_linux_sendfile_batch(c, &header, cl, limit - send);
+
+            if (cl == NGX_CHAIN_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
         send += header.size;
 
         /* set TCP_CORK if there is a header before a file */
@@ -312,6 +336,146 @@ eintr:
 }
 
 
+static ngx_chain_t *
+ngx_linux_sendfile_batch(ngx_connection_t *c, ngx_iovec_t *vec,
+    ngx_chain_t *in, off_t limit)
+{
+    off_t          start, end, size, left, right;
+    ssize_t        n;
+    ngx_buf_t     *b, *file;
+    ngx_uint_t     nfiles, niovs;
+    ngx_chain_t   *cl, *last;
+    struct iovec  *iov;
+
+    file = in->buf;
+
+    if (file->file->directio) {
+        return in;
+    }
+
+#if (NGX_THREADS)
+    if (file->file->thread_handler) {
+        return in;
+    }
+#endif
+
+    start = file->file_pos;
+    end = file->file_last;
+
+    left = start;
+    right = end;
+
+    size = vec->size;
+    niovs = vec->count;
+    nfiles = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (b->in_file) {
+            if (b->file->fd != file->file->fd) {
+                break;
+            }
+
+            left = ngx_min(start, b->file_pos);
+            right = ngx_max(end, b->file_last);
+
+            if (right - left > NGX_SENDFILE_BATCH_SIZE) {
+                break;
+            }
+
+            n = b->file_last - b->file_pos;
+
+        } else {
+            n = b->last - b->pos;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        if (niovs == vec->nalloc || size + n > limit) {
+            break;
+        }
+
+        if (b->in_file) {
+            start = left;
+            end = right;
+            nfiles++;
+        }
+
+        size += n;
+        niovs++;
+    }
+
+    if (nfiles < 2) {
+
+        /* a single file part is sent by sendfile() as is */
+
+        return in;
+    }
+
+    last = cl;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendfile batch: %ui parts @%O-%O, %O bytes",
+                   nfiles, start, end, size);
+
+    n = ngx_read_file(file->file, ngx_linux_sendfile_batch_buf,
+                      (size_t) (end - start), start);
+
+    if (n == NGX_ERROR) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (n != end - start) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      ngx_read_file_n " read only %z of %O from \"%s\"",
+                      n, end - start, file->file->name.data);
+        return NGX_CHAIN_ERROR;
+    }
+
+    for (cl = in; cl != last; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (b->in_file) {
+            n = b->file_last - b->file_pos;
+
+            if (n == 0) {
+                continue;
+            }
+
+            iov = &vec->iovs[vec->count++];
+            iov->iov_base = (void *) (ngx_linux_sendfile_batch_buf
+                                      + (b->file_pos - start));
+
+        } else {
+            n = b->last - b->pos;
+
+            if (n == 0) {
+                continue;
+            }
+
+            iov = &vec->iovs[vec->count++];
+            iov->iov_base = (void *) b->pos;
+        }
+
+        iov->iov_len = n;
+        vec->size += n;
+    }
+
+    return last;
+}
+
+
 #if (NGX_THREADS)
 
 typedef struct {
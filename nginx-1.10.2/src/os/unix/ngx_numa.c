@@ -0,0 +1,531 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_HAVE_NUMA && NGX_HAVE_SCHED_SETAFFINITY)
+
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+#include <linux/filter.h>
+#endif
+
+
+#define NGX_NUMA_MAX_NODES    (8 * sizeof(unsigned long))
+#define NGX_NUMA_CPULIST_LEN  4096
+
+
+static ngx_int_t ngx_numa_read_cpulist(ngx_uint_t node, ngx_log_t *log);
+static ngx_int_t ngx_numa_cpuset_node(ngx_cpuset_t *cpu_affinity);
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+static ngx_int_t ngx_numa_steer_reuseport(ngx_listening_t *ls,
+    ngx_uint_t workers, ngx_log_t *log);
+static void ngx_numa_detach_reuseport(ngx_listening_t *ls, ngx_log_t *log);
+static ngx_uint_t ngx_numa_same_group(ngx_listening_t *a, ngx_listening_t *b);
+#endif
+
+
+static ngx_uint_t     ngx_numa_nodes;
+static unsigned long  ngx_numa_mask;
+
+/* node number + 1 for each cpu, 0 if unknown */
+static u_char         ngx_numa_cpu_node[CPU_SETSIZE];
+
+
+void
+ngx_numa_init(ngx_uint_t enable, ngx_log_t *log)
+{
+    ngx_uint_t  node;
+
+    ngx_numa_nodes = 0;
+    ngx_numa_mask = 0;
+    ngx_memzero(ngx_numa_cpu_node, sizeof(ngx_numa_cpu_node));
+
+    if (!enable) {
+        return;
+    }
+
+    for (node = 0; node < NGX_NUMA_MAX_NODES; node++) {
+        if (ngx_numa_read_cpulist(node, log) == NGX_OK) {
+            ngx_numa_nodes++;
+            ngx_numa_mask |= 1UL << node;
+        }
+    }
+
+    if (ngx_numa_nodes == 0) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "no NUMA nodes found, \"worker_numa\" ignored");
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "numa nodes: %ui, mask: %xL",
+                   ngx_numa_nodes, (uint64_t) ngx_numa_mask);
+}
+
+
+static ngx_int_t
+ngx_numa_read_cpulist(ngx_uint_t node, ngx_log_t *log)
+{
+    u_char      *p, *last;
+    ssize_t      n;
+    ngx_fd_t     fd;
+    ngx_uint_t   cpu, from, to;
+    u_char       name[sizeof("/sys/devices/system/node/node/cpulist")
+                      + NGX_INT_T_LEN];
+    u_char       buf[NGX_NUMA_CPULIST_LEN];
+
+    ngx_sprintf(name, "/sys/devices/system/node/node%ui/cpulist%Z", node);
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    n = ngx_read_fd(fd, buf, NGX_NUMA_CPULIST_LEN);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_read_fd_n " \"%s\" failed", name);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if (n == -1) {
+        return NGX_DECLINED;
+    }
+
+    /* "0-3,8-11\n", a node with memory only has an empty list */
+
+    p = buf;
+    last = buf + n;
+
+    while (p < last && *p >= '0' && *p <= '9') {
+
+        for (from = 0; p < last && *p >= '0' && *p <= '9'; p++) {
+            from = from * 10 + (*p - '0');
+        }
+
+        to = from;
+
+        if (p < last && *p == '-') {
+            for (to = 0, p++; p < last && *p >= '0' && *p <= '9'; p++) {
+                to = to * 10 + (*p - '0');
+            }
+        }
+
+        for (cpu = from; cpu <= to && cpu < CPU_SETSIZE; cpu++) {
+            ngx_numa_cpu_node[cpu] = (u_char) (node + 1);
+        }
+
+        if (p < last && *p == ',') {
+            p++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_numa_cpuset_node(ngx_cpuset_t *cpu_affinity)
+{
+    ngx_int_t   node;
+    ngx_uint_t  cpu;
+
+    node = 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+
+        if (!CPU_ISSET(cpu, cpu_affinity)) {
+            continue;
+        }
+
+        if (ngx_numa_cpu_node[cpu] == 0
+            || (node && node != ngx_numa_cpu_node[cpu]))
+        {
+            /* unknown cpu or cpus of several nodes */
+            return NGX_ERROR;
+        }
+
+        node = ngx_numa_cpu_node[cpu];
+    }
+
+    return node ? node - 1 : NGX_ERROR;
+}
+
+
+void
+ngx_numa_interleave(void *addr, size_t size, ngx_log_t *log)
+{
+    unsigned long  mask;
+
+    if (ngx_numa_nodes < 2) {
+        return;
+    }
+
+    mask = ngx_numa_mask;
+
+    if (syscall(SYS_mbind, addr, size, MPOL_INTERLEAVE, &mask,
+                NGX_NUMA_MAX_NODES + 1, 0)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "mbind(MPOL_INTERLEAVE, %uz) failed", size);
+    }
+}
+
+
+void
+ngx_numa_order_reuseport(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+
+    ngx_uint_t        i, j, ordered, fresh, first, next, reused;
+    ngx_listening_t  *ls;
+
+    /*
+     * The kernel numbers the sockets of a reuseport group in the order
+     * they were added to the group, and a closed socket is replaced by
+     * the last one.  The index is the worker number if the sockets taken
+     * from the previous cycle were ordered there and kept their workers,
+     * and the new sockets were added after them in the order of workers.
+     * Sockets inherited on binary upgrade are never considered ordered.
+     */
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (!ls[i].reuseport || ls[i].worker != 0) {
+            continue;
+        }
+
+        ordered = 1;
+        fresh = 0;
+        first = 0;
+        next = 0;
+        reused = 0;
+
+        for (j = 0; j < cycle->listening.nelts; j++) {
+
+            if (!ngx_numa_same_group(&ls[i], &ls[j])) {
+                continue;
+            }
+
+            if (ls[j].previous) {
+                if (!ls[j].previous->ordered
+                    || ls[j].previous->worker != ls[j].worker)
+                {
+                    ordered = 0;
+                }
+
+                if (reused < ls[j].worker + 1) {
+                    reused = ls[j].worker + 1;
+                }
+
+                continue;
+            }
+
+            if (fresh++ == 0) {
+                first = ls[j].worker;
+
+            } else if (ls[j].worker != next) {
+                ordered = 0;
+            }
+
+            next = ls[j].worker + 1;
+        }
+
+        if (fresh && first < reused) {
+            ordered = 0;
+        }
+
+        for (j = 0; j < cycle->listening.nelts; j++) {
+            if (ngx_numa_same_group(&ls[i], &ls[j])) {
+                ls[j].ordered = ordered;
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                       "reuseport group %V ordered: %ui",
+                       &ls[i].addr_text, ordered);
+    }
+
+#endif
+}
+
+
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+
+static ngx_uint_t
+ngx_numa_same_group(ngx_listening_t *a, ngx_listening_t *b)
+{
+    return b->reuseport
+           && a->type == b->type
+           && ngx_cmp_sockaddr(a->sockaddr, a->socklen,
+                               b->sockaddr, b->socklen, 1)
+              == NGX_OK;
+}
+
+#endif
+
+
+void
+ngx_numa_init_worker(ngx_cycle_t *cycle, ngx_int_t worker)
+{
+    ngx_int_t         node;
+    unsigned long     mask;
+    ngx_cpuset_t     *cpu_affinity;
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+    ngx_uint_t        i;
+    ngx_core_conf_t  *ccf;
+    ngx_listening_t  *ls;
+#endif
+
+    if (worker < 0) {
+        return;
+    }
+
+    cpu_affinity = ngx_get_cpu_affinity(worker);
+
+    node = (ngx_numa_nodes > 1 && cpu_affinity)
+           ? ngx_numa_cpuset_node(cpu_affinity) : NGX_ERROR;
+
+    if (node != NGX_ERROR) {
+
+        /*
+         * memory of the worker, including pages copied on write
+         * from the master process, is preferably taken from its node
+         */
+
+        mask = 1UL << node;
+
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+                    NGX_NUMA_MAX_NODES + 1)
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "set_mempolicy(MPOL_PREFERRED, %i) failed", node);
+
+        } else {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "using memory of NUMA node %i", node);
+        }
+    }
+
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (!ls[i].reuseport
+            || ls[i].worker != (ngx_uint_t) worker
+            || ls[i].fd == (ngx_socket_t) -1)
+        {
+            continue;
+        }
+
+        if (ngx_numa_nodes
+            && ls[i].ordered
+            && ngx_numa_steer_reuseport(&ls[i], ccf->worker_processes,
+                                        cycle->log)
+               == NGX_OK)
+        {
+            continue;
+        }
+
+        /* a program attached by the previous workers is no longer valid */
+
+        if (ls[i].previous) {
+            ngx_numa_detach_reuseport(&ls[i], cycle->log);
+        }
+    }
+
+#endif
+}
+
+
+#if (NGX_HAVE_REUSEPORT && NGX_HAVE_REUSEPORT_CBPF)
+
+/*
+ * A group is only steered if it is ordered, that is, if the socket index
+ * is the worker number: a connection received on a cpu is passed to the
+ * worker bound to this cpu, or else to a worker bound to another cpu of
+ * the same node.  Connections received on other cpus are distributed
+ * by the kernel hash.
+ */
+
+#define ngx_numa_bpf(f, c, t, e, v)                                         \
+    (f)->code = c; (f)->jt = t; (f)->jf = e; (f)->k = v
+
+static ngx_int_t
+ngx_numa_steer_reuseport(ngx_listening_t *ls, ngx_uint_t workers,
+    ngx_log_t *log)
+{
+    ngx_uint_t           n, cpu, c, i, node;
+    ngx_cpuset_t        *cpu_affinity;
+    struct sock_fprog    prog;
+
+    static ngx_int_t           target[CPU_SETSIZE];
+    static u_char              own[CPU_SETSIZE];
+    static ngx_uint_t          next[NGX_NUMA_MAX_NODES + 1];
+    static struct sock_filter  code[2 * CPU_SETSIZE + 2];
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        target[cpu] = -1;
+        own[cpu] = 0;
+    }
+
+    for (n = 0; n < workers; n++) {
+        cpu_affinity = ngx_get_cpu_affinity(n);
+
+        if (cpu_affinity == NULL) {
+            continue;
+        }
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, cpu_affinity) && target[cpu] == -1) {
+                target[cpu] = n;
+                own[cpu] = 1;
+            }
+        }
+    }
+
+    ngx_memzero(next, sizeof(next));
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        node = ngx_numa_cpu_node[cpu];
+
+        if (target[cpu] != -1 || node == 0) {
+            continue;
+        }
+
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            c = (next[node] + i) % CPU_SETSIZE;
+
+            if (own[c] && ngx_numa_cpu_node[c] == node) {
+                target[cpu] = target[c];
+                next[node] = c + 1;
+                break;
+            }
+        }
+    }
+
+    n = 0;
+
+    ngx_numa_bpf(&code[n], BPF_LD|BPF_W|BPF_ABS, 0, 0,
+                 (uint32_t) (SKF_AD_OFF + SKF_AD_CPU));
+    n++;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+
+        if (target[cpu] == -1) {
+            continue;
+        }
+
+        ngx_numa_bpf(&code[n], BPF_JMP|BPF_JEQ|BPF_K, 0, 1, cpu);
+        n++;
+
+        ngx_numa_bpf(&code[n], BPF_RET|BPF_K, 0, 0, target[cpu]);
+        n++;
+    }
+
+    if (n == 1) {
+        return NGX_DECLINED;
+    }
+
+    /* an index out of the group falls back to hash */
+
+    ngx_numa_bpf(&code[n], BPF_RET|BPF_K, 0, 0, 0xffffffff);
+    n++;
+
+    prog.len = (unsigned short) n;
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   (const void *) &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "reuseport steering for %V: %ui instructions",
+                   &ls->addr_text, n);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_numa_detach_reuseport(ngx_listening_t *ls, ngx_log_t *log)
+{
+#ifdef SO_DETACH_REUSEPORT_BPF
+
+    int  unused;
+
+    unused = 0;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF,
+                   (const void *) &unused, sizeof(int))
+        == -1)
+    {
+        /* ENOENT: no program is attached */
+
+        if (ngx_socket_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                          "setsockopt(SO_DETACH_REUSEPORT_BPF) %V failed, "
+                          "ignored", &ls->addr_text);
+        }
+
+        return;
+    }
+
+#else
+
+    struct sock_filter  code[1];
+    struct sock_fprog   prog;
+
+    /* older kernels cannot detach, a program always using hash is set */
+
+    ngx_numa_bpf(&code[0], BPF_RET|BPF_K, 0, 0, 0xffffffff);
+
+    prog.len = 1;
+    prog.filter = code;
+
+    if (setsockopt(ls->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   (const void *) &prog, sizeof(struct sock_fprog))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_CBPF) %V failed, "
+                      "ignored", &ls->addr_text);
+        return;
+    }
+
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "reuseport steering for %V disabled", &ls->addr_text);
+}
+
+#endif
+
+#endif
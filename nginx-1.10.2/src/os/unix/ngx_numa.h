@@ -0,0 +1,27 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+#ifndef _NGX_NUMA_H_INCLUDED_
+#define _NGX_NUMA_H_INCLUDED_
+
+
+#if (NGX_HAVE_NUMA && NGX_HAVE_SCHED_SETAFFINITY)
+
+void ngx_numa_init(ngx_uint_t enable, ngx_log_t *log);
+void ngx_numa_interleave(void *addr, size_t size, ngx_log_t *log);
+void ngx_numa_order_reuseport(ngx_cycle_t *cycle);
+void ngx_numa_init_worker(ngx_cycle_t *cycle, ngx_int_t worker);
+
+#else
+
+#define ngx_numa_init(enable, log)
+#define ngx_numa_interleave(addr, size, log)
+#define ngx_numa_order_reuseport(cycle)
+#define ngx_numa_init_worker(cycle, worker)
+
+#endif
+
+
+#endif /* _NGX_NUMA_H_INCLUDED_ */
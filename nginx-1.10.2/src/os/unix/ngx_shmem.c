@@ -11,9 +11,26 @@
 
 #if (NGX_HAVE_MAP_ANON)
 
+#if (NGX_HAVE_MAP_HUGETLB)
+static ngx_int_t ngx_shm_alloc_huge(ngx_shm_t *shm);
+#endif
+
+
 ngx_int_t
 ngx_shm_alloc(ngx_shm_t *shm)
 {
+#if (NGX_HAVE_MAP_HUGETLB)
+
+    if (shm->huge) {
+        if (ngx_shm_alloc_huge(shm) == NGX_OK) {
+            return NGX_OK;
+        }
+
+        shm->huge = 0;
+    }
+
+#endif
+
     shm->addr = (u_char *) mmap(NULL, shm->size,
                                 PROT_READ|PROT_WRITE,
                                 MAP_ANON|MAP_SHARED, -1, 0);
@@ -28,12 +45,69 @@ ngx_shm_alloc(ngx_shm_t *shm)
 }
 
 
+#if (NGX_HAVE_MAP_HUGETLB)
+
+static ngx_int_t
+ngx_shm_alloc_huge(ngx_shm_t *shm)
+{
+    int         flags;
+    size_t      size;
+    ngx_uint_t  shift;
+
+    /* zones smaller than a huge page would waste most of it */
+
+    if (shm->size < shm->huge) {
+        return NGX_DECLINED;
+    }
+
+    for (shift = 0; ((size_t) 1 << shift) < shm->huge; shift++) {
+        /* void */
+    }
+
+    flags = MAP_ANON|MAP_SHARED|MAP_HUGETLB|(int) (shift << MAP_HUGE_SHIFT);
+
+    size = ngx_align(shm->size, shm->huge);
+
+    shm->addr = (u_char *) mmap(NULL, size, PROT_READ|PROT_WRITE, flags,
+                                -1, 0);
+
+    if (shm->addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_WARN, shm->log, ngx_errno,
+                      "mmap(MAP_HUGETLB, %uz) failed for zone \"%V\", "
+                      "using regular pages", size, &shm->name);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, shm->log, 0,
+                   "shm zone \"%V\" uses %uzK pages: %p",
+                   &shm->name, shm->huge / 1024, shm->addr);
+
+    return NGX_OK;
+}
+
+#endif
+
+
 void
 ngx_shm_free(ngx_shm_t *shm)
 {
-    if (munmap((void *) shm->addr, shm->size) == -1) {
+    size_t  size;
+
+    size = shm->size;
+
+#if (NGX_HAVE_MAP_HUGETLB)
+
+    /* huge page mappings are unmapped in whole pages */
+
+    if (shm->huge) {
+        size = ngx_align(size, shm->huge);
+    }
+
+#endif
+
+    if (munmap((void *) shm->addr, size) == -1) {
         ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno,
-                      "munmap(%p, %uz) failed", shm->addr, shm->size);
+                      "munmap(%p, %uz) failed", shm->addr, size);
     }
 }
 
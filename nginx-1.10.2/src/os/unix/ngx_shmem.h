@@ -19,6 +19,9 @@ typedef struct {
     ngx_str_t    name;
     ngx_log_t   *log;
     ngx_uint_t   exists;   /* unsigned  exists:1;  */
+#if (NGX_HAVE_MAP_HUGETLB)
+    size_t       huge;
+#endif
 } ngx_shm_t;
 
 
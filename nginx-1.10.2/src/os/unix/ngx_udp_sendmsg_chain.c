@@ -0,0 +1,180 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_UDP_SEND_BATCH  64
+
+
+#if (NGX_HAVE_SENDMMSG)
+static ssize_t ngx_sendmmsg(ngx_connection_t *c, struct mmsghdr *msgs,
+    ngx_uint_t count);
+#endif
+
+
+/*
+ * each buf in the chain is sent as a separate datagram,
+ * with sendmmsg() as many of them are sent in one syscall
+ */
+
+ngx_chain_t *
+ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
+{
+    off_t           send;
+    size_t          size;
+    ssize_t         n;
+    ngx_uint_t      i, count;
+    ngx_event_t    *wev;
+#if (NGX_HAVE_SENDMMSG)
+    ngx_chain_t    *cl;
+    struct iovec    iovs[NGX_UDP_SEND_BATCH];
+    struct mmsghdr  msgs[NGX_UDP_SEND_BATCH];
+#endif
+
+    wev = c->write;
+
+    if (!wev->ready) {
+        return in;
+    }
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_SIZE_T_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_SIZE_T_VALUE - ngx_pagesize;
+    }
+
+    send = 0;
+
+    for ( ;; ) {
+
+        /* skip the special bufs */
+
+        while (in && ngx_buf_special(in->buf)) {
+            in = in->next;
+        }
+
+        if (in == NULL || send >= limit) {
+            return in;
+        }
+
+#if (NGX_HAVE_SENDMMSG)
+
+        count = 0;
+
+        for (cl = in;
+             cl && count < NGX_UDP_SEND_BATCH && send < limit;
+             cl = cl->next)
+        {
+            if (ngx_buf_special(cl->buf)) {
+                continue;
+            }
+
+            size = cl->buf->last - cl->buf->pos;
+
+            iovs[count].iov_base = (void *) cl->buf->pos;
+            iovs[count].iov_len = size;
+
+            ngx_memzero(&msgs[count], sizeof(struct mmsghdr));
+
+            if (c->shared) {
+                msgs[count].msg_hdr.msg_name = c->sockaddr;
+                msgs[count].msg_hdr.msg_namelen = c->socklen;
+            }
+
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+
+            send += size;
+            count++;
+        }
+
+        n = ngx_sendmmsg(c, msgs, count);
+
+#else
+
+        size = in->buf->last - in->buf->pos;
+        count = 1;
+
+        send += size;
+
+        n = c->send(c, in->buf->pos, size);
+
+        if (n >= 0) {
+            n = 1;
+        }
+
+#endif
+
+        if (n == NGX_ERROR) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (n == NGX_AGAIN) {
+            return in;
+        }
+
+        for (i = 0; i < (ngx_uint_t) n; in = in->next) {
+
+            if (ngx_buf_special(in->buf)) {
+                continue;
+            }
+
+#if (NGX_HAVE_SENDMMSG)
+            c->sent += msgs[i].msg_len;
+#endif
+
+            in->buf->pos = in->buf->last;
+            i++;
+        }
+
+        if ((ngx_uint_t) n != count) {
+
+            /* the rest is sent by the next call, or fails there */
+
+            continue;
+        }
+    }
+}
+
+
+#if (NGX_HAVE_SENDMMSG)
+
+static ssize_t
+ngx_sendmmsg(ngx_connection_t *c, struct mmsghdr *msgs, ngx_uint_t count)
+{
+    ssize_t    n;
+    ngx_err_t  err;
+
+    for ( ;; ) {
+        n = sendmmsg(c->fd, msgs, count, 0);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "sendmmsg: fd:%d %z of %ui", c->fd, n, count);
+
+        if (n >= 0) {
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            c->write->ready = 0;
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, NGX_EAGAIN,
+                           "sendmmsg() not ready");
+            return NGX_AGAIN;
+        }
+
+        if (err != NGX_EINTR) {
+            c->write->error = 1;
+            (void) ngx_connection_error(c, err, "sendmmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+}
+
+#endif
@@ -20,6 +20,7 @@
 typedef struct ngx_stream_session_s  ngx_stream_session_t;
 
 
+#include <ngx_stream_variables.h>
 #include <ngx_stream_upstream.h>
 #include <ngx_stream_upstream_round_robin.h>
 
@@ -122,6 +123,11 @@ typedef struct {
     ngx_array_t             listen;      /* ngx_stream_listen_t */
     ngx_stream_access_pt    limit_conn_handler;
     ngx_stream_access_pt    access_handler;
+    ngx_stream_access_pt    preread_handler;
+    ngx_stream_access_pt    log_handler;
+
+    ngx_array_t             variables;   /* ngx_stream_variable_t */
+    ngx_hash_keys_arrays_t *variables_keys;
 } ngx_stream_core_main_conf_t;
 
 
@@ -135,27 +141,37 @@ typedef struct {
     ngx_int_t               line;
     ngx_log_t              *error_log;
     ngx_flag_t              tcp_nodelay;
+    size_t                  preread_buffer_size;
+    ngx_msec_t              preread_timeout;
 } ngx_stream_core_srv_conf_t;
 
 
 struct ngx_stream_session_s {
-    uint32_t                signature;         /* "STRM" */
+    uint32_t                       signature;         /* "STRM" */
 
-    ngx_connection_t       *connection;
+    ngx_connection_t              *connection;
 
-    off_t                   received;
+    off_t                          received;
+    time_t                         start_sec;
+    ngx_msec_t                     start_msec;
 
-    ngx_log_handler_pt      log_handler;
+    ngx_log_handler_pt             log_handler;
 
-    void                  **ctx;
-    void                  **main_conf;
-    void                  **srv_conf;
+    void                         **ctx;
+    void                         **main_conf;
+    void                         **srv_conf;
 
-    ngx_stream_upstream_t  *upstream;
+    ngx_stream_upstream_t         *upstream;
+    ngx_array_t                   *upstream_states;
+                                           /* of ngx_stream_upstream_state_t */
+    ngx_stream_variable_value_t   *variables;
+
+    ngx_uint_t                     status;
 };
 
 
 typedef struct {
+    ngx_int_t             (*preconfiguration)(ngx_conf_t *cf);
     ngx_int_t             (*postconfiguration)(ngx_conf_t *cf);
 
     void                 *(*create_main_conf)(ngx_conf_t *cf);
@@ -169,6 +185,13 @@ typedef struct {
 
 #define NGX_STREAM_MODULE       0x4d525453     /* "STRM" */
 
+#define NGX_STREAM_OK                        200
+#define NGX_STREAM_BAD_REQUEST               400
+#define NGX_STREAM_FORBIDDEN                 403
+#define NGX_STREAM_INTERNAL_SERVER_ERROR     500
+#define NGX_STREAM_BAD_GATEWAY               502
+#define NGX_STREAM_SERVICE_UNAVAILABLE       503
+
 #define NGX_STREAM_MAIN_CONF    0x02000000
 #define NGX_STREAM_SRV_CONF     0x04000000
 #define NGX_STREAM_UPS_CONF     0x08000000
@@ -201,6 +224,7 @@ typedef struct {
 
 
 void ngx_stream_init_connection(ngx_connection_t *c);
+void ngx_stream_finalize_session(ngx_stream_session_t *s, ngx_uint_t rc);
 void ngx_stream_close_connection(ngx_connection_t *c);
 
 
@@ -88,6 +88,7 @@ static ngx_command_t  ngx_stream_access_commands[] = {
 
 
 static ngx_stream_module_t  ngx_stream_access_module_ctx = {
+    NULL,                                  /* preconfiguration */
     ngx_stream_access_init,                /* postconfiguration */
 
     NULL,                                  /* create main configuration */
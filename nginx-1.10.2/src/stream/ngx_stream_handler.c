@@ -13,6 +13,7 @@
 
 static u_char *ngx_stream_log_error(ngx_log_t *log, u_char *buf, size_t len);
 static void ngx_stream_init_session(ngx_connection_t *c);
+static void ngx_stream_preread_handler(ngx_event_t *rev);
 
 #if (NGX_STREAM_SSL)
 static void ngx_stream_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c);
@@ -28,6 +29,7 @@ ngx_stream_init_connection(ngx_connection_t *c)
     size_t                        len;
     ngx_int_t                     rc;
     ngx_uint_t                    i;
+    ngx_time_t                   *tp;
     struct sockaddr              *sa;
     ngx_stream_port_t            *port;
     struct sockaddr_in           *sin;
@@ -131,6 +133,10 @@ ngx_stream_init_connection(ngx_connection_t *c)
     s->connection = c;
     c->data = s;
 
+    tp = ngx_timeofday();
+    s->start_sec = tp->sec;
+    s->start_msec = tp->msec;
+
     cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
 
     ngx_set_connection_log(c, cscf->error_log);
@@ -149,11 +155,24 @@ ngx_stream_init_connection(ngx_connection_t *c)
 
     cmcf = ngx_stream_get_module_main_conf(s, ngx_stream_core_module);
 
+    s->variables = ngx_pcalloc(c->pool, cmcf->variables.nelts
+                                        * sizeof(ngx_stream_variable_value_t));
+    if (s->variables == NULL) {
+        ngx_stream_close_connection(c);
+        return;
+    }
+
+    s->ctx = ngx_pcalloc(c->pool, sizeof(void *) * ngx_stream_max_module);
+    if (s->ctx == NULL) {
+        ngx_stream_close_connection(c);
+        return;
+    }
+
     if (cmcf->limit_conn_handler) {
         rc = cmcf->limit_conn_handler(s);
 
         if (rc != NGX_DECLINED) {
-            ngx_stream_close_connection(c);
+            ngx_stream_finalize_session(s, NGX_STREAM_SERVICE_UNAVAILABLE);
             return;
         }
     }
@@ -162,7 +181,7 @@ ngx_stream_init_connection(ngx_connection_t *c)
         rc = cmcf->access_handler(s);
 
         if (rc != NGX_OK && rc != NGX_DECLINED) {
-            ngx_stream_close_connection(c);
+            ngx_stream_finalize_session(s, NGX_STREAM_FORBIDDEN);
             return;
         }
     }
@@ -180,7 +199,7 @@ ngx_stream_init_connection(ngx_connection_t *c)
         {
             ngx_connection_error(c, ngx_socket_errno,
                                  "setsockopt(TCP_NODELAY) failed");
-            ngx_stream_close_connection(c);
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
@@ -201,7 +220,7 @@ ngx_stream_init_connection(ngx_connection_t *c)
             ngx_log_error(NGX_LOG_ERR, c->log, 0,
                           "no \"ssl_certificate\" is defined "
                           "in server listening on SSL port");
-            ngx_stream_close_connection(c);
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
@@ -218,20 +237,136 @@ ngx_stream_init_connection(ngx_connection_t *c)
 static void
 ngx_stream_init_session(ngx_connection_t *c)
 {
-    ngx_stream_session_t        *s;
-    ngx_stream_core_srv_conf_t  *cscf;
+    ngx_stream_session_t         *s;
+    ngx_stream_core_srv_conf_t   *cscf;
+    ngx_stream_core_main_conf_t  *cmcf;
 
     s = c->data;
+
+    cmcf = ngx_stream_get_module_main_conf(s, ngx_stream_core_module);
+
+    if (cmcf->preread_handler) {
+        c->log->action = "prereading client data";
+
+        c->read->handler = ngx_stream_preread_handler;
+        ngx_stream_preread_handler(c->read);
+        return;
+    }
+
     c->log->action = "handling client connection";
 
     cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
 
-    s->ctx = ngx_pcalloc(c->pool, sizeof(void *) * ngx_stream_max_module);
-    if (s->ctx == NULL) {
-        ngx_stream_close_connection(c);
+    cscf->handler(s);
+}
+
+
+static void
+ngx_stream_preread_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_stream_session_t         *s;
+    ngx_stream_core_srv_conf_t   *cscf;
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    c = rev->data;
+    s = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "stream preread handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    cmcf = ngx_stream_get_module_main_conf(s, ngx_stream_core_module);
+    cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
+
+    /*
+     * a datagram is already in c->buffer; a stream is read into a buffer
+     * allocated on the first request for data, until the handler has
+     * seen enough or the buffer is full
+     */
+
+    rc = cmcf->preread_handler(s);
+
+    while (rc == NGX_AGAIN && c->type == SOCK_STREAM) {
+
+        if (c->buffer == NULL) {
+            c->buffer = ngx_create_temp_buf(c->pool,
+                                            cscf->preread_buffer_size);
+            if (c->buffer == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+        }
+
+        if (c->buffer->last == c->buffer->end) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0, "preread buffer full");
+            rc = NGX_STREAM_BAD_REQUEST;
+            break;
+        }
+
+        if (!rev->ready) {
+            break;
+        }
+
+        n = c->recv(c, c->buffer->last, c->buffer->end - c->buffer->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            rc = NGX_STREAM_BAD_REQUEST;
+            break;
+        }
+
+        if (n == 0) {
+            rc = NGX_STREAM_OK;
+            break;
+        }
+
+        c->buffer->last += n;
+        s->received += n;
+
+        rc = cmcf->preread_handler(s);
+    }
+
+    if (rc == NGX_AGAIN && c->type == SOCK_STREAM) {
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        if (!rev->timer_set) {
+            ngx_add_timer(rev, cscf->preread_timeout);
+        }
+
+        return;
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
+    if (rc != NGX_OK && rc != NGX_DECLINED && rc != NGX_AGAIN) {
+        ngx_stream_finalize_session(s, rc);
+        return;
+    }
+
+    c->log->action = "handling client connection";
+
     cscf->handler(s);
 }
 
@@ -244,15 +379,15 @@ ngx_stream_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c)
     ngx_stream_session_t   *s;
     ngx_stream_ssl_conf_t  *sslcf;
 
+    s = c->data;
+
     if (ngx_ssl_create_connection(ssl, c, 0) == NGX_ERROR) {
-        ngx_stream_close_connection(c);
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
     if (ngx_ssl_handshake(c) == NGX_AGAIN) {
 
-        s = c->data;
-
         sslcf = ngx_stream_get_module_srv_conf(s, ngx_stream_ssl_module);
 
         ngx_add_timer(c->read, sslcf->handshake_timeout);
@@ -269,8 +404,12 @@ ngx_stream_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c)
 static void
 ngx_stream_ssl_handshake_handler(ngx_connection_t *c)
 {
+    ngx_stream_session_t  *s;
+
+    s = c->data;
+
     if (!c->ssl->handshaked) {
-        ngx_stream_close_connection(c);
+        ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
         return;
     }
 
@@ -284,6 +423,28 @@ ngx_stream_ssl_handshake_handler(ngx_connection_t *c)
 #endif
 
 
+void
+ngx_stream_finalize_session(ngx_stream_session_t *s, ngx_uint_t rc)
+{
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "finalize stream session: %ui", rc);
+
+    s->status = rc;
+
+    cmcf = ngx_stream_get_module_main_conf(s, ngx_stream_core_module);
+
+    if (cmcf->log_handler) {
+        s->connection->log->action = "logging session";
+
+        (void) cmcf->log_handler(s);
+    }
+
+    ngx_stream_close_connection(s->connection);
+}
+
+
 void
 ngx_stream_close_connection(ngx_connection_t *c)
 {
@@ -0,0 +1,1796 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <nginx.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
+
+/*
+ * Formats which use only the values below are not formatted when a session
+ * ends: a fixed-size record is copied to the buffer instead, and it is
+ * formatted when the buffer is flushed, in a thread pool if configured.
+ */
+
+typedef struct {
+    union {
+        struct in_addr              addr;
+#if (NGX_HAVE_INET6)
+        struct in6_addr             addr6;
+#endif
+        ngx_str_t                  *text;       /* AF_UNIX */
+    } u;
+
+    in_port_t                       port;
+    u_short                         family;
+} ngx_stream_log_addr_t;
+
+
+typedef struct {
+    ngx_stream_session_t           *session;    /* NULL in the buffer */
+
+    time_t                          sec;
+    ngx_msec_t                      msec;
+    ngx_msec_t                      session_time;
+
+    off_t                           bytes_sent;
+    off_t                           bytes_received;
+
+    ngx_atomic_uint_t               connection;
+    ngx_uint_t                      status;
+    ngx_uint_t                      type;
+
+    ngx_stream_log_addr_t           remote;
+    ngx_stream_log_addr_t           server;
+
+    ngx_uint_t                      nupstreams;
+    ngx_stream_upstream_state_t     upstream;
+} ngx_stream_log_record_t;
+
+
+typedef struct ngx_stream_log_op_s  ngx_stream_log_op_t;
+
+typedef u_char *(*ngx_stream_log_op_run_pt) (ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+
+typedef size_t (*ngx_stream_log_op_getlen_pt) (ngx_stream_log_record_t *rec,
+    uintptr_t data);
+
+
+struct ngx_stream_log_op_s {
+    size_t                          len;
+    ngx_stream_log_op_getlen_pt     getlen;
+    ngx_stream_log_op_run_pt        run;
+    uintptr_t                       data;
+};
+
+
+typedef struct {
+    ngx_str_t                       name;
+    ngx_array_t                    *ops;       /* of ngx_stream_log_op_t */
+
+    unsigned                        deferred:1;
+    unsigned                        server:1;
+} ngx_stream_log_fmt_t;
+
+
+typedef struct {
+    ngx_array_t                     formats;   /* of ngx_stream_log_fmt_t */
+} ngx_stream_log_main_conf_t;
+
+
+/*
+ * the buffer holds entries aligned to NGX_ALIGNMENT: a record
+ * of the entry format, or a line of len bytes if the format is NULL
+ */
+
+typedef struct {
+    ngx_stream_log_fmt_t           *format;
+    size_t                          len;
+} ngx_stream_log_entry_t;
+
+
+typedef struct {
+    ngx_fd_t                        fd;
+    u_char                         *name;
+
+    u_char                         *start;
+    u_char                         *end;
+
+    u_char                         *out;
+    size_t                          size;
+} ngx_stream_log_flush_ctx_t;
+
+
+typedef struct {
+    u_char                         *start;
+    u_char                         *pos;
+    u_char                         *last;
+
+    u_char                         *out;
+
+    ngx_event_t                    *event;
+    ngx_msec_t                      flush;
+
+#if (NGX_THREADS)
+    u_char                         *spare;
+    ngx_thread_pool_t              *thread_pool;
+    ngx_thread_task_t              *task;
+#endif
+} ngx_stream_log_buf_t;
+
+
+typedef struct {
+    ngx_open_file_t                *file;
+    time_t                          error_log_time;
+    ngx_stream_log_fmt_t           *format;
+} ngx_stream_log_t;
+
+
+typedef struct {
+    ngx_array_t                    *logs;      /* of ngx_stream_log_t */
+
+    ngx_uint_t                      off;        /* unsigned  off:1 */
+} ngx_stream_log_srv_conf_t;
+
+
+typedef struct {
+    ngx_str_t                       name;
+    size_t                          len;
+    ngx_stream_log_op_getlen_pt     getlen;
+    ngx_stream_log_op_run_pt        run;
+    uintptr_t                       data;
+} ngx_stream_log_var_t;
+
+
+static ngx_int_t ngx_stream_log_handler(ngx_stream_session_t *s);
+static void ngx_stream_log_init_record(ngx_stream_session_t *s,
+    ngx_stream_log_record_t *rec);
+static void ngx_stream_log_set_addr(ngx_stream_log_addr_t *addr,
+    struct sockaddr *sa, ngx_str_t *text);
+static size_t ngx_stream_log_line_len(ngx_stream_log_fmt_t *fmt,
+    ngx_stream_log_record_t *rec);
+static u_char *ngx_stream_log_format_line(ngx_stream_log_fmt_t *fmt,
+    ngx_stream_log_record_t *rec, u_char *buf);
+static void ngx_stream_log_write(ngx_stream_session_t *s, ngx_stream_log_t *log,
+    u_char *buf, size_t len);
+
+static void ngx_stream_log_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_stream_log_post_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_stream_log_flush_handler(ngx_event_t *ev);
+static void ngx_stream_log_write_entries(ngx_stream_log_flush_ctx_t *ctx,
+    ngx_log_t *log);
+static void ngx_stream_log_write_fd(ngx_stream_log_flush_ctx_t *ctx,
+    u_char *buf, size_t len, ngx_log_t *log);
+#if (NGX_THREADS)
+static void ngx_stream_log_thread_handler(void *data, ngx_log_t *log);
+static void ngx_stream_log_thread_event_handler(ngx_event_t *ev);
+#endif
+
+static u_char *ngx_stream_log_time(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_iso8601(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_msec(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_session_time(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_status(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_bytes(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_connection(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_protocol(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_addr(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_port(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_pid(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op);
+static size_t ngx_stream_log_hostname_getlen(ngx_stream_log_record_t *rec,
+    uintptr_t data);
+static u_char *ngx_stream_log_hostname(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static size_t ngx_stream_log_upstream_getlen(ngx_stream_log_record_t *rec,
+    uintptr_t data);
+static u_char *ngx_stream_log_upstream(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+
+static u_char *ngx_stream_log_copy_short(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static u_char *ngx_stream_log_copy_long(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+
+static ngx_int_t ngx_stream_log_variable_compile(ngx_conf_t *cf,
+    ngx_stream_log_op_t *op, ngx_str_t *value);
+static size_t ngx_stream_log_variable_getlen(ngx_stream_log_record_t *rec,
+    uintptr_t data);
+static u_char *ngx_stream_log_variable(ngx_stream_log_record_t *rec,
+    u_char *buf, ngx_stream_log_op_t *op);
+static uintptr_t ngx_stream_log_escape(u_char *dst, u_char *src, size_t size);
+
+
+static void *ngx_stream_log_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_log_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_log_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_stream_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_stream_log_compile_format(ngx_conf_t *cf,
+    ngx_stream_log_fmt_t *fmt, ngx_array_t *args, ngx_uint_t s);
+static ngx_int_t ngx_stream_log_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_stream_log_commands[] = {
+
+    { ngx_string("log_format"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_stream_log_set_format,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("access_log"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
+      ngx_stream_log_set_log,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_log_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_log_init,                   /* postconfiguration */
+
+    ngx_stream_log_create_main_conf,       /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_log_create_srv_conf,        /* create server configuration */
+    ngx_stream_log_merge_srv_conf          /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_log_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_log_module_ctx,            /* module context */
+    ngx_stream_log_commands,               /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static char  *ngx_stream_log_months[] = { "Jan", "Feb", "Mar", "Apr", "May",
+                                          "Jun", "Jul", "Aug", "Sep", "Oct",
+                                          "Nov", "Dec" };
+
+static ngx_str_t  ngx_stream_log_unix = ngx_string("unix:");
+
+
+static ngx_stream_log_var_t  ngx_stream_log_vars[] = {
+    { ngx_string("time_local"), sizeof("28/Sep/1970:12:00:00 +0600") - 1,
+                          NULL, ngx_stream_log_time, 0 },
+    { ngx_string("time_iso8601"), sizeof("1970-09-28T12:00:00+06:00") - 1,
+                          NULL, ngx_stream_log_iso8601, 0 },
+    { ngx_string("msec"), NGX_TIME_T_LEN + 4, NULL, ngx_stream_log_msec, 0 },
+    { ngx_string("session_time"), NGX_TIME_T_LEN + 4,
+                          NULL, ngx_stream_log_session_time, 0 },
+    { ngx_string("status"), NGX_INT_T_LEN, NULL, ngx_stream_log_status, 0 },
+    { ngx_string("bytes_sent"), NGX_OFF_T_LEN,
+                          NULL, ngx_stream_log_bytes, 0 },
+    { ngx_string("bytes_received"), NGX_OFF_T_LEN,
+                          NULL, ngx_stream_log_bytes, 1 },
+    { ngx_string("connection"), NGX_ATOMIC_T_LEN,
+                          NULL, ngx_stream_log_connection, 0 },
+    { ngx_string("protocol"), sizeof("TCP") - 1,
+                          NULL, ngx_stream_log_protocol, 0 },
+    { ngx_string("remote_addr"), NGX_SOCKADDR_STRLEN,
+                          NULL, ngx_stream_log_addr, 0 },
+    { ngx_string("remote_port"), sizeof("65535") - 1,
+                          NULL, ngx_stream_log_port, 0 },
+    { ngx_string("server_addr"), NGX_SOCKADDR_STRLEN,
+                          NULL, ngx_stream_log_addr, 1 },
+    { ngx_string("server_port"), sizeof("65535") - 1,
+                          NULL, ngx_stream_log_port, 1 },
+    { ngx_string("pid"), NGX_INT64_LEN, NULL, ngx_stream_log_pid, 0 },
+    { ngx_string("hostname"), 0, ngx_stream_log_hostname_getlen,
+                          ngx_stream_log_hostname, 0 },
+    { ngx_string("upstream_addr"), 0, ngx_stream_log_upstream_getlen,
+                          ngx_stream_log_upstream, 0 },
+    { ngx_string("upstream_connect_time"), 0, ngx_stream_log_upstream_getlen,
+                          ngx_stream_log_upstream, 1 },
+    { ngx_string("upstream_bytes_sent"), 0, ngx_stream_log_upstream_getlen,
+                          ngx_stream_log_upstream, 2 },
+    { ngx_string("upstream_bytes_received"), 0,
+                          ngx_stream_log_upstream_getlen,
+                          ngx_stream_log_upstream, 3 },
+
+    { ngx_null_string, 0, NULL, NULL, 0 }
+};
+
+
+static ngx_int_t
+ngx_stream_log_handler(ngx_stream_session_t *s)
+{
+    u_char                     *line, *p;
+    size_t                      len, size;
+    ngx_uint_t                  l, server;
+    ngx_stream_log_t           *log;
+    ngx_stream_log_fmt_t       *fmt;
+    ngx_stream_log_buf_t       *buffer;
+    ngx_stream_log_entry_t     *entry;
+    ngx_stream_log_record_t     rec, *r;
+    ngx_stream_log_srv_conf_t  *lscf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "stream log handler");
+
+    lscf = ngx_stream_get_module_srv_conf(s, ngx_stream_log_module);
+
+    if (lscf->off || lscf->logs == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_stream_log_init_record(s, &rec);
+
+    server = 0;
+
+    log = lscf->logs->elts;
+    for (l = 0; l < lscf->logs->nelts; l++) {
+
+        fmt = log[l].format;
+
+        if (fmt->server && !server) {
+            if (ngx_connection_local_sockaddr(s->connection, NULL, 0)
+                == NGX_OK)
+            {
+                ngx_stream_log_set_addr(&rec.server,
+                                        s->connection->local_sockaddr,
+                                        &s->connection->listening->addr_text);
+            }
+
+            server = 1;
+        }
+
+        buffer = log[l].file->data;
+
+        if (buffer && fmt->deferred && rec.nupstreams <= 1) {
+
+            size = sizeof(ngx_stream_log_entry_t)
+                   + sizeof(ngx_stream_log_record_t);
+
+            if (size > (size_t) (buffer->last - buffer->pos)) {
+                ngx_stream_log_post_flush(log[l].file, s->connection->log);
+            }
+
+            if (buffer->event && buffer->pos == buffer->start) {
+                ngx_add_timer(buffer->event, buffer->flush);
+            }
+
+            entry = (ngx_stream_log_entry_t *) buffer->pos;
+            entry->format = fmt;
+            entry->len = 0;
+
+            r = (ngx_stream_log_record_t *) (entry + 1);
+            *r = rec;
+            r->session = NULL;
+
+            buffer->pos += size;
+
+            continue;
+        }
+
+        len = ngx_stream_log_line_len(fmt, &rec) + NGX_LINEFEED_SIZE;
+
+        if (buffer) {
+
+            size = sizeof(ngx_stream_log_entry_t)
+                   + ngx_align(len, NGX_ALIGNMENT);
+
+            if (size > (size_t) (buffer->last - buffer->pos)) {
+                ngx_stream_log_post_flush(log[l].file, s->connection->log);
+            }
+
+            if (size <= (size_t) (buffer->last - buffer->pos)) {
+
+                if (buffer->event && buffer->pos == buffer->start) {
+                    ngx_add_timer(buffer->event, buffer->flush);
+                }
+
+                entry = (ngx_stream_log_entry_t *) buffer->pos;
+                entry->format = NULL;
+
+                line = (u_char *) (entry + 1);
+
+                p = ngx_stream_log_format_line(fmt, &rec, line);
+
+                ngx_linefeed(p);
+
+                entry->len = p - line;
+
+                buffer->pos = line + ngx_align(entry->len, NGX_ALIGNMENT);
+
+                continue;
+            }
+        }
+
+        line = ngx_pnalloc(s->connection->pool, len);
+        if (line == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_stream_log_format_line(fmt, &rec, line);
+
+        ngx_linefeed(p);
+
+        ngx_stream_log_write(s, &log[l], line, p - line);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_log_init_record(ngx_stream_session_t *s,
+    ngx_stream_log_record_t *rec)
+{
+    ngx_time_t                   *tp;
+    ngx_msec_int_t                ms;
+    ngx_connection_t             *c;
+    ngx_stream_upstream_state_t  *state;
+
+    c = s->connection;
+
+    tp = ngx_timeofday();
+
+    rec->session = s;
+
+    rec->sec = tp->sec;
+    rec->msec = tp->msec;
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - s->start_sec) * 1000 + (tp->msec - s->start_msec));
+    rec->session_time = ngx_max(ms, 0);
+
+    rec->bytes_sent = c->sent;
+    rec->bytes_received = s->received;
+
+    rec->connection = c->number;
+    rec->status = s->status;
+    rec->type = c->type;
+
+    ngx_stream_log_set_addr(&rec->remote, c->sockaddr, &ngx_stream_log_unix);
+
+    rec->server.family = 0;
+
+    if (s->upstream_states == NULL) {
+        rec->nupstreams = 0;
+        return;
+    }
+
+    rec->nupstreams = s->upstream_states->nelts;
+
+    if (rec->nupstreams == 1) {
+        state = s->upstream_states->elts;
+        rec->upstream = state[0];
+    }
+}
+
+
+static void
+ngx_stream_log_set_addr(ngx_stream_log_addr_t *addr, struct sockaddr *sa,
+    ngx_str_t *text)
+{
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
+
+    switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) sa;
+        addr->u.addr6 = sin6->sin6_addr;
+        addr->port = ntohs(sin6->sin6_port);
+        break;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        addr->u.text = text;
+        addr->port = 0;
+        break;
+#endif
+
+    default: /* AF_INET */
+        sin = (struct sockaddr_in *) sa;
+        addr->u.addr = sin->sin_addr;
+        addr->port = ntohs(sin->sin_port);
+        break;
+    }
+
+    addr->family = sa->sa_family;
+}
+
+
+static size_t
+ngx_stream_log_line_len(ngx_stream_log_fmt_t *fmt,
+    ngx_stream_log_record_t *rec)
+{
+    size_t                len;
+    ngx_uint_t            i;
+    ngx_stream_log_op_t  *op;
+
+    len = 0;
+
+    op = fmt->ops->elts;
+    for (i = 0; i < fmt->ops->nelts; i++) {
+        if (op[i].len == 0) {
+            len += op[i].getlen(rec, op[i].data);
+
+        } else {
+            len += op[i].len;
+        }
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_stream_log_format_line(ngx_stream_log_fmt_t *fmt,
+    ngx_stream_log_record_t *rec, u_char *buf)
+{
+    ngx_uint_t            i;
+    ngx_stream_log_op_t  *op;
+
+    op = fmt->ops->elts;
+    for (i = 0; i < fmt->ops->nelts; i++) {
+        buf = op[i].run(rec, buf, &op[i]);
+    }
+
+    return buf;
+}
+
+
+static void
+ngx_stream_log_write(ngx_stream_session_t *s, ngx_stream_log_t *log,
+    u_char *buf, size_t len)
+{
+    time_t     now;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    n = ngx_write_fd(log->file->fd, buf, len);
+
+    if (n == (ssize_t) len) {
+        return;
+    }
+
+    now = ngx_time();
+
+    if (now - log->error_log_time < 60) {
+        return;
+    }
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        ngx_log_error(NGX_LOG_ALERT, s->connection->log, err,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      log->file->name.data);
+
+    } else {
+        ngx_log_error(NGX_LOG_ALERT, s->connection->log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      log->file->name.data, n, len);
+    }
+
+    log->error_log_time = now;
+}
+
+
+static void
+ngx_stream_log_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_stream_log_buf_t        *buffer;
+    ngx_stream_log_flush_ctx_t   ctx;
+
+    buffer = file->data;
+
+    if (buffer->pos != buffer->start) {
+        ctx.fd = file->fd;
+        ctx.name = file->name.data;
+        ctx.start = buffer->start;
+        ctx.end = buffer->pos;
+        ctx.out = buffer->out;
+        ctx.size = buffer->last - buffer->start;
+
+        ngx_stream_log_write_entries(&ctx, log);
+
+        buffer->pos = buffer->start;
+    }
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+
+static void
+ngx_stream_log_post_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+#if (NGX_THREADS)
+    u_char                      *p;
+    ngx_fd_t                     fd;
+    ngx_thread_task_t           *task;
+    ngx_stream_log_buf_t        *buffer;
+    ngx_stream_log_flush_ctx_t  *ctx;
+
+    buffer = file->data;
+    task = buffer->task;
+
+    if (task == NULL || task->event.active || buffer->pos == buffer->start) {
+        goto sync;
+    }
+
+    /*
+     * the task writes to a duplicate descriptor,
+     * so the file may be reopened meanwhile
+     */
+
+    fd = dup(file->fd);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "dup() failed");
+        goto sync;
+    }
+
+    ctx = task->ctx;
+
+    ctx->fd = fd;
+    ctx->start = buffer->start;
+    ctx->end = buffer->pos;
+
+    if (ngx_thread_task_post(buffer->thread_pool, task) != NGX_OK) {
+        (void) ngx_close_file(fd);
+        goto sync;
+    }
+
+    p = buffer->start;
+
+    buffer->start = buffer->spare;
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + (buffer->last - p);
+
+    buffer->spare = p;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    return;
+
+sync:
+
+#endif
+
+    ngx_stream_log_flush(file, log);
+}
+
+
+static void
+ngx_stream_log_flush_handler(ngx_event_t *ev)
+{
+    ngx_open_file_t       *file;
+    ngx_stream_log_buf_t  *buffer;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "stream log buffer flush handler");
+
+    if (ev->timedout) {
+        ngx_stream_log_post_flush(ev->data, ev->log);
+        return;
+    }
+
+    /* cancel the flush timer for graceful shutdown */
+
+    file = ev->data;
+    buffer = file->data;
+
+    buffer->event = NULL;
+}
+
+
+static void
+ngx_stream_log_write_entries(ngx_stream_log_flush_ctx_t *ctx, ngx_log_t *log)
+{
+    u_char                   *p, *o, *line, *last;
+    size_t                    len;
+    ngx_stream_log_entry_t   *entry;
+    ngx_stream_log_record_t  *rec;
+
+    o = ctx->out;
+
+    for (p = ctx->start; p < ctx->end; /* void */) {
+
+        entry = (ngx_stream_log_entry_t *) p;
+        p += sizeof(ngx_stream_log_entry_t);
+
+        if (entry->format == NULL) {
+            len = entry->len;
+            line = p;
+
+            p += ngx_align(len, NGX_ALIGNMENT);
+
+            if (len > (size_t) (ctx->out + ctx->size - o)) {
+                ngx_stream_log_write_fd(ctx, ctx->out, o - ctx->out, log);
+                o = ctx->out;
+            }
+
+            if (len > ctx->size) {
+                ngx_stream_log_write_fd(ctx, line, len, log);
+                continue;
+            }
+
+            o = ngx_cpymem(o, line, len);
+
+            continue;
+        }
+
+        rec = (ngx_stream_log_record_t *) p;
+        p += sizeof(ngx_stream_log_record_t);
+
+        len = ngx_stream_log_line_len(entry->format, rec) + NGX_LINEFEED_SIZE;
+
+        if (len > (size_t) (ctx->out + ctx->size - o)) {
+            ngx_stream_log_write_fd(ctx, ctx->out, o - ctx->out, log);
+            o = ctx->out;
+        }
+
+        if (len > ctx->size) {
+            line = ngx_alloc(len, log);
+            if (line == NULL) {
+                continue;
+            }
+
+            last = ngx_stream_log_format_line(entry->format, rec, line);
+
+            ngx_linefeed(last);
+
+            ngx_stream_log_write_fd(ctx, line, last - line, log);
+
+            ngx_free(line);
+
+            continue;
+        }
+
+        o = ngx_stream_log_format_line(entry->format, rec, o);
+
+        ngx_linefeed(o);
+    }
+
+    if (o != ctx->out) {
+        ngx_stream_log_write_fd(ctx, ctx->out, o - ctx->out, log);
+    }
+}
+
+
+static void
+ngx_stream_log_write_fd(ngx_stream_log_flush_ctx_t *ctx, u_char *buf,
+    size_t len, ngx_log_t *log)
+{
+    ssize_t  n;
+
+    if (len == 0) {
+        return;
+    }
+
+    n = ngx_write_fd(ctx->fd, buf, len);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed", ctx->name);
+
+    } else if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      ctx->name, n, len);
+    }
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_stream_log_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_stream_log_flush_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "stream log thread: %uz bytes", ctx->end - ctx->start);
+
+    ngx_stream_log_write_entries(ctx, log);
+
+    if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->name);
+    }
+}
+
+
+static void
+ngx_stream_log_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "stream log thread done");
+}
+
+#endif
+
+
+static u_char *
+ngx_stream_log_time(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_tm_t     tm;
+    ngx_int_t    gmtoff;
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+    gmtoff = tp->gmtoff;
+
+    ngx_gmtime(rec->sec + gmtoff * 60, &tm);
+
+    return ngx_sprintf(buf, "%02d/%s/%d:%02d:%02d:%02d %c%02i%02i",
+                       tm.ngx_tm_mday, ngx_stream_log_months[tm.ngx_tm_mon - 1],
+                       tm.ngx_tm_year, tm.ngx_tm_hour,
+                       tm.ngx_tm_min, tm.ngx_tm_sec,
+                       gmtoff < 0 ? '-' : '+',
+                       ngx_abs(gmtoff / 60), ngx_abs(gmtoff % 60));
+}
+
+
+static u_char *
+ngx_stream_log_iso8601(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_tm_t     tm;
+    ngx_int_t    gmtoff;
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+    gmtoff = tp->gmtoff;
+
+    ngx_gmtime(rec->sec + gmtoff * 60, &tm);
+
+    return ngx_sprintf(buf, "%4d-%02d-%02dT%02d:%02d:%02d%c%02i:%02i",
+                       tm.ngx_tm_year, tm.ngx_tm_mon,
+                       tm.ngx_tm_mday, tm.ngx_tm_hour,
+                       tm.ngx_tm_min, tm.ngx_tm_sec,
+                       gmtoff < 0 ? '-' : '+',
+                       ngx_abs(gmtoff / 60), ngx_abs(gmtoff % 60));
+}
+
+
+static u_char *
+ngx_stream_log_msec(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%T.%03M", rec->sec, rec->msec);
+}
+
+
+static u_char *
+ngx_stream_log_session_time(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%T.%03M", (time_t) rec->session_time / 1000,
+                       rec->session_time % 1000);
+}
+
+
+static u_char *
+ngx_stream_log_status(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%03ui", rec->status);
+}
+
+
+static u_char *
+ngx_stream_log_bytes(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", op->data ? rec->bytes_received
+                                           : rec->bytes_sent);
+}
+
+
+static u_char *
+ngx_stream_log_connection(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%uA", rec->connection);
+}
+
+
+static u_char *
+ngx_stream_log_protocol(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_cpymem(buf, rec->type == SOCK_DGRAM ? "UDP" : "TCP",
+                      sizeof("TCP") - 1);
+}
+
+
+static u_char *
+ngx_stream_log_addr(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_stream_log_addr_t  *addr;
+
+    addr = op->data ? &rec->server : &rec->remote;
+
+    switch (addr->family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        return buf + ngx_inet_ntop(AF_INET6, &addr->u.addr6, buf,
+                                   NGX_INET6_ADDRSTRLEN);
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        return ngx_cpymem(buf, addr->u.text->data, addr->u.text->len);
+#endif
+
+    case AF_INET:
+        return buf + ngx_inet_ntop(AF_INET, &addr->u.addr, buf,
+                                   NGX_INET_ADDRSTRLEN);
+
+    default:
+        *buf = '-';
+        return buf + 1;
+    }
+}
+
+
+static u_char *
+ngx_stream_log_port(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_stream_log_addr_t  *addr;
+
+    addr = op->data ? &rec->server : &rec->remote;
+
+    if (addr->family == 0) {
+        *buf = '-';
+        return buf + 1;
+    }
+
+    if (addr->port == 0) {
+        return buf;
+    }
+
+    return ngx_sprintf(buf, "%ui", (ngx_uint_t) addr->port);
+}
+
+
+static u_char *
+ngx_stream_log_pid(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%P", ngx_pid);
+}
+
+
+static size_t
+ngx_stream_log_hostname_getlen(ngx_stream_log_record_t *rec, uintptr_t data)
+{
+    return ngx_cycle->hostname.len;
+}
+
+
+static u_char *
+ngx_stream_log_hostname(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cycle->hostname.data, ngx_cycle->hostname.len);
+}
+
+
+/*
+ * a record keeps the state of a single upstream, sessions with more
+ * states are formatted at once, so the session is still available
+ */
+
+static size_t
+ngx_stream_log_upstream_getlen(ngx_stream_log_record_t *rec, uintptr_t data)
+{
+    size_t                        len;
+    ngx_uint_t                    i;
+    ngx_stream_upstream_state_t  *state;
+
+    if (rec->nupstreams == 0) {
+        return 1;
+    }
+
+    state = (rec->nupstreams == 1) ? &rec->upstream
+                                   : rec->session->upstream_states->elts;
+
+    if (data != 0) {
+        return rec->nupstreams * (NGX_OFF_T_LEN + 2);
+    }
+
+    len = 0;
+
+    for (i = 0; i < rec->nupstreams; i++) {
+        if (state[i].peer) {
+            len += state[i].peer->len;
+        }
+
+        len += 2;
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_stream_log_upstream(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_uint_t                    i;
+    ngx_msec_int_t                ms;
+    ngx_stream_upstream_state_t  *state;
+
+    if (rec->nupstreams == 0) {
+        *buf = '-';
+        return buf + 1;
+    }
+
+    state = (rec->nupstreams == 1) ? &rec->upstream
+                                   : rec->session->upstream_states->elts;
+
+    for (i = 0; i < rec->nupstreams; i++) {
+
+        if (i) {
+            *buf++ = ',';
+            *buf++ = ' ';
+        }
+
+        switch (op->data) {
+
+        case 0: /* $upstream_addr */
+            if (state[i].peer) {
+                buf = ngx_cpymem(buf, state[i].peer->data, state[i].peer->len);
+            }
+
+            break;
+
+        case 1: /* $upstream_connect_time */
+            if (state[i].connect_time == (ngx_msec_t) -1) {
+                *buf++ = '-';
+                break;
+            }
+
+            ms = state[i].connect_time;
+            buf = ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+            break;
+
+        case 2: /* $upstream_bytes_sent */
+            buf = ngx_sprintf(buf, "%O", state[i].bytes_sent);
+            break;
+
+        default: /* $upstream_bytes_received */
+            buf = ngx_sprintf(buf, "%O", state[i].bytes_received);
+            break;
+        }
+    }
+
+    return buf;
+}
+
+
+static u_char *
+ngx_stream_log_copy_short(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    size_t     len;
+    uintptr_t  data;
+
+    len = op->len;
+    data = op->data;
+
+    while (len--) {
+        *buf++ = (u_char) (data & 0xff);
+        data >>= 8;
+    }
+
+    return buf;
+}
+
+
+static u_char *
+ngx_stream_log_copy_long(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static ngx_int_t
+ngx_stream_log_variable_compile(ngx_conf_t *cf, ngx_stream_log_op_t *op,
+    ngx_str_t *value)
+{
+    ngx_int_t  index;
+
+    index = ngx_stream_get_variable_index(cf, value);
+    if (index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    op->len = 0;
+    op->getlen = ngx_stream_log_variable_getlen;
+    op->run = ngx_stream_log_variable;
+    op->data = index;
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_stream_log_variable_getlen(ngx_stream_log_record_t *rec, uintptr_t data)
+{
+    uintptr_t                     len;
+    ngx_stream_variable_value_t  *value;
+
+    value = ngx_stream_get_flushed_variable(rec->session, data);
+
+    if (value == NULL || value->not_found) {
+        return 1;
+    }
+
+    len = ngx_stream_log_escape(NULL, value->data, value->len);
+
+    value->escape = len ? 1 : 0;
+
+    return value->len + len * 3;
+}
+
+
+static u_char *
+ngx_stream_log_variable(ngx_stream_log_record_t *rec, u_char *buf,
+    ngx_stream_log_op_t *op)
+{
+    ngx_stream_variable_value_t  *value;
+
+    value = ngx_stream_get_indexed_variable(rec->session, op->data);
+
+    if (value == NULL || value->not_found) {
+        *buf = '-';
+        return buf + 1;
+    }
+
+    if (value->escape == 0) {
+        return ngx_cpymem(buf, value->data, value->len);
+
+    } else {
+        return (u_char *) ngx_stream_log_escape(buf, value->data, value->len);
+    }
+}
+
+
+static uintptr_t
+ngx_stream_log_escape(u_char *dst, u_char *src, size_t size)
+{
+    ngx_uint_t      n;
+    static u_char   hex[] = "0123456789ABCDEF";
+
+    static uint32_t   escape[] = {
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+
+                    /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
+        0x00000004, /* 0000 0000 0000 0000  0000 0000 0000 0100 */
+
+                    /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
+        0x10000000, /* 0001 0000 0000 0000  0000 0000 0000 0000 */
+
+                    /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
+        0x80000000, /* 1000 0000 0000 0000  0000 0000 0000 0000 */
+
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+        0xffffffff, /* 1111 1111 1111 1111  1111 1111 1111 1111 */
+    };
+
+
+    if (dst == NULL) {
+
+        /* find the number of the characters to be escaped */
+
+        n = 0;
+
+        while (size) {
+            if (escape[*src >> 5] & (1U << (*src & 0x1f))) {
+                n++;
+            }
+            src++;
+            size--;
+        }
+
+        return (uintptr_t) n;
+    }
+
+    while (size) {
+        if (escape[*src >> 5] & (1U << (*src & 0x1f))) {
+            *dst++ = '\\';
+            *dst++ = 'x';
+            *dst++ = hex[*src >> 4];
+            *dst++ = hex[*src & 0xf];
+            src++;
+
+        } else {
+            *dst++ = *src++;
+        }
+        size--;
+    }
+
+    return (uintptr_t) dst;
+}
+
+
+static void *
+ngx_stream_log_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_log_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_log_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->formats, cf->pool, 4,
+                       sizeof(ngx_stream_log_fmt_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return conf;
+}
+
+
+static void *
+ngx_stream_log_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_log_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_log_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->logs = NULL;
+     *     conf->off = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_log_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_log_srv_conf_t *prev = parent;
+    ngx_stream_log_srv_conf_t *conf = child;
+
+    if (conf->logs || conf->off) {
+        return NGX_CONF_OK;
+    }
+
+    conf->logs = prev->logs;
+    conf->off = prev->off;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_srv_conf_t *lscf = conf;
+
+    ssize_t                       size;
+    ngx_uint_t                    i;
+    ngx_msec_t                    flush;
+    ngx_str_t                    *value, s;
+    ngx_stream_log_t             *log;
+    ngx_stream_log_buf_t         *buffer;
+    ngx_stream_log_fmt_t         *fmt;
+    ngx_stream_log_main_conf_t   *lmcf;
+#if (NGX_THREADS)
+    ngx_thread_pool_t            *tp;
+    ngx_thread_task_t            *task;
+    ngx_stream_log_flush_ctx_t   *ctx;
+#endif
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lscf->off = 1;
+        if (cf->args->nelts == 2) {
+            return NGX_CONF_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts < 3) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "log format is not specified");
+        return NGX_CONF_ERROR;
+    }
+
+    if (lscf->logs == NULL) {
+        lscf->logs = ngx_array_create(cf->pool, 2, sizeof(ngx_stream_log_t));
+        if (lscf->logs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    lmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_log_module);
+
+    log = ngx_array_push(lscf->logs);
+    if (log == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(log, sizeof(ngx_stream_log_t));
+
+    log->file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (log->file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt = lmcf->formats.elts;
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        if (fmt[i].name.len == value[2].len
+            && ngx_strcasecmp(fmt[i].name.data, value[2].data) == 0)
+        {
+            log->format = &fmt[i];
+            break;
+        }
+    }
+
+    if (log->format == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown log format \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    flush = 0;
+#if (NGX_THREADS)
+    tp = NULL;
+#endif
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR
+                || size < (ssize_t) (sizeof(ngx_stream_log_entry_t)
+                                     + sizeof(ngx_stream_log_record_t)))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            flush = ngx_parse_time(&s, 0);
+
+            if (flush == (ngx_msec_t) NGX_ERROR || flush == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "threads", 7) == 0
+            && (value[i].len == 7 || value[i].data[7] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 7) {
+                tp = ngx_thread_pool_add(cf, NULL);
+
+            } else {
+                s.len = value[i].len - 8;
+                s.data = value[i].data + 8;
+
+                tp = ngx_thread_pool_add(cf, &s);
+            }
+
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "nginx was built without threads support");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (flush && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no buffer is defined for access_log \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (log->file->data) {
+        buffer = log->file->data;
+
+        if (buffer->last - buffer->start != size
+            || buffer->flush != flush
+#if (NGX_THREADS)
+            || buffer->thread_pool != tp
+#endif
+           )
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "access_log \"%V\" already defined "
+                               "with conflicting parameters",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    buffer = ngx_pcalloc(cf->pool, sizeof(ngx_stream_log_buf_t));
+    if (buffer == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->start = ngx_palloc(cf->pool, size);
+    if (buffer->start == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + size;
+
+    buffer->out = ngx_pnalloc(cf->pool, size);
+    if (buffer->out == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (flush) {
+        buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+        if (buffer->event == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        buffer->event->data = log->file;
+        buffer->event->handler = ngx_stream_log_flush_handler;
+        buffer->event->log = &cf->cycle->new_log;
+        buffer->event->cancelable = 1;
+
+        buffer->flush = flush;
+    }
+
+#if (NGX_THREADS)
+
+    if (tp) {
+
+        /* records are formatted and written by the task in a spare buffer */
+
+        buffer->spare = ngx_palloc(cf->pool, size);
+        if (buffer->spare == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        task = ngx_thread_task_alloc(cf->pool,
+                                     sizeof(ngx_stream_log_flush_ctx_t));
+        if (task == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx = task->ctx;
+
+        ctx->name = log->file->name.data;
+        ctx->size = size;
+
+        ctx->out = ngx_pnalloc(cf->pool, size);
+        if (ctx->out == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        task->handler = ngx_stream_log_thread_handler;
+        task->event.data = log->file;
+        task->event.handler = ngx_stream_log_thread_event_handler;
+        task->event.log = &cf->cycle->new_log;
+
+        buffer->thread_pool = tp;
+        buffer->task = task;
+    }
+
+#endif
+
+    log->file->flush = ngx_stream_log_flush;
+    log->file->data = buffer;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_log_main_conf_t *lmcf = conf;
+
+    ngx_str_t             *value;
+    ngx_uint_t             i;
+    ngx_stream_log_fmt_t  *fmt;
+
+    value = cf->args->elts;
+
+    fmt = lmcf->formats.elts;
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        if (fmt[i].name.len == value[1].len
+            && ngx_strcmp(fmt[i].name.data, value[1].data) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate \"log_format\" name \"%V\"",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    fmt = ngx_array_push(&lmcf->formats);
+    if (fmt == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(fmt, sizeof(ngx_stream_log_fmt_t));
+
+    fmt->name = value[1];
+
+    fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_stream_log_op_t));
+    if (fmt->ops == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->deferred = 1;
+
+    return ngx_stream_log_compile_format(cf, fmt, cf->args, 2);
+}
+
+
+static char *
+ngx_stream_log_compile_format(ngx_conf_t *cf, ngx_stream_log_fmt_t *fmt,
+    ngx_array_t *args, ngx_uint_t s)
+{
+    u_char                *data, *p, ch;
+    size_t                 i, len;
+    ngx_str_t             *value, var;
+    ngx_uint_t             bracket;
+    ngx_stream_log_op_t   *op;
+    ngx_stream_log_var_t  *v;
+
+    value = args->elts;
+
+    for ( /* void */ ; s < args->nelts; s++) {
+
+        i = 0;
+
+        while (i < value[s].len) {
+
+            op = ngx_array_push(fmt->ops);
+            if (op == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            data = &value[s].data[i];
+
+            if (value[s].data[i] == '$') {
+
+                if (++i == value[s].len) {
+                    goto invalid;
+                }
+
+                if (value[s].data[i] == '{') {
+                    bracket = 1;
+
+                    if (++i == value[s].len) {
+                        goto invalid;
+                    }
+
+                    var.data = &value[s].data[i];
+
+                } else {
+                    bracket = 0;
+                    var.data = &value[s].data[i];
+                }
+
+                for (var.len = 0; i < value[s].len; i++, var.len++) {
+                    ch = value[s].data[i];
+
+                    if (ch == '}' && bracket) {
+                        i++;
+                        bracket = 0;
+                        break;
+                    }
+
+                    if ((ch >= 'A' && ch <= 'Z')
+                        || (ch >= 'a' && ch <= 'z')
+                        || (ch >= '0' && ch <= '9')
+                        || ch == '_')
+                    {
+                        continue;
+                    }
+
+                    break;
+                }
+
+                if (bracket) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "the closing bracket in \"%V\" "
+                                       "variable is missing", &var);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (var.len == 0) {
+                    goto invalid;
+                }
+
+                for (v = ngx_stream_log_vars; v->name.len; v++) {
+
+                    if (v->name.len == var.len
+                        && ngx_strncmp(v->name.data, var.data, var.len) == 0)
+                    {
+                        op->len = v->len;
+                        op->getlen = v->getlen;
+                        op->run = v->run;
+                        op->data = v->data;
+
+                        if ((v->run == ngx_stream_log_addr
+                             || v->run == ngx_stream_log_port)
+                            && v->data)
+                        {
+                            fmt->server = 1;
+                        }
+
+                        goto found;
+                    }
+                }
+
+                if (ngx_stream_log_variable_compile(cf, op, &var) != NGX_OK) {
+                    return NGX_CONF_ERROR;
+                }
+
+                /* the variable is evaluated while the session is alive */
+
+                fmt->deferred = 0;
+
+            found:
+
+                continue;
+            }
+
+            i++;
+
+            while (i < value[s].len && value[s].data[i] != '$') {
+                i++;
+            }
+
+            len = &value[s].data[i] - data;
+
+            if (len) {
+
+                op->len = len;
+                op->getlen = NULL;
+
+                if (len <= sizeof(uintptr_t)) {
+                    op->run = ngx_stream_log_copy_short;
+                    op->data = 0;
+
+                    while (len--) {
+                        op->data <<= 8;
+                        op->data |= data[len];
+                    }
+
+                } else {
+                    op->run = ngx_stream_log_copy_long;
+
+                    p = ngx_pnalloc(cf->pool, len);
+                    if (p == NULL) {
+                        return NGX_CONF_ERROR;
+                    }
+
+                    ngx_memcpy(p, data, len);
+                    op->data = (uintptr_t) p;
+                }
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%s\"", data);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_stream_log_init(ngx_conf_t *cf)
+{
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    cmcf->log_handler = ngx_stream_log_handler;
+
+    return NGX_OK;
+}
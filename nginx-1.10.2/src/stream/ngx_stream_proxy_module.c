@@ -43,10 +43,13 @@ typedef struct {
 #endif
 
     ngx_stream_upstream_srv_conf_t  *upstream;
+    ngx_int_t                        upstream_value;
 } ngx_stream_proxy_srv_conf_t;
 
 
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
+static ngx_stream_upstream_srv_conf_t *ngx_stream_proxy_find_upstream(
+    ngx_stream_session_t *s, ngx_stream_proxy_srv_conf_t *pscf);
 static void ngx_stream_proxy_connect(ngx_stream_session_t *s);
 static void ngx_stream_proxy_init_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_upstream_handler(ngx_event_t *ev);
@@ -57,8 +60,9 @@ static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+static ngx_int_t ngx_stream_proxy_send_datagrams(ngx_stream_session_t *s);
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
-static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc);
+static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
     size_t len);
 
@@ -303,6 +307,7 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
 
 
 static ngx_stream_module_t  ngx_stream_proxy_module_ctx = {
+    NULL,                                  /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -333,6 +338,7 @@ static void
 ngx_stream_proxy_handler(ngx_stream_session_t *s)
 {
     u_char                          *p;
+    size_t                           size, preread;
     ngx_connection_t                *c;
     ngx_stream_upstream_t           *u;
     ngx_stream_proxy_srv_conf_t     *pscf;
@@ -347,7 +353,7 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
 
     u = ngx_pcalloc(c->pool, sizeof(ngx_stream_upstream_t));
     if (u == NULL) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
@@ -355,16 +361,34 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
 
     s->log_handler = ngx_stream_proxy_log_error;
 
+    s->upstream_states = ngx_array_create(c->pool, 1,
+                                          sizeof(ngx_stream_upstream_state_t));
+    if (s->upstream_states == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->peer.log = c->log;
     u->peer.log_error = NGX_ERROR_ERR;
 
     u->peer.local = pscf->local;
     u->peer.type = c->type;
 
-    uscf = pscf->upstream;
+    if (pscf->upstream_value != NGX_CONF_UNSET) {
+        uscf = ngx_stream_proxy_find_upstream(s, pscf);
+        if (uscf == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+            return;
+        }
+
+    } else {
+        uscf = pscf->upstream;
+    }
+
+    u->upstream = uscf;
 
     if (uscf->peer.init(s, uscf) != NGX_OK) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
@@ -387,14 +411,24 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         return;
     }
 
-    p = ngx_pnalloc(c->pool, pscf->buffer_size);
+    /* data read by a preread handler is sent first, after PROXY header */
+
+    preread = c->buffer ? c->buffer->last - c->buffer->pos : 0;
+
+    size = pscf->buffer_size;
+
+    if (preread && size < preread + NGX_PROXY_PROTOCOL_MAX_HEADER) {
+        size = preread + NGX_PROXY_PROTOCOL_MAX_HEADER;
+    }
+
+    p = ngx_pnalloc(c->pool, size);
     if (p == NULL) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
     u->downstream_buf.start = p;
-    u->downstream_buf.end = p + pscf->buffer_size;
+    u->downstream_buf.end = p + size;
     u->downstream_buf.pos = p;
     u->downstream_buf.last = p;
 
@@ -412,7 +446,7 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         p = ngx_proxy_protocol_write(c, u->downstream_buf.last,
                                      u->downstream_buf.end);
         if (p == NULL) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
@@ -420,6 +454,15 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         u->proxy_protocol = 0;
     }
 
+    if (preread) {
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy add preread buffer: %uz", preread);
+
+        u->downstream_buf.last = ngx_cpymem(u->downstream_buf.last,
+                                            c->buffer->pos, preread);
+        c->buffer->pos = c->buffer->last;
+    }
+
     if (c->read->ready) {
         ngx_post_event(c->read, &ngx_posted_events);
     }
@@ -428,6 +471,49 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
 }
 
 
+static ngx_stream_upstream_srv_conf_t *
+ngx_stream_proxy_find_upstream(ngx_stream_session_t *s,
+    ngx_stream_proxy_srv_conf_t *pscf)
+{
+    ngx_uint_t                        i;
+    ngx_stream_variable_value_t      *value;
+    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    value = ngx_stream_get_flushed_variable(s, pscf->upstream_value);
+
+    if (value == NULL || value->not_found || value->len == 0) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "no upstream name in \"proxy_pass\"");
+        return NULL;
+    }
+
+    umcf = ngx_stream_get_module_main_conf(s, ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uscf = uscfp[i];
+
+        if ((uscf->flags & NGX_STREAM_UPSTREAM_CREATE)
+            && uscf->host.len == value->len
+            && ngx_strncasecmp(uscf->host.data, value->data, value->len) == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                           "proxy upstream: \"%v\"", value);
+
+            return uscf;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "upstream \"%v\" not found", value);
+
+    return NULL;
+}
+
+
 static void
 ngx_stream_proxy_connect(ngx_stream_session_t *s)
 {
@@ -442,18 +528,31 @@ ngx_stream_proxy_connect(ngx_stream_session_t *s)
 
     u = s->upstream;
 
+    u->state = ngx_array_push(s->upstream_states);
+    if (u->state == NULL) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_memzero(u->state, sizeof(ngx_stream_upstream_state_t));
+
+    u->state->connect_time = (ngx_msec_t) -1;
+    u->start_time = ngx_current_msec;
+
     rc = ngx_event_connect_peer(&u->peer);
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "proxy connect: %i", rc);
 
     if (rc == NGX_ERROR) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
+    u->state->peer = u->peer.name;
+
     if (rc == NGX_BUSY) {
         ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
-        ngx_stream_proxy_finalize(s, NGX_DECLINED);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
         return;
     }
 
@@ -541,6 +640,10 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
     c = s->connection;
 
+    if (u->state->connect_time == (ngx_msec_t) -1) {
+        u->state->connect_time = ngx_current_msec - u->start_time;
+    }
+
     if (c->log->log_level >= NGX_LOG_INFO) {
         ngx_str_t  str;
         u_char     addr[NGX_SOCKADDR_STRLEN];
@@ -566,7 +669,7 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     if (u->upstream_buf.start == NULL) {
         p = ngx_pnalloc(c->pool, pscf->buffer_size);
         if (p == NULL) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
@@ -577,8 +680,28 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     }
 
     if (c->type == SOCK_DGRAM) {
+
+        if (c->udp && pscf->upload_rate
+            && (size_t) (c->buffer->end - c->buffer->start) < pscf->buffer_size)
+        {
+            /* further datagrams of the session are read into the buffer */
+
+            p = ngx_pnalloc(c->pool, pscf->buffer_size);
+            if (p == NULL) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            c->buffer->last = ngx_cpymem(p, c->buffer->pos,
+                                         c->buffer->last - c->buffer->pos);
+            c->buffer->start = p;
+            c->buffer->pos = p;
+            c->buffer->end = p + pscf->buffer_size;
+        }
+
         s->received = c->buffer->last - c->buffer->pos;
         u->downstream_buf = *c->buffer;
+        u->requests = 1;
 
         if (pscf->responses == 0) {
             pc->read->ready = 0;
@@ -616,7 +739,7 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
 
     p = ngx_proxy_protocol_write(c, buf, buf + NGX_PROXY_PROTOCOL_MAX_HEADER);
     if (p == NULL) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return NGX_ERROR;
     }
 
@@ -630,7 +753,7 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
 
     if (n == NGX_AGAIN) {
         if (ngx_handle_write_event(pc->write, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return NGX_ERROR;
         }
 
@@ -644,7 +767,7 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
     }
 
     if (n == NGX_ERROR) {
-        ngx_stream_proxy_finalize(s, NGX_DECLINED);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
         return NGX_ERROR;
     }
 
@@ -660,7 +783,7 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
         ngx_log_error(NGX_LOG_ERR, c->log, 0,
                       "could not send PROXY protocol header at once");
 
-        ngx_stream_proxy_finalize(s, NGX_DECLINED);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
 
         return NGX_ERROR;
     }
@@ -712,20 +835,20 @@ ngx_stream_proxy_ssl_init_connection(ngx_stream_session_t *s)
     if (ngx_ssl_create_connection(pscf->ssl, pc, NGX_SSL_BUFFER|NGX_SSL_CLIENT)
         != NGX_OK)
     {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
     if (pscf->ssl_server_name || pscf->ssl_verify) {
         if (ngx_stream_proxy_ssl_name(s) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
     }
 
     if (pscf->ssl_session_reuse) {
         if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
     }
@@ -817,7 +940,7 @@ ngx_stream_proxy_ssl_name(ngx_stream_session_t *s)
     name = pscf->ssl_name;
 
     if (name.len == 0) {
-        name = pscf->upstream->host;
+        name = u->upstream->host;
     }
 
     if (name.len == 0) {
@@ -938,7 +1061,8 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
 
             if (!ev->ready) {
                 if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-                    ngx_stream_proxy_finalize(s, NGX_ERROR);
+                    ngx_stream_proxy_finalize(s,
+                                              NGX_STREAM_INTERNAL_SERVER_ERROR);
                     return;
                 }
 
@@ -972,7 +1096,7 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
             }
 
             ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
-            ngx_stream_proxy_finalize(s, NGX_DECLINED);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
             return;
         }
 
@@ -982,7 +1106,7 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
                        "stream connection delayed");
 
         if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         }
 
         return;
@@ -1100,12 +1224,21 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
         c->log->handler = handler;
 
-        ngx_stream_proxy_finalize(s, NGX_OK);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
         return;
     }
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
 
+    if (c->type == SOCK_DGRAM && !from_upstream && c->udp && c->udp->in
+        && pc && pscf->upload_rate == 0)
+    {
+        if (ngx_stream_proxy_send_datagrams(s) != NGX_OK) {
+            ngx_stream_proxy_next_upstream(s);
+            return;
+        }
+    }
+
     if (from_upstream) {
         src = pc;
         dst = c;
@@ -1142,7 +1275,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                         return;
                     }
 
-                    ngx_stream_proxy_finalize(s, NGX_DECLINED);
+                    ngx_stream_proxy_finalize(s, from_upstream
+                                                 ? NGX_STREAM_OK
+                                                 : NGX_STREAM_BAD_GATEWAY);
                     return;
                 }
 
@@ -1159,6 +1294,13 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
         size = b->end - b->last;
 
+        if (c->type == SOCK_DGRAM && b->pos != b->last) {
+
+            /* datagrams are not merged */
+
+            size = 0;
+        }
+
         if (size && src->read->ready && !src->read->delayed) {
 
             if (limit_rate) {
@@ -1193,10 +1335,17 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     }
                 }
 
-                if (c->type == SOCK_DGRAM && ++u->responses == pscf->responses)
-                {
-                    src->read->ready = 0;
-                    src->read->eof = 1;
+                if (c->type == SOCK_DGRAM) {
+
+                    if (!from_upstream) {
+                        u->requests++;
+
+                    } else if (++u->responses
+                               == pscf->responses * u->requests)
+                    {
+                        src->read->ready = 0;
+                        src->read->eof = 1;
+                    }
                 }
 
                 *received += n;
@@ -1233,20 +1382,20 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
         c->log->handler = handler;
 
-        ngx_stream_proxy_finalize(s, NGX_OK);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
         return;
     }
 
     flags = src->read->eof ? NGX_CLOSE_EVENT : 0;
 
     if (!src->shared && ngx_handle_read_event(src->read, flags) != NGX_OK) {
-        ngx_stream_proxy_finalize(s, NGX_ERROR);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return;
     }
 
     if (dst) {
         if (!dst->shared && ngx_handle_write_event(dst->write, 0) != NGX_OK) {
-            ngx_stream_proxy_finalize(s, NGX_ERROR);
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
 
@@ -1260,6 +1409,81 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+static ngx_int_t
+ngx_stream_proxy_send_datagrams(ngx_stream_session_t *s)
+{
+    size_t                  size;
+    ngx_buf_t              *b;
+    ngx_uint_t              n;
+    ngx_chain_t            *in, *cl;
+    ngx_connection_t       *c, *pc;
+    ngx_stream_upstream_t  *u;
+
+    /*
+     * datagrams received from the client in one batch are sent
+     * to the upstream as is, with as few syscalls as possible
+     */
+
+    c = s->connection;
+    u = s->upstream;
+    pc = u->peer.connection;
+    b = &u->downstream_buf;
+
+    in = c->udp->in;
+
+    c->udp->in = NULL;
+    c->read->ready = 0;
+
+    n = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        s->received += cl->buf->last - cl->buf->pos;
+        n++;
+    }
+
+    u->requests += n;
+
+    if (b->pos == b->last) {
+        in = pc->send_chain(pc, in, 0);
+
+        if (in == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (in) {
+
+            /* the first unsent datagram waits for the upstream socket */
+
+            size = in->buf->last - in->buf->pos;
+
+            if (size <= (size_t) (b->end - b->start)) {
+                b->pos = b->start;
+                b->last = ngx_cpymem(b->start, in->buf->pos, size);
+
+                in = in->next;
+            }
+        }
+    }
+
+    if (in) {
+
+        /* dropped datagrams are neither received nor waited for replies */
+
+        for (n = 0; in; in = in->next) {
+            s->received -= in->buf->last - in->buf->pos;
+            n++;
+        }
+
+        u->requests -= n;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy dropped %ui datagrams", n);
+    }
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -1286,7 +1510,7 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
         || !pscf->next_upstream
         || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
     {
-        ngx_stream_proxy_finalize(s, NGX_DECLINED);
+        ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
         return;
     }
 
@@ -1296,6 +1520,9 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                        "close proxy upstream connection: %d", pc->fd);
 
+        u->state->bytes_received = u->received;
+        u->state->bytes_sent = pc->sent;
+
 #if (NGX_STREAM_SSL)
         if (pc->ssl) {
             pc->ssl->no_wait_shutdown = 1;
@@ -1314,13 +1541,13 @@ ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 
 
 static void
-ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc)
+ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
 {
     ngx_connection_t       *pc;
     ngx_stream_upstream_t  *u;
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                   "finalize stream proxy: %i", rc);
+                   "finalize stream proxy: %ui", rc);
 
     u = s->upstream;
 
@@ -1335,6 +1562,14 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc)
 
     pc = u->peer.connection;
 
+    if (u->state) {
+        u->state->bytes_received = u->received;
+
+        if (pc) {
+            u->state->bytes_sent = pc->sent;
+        }
+    }
+
     if (pc) {
         ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                        "close stream proxy upstream connection: %d", pc->fd);
@@ -1352,7 +1587,7 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc)
 
 noupstream:
 
-    ngx_stream_close_connection(s->connection);
+    ngx_stream_finalize_session(s, rc);
 }
 
 
@@ -1412,6 +1647,8 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
      *     conf->upstream = NULL;
      */
 
+    conf->upstream_value = NGX_CONF_UNSET;
+
     conf->connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->timeout = NGX_CONF_UNSET_MSEC;
     conf->next_upstream_timeout = NGX_CONF_UNSET_MSEC;
@@ -1603,10 +1840,10 @@ ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_stream_proxy_srv_conf_t *pscf = conf;
 
     ngx_url_t                    u;
-    ngx_str_t                   *value, *url;
+    ngx_str_t                   *value, *url, name;
     ngx_stream_core_srv_conf_t  *cscf;
 
-    if (pscf->upstream) {
+    if (pscf->upstream || pscf->upstream_value != NGX_CONF_UNSET) {
         return "is duplicate";
     }
 
@@ -1618,6 +1855,21 @@ ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     url = &value[1];
 
+    if (url->len > 1 && url->data[0] == '$') {
+
+        /* a variable is resolved to an upstream{} block by name */
+
+        name.len = url->len - 1;
+        name.data = url->data + 1;
+
+        pscf->upstream_value = ngx_stream_get_variable_index(cf, &name);
+        if (pscf->upstream_value == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
     ngx_memzero(&u, sizeof(ngx_url_t));
 
     u.url = *url;
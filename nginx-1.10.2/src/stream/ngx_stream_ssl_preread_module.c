@@ -0,0 +1,480 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_flag_t      enabled;
+} ngx_stream_ssl_preread_srv_conf_t;
+
+
+typedef struct {
+    size_t          offset;         /* of unparsed data in c->buffer */
+    size_t          left;           /* of the current record */
+
+    u_char          header[4];      /* of the handshake message */
+    size_t          header_len;
+
+    u_char         *hello;
+    u_char         *last;
+    u_char         *end;
+
+    ngx_str_t       host;
+    ngx_str_t       alpn;
+} ngx_stream_ssl_preread_ctx_t;
+
+
+static ngx_int_t ngx_stream_ssl_preread_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_ssl_preread_parse_hello(ngx_stream_session_t *s,
+    ngx_stream_ssl_preread_ctx_t *ctx, u_char *p, u_char *last);
+static ngx_int_t ngx_stream_ssl_preread_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_stream_ssl_preread_add_variables(ngx_conf_t *cf);
+static void *ngx_stream_ssl_preread_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_ssl_preread_merge_srv_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_stream_ssl_preread_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_stream_ssl_preread_commands[] = {
+
+    { ngx_string("ssl_preread"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ssl_preread_srv_conf_t, enabled),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_ssl_preread_module_ctx = {
+    ngx_stream_ssl_preread_add_variables,  /* preconfiguration */
+    ngx_stream_ssl_preread_init,           /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_ssl_preread_create_srv_conf,/* create server configuration */
+    ngx_stream_ssl_preread_merge_srv_conf  /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_ssl_preread_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_ssl_preread_module_ctx,    /* module context */
+    ngx_stream_ssl_preread_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_stream_variable_t  ngx_stream_ssl_preread_vars[] = {
+
+    { ngx_string("ssl_preread_server_name"), ngx_stream_ssl_preread_variable,
+      offsetof(ngx_stream_ssl_preread_ctx_t, host), 0, 0 },
+
+    { ngx_string("ssl_preread_alpn_protocols"),
+      ngx_stream_ssl_preread_variable,
+      offsetof(ngx_stream_ssl_preread_ctx_t, alpn), 0, 0 },
+
+    { ngx_null_string, NULL, 0, 0, 0 }
+};
+
+
+/*
+ * The ClientHello is collected from the handshake records as they arrive
+ * without touching the data in c->buffer, which is later proxied as is.
+ * Anything that is not a TLS handshake is declined at once.
+ */
+
+static ngx_int_t
+ngx_stream_ssl_preread_handler(ngx_stream_session_t *s)
+{
+    u_char                             *p, *last;
+    size_t                              n, len;
+    ngx_connection_t                   *c;
+    ngx_stream_ssl_preread_ctx_t       *ctx;
+    ngx_stream_ssl_preread_srv_conf_t  *sscf;
+
+    c = s->connection;
+
+    sscf = ngx_stream_get_module_srv_conf(s, ngx_stream_ssl_preread_module);
+
+    if (!sscf->enabled || c->type != SOCK_STREAM) {
+        return NGX_DECLINED;
+    }
+
+    if (c->buffer == NULL) {
+        return NGX_AGAIN;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_ssl_preread_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_ssl_preread_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_ssl_preread_module);
+    }
+
+    p = c->buffer->pos + ctx->offset;
+    last = c->buffer->last;
+
+    while (p < last) {
+
+        if (ctx->left == 0) {
+
+            /* record header: type, version, length */
+
+            if (last - p < 5) {
+                break;
+            }
+
+            if (p[0] != 0x16 || p[1] != 3) {
+                ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                               "ssl preread: not a handshake");
+                return NGX_DECLINED;
+            }
+
+            ctx->left = (p[3] << 8) + p[4];
+            p += 5;
+
+            if (ctx->left == 0) {
+                return NGX_DECLINED;
+            }
+
+            continue;
+        }
+
+        n = ngx_min((size_t) (last - p), ctx->left);
+
+        ctx->left -= n;
+
+        while (n && ctx->header_len < 4) {
+            ctx->header[ctx->header_len++] = *p++;
+            n--;
+        }
+
+        if (ctx->hello == NULL && ctx->header_len == 4) {
+
+            if (ctx->header[0] != 1) {
+                ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                               "ssl preread: handshake type %d",
+                               ctx->header[0]);
+                return NGX_DECLINED;
+            }
+
+            len = (ctx->header[1] << 16) + (ctx->header[2] << 8)
+                  + ctx->header[3];
+
+            if (len > (size_t) (c->buffer->end - c->buffer->start)) {
+                ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                               "ssl preread: client hello too long: %uz",
+                               len);
+                return NGX_DECLINED;
+            }
+
+            ctx->hello = ngx_pnalloc(c->pool, len);
+            if (ctx->hello == NULL) {
+                return NGX_ERROR;
+            }
+
+            ctx->last = ctx->hello;
+            ctx->end = ctx->hello + len;
+        }
+
+        if (n) {
+            n = ngx_min(n, (size_t) (ctx->end - ctx->last));
+            ctx->last = ngx_cpymem(ctx->last, p, n);
+            p += n;
+        }
+
+        if (ctx->hello && ctx->last == ctx->end) {
+            return ngx_stream_ssl_preread_parse_hello(s, ctx, ctx->hello,
+                                                      ctx->end);
+        }
+
+        if (ctx->left) {
+            break;
+        }
+    }
+
+    ctx->offset = p - c->buffer->pos;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_stream_ssl_preread_parse_hello(ngx_stream_session_t *s,
+    ngx_stream_ssl_preread_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char     *end, *ext, *q;
+    size_t      len, size;
+    ngx_uint_t  type, i;
+
+    /* version, random */
+
+    if (last - p < 2 + 32 + 1) {
+        goto invalid;
+    }
+
+    p += 2 + 32;
+
+    /* session id */
+
+    len = *p++;
+
+    if ((size_t) (last - p) < len + 2) {
+        goto invalid;
+    }
+
+    p += len;
+
+    /* cipher suites */
+
+    len = (p[0] << 8) + p[1];
+    p += 2;
+
+    if ((size_t) (last - p) < len + 1) {
+        goto invalid;
+    }
+
+    p += len;
+
+    /* compression methods */
+
+    len = *p++;
+
+    if ((size_t) (last - p) < len) {
+        goto invalid;
+    }
+
+    p += len;
+
+    if (last - p < 2) {
+
+        /* no extensions */
+
+        return NGX_OK;
+    }
+
+    len = (p[0] << 8) + p[1];
+    p += 2;
+
+    if ((size_t) (last - p) < len) {
+        goto invalid;
+    }
+
+    end = p + len;
+
+    while (end - p >= 4) {
+
+        type = (p[0] << 8) + p[1];
+        len = (p[2] << 8) + p[3];
+        p += 4;
+
+        if ((size_t) (end - p) < len) {
+            goto invalid;
+        }
+
+        ext = p;
+        p += len;
+
+        switch (type) {
+
+        case 0: /* server_name */
+
+            /* list length, name type, name length */
+
+            if (len < 5 || ext[2] != 0) {
+                goto invalid;
+            }
+
+            size = (ext[3] << 8) + ext[4];
+
+            if (size == 0 || size > len - 5) {
+                goto invalid;
+            }
+
+            ctx->host.data = ext + 5;
+            ctx->host.len = size;
+
+            ngx_strlow(ctx->host.data, ctx->host.data, size);
+
+            break;
+
+        case 16: /* application_layer_protocol_negotiation */
+
+            if (len < 3) {
+                goto invalid;
+            }
+
+            size = (ext[0] << 8) + ext[1];
+
+            if (size != len - 2) {
+                goto invalid;
+            }
+
+            /* the length prefixes are replaced with commas in place */
+
+            ext += 2;
+            q = ext;
+
+            for (i = 0; i < size; /* void */) {
+                len = ext[i];
+
+                if (len == 0 || i + 1 + len > size) {
+                    goto invalid;
+                }
+
+                if (q != ext) {
+                    *q++ = ',';
+                }
+
+                q = ngx_movemem(q, &ext[i + 1], len);
+                i += 1 + len;
+            }
+
+            ctx->alpn.data = ext;
+            ctx->alpn.len = q - ext;
+
+            break;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "ssl preread: server name \"%V\", alpn \"%V\"",
+                   &ctx->host, &ctx->alpn);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "ssl preread: invalid client hello");
+
+    ngx_str_null(&ctx->host);
+    ngx_str_null(&ctx->alpn);
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_stream_ssl_preread_variable(ngx_stream_session_t *s,
+    ngx_stream_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t                     *str;
+    ngx_stream_ssl_preread_ctx_t  *ctx;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_ssl_preread_module);
+
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    str = (ngx_str_t *) ((char *) ctx + data);
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->len = str->len;
+    v->data = str->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_ssl_preread_add_variables(ngx_conf_t *cf)
+{
+    ngx_stream_variable_t  *var, *v;
+
+    for (v = ngx_stream_ssl_preread_vars; v->name.len; v++) {
+        var = ngx_stream_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_stream_ssl_preread_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_ssl_preread_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_ssl_preread_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enabled = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_ssl_preread_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_stream_ssl_preread_srv_conf_t *prev = parent;
+    ngx_stream_ssl_preread_srv_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enabled, prev->enabled, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_ssl_preread_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          s;
+    ngx_stream_core_srv_conf_t        **cscfp;
+    ngx_stream_core_main_conf_t        *cmcf;
+    ngx_stream_ssl_preread_srv_conf_t  *sscf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    /* sessions are not delayed unless some server needs it */
+
+    cscfp = cmcf->servers.elts;
+
+    for (s = 0; s < cmcf->servers.nelts; s++) {
+
+        sscf = cscfp[s]->ctx->srv_conf[ngx_stream_ssl_preread_module.ctx_index];
+
+        if (sscf->enabled) {
+            cmcf->preread_handler = ngx_stream_ssl_preread_handler;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -78,16 +78,29 @@ struct ngx_stream_upstream_srv_conf_s {
 };
 
 
+typedef struct {
+    ngx_msec_t                         connect_time;
+    off_t                              bytes_sent;
+    off_t                              bytes_received;
+
+    ngx_str_t                         *peer;
+} ngx_stream_upstream_state_t;
+
+
 typedef struct {
     ngx_peer_connection_t              peer;
+    ngx_stream_upstream_srv_conf_t    *upstream;
     ngx_buf_t                          downstream_buf;
     ngx_buf_t                          upstream_buf;
     off_t                              received;
     time_t                             start_sec;
+    ngx_msec_t                         start_time;
+    ngx_uint_t                         requests;
     ngx_uint_t                         responses;
 #if (NGX_STREAM_SSL)
     ngx_str_t                          ssl_name;
 #endif
+    ngx_stream_upstream_state_t       *state;
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
 } ngx_stream_upstream_t;
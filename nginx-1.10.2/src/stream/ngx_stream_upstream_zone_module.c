@@ -32,6 +32,7 @@ static ngx_command_t  ngx_stream_upstream_zone_commands[] = {
 
 
 static ngx_stream_module_t  ngx_stream_upstream_zone_module_ctx = {
+    NULL,                                  /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */